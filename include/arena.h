@@ -0,0 +1,150 @@
+/**
+ * @file arena.h
+ * @brief Linear memory arenas
+ * @ingroup arena
+ */
+#ifndef __LIBDRAGON_ARENA_H
+#define __LIBDRAGON_ARENA_H
+
+#include <stdint.h>
+
+/**
+ * @defgroup arena Linear memory arenas
+ * @ingroup lowlevel
+ * @brief Fast allocator for transient memory, released in bulk.
+ *
+ * An arena is a fixed-size memory buffer from which memory is allocated
+ * linearly, by simply bumping a pointer. Allocations cannot be freed
+ * individually: the whole arena is released at once with #arena_reset,
+ * or rewound to a previous point with #arena_rewind. Both allocating
+ * and releasing are O(1).
+ *
+ * This is a good fit for memory whose lifetime is bound to a frame
+ * (eg: temporary buffers built while preparing the next frame), as it
+ * avoids both the overhead of malloc and the heap fragmentation caused
+ * by many short-lived allocations.
+ *
+ * @code{.c}
+ *      arena_t frame_arena;
+ *      arena_init(&frame_arena, "frame", 64*1024);
+ *
+ *      while (1) {
+ *          // All the memory allocated during the previous frame is released
+ *          arena_reset(&frame_arena);
+ *
+ *          vertex_t *verts = arena_alloc(&frame_arena, num_verts * sizeof(vertex_t));
+ *          ...
+ *      }
+ * @endcode
+ *
+ * Arenas are not protected against concurrent access: do not share an
+ * arena between interrupt handlers and the main code.
+ * @{
+ */
+
+/** @brief A linear memory arena */
+typedef struct arena_s {
+    uint8_t *buffer;      ///< Memory of the arena
+    uint32_t size;        ///< Size of the memory of the arena in bytes
+    uint32_t used;        ///< Bytes currently allocated (including alignment padding)
+    uint32_t peak;        ///< Highest value of used since the arena was initialized
+    const char *name;     ///< Memory tag used for the arena buffer (NULL if not owned)
+} arena_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Initialize an arena, allocating its memory from the heap
+ *
+ * The memory is accounted in the memory tag @p name (see #sys_memory_tag_update),
+ * so that it is shown in #debug_memory_report.
+ *
+ * @param[out] arena   Arena to initialize
+ * @param[in]  name    Name of the arena (used as memory tag)
+ * @param[in]  size    Size of the arena in bytes
+ */
+void arena_init(arena_t *arena, const char *name, uint32_t size);
+
+/**
+ * @brief Initialize an arena on an existing buffer
+ *
+ * The buffer is not owned by the arena, so #arena_close will not free it.
+ *
+ * @param[out] arena   Arena to initialize
+ * @param[in]  buffer  Memory to use for the arena
+ * @param[in]  size    Size of the buffer in bytes
+ */
+void arena_init_buffer(arena_t *arena, void *buffer, uint32_t size);
+
+/**
+ * @brief Release an arena, freeing its memory if owned
+ *
+ * @param[in]  arena   Arena to release
+ */
+void arena_close(arena_t *arena);
+
+/**
+ * @brief Allocate memory from an arena, with the specified alignment
+ *
+ * @param[in]  arena   Arena to allocate from
+ * @param[in]  align   Alignment in bytes (must be a power of two)
+ * @param[in]  size    Number of bytes to allocate
+ * @return             Pointer to the allocated memory, or NULL if the arena is full
+ */
+void *arena_alloc_aligned(arena_t *arena, uint32_t align, uint32_t size);
+
+/**
+ * @brief Allocate memory from an arena
+ *
+ * The memory is aligned to 8 bytes, like memory returned by malloc.
+ *
+ * @param[in]  arena   Arena to allocate from
+ * @param[in]  size    Number of bytes to allocate
+ * @return             Pointer to the allocated memory, or NULL if the arena is full
+ */
+inline void *arena_alloc(arena_t *arena, uint32_t size) {
+    return arena_alloc_aligned(arena, 8, size);
+}
+
+/**
+ * @brief Return a mark of the current allocation point, to be used with #arena_rewind
+ *
+ * @param[in]  arena   Arena
+ * @return             The mark
+ */
+inline uint32_t arena_mark(const arena_t *arena) {
+    return arena->used;
+}
+
+/**
+ * @brief Release all the memory allocated after a mark
+ *
+ * This allows to use an arena as a scratch stack: take a mark, do some
+ * temporary allocations, and rewind to the mark when they are not
+ * needed anymore.
+ *
+ * @param[in]  arena   Arena
+ * @param[in]  mark    Mark previously returned by #arena_mark
+ */
+inline void arena_rewind(arena_t *arena, uint32_t mark) {
+    arena->used = mark;
+}
+
+/**
+ * @brief Release all the memory allocated from an arena
+ *
+ * @param[in]  arena   Arena
+ */
+inline void arena_reset(arena_t *arena) {
+    arena->used = 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */ /* arena */
+
+#endif
@@ -193,17 +193,40 @@ typedef struct controller_origin_data
     struct SI_origdat_gc gc[4];
 } SI_controllers_origin_t;
 
+/**
+ * @brief Input latency statistics.
+ * 
+ * @see #controller_get_latency_stats
+ */
+typedef struct controller_latency_stats_s
+{
+    /** @brief Number of samples fetched by #controller_scan */
+    uint32_t samples;
+    /** @brief Number of samples that were replaced by a newer one before being fetched */
+    uint32_t dropped;
+    /** @brief Minimum latency (in ticks) */
+    uint32_t min;
+    /** @brief Maximum latency (in ticks) */
+    uint32_t max;
+    /** @brief Sum of all the latencies (in ticks), to compute the average */
+    uint64_t total;
+} controller_latency_stats_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void controller_init( void );
+void controller_set_scan_schedule( int scans_per_frame, int line );
 void controller_read( struct controller_data * data );
 void controller_read_gc( struct controller_data * data, const uint8_t rumble[4] );
 void controller_read_gc_origin( struct controller_origin_data * data);
 int get_controllers_present( void );
 int get_accessories_present( struct controller_data * data );
 void controller_scan( void );
+uint32_t controller_get_sample_ticks( void );
+void controller_get_latency_stats( controller_latency_stats_t *stats );
+void controller_reset_latency_stats( void );
 struct controller_data get_keys_down( void );
 struct controller_data get_keys_up( void );
 struct controller_data get_keys_held( void );
@@ -211,6 +234,8 @@ struct controller_data get_keys_pressed( void );
 int get_dpad_direction( int controller );
 int read_mempak_address( int controller, uint16_t address, uint8_t *data );
 int write_mempak_address( int controller, uint16_t address, uint8_t *data );
+int read_mempak_bulk( int controller, uint16_t address, uint8_t *data, int len );
+int write_mempak_bulk( int controller, uint16_t address, uint8_t *data, int len );
 int identify_accessory( int controller );
 void rumble_start( int controller );
 void rumble_stop( int controller );
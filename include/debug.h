@@ -6,6 +6,7 @@
 #ifndef __LIBDRAGON_DEBUG_H
 #define __LIBDRAGON_DEBUG_H
 
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 
@@ -138,6 +139,46 @@ extern "C" {
 	/** @brief Shutdown SD filesystem. */
 	void debug_close_sdfs(void);
 
+	/**
+	 * @brief Make logging asynchronous, through a ring buffer.
+	 *
+	 * After this call, writes to stderr (eg: via #debugf) are appended to a
+	 * ring buffer in memory, instead of being sent immediately to the
+	 * debugging channels, which can be very slow (eg: USB or SD). The ring
+	 * buffer is drained by #debug_flush, which can be called at any idle
+	 * point (eg: once per frame). If the kernel is running (see #kernel_init),
+	 * a low-priority thread is also created to drain the buffer whenever the
+	 * other threads are waiting.
+	 *
+	 * If the ring buffer is full, writes are dropped and counted (see
+	 * #debug_get_async_stats); the next flush will report how many were lost.
+	 * On assertion, the buffer is flushed before printing the assertion.
+	 *
+	 * @param size  Size of the ring buffer in bytes (power of two)
+	 * @return true if asynchronous logging is active, false otherwise
+	 */
+	bool debug_init_async(int size);
+
+	/** @brief Flush the asynchronous log and go back to synchronous logging. */
+	void debug_close_async(void);
+
+	/**
+	 * @brief Send the contents of the asynchronous log ring buffer to the debugging channels.
+	 *
+	 * This function must not be called from interrupt handlers, as the
+	 * debugging channels cannot be accessed there. If another thread is
+	 * already flushing the buffer, it returns immediately.
+	 */
+	void debug_flush(void);
+
+	/**
+	 * @brief Get the statistics of asynchronous logging.
+	 *
+	 * @param[out] dropped        Number of writes dropped because the ring buffer was full
+	 * @param[out] dropped_bytes  Number of bytes dropped because the ring buffer was full
+	 */
+	void debug_get_async_stats(uint32_t *dropped, uint32_t *dropped_bytes);
+
 	/**
 	 * @brief Initialize debugging features of libdragon.
 	 *
@@ -198,6 +239,10 @@ extern "C" {
 	#define debug_init_isviewer()      ({ false; })
 	#define debug_init_sdlog(fn,fmt)   ({ false; })
 	#define debug_init_sdfs(prefix,np) ({ false; })
+	#define debug_init_async(size)     ({ false; })
+	#define debug_close_async()        ({ })
+	#define debug_flush()              ({ })
+	#define debug_get_async_stats(d,b) ({ })
 	#define debugf(msg, ...)           ({ })
 	#define assertf(expr, msg, ...)    ({ })
 #endif
@@ -223,6 +268,16 @@ extern "C" {
  */
 void debug_hexdump(const void *buffer, int size);
 
+/**
+ * @brief Dump a report of the memory usage via #debugf
+ *
+ * The report shows the heap boundaries and its high-water mark, the bytes
+ * allocated and free, how much of the free memory is fragmented in holes
+ * between allocations, and the live bytes accounted to each memory tag
+ * (see #sys_memory_tag_update).
+ */
+void debug_memory_report(void);
+
 /** @brief Underlying implementation function for assert() and #assertf. */ 
 void debug_assert_func_f(const char *file, int line, const char *func, const char *failedexpr, const char *msg, ...)
    __attribute__((noreturn, format(printf, 5, 6)));
@@ -110,6 +110,21 @@ typedef enum
     ANTIALIAS_RESAMPLE_FETCH_ALWAYS
 } antialias_t;
 
+/**
+ * @brief Presentation modes
+ *
+ * @see #display_set_present_mode
+ */
+typedef enum
+{
+    /** @brief Frames are shown in locking order, each one for at least one
+     *         vertical blank (or as configured by #display_set_refresh_divisor) */
+    DISPLAY_PRESENT_FIFO,
+    /** @brief At each vertical blank, the newest ready frame is shown, and
+     *         older ready frames are discarded and recycled for drawing */
+    DISPLAY_PRESENT_MAILBOX
+} display_present_mode_t;
+
 /** 
  * @brief Display context (DEPRECATED: Use #surface_t instead)
  * 
@@ -117,6 +132,36 @@ typedef enum
  */
 typedef surface_t* display_context_t;
 
+/**
+ * @brief Frame pacing statistics
+ *
+ * Counters collected by the display subsystem while flipping frames. All
+ * times are expressed in CPU ticks (see #TICKS_PER_SECOND).
+ *
+ * @see #display_get_stats
+ */
+typedef struct {
+    /** @brief Number of frames that have been flipped on screen */
+    uint32_t frames_shown;
+    /** @brief Number of frames shown later than their pacing slot */
+    uint32_t frames_late;
+    /** @brief Number of pacing slots in which a frame was being drawn but was
+     *         not ready, so that the previous frame was shown again */
+    uint32_t frames_dropped;
+    /** @brief Number of ready frames that were never shown because a newer
+     *         one was available (only in #DISPLAY_PRESENT_MAILBOX mode) */
+    uint32_t frames_skipped;
+    /** @brief Latency between #display_show and the VI flip for the last frame */
+    uint32_t last_latency;
+    /** @brief Maximum latency between #display_show and the VI flip */
+    uint32_t max_latency;
+    /** @brief Sum of the latencies of all shown frames (divide by frames_shown
+     *         to get the average) */
+    uint64_t total_latency;
+    /** @brief Total time spent blocking in #display_lock_wait */
+    uint64_t wait_ticks;
+} display_stats_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -134,9 +179,11 @@ extern "C" {
  * @param[in] bit
  *            The requested bit depth (#DEPTH_16_BPP or #DEPTH_32_BPP)
  * @param[in] num_buffers
- *            Number of buffers, usually 2 or 3, but can be more. Triple buffering
+ *            Number of buffers, usually 2 or 3, but can be more (up to 32). Triple buffering
  *            is recommended in case the application cannot hold a steady full framerate,
- *            so that slowdowns don't impact too much.
+ *            so that slowdowns don't impact too much. With 3 or more buffers,
+ *            #DISPLAY_PRESENT_MAILBOX mode can be used to always show the newest
+ *            frame (see #display_set_present_mode).
  * @param[in] gamma
  *            The requested gamma setting
  * @param[in] aa
@@ -165,12 +212,34 @@ void display_close();
  * instance to begin working on a new frame while the previous one is still
  * being rendered in parallel through RDP. It is important to notice that
  * surfaces will always be shown on the screen in locking order,
- * irrespective of the order #display_show is called.
+ * irrespective of the order #display_show is called. In
+ * #DISPLAY_PRESENT_MAILBOX mode, surfaces shown after a more recently locked
+ * one has been displayed are discarded.
  *
  * @return A valid surface to render to or NULL if none is available.
+ *
+ * @see #display_lock_wait
  */
 surface_t* display_lock(void);
 
+/**
+ * @brief Lock a display buffer for rendering, waiting for one to be available
+ *
+ * This is similar to #display_lock, but it never returns NULL: if no buffer
+ * is currently available, it waits until the VI interrupt frees one. While
+ * waiting, the function does not poll the buffer state continuously, but
+ * only after each VI interrupt has been serviced, so it does not interfere
+ * with interrupt latency.
+ *
+ * The time spent waiting is accumulated in #display_stats_t::wait_ticks.
+ *
+ * @note Interrupts must be enabled, otherwise this function could wait
+ *       forever for a buffer to be released.
+ *
+ * @return A valid surface to render to.
+ */
+surface_t* display_lock_wait(void);
+
 /**
  * @brief Display a previously locked buffer
  *
@@ -205,6 +274,73 @@ uint32_t display_get_bitdepth(void);
  */
 uint32_t display_get_num_buffers(void);
 
+/**
+ * @brief Configure the presentation mode
+ *
+ * In #DISPLAY_PRESENT_FIFO mode (the default), every frame passed to
+ * #display_show is displayed, in locking order. If the application renders
+ * faster than the display refresh, #display_lock will eventually fail (or
+ * #display_lock_wait will block) until a buffer is flipped.
+ *
+ * In #DISPLAY_PRESENT_MAILBOX mode, at each vertical blank the most recently
+ * locked frame among those that are ready is shown, and the older ready ones are
+ * recycled without being displayed. With at least three buffers (triple
+ * buffering), the application can thus keep rendering without ever waiting
+ * for the display, while the screen always shows the newest complete frame.
+ * This decouples the rendering rate from the refresh rate without adding
+ * latency. With only two buffers, the mode behaves like FIFO.
+ *
+ * @param[in] mode
+ *            The presentation mode to use
+ */
+void display_set_present_mode(display_present_mode_t mode);
+
+/**
+ * @brief Get the current presentation mode
+ *
+ * @see #display_set_present_mode
+ */
+display_present_mode_t display_get_present_mode(void);
+
+/**
+ * @brief Configure frame pacing
+ *
+ * Set the minimum number of vertical blanks between two consecutive frame
+ * flips. For instance, with a divisor of 2 on a NTSC console, new frames
+ * are shown at most at 30 FPS, and each frame is kept on screen for the same
+ * amount of time even if the application is able to render faster, which
+ * avoids uneven frame pacing.
+ *
+ * The default divisor is 1, which means that a new frame is shown at every
+ * vertical blank, as soon as it is ready.
+ *
+ * @param[in] divisor
+ *            Number of vertical blanks per frame (must be at least 1)
+ */
+void display_set_refresh_divisor(uint32_t divisor);
+
+/**
+ * @brief Get the currently configured refresh divisor
+ *
+ * @see #display_set_refresh_divisor
+ */
+uint32_t display_get_refresh_divisor(void);
+
+/**
+ * @brief Get the frame pacing statistics
+ *
+ * Statistics are reset by #display_init and #display_reset_stats.
+ *
+ * @param[out] stats
+ *             Structure that will be filled with the current statistics
+ */
+void display_get_stats(display_stats_t *stats);
+
+/**
+ * @brief Reset the frame pacing statistics
+ */
+void display_reset_stats(void);
+
 #ifdef __cplusplus
 }
 #endif
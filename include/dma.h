@@ -6,12 +6,36 @@
 #ifndef __LIBDRAGON_DMA_H
 #define __LIBDRAGON_DMA_H
 
+#include <stdint.h>
 #include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** @brief Cache state of a DMA buffer (see #dma_buffer_t) */
+typedef enum {
+    /** @brief The CPU might have written to the buffer: the cache can contain dirty lines */
+    DMA_BUFFER_DIRTY,
+    /** @brief The cache and RDRAM contents of the buffer match */
+    DMA_BUFFER_CLEAN,
+    /** @brief The RCP is reading the buffer: the CPU can read it, but not write it */
+    DMA_BUFFER_RCP_READING,
+    /** @brief The RCP is writing the buffer: the CPU must not access it */
+    DMA_BUFFER_RCP_WRITING,
+} dma_buffer_state_t;
+
+/**
+ * @brief A memory buffer used for DMA transfers, with its cache state
+ *
+ * See #dma_buffer_init for details.
+ */
+typedef struct {
+    void *addr;                 ///< Start of the buffer
+    uint32_t len;               ///< Length of the buffer in bytes
+    dma_buffer_state_t state;   ///< Current cache state of the buffer
+} dma_buffer_t;
+
 void dma_write_raw_async(const void *ram_address, unsigned long pi_address, unsigned long len);
 void dma_write(const void * ram_address, unsigned long pi_address, unsigned long len);
 
@@ -29,6 +53,13 @@ void io_write(uint32_t pi_address, uint32_t data);
 
 bool io_accessible(uint32_t pi_address);
 
+void dma_buffer_init(dma_buffer_t *buf, void *addr, uint32_t len);
+void dma_buffer_cpu_write(dma_buffer_t *buf);
+void dma_buffer_rcp_read(dma_buffer_t *buf);
+void dma_buffer_rcp_write(dma_buffer_t *buf);
+void dma_buffer_release(dma_buffer_t *buf);
+void dma_buffer_audit(bool enable);
+
 __attribute__((deprecated("use dma_wait instead"))) 
 volatile int dma_busy(void);
 
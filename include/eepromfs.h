@@ -28,6 +28,8 @@
 #define EEPFS_EBADHANDLE -5
 /** @brief Filesystem already initialized */
 #define EEPFS_ECONFLICT  -6
+/** @brief Error writing to EEPROM */
+#define EEPFS_EIO        -7
 /** @} */
 
 #ifdef __cplusplus
@@ -83,6 +85,9 @@ int eepfs_erase(const char * path);
 bool eepfs_verify_signature(void);
 void eepfs_wipe(void);
 
+int eepfs_flush(void);
+size_t eepfs_pending_blocks(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -73,7 +73,10 @@ typedef struct
     uint8_t bitdepth;
     /** 
      * @brief Sprite format
-     * @note Currently unused
+     *
+     * The lower 4 bits are the pixel format (currently unused, always 0).
+     * The upper 4 bits are the number of additional mipmap levels stored
+     * after the full size image (see #sprite_get_lod_count).
      */
     uint8_t format;
     /** @brief Number of horizontal slices for spritemaps */
@@ -85,6 +88,19 @@ typedef struct
     uint32_t data[0];
 } sprite_t;
 
+/** @brief Shift of the number of additional mipmap levels within #sprite_t::format */
+#define SPRITE_FORMAT_LODS_SHIFT   4
+
+/**
+ * @brief Return the number of mipmap levels of a sprite, including the full size image
+ *
+ * Level N is the full size image scaled down by 2^N. Sprites converted
+ * by mksprite without the --mipmap option only have one level.
+ */
+inline int sprite_get_lod_count(const sprite_t *sprite) {
+    return 1 + (sprite->format >> SPRITE_FORMAT_LODS_SHIFT);
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -107,6 +123,7 @@ void graphics_draw_sprite( surface_t* surf, int x, int y, sprite_t *sprite );
 void graphics_draw_sprite_stride( surface_t* surf, int x, int y, sprite_t *sprite, int offset );
 void graphics_draw_sprite_trans( surface_t* surf, int x, int y, sprite_t *sprite );
 void graphics_draw_sprite_trans_stride( surface_t* surf, int x, int y, sprite_t *sprite, int offset );
+void *sprite_get_lod_data( sprite_t *sprite, int lod );
 
 #ifdef __cplusplus
 }
@@ -6,6 +6,9 @@
 #ifndef __LIBDRAGON_INTERRUPT_H
 #define __LIBDRAGON_INTERRUPT_H
 
+#include <stdint.h>
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -28,6 +31,77 @@ typedef enum
     INTERRUPTS_ENABLED
 } interrupt_state_t;
 
+/** @brief Source of an interrupt */
+typedef enum
+{
+    /** @brief RSP interrupt */
+    INTERRUPT_SP,
+    /** @brief Serial interface (joybus) interrupt */
+    INTERRUPT_SI,
+    /** @brief Audio interface interrupt */
+    INTERRUPT_AI,
+    /** @brief Video interface interrupt */
+    INTERRUPT_VI,
+    /** @brief Peripheral interface (DMA) interrupt */
+    INTERRUPT_PI,
+    /** @brief RDP interrupt */
+    INTERRUPT_DP,
+    /** @brief CPU timer interrupt */
+    INTERRUPT_TI,
+    /** @brief CART interrupt */
+    INTERRUPT_CART,
+    /** @brief Number of interrupt sources */
+    INTERRUPT_NUM_SOURCES,
+} interrupt_source_t;
+
+/** @brief Maximum number of callbacks that can be registered for each interrupt source */
+#define INTERRUPT_MAX_CALLBACKS     8
+
+/** @brief Priority of callbacks that must run before the others (eg: audio) */
+#define INTERRUPT_PRIORITY_HIGH     100
+/** @brief Priority of callbacks registered without an explicit priority */
+#define INTERRUPT_PRIORITY_DEFAULT  0
+/** @brief Priority of callbacks that can run after all the others */
+#define INTERRUPT_PRIORITY_LOW      -100
+
+/**
+ * @brief Hook to measure the interrupt latency (see #set_interrupt_latency_hook)
+ *
+ * @param source    Source of the interrupt being serviced
+ * @param callback  Callback that is about to be called
+ * @param ticks     Ticks elapsed since the interrupt handler was entered
+ */
+typedef void (*interrupt_latency_hook_t)(interrupt_source_t source, void (*callback)(), uint32_t ticks);
+
+/** @brief Number of longest critical sections recorded by the interrupt statistics */
+#define INTERRUPT_STATS_MAX_SECTIONS    8
+
+/** @brief A critical section recorded by the interrupt statistics */
+typedef struct
+{
+    /** @brief Duration of the critical section, in ticks */
+    uint32_t ticks;
+    /** @brief Return address of the call to #disable_interrupts that started it */
+    void *caller;
+} interrupt_section_t;
+
+/** @brief Interrupt statistics (see #interrupt_stats_enable) */
+typedef struct
+{
+    /** @brief Longest critical sections, sorted by decreasing duration */
+    interrupt_section_t longest[INTERRUPT_STATS_MAX_SECTIONS];
+    /** @brief Number of critical sections measured */
+    uint32_t num_sections;
+    /** @brief Total time spent with interrupts disabled by critical sections, in ticks */
+    uint64_t disabled_ticks;
+    /** @brief Number of interrupts handled, per source */
+    uint32_t handler_count[INTERRUPT_NUM_SOURCES];
+    /** @brief Total time spent in the callbacks, per source, in ticks */
+    uint64_t handler_ticks[INTERRUPT_NUM_SOURCES];
+    /** @brief Longest time spent in the callbacks of a single interrupt, per source, in ticks */
+    uint32_t handler_max_ticks[INTERRUPT_NUM_SOURCES];
+} interrupt_stats_t;
+
 /** @} */
 
 void register_AI_handler( void (*callback)() );
@@ -48,6 +122,14 @@ void unregister_SP_handler( void (*callback)() );
 void unregister_TI_handler( void (*callback)() );
 void unregister_CART_handler( void (*callback)() );
 
+void register_interrupt_handler( interrupt_source_t source, void (*callback)(), int priority );
+void set_interrupt_latency_hook( interrupt_latency_hook_t hook );
+
+void interrupt_stats_enable( bool enable );
+void interrupt_stats_reset( void );
+void interrupt_stats_get( interrupt_stats_t *stats );
+void interrupt_stats_report( void );
+
 void set_AI_interrupt( int active );
 void set_VI_interrupt( int active, unsigned long line );
 void set_PI_interrupt( int active );
@@ -24,11 +24,36 @@
 #define JOYBUS_BLOCK_DWORDS ( JOYBUS_BLOCK_SIZE / sizeof(uint64_t) )
 
 
+/**
+ * @brief Number of priority levels of joybus messages.
+ *
+ * Level 0 is used for input polling, level 1 for generic messages and level
+ * 2 for background transfers (eg: saves).
+ */
+#define JOYBUS_NUM_PRIORITIES 3
+
+/**
+ * @brief Statistics of the joybus scheduler
+ *
+ * @see #joybus_get_stats
+ */
+typedef struct {
+    uint32_t transactions;                          ///< Number of blocks exchanged with the PIF
+    uint32_t merged;                                ///< Number of messages that shared a block with other messages
+    uint32_t queue_depth;                           ///< Number of messages currently queued
+    uint32_t max_depth;                             ///< Maximum number of messages queued at the same time
+    uint32_t messages[JOYBUS_NUM_PRIORITIES];       ///< Number of messages completed, per priority
+    uint64_t wait_total[JOYBUS_NUM_PRIORITIES];     ///< Total time spent in the queue (in ticks), per priority
+    uint32_t wait_max[JOYBUS_NUM_PRIORITIES];       ///< Maximum time spent in the queue (in ticks), per priority
+} joybus_stats_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void joybus_exec( const void * inblock, void * outblock );
+void joybus_get_stats( joybus_stats_t *stats );
+void joybus_reset_stats( void );
 
 #ifdef __cplusplus
 }
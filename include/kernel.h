@@ -0,0 +1,124 @@
+/**
+ * @file kernel.h
+ * @brief Cooperative multithreading kernel
+ * @ingroup kernel
+ */
+#ifndef __LIBDRAGON_KERNEL_H
+#define __LIBDRAGON_KERNEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @defgroup kernel Multithreading kernel
+ * @ingroup lowlevel
+ * @brief Cooperative threads with interrupt-aware synchronization primitives.
+ *
+ * The kernel allows to run multiple threads of execution, each one with its
+ * own stack. Threads are cooperative: a thread runs until it blocks (waiting
+ * on a mutex, a condition variable or an event), sleeps, yields or exits.
+ * This makes it possible to, for instance, stream assets from a loader thread
+ * while the main thread is waiting for the RSP or for the vblank.
+ *
+ * After #kernel_init, the code calling it becomes the "main" thread, and new
+ * threads can be created with #kthread_new:
+ *
+ * @code{.c}
+ *      int loader(void *arg) {
+ *          // Load assets in background
+ *          ...
+ *          return 0;
+ *      }
+ *
+ *      kernel_init();
+ *      kthread_t *th = kthread_new("loader", 8192, 0, loader, NULL);
+ *      while (!done) {
+ *          // Render. While waiting for the next framebuffer, libdragon
+ *          // lets the loader thread run.
+ *          ...
+ *      }
+ *      kthread_join(th);
+ * @endcode
+ *
+ * Some waits within libdragon (#display_lock_wait, #joybus_exec) block until
+ * the relevant interrupt happens, letting other threads run meanwhile; called
+ * with interrupts disabled, they busy-wait as before. Other waits (eg:
+ * #dma_wait, #rspq_syncpoint_wait) are still busy-waits, because the code
+ * that calls them is not reentrant: another thread would be able to run
+ * the same code (eg: a DFS read) while the first one is halfway through it.
+ *
+ * Interrupt handlers can wake up threads with #kcond_signal, #kcond_broadcast
+ * and #kevent_set. Since the kernel is cooperative, the woken threads run when
+ * the current thread blocks or yields, not immediately.
+ *
+ * All the blocking functions (and #kthread_yield) must be called with interrupts
+ * enabled: calling #kthread_yield with interrupts disabled or within an interrupt
+ * handler has no effect, while blocking functions will assert. If the kernel is
+ * not initialized, there is only one thread, so yielding does nothing, and
+ * waiting for an event busy-waits for the interrupt that sets it.
+ * @{
+ */
+
+/** @brief A thread (opaque) */
+typedef struct kthread_s kthread_t;
+
+/** @brief A mutex */
+typedef struct {
+    kthread_t *owner;       ///< Thread owning the mutex (NULL if unlocked)
+    kthread_t *waiters;     ///< Threads waiting for the mutex
+} kmutex_t;
+
+/** @brief A condition variable */
+typedef struct {
+    kthread_t *waiters;     ///< Threads waiting on the condition variable
+} kcond_t;
+
+/**
+ * @brief An event, that can be set from interrupt handlers
+ *
+ * An event is set by #kevent_set, and stays set until a thread waits for
+ * it via #kevent_wait, which resets it (auto-reset). Compared to a condition
+ * variable, an event is not lost if it is set before a thread waits for it.
+ */
+typedef struct {
+    volatile bool signaled; ///< True if the event is set
+    kthread_t *waiters;     ///< Threads waiting for the event
+} kevent_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void kernel_init(void);
+void kernel_close(void);
+
+kthread_t* kthread_new(const char *name, int stack_size, int8_t pri, int (*user_entry)(void*), void *user_data);
+int kthread_join(kthread_t *th);
+void kthread_exit(int result) __attribute__((noreturn));
+void kthread_yield(void);
+bool kthread_can_switch(void);
+void kthread_sleep(uint32_t ticks);
+kthread_t* kthread_current(void);
+const char* kthread_name(kthread_t *th);
+
+void kmutex_init(kmutex_t *mutex);
+void kmutex_lock(kmutex_t *mutex);
+bool kmutex_try_lock(kmutex_t *mutex);
+void kmutex_unlock(kmutex_t *mutex);
+
+void kcond_init(kcond_t *cond);
+void kcond_wait(kcond_t *cond, kmutex_t *mutex);
+void kcond_signal(kcond_t *cond);
+void kcond_broadcast(kcond_t *cond);
+
+void kevent_init(kevent_t *event);
+void kevent_set(kevent_t *event);
+void kevent_wait(kevent_t *event);
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */ /* kernel */
+
+#endif
@@ -53,5 +53,8 @@
 #include "ym64.h"
 #include "rspq.h"
 #include "surface.h"
+#include "arena.h"
+#include "profile.h"
+#include "kernel.h"
 
 #endif
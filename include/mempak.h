@@ -6,6 +6,8 @@
 #ifndef __LIBDRAGON_MEMPAK_H
 #define __LIBDRAGON_MEMPAK_H
 
+#include <stdint.h>
+
 /**
  * @addtogroup mempak
  * @{
@@ -13,6 +15,8 @@
 
 /** @brief Size in bytes of a Mempak block */
 #define MEMPAK_BLOCK_SIZE   256
+/** @brief Size in bytes of a whole Mempak image (128 blocks) */
+#define MEMPAK_IMAGE_SIZE   (128 * MEMPAK_BLOCK_SIZE)
 
 /**
  * @brief Structure representing a save entry in a mempak
@@ -49,6 +53,9 @@ typedef struct entry_structure
     char name[19];
 } entry_structure_t;
 
+/** @brief A whole Mempak image transfer (see #mempak_backup_begin). Its contents are private. */
+typedef struct mempak_image_s mempak_image_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -62,6 +69,12 @@ int format_mempak( int controller );
 int read_mempak_entry_data( int controller, entry_structure_t *entry, uint8_t *data );
 int write_mempak_entry_data( int controller, entry_structure_t *entry, uint8_t *data );
 int delete_mempak_entry( int controller, entry_structure_t *entry );
+int mempak_batch_begin( int controller );
+int mempak_batch_end( int controller );
+int mempak_backup_begin( mempak_image_t **image, int controller, uint8_t *data );
+int mempak_restore_begin( mempak_image_t **image, int controller, const uint8_t *data );
+int mempak_image_progress( mempak_image_t *image );
+int mempak_image_end( mempak_image_t *image );
 
 #ifdef __cplusplus
 }
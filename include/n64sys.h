@@ -240,6 +240,8 @@ void wait_ms( unsigned long wait_ms );
 void __data_cache_hit_invalidate(volatile void * addr, unsigned long length);
 void data_cache_hit_writeback(volatile const void *, unsigned long);
 void data_cache_hit_writeback_invalidate(volatile void *, unsigned long);
+void data_cache_dma_in(volatile void *, unsigned long);
+void data_cache_dma_out(volatile const void *, unsigned long);
 void data_cache_index_writeback_invalidate(volatile void *, unsigned long);
 void data_cache_writeback_invalidate_all(void);
 void inst_cache_hit_writeback(volatile const void *, unsigned long);
@@ -0,0 +1,52 @@
+/**
+ * @file profile.h
+ * @brief Statistical CPU profiler
+ * @ingroup profile
+ */
+#ifndef __LIBDRAGON_PROFILE_H
+#define __LIBDRAGON_PROFILE_H
+
+#include <stdint.h>
+
+/**
+ * @defgroup profile Statistical CPU profiler
+ * @ingroup lowlevel
+ * @brief Sampling profiler driven by the timer interrupt.
+ *
+ * The profiler periodically interrupts the CPU via a timer, and records
+ * the program counter of the interrupted code into a histogram that covers
+ * the whole text segment. After enough samples, the histogram shows where the
+ * CPU time is spent, with no need of instrumenting the code.
+ *
+ * The histogram can be dumped via #debugf with #profile_dump, and then
+ * symbolized on the PC with the n64prof tool, that matches the samples
+ * against the symbols of the ELF file and prints a report of the
+ * hottest functions:
+ *
+ * <pre>
+ *     $ n64prof game.elf usblog.txt
+ * </pre>
+ *
+ * The profiler requires the timer module (see #timer_init). Notice that code
+ * running with interrupts disabled cannot be sampled: the samples will be
+ * accounted to the code that re-enables interrupts.
+ *
+ * @{
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void profile_start(int frequency, int granularity);
+void profile_stop(void);
+void profile_reset(void);
+void profile_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */ /* profile */
+
+#endif
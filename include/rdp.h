@@ -55,6 +55,41 @@ typedef enum
     FLUSH_STRATEGY_AUTOMATIC
 } flush_t;
 
+/**
+ * @brief Vertex of a triangle drawn with #rdp_draw_triangle
+ *
+ * All the values are in the fixed point formats used by the RDP, so that
+ * triangle setup does not require any floating point math.
+ */
+typedef struct
+{
+    /** @brief Screen X coordinate, in 1/4 pixels (s13.2) */
+    int16_t x;
+    /** @brief Screen Y coordinate, in 1/4 pixels (s13.2) */
+    int16_t y;
+    /** @brief Depth (0 is the nearest, 0x7FFF the farthest) */
+    uint16_t z;
+    /** @brief Horizontal texture coordinate, in 1/32 texels (s10.5) */
+    int16_t s;
+    /** @brief Vertical texture coordinate, in 1/32 texels (s10.5) */
+    int16_t t;
+    /** @brief Red component of the shade color */
+    uint8_t r;
+    /** @brief Green component of the shade color */
+    uint8_t g;
+    /** @brief Blue component of the shade color */
+    uint8_t b;
+    /** @brief Alpha component of the shade color */
+    uint8_t a;
+} rdp_vertex_t;
+
+/** @brief Triangle flag: interpolate the vertex colors (Gouraud shading) */
+#define RDP_TRI_SHADE   0x4
+/** @brief Triangle flag: interpolate the texture coordinates */
+#define RDP_TRI_TEX     0x2
+/** @brief Triangle flag: interpolate the depth and use the Z-buffer */
+#define RDP_TRI_ZBUF    0x1
+
 /** @} */
 
 #ifdef __cplusplus
@@ -72,6 +107,8 @@ void rdp_enable_blend_fill( void );
 void rdp_enable_texture_copy( void );
 uint32_t rdp_load_texture( uint32_t texslot, uint32_t texloc, mirror_t mirror, sprite_t *sprite );
 uint32_t rdp_load_texture_stride( uint32_t texslot, uint32_t texloc, mirror_t mirror, sprite_t *sprite, int offset );
+uint32_t rdp_load_texture_scaled( uint32_t texslot, uint32_t texloc, mirror_t mirror, sprite_t *sprite, double x_scale, double y_scale );
+uint32_t rdp_load_texture_stride_scaled( uint32_t texslot, uint32_t texloc, mirror_t mirror, sprite_t *sprite, int offset, double x_scale, double y_scale );
 void rdp_draw_textured_rectangle( uint32_t texslot, int tx, int ty, int bx, int by,  mirror_t mirror );
 void rdp_draw_textured_rectangle_scaled( uint32_t texslot, int tx, int ty, int bx, int by, double x_scale, double y_scale,  mirror_t mirror );
 void rdp_draw_sprite( uint32_t texslot, int x, int y ,  mirror_t mirror);
@@ -80,6 +117,10 @@ void rdp_set_primitive_color( uint32_t color );
 void rdp_set_blend_color( uint32_t color );
 void rdp_draw_filled_rectangle( int tx, int ty, int bx, int by );
 void rdp_draw_filled_triangle( float x1, float y1, float x2, float y2, float x3, float y3 );
+void rdp_enable_triangle_mode( uint32_t flags );
+void rdp_attach_zbuffer( surface_t *zbuf );
+void rdp_draw_triangle( uint32_t flags, uint32_t texslot, const rdp_vertex_t *v1, const rdp_vertex_t *v2, const rdp_vertex_t *v3 );
+void rdp_draw_triangles( uint32_t flags, uint32_t texslot, const rdp_vertex_t *vertices, const uint16_t *indices, int num_triangles );
 void rdp_set_texture_flush( flush_t flush );
 void rdp_close( void );
 
@@ -37,8 +37,7 @@
  * a portion of the original surface:
  * 
  * @code{.c}
- *      surface_t *fb;
- *      while (fb = display_lock()) ;  // wait for a framebuffer to be ready
+ *      surface_t *fb = display_lock_wait();  // wait for a framebuffer to be ready
  *      
  *      // Attach the RDP to the top 40 rows of the framebuffer
  *      surface_t fbtop = surface_make_sub(fb, 0, 0, 320, 40);
@@ -242,6 +241,79 @@ surface_t surface_make_sub(surface_t *parent,
  */
 void surface_free(surface_t *surface);
 
+/**
+ * @brief Initialize the RSP surface operations
+ * 
+ * This function initializes the RSP command queue (if required) and registers
+ * the overlay that implements #surface_fill_async, #surface_copy_async and
+ * #surface_convert_async. Calling it is optional, as those functions
+ * perform the initialization on first use.
+ */
+void surface_rsp_init(void);
+
+/**
+ * @brief Unregister the RSP surface operations
+ * 
+ * This must be called before #rspq_close if the RSP surface operations were used,
+ * so that they can be registered again after the queue is reinitialized.
+ */
+void surface_rsp_close(void);
+
+/**
+ * @brief Fill a surface with a color, using the RSP.
+ * 
+ * The fill is enqueued in the RSP command queue (see rspq.h) and runs
+ * asynchronously: the function returns immediately, and the surface contents
+ * are undefined until the RSP has processed the command (use #rspq_wait
+ * to wait for it, or any other rspq synchronization primitive).
+ * 
+ * The color must be given in the pixel format of the surface (eg: as
+ * returned by #graphics_convert_color for RGBA16/RGBA32 surfaces).
+ * 
+ * The surface buffer, stride and row length (in bytes) must be multiples
+ * of 8, which is always true for surfaces created with #surface_alloc
+ * and for framebuffers. Like all RSP DMA transfers, the RSP bypasses the CPU
+ * cache, so if the buffer is accessed via cached memory, the cache must
+ * be invalidated before reading back the results.
+ * 
+ * @param[in]  surface   Surface to fill
+ * @param[in]  color     Fill color, in the surface pixel format
+ */
+void surface_fill_async(surface_t *surface, uint32_t color);
+
+/**
+ * @brief Copy the contents of a surface into another one, using the RSP.
+ * 
+ * The two surfaces must have the same format and size. To copy a rectangle
+ * between two larger surfaces, create sub-surfaces with #surface_make_sub.
+ * 
+ * The copy is asynchronous and has the same alignment requirements as
+ * #surface_fill_async. If the source is written via cached memory, make sure
+ * to write back the cache before calling this function.
+ * 
+ * @param[in]  dst       Destination surface
+ * @param[in]  src       Source surface
+ */
+void surface_copy_async(surface_t *dst, const surface_t *src);
+
+/**
+ * @brief Convert the pixels of a surface into another format, using the RSP.
+ * 
+ * Conversion between #FMT_RGBA16 and #FMT_RGBA32 (in both directions) is
+ * supported. When expanding to 32-bit, each 5-bit component is scaled to
+ * the full 8-bit range; when reducing to 16-bit, the lower bits are truncated
+ * and alpha keeps only its top bit. If both surfaces have the same format,
+ * this is equivalent to #surface_copy_async.
+ * 
+ * The two surfaces must have the same size, and the width must be a multiple
+ * of 4. The conversion is asynchronous and has the same alignment requirements
+ * as #surface_fill_async.
+ * 
+ * @param[in]  dst       Destination surface
+ * @param[in]  src       Source surface
+ */
+void surface_convert_async(surface_t *dst, const surface_t *src);
+
 /**
  * @brief Returns the pixel format of a surface
  * 
@@ -15,6 +15,8 @@
 #define MAX_FILESYSTEMS     10
 /** @brief Number of open handles that can be maintained at one time */
 #define MAX_OPEN_HANDLES    100
+/** @brief Number of memory tags that can be tracked at the same time */
+#define MAX_MEMORY_TAGS     16
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,6 +24,7 @@ extern "C" {
 
 #include <dir.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 /**
  * @brief Filesystem hook structure
@@ -182,6 +185,46 @@ typedef struct
     int (*stderr_write)( char *data, unsigned int len );
 } stdio_t;
 
+/**
+ * @brief Heap usage statistics
+ *
+ * @see #sys_get_heap_stats
+ */
+typedef struct
+{
+    /** @brief Start address of the heap */
+    uint32_t heap_start;
+    /** @brief Current end of the heap, as grown by sbrk */
+    uint32_t heap_end;
+    /** @brief Highest end of the heap ever reached (high-water mark) */
+    uint32_t heap_peak;
+    /** @brief Maximum end of the heap (the stack is above it) */
+    uint32_t heap_limit;
+    /** @brief Bytes currently allocated by malloc */
+    uint32_t live_bytes;
+    /** @brief Free bytes within the heap */
+    uint32_t free_bytes;
+    /** @brief Number of free chunks within the heap */
+    uint32_t free_chunks;
+    /** @brief Free bytes at the top of the heap. The remaining free bytes are holes between allocations. */
+    uint32_t top_free_bytes;
+} heap_stats_t;
+
+/**
+ * @brief Live memory accounted to a memory tag
+ *
+ * @see #sys_memory_tag_update
+ */
+typedef struct
+{
+    /** @brief Name of the tag */
+    const char *name;
+    /** @brief Bytes currently accounted to the tag */
+    int32_t live_bytes;
+    /** @brief Highest value of live_bytes */
+    int32_t peak_bytes;
+} memory_tag_t;
+
 int attach_filesystem( const char * const prefix, filesystem_t *filesystem );
 int detach_filesystem( const char * const prefix );
 
@@ -190,6 +233,14 @@ int unhook_stdio_calls( stdio_t *stdio_calls );
 
 int hook_time_call( time_t (*time_fn)( void ) );
 int unhook_time_call( time_t (*time_fn)( void ) );
+int hook_timeofday_call( int (*timeofday_fn)( struct timeval *ptimeval ) );
+int unhook_timeofday_call( int (*timeofday_fn)( struct timeval *ptimeval ) );
+
+void sys_get_heap_stats( heap_stats_t *stats );
+void sys_memory_tag_update( const char *name, int32_t delta );
+int sys_get_memory_tags( memory_tag_t *tags, int max );
+
+int sys_set_readahead( int file, int size );
 
 #ifdef __cplusplus
 }
@@ -39,8 +39,8 @@ typedef struct timer_link
     };
     /** @brief Callback context parameter */
     void *ctx;
-    /** @brief Link to next timer */
-    struct timer_link *next;
+    /** @brief Position of the timer in the timer queue (internal) */
+    int queue_idx;
 } timer_link_t;
 
 /** @brief Timer should fire only once */
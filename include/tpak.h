@@ -31,6 +31,14 @@ extern "C" {
 #define TPAK_ERROR_NO_CARTRIDGE         -5
 /** @brief Transfer Pak error: Address overflow */
 #define TPAK_ERROR_ADDRESS_OVERFLOW     -6
+/** @brief Transfer Pak error: Cartridge memory bank controller not supported */
+#define TPAK_ERROR_UNSUPPORTED_CART     -7
+/** @brief Transfer Pak error: Data CRC mismatch persisted after retrying */
+#define TPAK_ERROR_TRANSFER             -8
+/** @brief Transfer Pak error: Cartridge checksum mismatch */
+#define TPAK_ERROR_CHECKSUM             -9
+/** @brief Transfer Pak error: Not enough memory */
+#define TPAK_ERROR_NO_MEMORY            -10
 /** @} */
 
 /**
@@ -314,6 +322,21 @@ struct gameboy_cartridge_header
     uint8_t overflow[16];
 };
 
+/** @brief Maximum number of Transfer Pak commands in flight for a stream */
+#define TPAK_STREAM_INFLIGHT    4
+
+/** @brief Game Boy cartridge memory that can be streamed (see #tpak_stream_begin) */
+typedef enum
+{
+    /** @brief Cartridge ROM */
+    TPAK_STREAM_ROM,
+    /** @brief Cartridge Save RAM */
+    TPAK_STREAM_SRAM,
+} tpak_stream_source_t;
+
+/** @brief A Game Boy cartridge stream (see #tpak_stream_begin). Its contents are private. */
+typedef struct tpak_stream_s tpak_stream_t;
+
 int tpak_init(int controller);
 int tpak_set_value(int controller, uint16_t address, uint8_t value);
 int tpak_set_bank(int controller, int bank);
@@ -325,6 +348,13 @@ bool tpak_check_header(struct gameboy_cartridge_header* header);
 int tpak_write(int controller, uint16_t address, uint8_t* data, uint16_t size);
 int tpak_read(int controller, uint16_t address, uint8_t* buffer, uint16_t size);
 
+int tpak_get_cartridge_size(struct gameboy_cartridge_header* header, tpak_stream_source_t source);
+int tpak_stream_begin(tpak_stream_t **stream, int controller, tpak_stream_source_t source, uint8_t *ring, uint32_t ring_size);
+int tpak_stream_read(tpak_stream_t *stream, uint8_t *buffer, uint32_t size);
+uint32_t tpak_stream_size(tpak_stream_t *stream);
+uint32_t tpak_stream_tell(tpak_stream_t *stream);
+int tpak_stream_end(tpak_stream_t *stream);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,61 @@
+/**
+ * @file arena.c
+ * @brief Linear memory arenas
+ * @ingroup arena
+ */
+#include <malloc.h>
+#include "arena.h"
+#include "system.h"
+#include "debug.h"
+
+void arena_init(arena_t *arena, const char *name, uint32_t size)
+{
+    assertf(name, "arena_init requires a name; use arena_init_buffer for external buffers");
+    arena->buffer = memalign(16, size);
+    assertf(arena->buffer, "not enough memory for arena %s (%lu bytes)", name, size);
+    arena->size = size;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->name = name;
+    sys_memory_tag_update(name, size);
+}
+
+void arena_init_buffer(arena_t *arena, void *buffer, uint32_t size)
+{
+    arena->buffer = buffer;
+    arena->size = size;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->name = NULL;
+}
+
+void arena_close(arena_t *arena)
+{
+    if (arena->name) {
+        sys_memory_tag_update(arena->name, -(int32_t)arena->size);
+        free(arena->buffer);
+    }
+    arena->buffer = NULL;
+    arena->size = arena->used = 0;
+}
+
+void *arena_alloc_aligned(arena_t *arena, uint32_t align, uint32_t size)
+{
+    assertf((align & (align - 1)) == 0, "alignment must be a power of two: %lu", align);
+
+    // Align the absolute address, as the buffer might be less aligned than requested
+    uint32_t start = (uint32_t)arena->buffer;
+    uint32_t offset = ((start + arena->used + align - 1) & ~(align - 1)) - start;
+    if (offset + size > arena->size || offset + size < offset)
+        return NULL;
+
+    arena->used = offset + size;
+    if (arena->used > arena->peak)
+        arena->peak = arena->used;
+    return arena->buffer + offset;
+}
+
+extern inline void *arena_alloc(arena_t *arena, uint32_t size);
+extern inline uint32_t arena_mark(const arena_t *arena);
+extern inline void arena_rewind(arena_t *arena, uint32_t mark);
+extern inline void arena_reset(arena_t *arena);
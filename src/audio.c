@@ -257,7 +257,7 @@ void audio_init(const int frequency, int numbuffers)
     _frequency = 2 * clockrate / ((2 * clockrate / frequency) + 1);
 
     /* Set up hardware to notify us when it needs more data */
-    register_AI_handler(audio_callback);
+    register_interrupt_handler(INTERRUPT_AI, audio_callback, INTERRUPT_PRIORITY_HIGH);
     set_AI_interrupt(1);
 
     /* Set up buffers */
@@ -253,7 +253,7 @@ static void __console_render(void)
     static display_context_t dc = 0;
 
     /* Wait until we get a valid context */
-    while(!(dc = display_lock()));
+    dc = display_lock_wait();
 
     /* Background color! */
     graphics_fill_screen( dc, 0 );
@@ -9,7 +9,11 @@
 #include "joybus.h"
 #include "joybusinternal.h"
 #include "debug.h"
+#include "kernel.h"
+#include "timer.h"
+#include "n64sys.h"
 #include <string.h>
+#include <assert.h>
 #include <stdbool.h>
 
 /**
@@ -72,13 +76,42 @@ static volatile bool controller_autoscan_in_progress = false;
 /** @brief True if the module was initialized */
 static bool controller_inited = false;
 
+/** @brief Timestamp (in ticks) of the sample in #next */
+static volatile uint32_t next_ticks;
+/** @brief Number of samples read by autoscan so far */
+static volatile uint32_t next_seq;
+/** @brief Timestamp (in ticks) of the sample in #current */
+static uint32_t current_ticks;
+/** @brief Value of #next_seq when #current was fetched */
+static uint32_t current_seq;
+/** @brief Input latency statistics (see #controller_get_latency_stats) */
+static controller_latency_stats_t latency_stats;
+
+/** @brief Number of autoscans per frame (see #controller_set_scan_schedule) */
+static int scan_count = 1;
+/** @brief VI line of the first autoscan of each frame (see #controller_set_scan_schedule) */
+static int scan_line = 0;
+/** @brief Timer used for the autoscans that do not happen at the vertical interrupt */
+static timer_link_t *scan_timer = NULL;
+/** @brief Interval between autoscans (in ticks) */
+static uint32_t scan_interval;
+/** @brief Measured duration of a frame (in ticks) */
+static uint32_t frame_ticks;
+/** @brief Timestamp of the last vertical interrupt */
+static uint32_t last_vi_ticks = 0;
+
 static void controller_interrupt_update(uint64_t *output, void *ctx)
 {
     memcpy((void*)&next, output, sizeof(struct controller_data));
+    next_ticks = TICKS_READ();
+    next_seq++;
     controller_autoscan_in_progress = false;
 }
 
-static void controller_interrupt(void) 
+/**
+ * @brief Start an autoscan of the controllers in background, unless one is already pending.
+ */
+static void controller_autoscan(void)
 {
     static const unsigned long long SI_read_con_block[8] =
     {
@@ -94,8 +127,43 @@ static void controller_interrupt(void)
     
     if (!controller_autoscan_in_progress) {    
         controller_autoscan_in_progress = true;
-        joybus_exec_async(SI_read_con_block, controller_interrupt_update, NULL);
+        joybus_exec_async_priority(SI_read_con_block, controller_interrupt_update, NULL, JOYBUS_PRIORITY_INPUT);
+    }
+}
+
+static void controller_scan_timer(int ovfl)
+{
+    controller_autoscan();
+
+    // Schedule the next scan of this frame. The vertical interrupt stops
+    // the timer and starts over, so any drift is reset every frame.
+    start_timer(scan_timer, scan_interval, TF_ONE_SHOT, controller_scan_timer);
+}
+
+static void controller_interrupt(void) 
+{
+    // Measure the frame duration, to adapt to the TV type and video mode
+    uint32_t now = TICKS_READ();
+    if (last_vi_ticks)
+        frame_ticks = now - last_vi_ticks;
+    last_vi_ticks = now;
+
+    if (!scan_timer) {
+        controller_autoscan();
+        return;
+    }
+
+    // Scans are spaced by scan_interval, starting from the configured line
+    int total_lines = get_tv_type() == TV_PAL ? 625 : 525;
+    scan_interval = frame_ticks / scan_count;
+    uint32_t delay = (uint64_t)frame_ticks * scan_line / total_lines % scan_interval;
+
+    stop_timer(scan_timer);
+    if (delay == 0) {
+        controller_autoscan();
+        delay = scan_interval;
     }
+    start_timer(scan_timer, delay, TF_ONE_SHOT, controller_scan_timer);
 }
 
 /** 
@@ -104,17 +172,65 @@ static void controller_interrupt(void)
  * After initialization, the controllers will be scanned automatically in
  * background one time per frame. You can access the last scanned status
  * using #get_keys_down, #get_keys_up, #get_keys_held #get_keys_pressed,
- * and #get_dpad_direction.
+ * and #get_dpad_direction. To scan more often, or at a different point of
+ * the frame, see #controller_set_scan_schedule.
  */
 void controller_init( void )
 {
     memset(&prev, 0, sizeof(struct controller_data));
     memset(&current, 0, sizeof(struct controller_data));
     memset((void*)&next, 0, sizeof(struct controller_data));
+    controller_reset_latency_stats();
+    frame_ticks = TICKS_PER_SECOND / (get_tv_type() == TV_PAL ? 50 : 60);
     register_VI_handler(controller_interrupt);
     controller_inited = true;
 }
 
+/**
+ * @brief Configure when the controllers are scanned in background.
+ * 
+ * By default, controllers are scanned once per frame at the vertical
+ * interrupt. Scanning more often reduces the average age of the sample
+ * returned by #controller_scan; scanning closer to the point where the
+ * game calls #controller_scan (eg: near the end of the frame, if the game
+ * logic runs late) reduces it further. See #controller_get_latency_stats to
+ * measure the effect.
+ * 
+ * The scans happen at the given VI line, and then every 1/N of a frame.
+ * The line is given in the same units of #set_VI_interrupt (half-lines on
+ * interlaced modes), but the VI interrupt itself is not moved, as the display
+ * module relies on it: the scans are instead scheduled with a timer relative
+ * to the vertical interrupt, using the measured frame duration. The scans
+ * are asynchronous: they never block the CPU.
+ * 
+ * @note Any schedule other than the default requires the timer subsystem
+ *       (see #timer_init).
+ * 
+ * @param[in] scans_per_frame
+ *            Number of scans per frame (1-8)
+ * @param[in] line
+ *            VI line of the first scan of each frame (0 for the vertical
+ *            interrupt)
+ */
+void controller_set_scan_schedule( int scans_per_frame, int line )
+{
+    assertf(scans_per_frame >= 1 && scans_per_frame <= 8, "invalid number of scans per frame: %d", scans_per_frame);
+    assertf(line >= 0, "invalid VI line: %d", line);
+
+    disable_interrupts();
+    scan_count = scans_per_frame;
+    scan_line = line;
+    if (scan_count == 1 && scan_line == 0) {
+        if (scan_timer) {
+            delete_timer(scan_timer);
+            scan_timer = NULL;
+        }
+    } else if (!scan_timer) {
+        scan_timer = new_timer(0, TF_ONE_SHOT | TF_DISABLED, controller_scan_timer);
+    }
+    enable_interrupts();
+}
+
 /**
  * @brief Read the controller button status for all controllers
  *
@@ -244,6 +360,60 @@ void controller_scan( void )
 
     disable_interrupts();
     memcpy(&current, (void*)&next, sizeof(struct controller_data));
+    uint32_t seq = next_seq;
+    current_ticks = next_ticks;
+
+    // Account the latency of the new sample, if any
+    if (seq != current_seq) {
+        uint32_t latency = TICKS_SINCE(current_ticks);
+        latency_stats.samples++;
+        latency_stats.dropped += seq - current_seq - 1;
+        latency_stats.total += latency;
+        if (latency < latency_stats.min) latency_stats.min = latency;
+        if (latency > latency_stats.max) latency_stats.max = latency;
+        current_seq = seq;
+    }
+    enable_interrupts();
+}
+
+/**
+ * @brief Get the time at which the current controller state was sampled.
+ * 
+ * This refers to the state fetched by the last call to #controller_scan.
+ * 
+ * @return The timestamp of the sample, in ticks (see #TICKS_READ)
+ */
+uint32_t controller_get_sample_ticks( void )
+{
+    return current_ticks;
+}
+
+/**
+ * @brief Get the input latency statistics.
+ * 
+ * The latency of a sample is the time between the autoscan that read it
+ * and the call to #controller_scan that fetched it. Samples that are read
+ * but never fetched (because a newer one arrived first) are counted as
+ * dropped.
+ * 
+ * @param[out] stats
+ *             Structure to fill with the statistics
+ */
+void controller_get_latency_stats( controller_latency_stats_t *stats )
+{
+    disable_interrupts();
+    *stats = latency_stats;
+    enable_interrupts();
+}
+
+/**
+ * @brief Reset the input latency statistics.
+ */
+void controller_reset_latency_stats( void )
+{
+    disable_interrupts();
+    memset(&latency_stats, 0, sizeof(latency_stats));
+    latency_stats.min = UINT32_MAX;
     enable_interrupts();
 }
 
@@ -765,6 +935,336 @@ int write_mempak_address( int controller, uint16_t address, uint8_t *data )
     return ret;
 }
 
+/**
+ * @brief Add a 32-byte accessory read or write command to a joybus block
+ *
+ * @param[in,out] blk        Block being composed
+ * @param[in]     controller Controller (0-3) with the accessory
+ * @param[in]     address    32-byte aligned accessory address
+ * @param[in]     data       32 bytes to write (writes only)
+ * @param[in]     write      True for a write command, false for a read command
+ *
+ * @return Offset of the reply within the output block (to be passed to
+ *         #accessory_block_reply), or -1 if the block is full
+ */
+int accessory_block_add( joybus_block_t *blk, int controller, uint16_t address, const uint8_t *data, bool write )
+{
+    uint8_t send[1 + 2 + 32];
+    uint16_t addr_crc = __calc_address_crc( address );
+    send[0] = write ? 0x03 : 0x02;
+    send[1] = (addr_crc >> 8) & 0xFF;
+    send[2] = addr_crc & 0xFF;
+    if( write ) { memcpy( &send[3], data, 32 ); }
+
+    return joybus_block_add( blk, controller, send, write ? 35 : 3, write ? 1 : 33 );
+}
+
+/**
+ * @brief Check the reply of an accessory command added by #accessory_block_add
+ *
+ * @param[in]  output    Output block returned by the joybus
+ * @param[in]  reply     Offset returned by #accessory_block_add
+ * @param[in]  write     True for a write command, false for a read command
+ * @param[out] payload   If not NULL, set to the 32 bytes of data of the command
+ *
+ * @retval 0  if the data CRC matches
+ * @retval -2 if there was no accessory present in the controller
+ * @retval -3 if the accessory returned invalid data
+ */
+int accessory_block_reply( uint64_t *output, int reply, bool write, uint8_t **payload )
+{
+    uint8_t *out = (uint8_t*)output;
+    uint8_t *data = write ? out + reply - 32 : out + reply;
+    uint8_t reply_crc = write ? out[reply] : out[reply + 32];
+    uint8_t crc = __calc_data_crc( data );
+
+    if( payload ) { *payload = data; }
+
+    /* Same error codes of read_mempak_address */
+    if( crc == reply_crc ) { return 0; }
+    return ( crc == (reply_crc ^ 0xFF) ) ? -2 : -3;
+}
+
+static void __accessory_pipe_done( uint64_t *output, void *ctx );
+
+/**
+ * @brief Send (or resend) a command of an accessory pipeline
+ */
+static void __accessory_pipe_issue( accessory_pipe_cmd_t *cmd )
+{
+    joybus_block_t blk;
+
+    joybus_block_init( &blk );
+    cmd->reply = accessory_block_add( &blk, cmd->pipe->controller, cmd->address, cmd->data, cmd->write );
+    assert( cmd->reply >= 0 );
+    joybus_exec_async_priority( blk.data, __accessory_pipe_done, cmd, JOYBUS_PRIORITY_BACKGROUND );
+}
+
+/**
+ * @brief Issue as many commands of an accessory pipeline as possible
+ *
+ * Commands are requested to the next callback of the pipeline, until it
+ * returns false or #ACCESSORY_PIPE_INFLIGHT commands are in flight. Nothing
+ * is issued after a command failed, or once the pipeline is stopping.
+ *
+ * Must be called with interrupts disabled, whenever the next callback might
+ * be able to issue a command that it refused before.
+ *
+ * @param[in,out] pipe The pipeline
+ */
+void accessory_pipe_pump( accessory_pipe_t *pipe )
+{
+    while( pipe->count < ACCESSORY_PIPE_INFLIGHT && !pipe->error && !pipe->failed && !pipe->stopping )
+    {
+        int idx = (pipe->head + pipe->count) % ACCESSORY_PIPE_INFLIGHT;
+        accessory_pipe_cmd_t *cmd = &pipe->cmds[idx];
+        if( !pipe->next( pipe, cmd ) ) { break; }
+
+        cmd->pipe = pipe;
+        cmd->done = false;
+        cmd->failed = false;
+        cmd->retries = 0;
+        pipe->count++;
+        __accessory_pipe_issue( cmd );
+    }
+}
+
+/**
+ * @brief Completion callback of an accessory pipeline command (called under interrupt)
+ *
+ * Commands whose data CRC does not match are resent up to max_retries times.
+ * The joybus message slot of the command is already free when this is
+ * called, so resending it (or issuing the next one) never finds the queue
+ * full. Completed commands are then retired in issue order.
+ *
+ * Once the pipeline is stopping, the data of the commands still in flight is
+ * not needed anymore: failed commands are not resent, and their errors are
+ * not reported.
+ */
+static void __accessory_pipe_done( uint64_t *output, void *ctx )
+{
+    accessory_pipe_cmd_t *cmd = ctx;
+    accessory_pipe_t *pipe = cmd->pipe;
+    uint8_t *payload;
+
+    int err = accessory_block_reply( output, cmd->reply, cmd->write, &payload );
+    if( err == -3 && cmd->retries < pipe->max_retries && !pipe->stopping )
+    {
+        cmd->retries++;
+        __accessory_pipe_issue( cmd );
+        return;
+    }
+
+    if( err )
+    {
+        cmd->failed = true;
+        if( !pipe->error && !pipe->stopping ) { pipe->error = err; }
+    }
+    else if( !cmd->write )
+    {
+        memcpy( cmd->data, payload, 32 );
+    }
+    cmd->done = true;
+
+    while( pipe->count && pipe->cmds[pipe->head].done )
+    {
+        accessory_pipe_cmd_t *head = &pipe->cmds[pipe->head];
+        if( head->failed ) { pipe->failed = true; }
+        if( !pipe->failed && pipe->retire ) { pipe->retire( pipe, head ); }
+        pipe->head = (pipe->head + 1) % ACCESSORY_PIPE_INFLIGHT;
+        pipe->count--;
+    }
+
+    accessory_pipe_pump( pipe );
+    kevent_set( &pipe->event );
+}
+
+/**
+ * @brief Start an accessory transfer with pipelined 32-byte commands
+ *
+ * The transfer is driven by two callbacks, both called with interrupts
+ * disabled: next prepares each command (address, direction, data to write
+ * and position within the transfer), and retire consumes each successful
+ * command in issue order (for instance, to copy the data read).
+ *
+ * Each command is composed in its own joybus block via #accessory_block_add,
+ * and up to #ACCESSORY_PIPE_INFLIGHT of them are queued with background
+ * priority (see #joybus_exec_async_priority). The next command is issued as
+ * soon as one completes, under interrupt, so the SI goes from one block to
+ * the next without waiting for the caller.
+ *
+ * @param[out] pipe         The pipeline to initialize
+ * @param[in]  controller   Controller (0-3) with the accessory
+ * @param[in]  max_retries  Number of times a command is resent on a data CRC mismatch
+ * @param[in]  next         Callback that prepares the next command
+ * @param[in]  retire       Callback that consumes a successful command (can be NULL)
+ * @param[in]  ctx          Context of the callbacks
+ */
+void accessory_pipe_start( accessory_pipe_t *pipe, int controller, int max_retries,
+    bool (*next)(accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd),
+    void (*retire)(accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd), void *ctx )
+{
+    memset( pipe, 0, sizeof(*pipe) );
+    pipe->controller = controller;
+    pipe->max_retries = max_retries;
+    pipe->next = next;
+    pipe->retire = retire;
+    pipe->ctx = ctx;
+    kevent_init( &pipe->event );
+
+    disable_interrupts();
+    accessory_pipe_pump( pipe );
+    enable_interrupts();
+}
+
+/**
+ * @brief Stop issuing the commands of an accessory pipeline
+ *
+ * The commands in flight still complete: use #accessory_pipe_wait to wait
+ * for them.
+ *
+ * @param[in,out] pipe The pipeline
+ */
+void accessory_pipe_stop( accessory_pipe_t *pipe )
+{
+    disable_interrupts();
+    pipe->stopping = true;
+    enable_interrupts();
+}
+
+/**
+ * @brief Wait for the commands in flight of an accessory pipeline
+ *
+ * If the next callback never refuses a command while there is still data
+ * to transfer, this waits for the whole transfer to complete.
+ *
+ * @param[in,out] pipe The pipeline
+ *
+ * @retval 0  if all the commands were successful
+ * @retval -2 if there was no accessory present in the controller
+ * @retval -3 if the accessory returned invalid data
+ */
+int accessory_pipe_wait( accessory_pipe_t *pipe )
+{
+    // Block if possible, otherwise (eg: from an exception handler) spin
+    while( pipe->count > 0 )
+    {
+        if( kthread_can_switch() ) { kevent_wait( &pipe->event ); }
+    }
+    return pipe->error;
+}
+
+/** @brief State of a bulk accessory transfer (see #read_mempak_bulk) */
+typedef struct {
+    uint16_t address;           ///< Accessory address of the range
+    uint8_t *data;              ///< Buffer of the range
+    int len;                    ///< Length of the range
+    int issued;                 ///< Number of bytes requested so far
+    bool write;                 ///< True if this is a write transfer
+} accessory_bulk_t;
+
+/**
+ * @brief Prepare the next command of a bulk accessory transfer
+ */
+static bool __accessory_bulk_next( accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd )
+{
+    accessory_bulk_t *bulk = pipe->ctx;
+    if( bulk->issued >= bulk->len ) { return false; }
+
+    cmd->offset = bulk->issued;
+    cmd->address = bulk->address + bulk->issued;
+    cmd->write = bulk->write;
+    if( bulk->write ) { memcpy( cmd->data, bulk->data + bulk->issued, 32 ); }
+    bulk->issued += 32;
+    return true;
+}
+
+/**
+ * @brief Store the data of a completed bulk accessory command
+ */
+static void __accessory_bulk_retire( accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd )
+{
+    accessory_bulk_t *bulk = pipe->ctx;
+    if( !cmd->write ) { memcpy( bulk->data + cmd->offset, cmd->data, 32 ); }
+}
+
+/**
+ * @brief Read or write a range of a controller accessory with pipelined joybus messages
+ *
+ * The range is split in 32-byte commands, run through an accessory pipeline
+ * (see #accessory_pipe_start). Commands are not retried: the transfer stops
+ * at the first error.
+ */
+static int __accessory_bulk( int controller, uint16_t address, uint8_t *data, int len, bool write )
+{
+    accessory_pipe_t pipe;
+    accessory_bulk_t bulk;
+
+    if( controller < 0 || controller > 3 ) { return -1; }
+    if( address % 32 || len % 32 ) { return -1; }
+
+    bulk.address = address;
+    bulk.data = data;
+    bulk.len = len;
+    bulk.issued = 0;
+    bulk.write = write;
+
+    accessory_pipe_start( &pipe, controller, 0, __accessory_bulk_next, __accessory_bulk_retire, &bulk );
+    return accessory_pipe_wait( &pipe );
+}
+
+/**
+ * @brief Read a range of data from a mempak (or any controller accessory)
+ *
+ * This is equivalent to calling #read_mempak_address for each 32-byte chunk
+ * of the range, but the joybus messages are queued back to back, so it is
+ * much faster for large reads.
+ *
+ * @param[in]  controller
+ *             Which controller to read the data from (0-3)
+ * @param[in]  address
+ *             A 32 byte aligned offset to read from on the mempak
+ * @param[out] data
+ *             Buffer to place the data read from the mempak
+ * @param[in]  len
+ *             Number of bytes to read (multiple of 32)
+ *
+ * @retval 0  if reading was successful
+ * @retval -1 if the controller was out of range or the range was not aligned
+ * @retval -2 if there was no mempak present in the controller
+ * @retval -3 if the mempak returned invalid data
+ */
+int read_mempak_bulk( int controller, uint16_t address, uint8_t *data, int len )
+{
+    return __accessory_bulk( controller, address, data, len, false );
+}
+
+/**
+ * @brief Write a range of data to a mempak (or any controller accessory)
+ *
+ * This is equivalent to calling #write_mempak_address for each 32-byte chunk
+ * of the range, but the joybus messages are queued back to back, so it is
+ * much faster for large writes. Writing stops at the first error.
+ *
+ * @param[in]  controller
+ *             Which controller to write the data to (0-3)
+ * @param[in]  address
+ *             A 32 byte aligned offset to write to on the mempak
+ * @param[in]  data
+ *             Buffer containing the data to write
+ * @param[in]  len
+ *             Number of bytes to write (multiple of 32)
+ *
+ * @retval 0  if writing was successful
+ * @retval -1 if the controller was out of range or the range was not aligned
+ * @retval -2 if there was no mempak present in the controller
+ * @retval -3 if the mempak returned invalid data
+ */
+int write_mempak_bulk( int controller, uint16_t address, uint8_t *data, int len )
+{
+    return __accessory_bulk( controller, address, data, len, true );
+}
+
 /**
  * @brief Check if connected accesory is transfer pak by setting power to the device on and off and checking that it responds as expected.
  *
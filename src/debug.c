@@ -42,6 +42,10 @@
  *    cartridge (#DEBUG_FEATURE_LOG_SD).
  *    On N64, logging can simply be performed by writing to stderr,
  *    for instance through the #debugf macro.
+ *    By default, writes to the logging channels are synchronous. With
+ *    #debug_init_async, they are instead appended to a ring buffer, which
+ *    is drained in the background, so that logging does not stall the
+ *    application on slow I/O.
  *
  *  * External filesystems. In addition to the read-only filesystem
  *    stored within the ROM image (dragonfs), these debugging features
@@ -69,6 +73,29 @@ static char sdfs_logic_drive[3] = { 0 };
 /** @brief debug writer functions (USB, SD, IS64) */
 static void (*debug_writer[3])(const uint8_t *buf, int size) = { 0 };
 
+/** @brief Ring buffer for asynchronous logging (NULL if logging is synchronous) */
+static uint8_t *async_buf = NULL;
+/** @brief Size of the ring buffer (power of two) */
+static uint32_t async_size;
+/** @brief Total number of bytes appended to the ring buffer (write position) */
+static volatile uint32_t async_head;
+/** @brief Total number of bytes drained from the ring buffer (read position) */
+static volatile uint32_t async_tail;
+/** @brief Number of writes dropped because the ring buffer was full */
+static uint32_t async_dropped;
+/** @brief Number of bytes dropped because the ring buffer was full */
+static uint32_t async_dropped_bytes;
+/** @brief Number of writes dropped since the last time it was reported */
+static uint32_t async_dropped_report;
+/** @brief True while the ring buffer is being drained */
+static bool async_flushing = false;
+/** @brief Thread draining the ring buffer (if the kernel is running) */
+static kthread_t *async_thread = NULL;
+/** @brief Event set when new data is appended to the ring buffer */
+static kevent_t async_event;
+/** @brief True to ask the drain thread to exit */
+static volatile bool async_quit = false;
+
 
 /*********************************************************************
  * Log writers
@@ -393,11 +420,47 @@ static bool usb_initialize_once(void) {
 	return ok;
 }
 
-static int __stderr_write(char *buf, unsigned int len)
+/** @brief Send data to all the active debug writers */
+static void debug_write_all(const uint8_t *buf, int len)
 {
 	for (int i=0; i<sizeof(debug_writer) / sizeof(debug_writer[0]); i++)
 		if (debug_writer[i])
-			debug_writer[i]((uint8_t*)buf, len);
+			debug_writer[i](buf, len);
+}
+
+/** @brief Append data to the asynchronous logging ring buffer */
+static void async_append(const uint8_t *buf, int len)
+{
+	// Writes can come from both threads and interrupt handlers, so
+	// serialize them. The drain side does not need to take the lock:
+	// it just reads the head, and it is the only one writing the tail.
+	disable_interrupts();
+	if (len > async_size - (async_head - async_tail)) {
+		async_dropped++;
+		async_dropped_report++;
+		async_dropped_bytes += len;
+		enable_interrupts();
+		return;
+	}
+
+	uint32_t pos = async_head & (async_size - 1);
+	uint32_t n = len < async_size - pos ? len : async_size - pos;
+	memcpy(async_buf + pos, buf, n);
+	memcpy(async_buf, buf + n, len - n);
+	MEMORY_BARRIER();
+	async_head += len;
+	enable_interrupts();
+
+	if (async_thread)
+		kevent_set(&async_event);
+}
+
+static int __stderr_write(char *buf, unsigned int len)
+{
+	if (async_buf)
+		async_append((uint8_t*)buf, len);
+	else
+		debug_write_all((uint8_t*)buf, len);
 
 	// Pretend stderr is written correctly even if it isn't. 
 	// There's really no benefit in bubbling up I/O errors
@@ -506,8 +569,114 @@ void debug_close_sdfs(void)
 	}
 }
 
+/** @brief Drain thread: flush the ring buffer every time new data is appended */
+static int async_drain_thread(void *arg)
+{
+	while (!async_quit) {
+		kevent_wait(&async_event);
+		debug_flush();
+	}
+	return 0;
+}
+
+bool debug_init_async(int size)
+{
+	assertf(size >= 64 && (size & (size - 1)) == 0,
+		"ring buffer size must be a power of two, at least 64: %d", size);
+	if (async_buf)
+		return true;
+
+	uint8_t *buf = malloc(size);
+	if (!buf)
+		return false;
+
+	async_size = size;
+	async_head = async_tail = 0;
+	async_dropped = async_dropped_bytes = async_dropped_report = 0;
+	async_buf = buf;
+
+	// If the kernel is running, drain the buffer from a thread with the
+	// lowest priority, so that it runs whenever the other threads are
+	// waiting (eg: for the RSP or the next vblank).
+	if (kthread_current()) {
+		kevent_init(&async_event);
+		async_quit = false;
+		async_thread = kthread_new("debug_log", 8192, -128, async_drain_thread, NULL);
+	}
+	return true;
+}
+
+void debug_close_async(void)
+{
+	if (!async_buf)
+		return;
+
+	if (async_thread) {
+		async_quit = true;
+		kevent_set(&async_event);
+		kthread_join(async_thread);
+		async_thread = NULL;
+	}
+
+	debug_flush();
+	uint8_t *buf = async_buf;
+	async_buf = NULL;
+	free(buf);
+}
+
+void debug_flush(void)
+{
+	// Nothing to do for synchronous logging. Also, only one flush can run at
+	// a time: skip the call if another thread (eg: the drain thread) is
+	// already flushing. Check and set the flag atomically.
+	// Notice that this must not be called from interrupt handlers, as the
+	// debugging channels (eg: SD or USB) cannot be accessed there. The only
+	// exception is the best-effort flush before printing an assertion.
+	disable_interrupts();
+	bool busy = !async_buf || async_flushing;
+	if (!busy)
+		async_flushing = true;
+	enable_interrupts();
+	if (busy)
+		return;
+
+	while (async_tail != async_head) {
+		uint32_t pos = async_tail & (async_size - 1);
+		uint32_t n = async_head - async_tail;
+		if (n > async_size - pos)
+			n = async_size - pos;
+		debug_write_all(async_buf + pos, n);
+		MEMORY_BARRIER();
+		async_tail += n;
+	}
+
+	if (async_dropped_report) {
+		char msg[80];
+		disable_interrupts();
+		int n = snprintf(msg, sizeof(msg), "[debug] log buffer full: %lu writes dropped\n", async_dropped_report);
+		async_dropped_report = 0;
+		enable_interrupts();
+		debug_write_all((uint8_t*)msg, n);
+	}
+
+	async_flushing = false;
+}
+
+void debug_get_async_stats(uint32_t *dropped, uint32_t *dropped_bytes)
+{
+	disable_interrupts();
+	if (dropped) *dropped = async_dropped;
+	if (dropped_bytes) *dropped_bytes = async_dropped_bytes;
+	enable_interrupts();
+}
+
 void debug_assert_func_f(const char *file, int line, const char *func, const char *failedexpr, const char *msg, ...)
 {
+	// Write out any pending asynchronous log, and switch to synchronous
+	// logging, so that the assertion is not lost.
+	debug_flush();
+	async_buf = NULL;
+
 	// As first step, immediately print the assertion on stderr. This is
 	// very likely to succeed as it should not cause any further allocations
 	// and we would display the assertion immediately on logs.
@@ -598,3 +767,23 @@ void debug_hexdump(const void *vbuf, int size)
         }
     }
 }
+
+void debug_memory_report(void)
+{
+	heap_stats_t hs;
+	sys_get_heap_stats(&hs);
+
+	uint32_t heap_size = hs.heap_end - hs.heap_start;
+	uint32_t holes = hs.free_bytes - hs.top_free_bytes;
+	debugf("heap: %08lx-%08lx (peak: %08lx, limit: %08lx)\n",
+		hs.heap_start, hs.heap_end, hs.heap_peak, hs.heap_limit);
+	debugf("  live: %lu bytes, free: %lu bytes in %lu chunks\n",
+		hs.live_bytes, hs.free_bytes, hs.free_chunks);
+	debugf("  fragmentation: %lu bytes in holes (%lu%% of heap), %lu bytes at top\n",
+		holes, heap_size ? holes * 100 / heap_size : 0, hs.top_free_bytes);
+
+	memory_tag_t tags[MAX_MEMORY_TAGS];
+	int ntags = sys_get_memory_tags(tags, MAX_MEMORY_TAGS);
+	for (int i = 0; i < ntags; i++)
+		debugf("  %-16s live: %8ld  peak: %8ld\n", tags[i].name, tags[i].live_bytes, tags[i].peak_bytes);
+}
@@ -14,6 +14,7 @@
 #include "utils.h"
 #include "debug.h"
 #include "surface.h"
+#include "kernel.h"
 
 /** @brief Maximum number of video backbuffers */
 #define NUM_BUFFERS         32
@@ -93,6 +94,24 @@ static int now_showing = -1;
 static uint32_t drawing_mask = 0;
 /** @brief Bitmask of surfaces that are ready to be shown */
 static volatile uint32_t ready_mask = 0;
+/** @brief Number of VI interrupts received since #display_init */
+static volatile uint32_t vi_count = 0;
+/** @brief Event set at every VI interrupt, to wake up #display_lock_wait */
+static kevent_t vi_event;
+/** @brief Value of #vi_count when the last new frame was flipped on screen */
+static uint32_t last_flip_vi = 0;
+/** @brief Refresh divisor for frame pacing (1 = a new frame can be shown at every VI) */
+static uint32_t refresh_divisor = 1;
+/** @brief Tick at which each surface was passed to #display_show */
+static uint32_t ready_tick[NUM_BUFFERS];
+/** @brief Frame pacing statistics */
+static display_stats_t stats;
+/** @brief Current presentation mode */
+static display_present_mode_t present_mode = DISPLAY_PRESENT_FIFO;
+/** @brief Sequence number assigned to each surface when locked */
+static uint32_t lock_seq[NUM_BUFFERS];
+/** @brief Sequence number that will be assigned to the next locked surface */
+static uint32_t next_seq = 0;
 
 /** @brief Get the next buffer index (with wraparound) */
 static inline int buffer_next(int idx) {
@@ -102,6 +121,50 @@ static inline int buffer_next(int idx) {
     return idx;
 }
 
+/** @brief Bitmask with one bit set for each active buffer */
+static inline uint32_t buffers_mask(void) {
+    return __buffers == 32 ? 0xFFFFFFFF : (1u << __buffers) - 1;
+}
+
+/**
+ * @brief Find the first buffer set in a mask, starting after the one being shown
+ *
+ * The search wraps around, so that buffers are returned in the order in which
+ * they will be displayed in FIFO mode.
+ *
+ * @return The buffer index, or -1 if the mask is empty.
+ */
+static inline int buffer_find_first(uint32_t mask) {
+    int start = buffer_next(now_showing);
+
+    /* Rotate the mask so that bit 0 refers to the start buffer */
+    uint32_t rot = mask >> start;
+    if (start) rot |= mask << (__buffers - start);
+    rot &= buffers_mask();
+    if (!rot) return -1;
+
+    int idx = start + __builtin_ctz(rot);
+    if (idx >= __buffers)
+        idx -= __buffers;
+    return idx;
+}
+
+/**
+ * @brief Find the most recently locked buffer among those set in a mask
+ *
+ * @return The buffer index, or -1 if the mask is empty.
+ */
+static int buffer_find_newest(uint32_t mask) {
+    int newest = -1;
+    while (mask) {
+        int idx = __builtin_ctz(mask);
+        mask &= mask - 1;
+        if (newest < 0 || (int32_t)(lock_seq[idx] - lock_seq[newest]) > 0)
+            newest = idx;
+    }
+    return newest;
+}
+
 /**
  * @brief Write a set of video registers to the VI
  *
@@ -158,11 +221,12 @@ static inline bool __is_vi_active()
 }
 
 /**
- * @brief Interrupt handler for vertical blank
+ * @brief Flip to the next frame if there is one to display
  *
- * If there is another frame to display, display the frame
+ * @param[in] force
+ *            If true, ignore frame pacing and flip right away
  */
-static void __display_callback()
+static void __display_refresh(bool force)
 {
     volatile uint32_t *reg_base = (uint32_t *)REGISTER_BASE;
 
@@ -171,17 +235,67 @@ static void __display_callback()
     bool field = reg_base[4] & 1;
     bool interlaced = reg_base[0] & (1<<6);
 
-    /* Check if the next buffer is ready to be displayed, otherwise just
-       leave up the current frame */
-    int next = buffer_next(now_showing);
-    if (ready_mask & (1 << next)) {
-        now_showing = next;
-        ready_mask &= ~(1 << next);
+    /* Frame pacing: do not flip until the configured number of VI interrupts
+       has elapsed since the previous flip. */
+    if (force || vi_count - last_flip_vi >= refresh_divisor) {
+        int next = -1;
+
+        if (present_mode == DISPLAY_PRESENT_FIFO) {
+            /* Check if the next buffer is ready to be displayed, otherwise just
+               leave up the current frame */
+            next = buffer_next(now_showing);
+            if (!(ready_mask & (1 << next)))
+                next = -1;
+        } else {
+            /* Mailbox: show the newest ready frame, and recycle the older
+               ones that never made it to the screen. */
+            uint32_t ready = ready_mask;
+            next = buffer_find_newest(ready);
+            if (next >= 0) {
+                stats.frames_skipped += __builtin_popcount(ready) - 1;
+                ready_mask &= ~ready | (1 << next);
+            }
+        }
+
+        if (next >= 0) {
+            uint32_t latency = TICKS_READ() - ready_tick[next];
+
+            /* A frame is late if it was flipped after the slot it was
+               supposed to be shown at (given the refresh divisor). */
+            if (stats.frames_shown && vi_count - last_flip_vi > refresh_divisor)
+                stats.frames_late++;
+
+            stats.frames_shown++;
+            stats.last_latency = latency;
+            stats.total_latency += latency;
+            if (latency > stats.max_latency)
+                stats.max_latency = latency;
+
+            now_showing = next;
+            ready_mask &= ~(1 << next);
+            last_flip_vi = vi_count;
+        } else if (drawing_mask) {
+            /* A frame was being drawn but it was not ready in time: the
+               previous frame will be shown again. */
+            stats.frames_dropped++;
+        }
     }
 
     __write_dram_register(__safe_buffer[now_showing] + (interlaced && !field ? __width * __bitdepth : 0));
 }
 
+/**
+ * @brief Interrupt handler for vertical blank
+ *
+ * If there is another frame to display, display the frame
+ */
+static void __display_callback()
+{
+    vi_count++;
+    __display_refresh(false);
+    kevent_set(&vi_event);
+}
+
 void display_init( resolution_t res, bitdepth_t bit, uint32_t num_buffers, gamma_t gamma, antialias_t aa )
 {
     uint32_t registers[REGISTER_COUNT];
@@ -323,6 +437,11 @@ void display_init( resolution_t res, bitdepth_t bit, uint32_t num_buffers, gamma
     now_showing = 0;
     drawing_mask = 0;
     ready_mask = 0;
+    next_seq = 1;
+    memset(lock_seq, 0, sizeof(lock_seq));
+    vi_count = 0;
+    last_flip_vi = 0;
+    memset(&stats, 0, sizeof(stats));
 
     /* Show our screen normally. If display is already active, do that during vblank
        to avoid confusing the VI chip with in-frame modifications. */
@@ -384,14 +503,13 @@ surface_t* display_lock(void)
     disable_interrupts();
 
     /* Calculate index of next display context to draw on. We need
-       to find the first buffer which is not being drawn upon nor
+       to find the first buffer which is not being shown, drawn upon nor
        being ready to be displayed. */
-    for (next = buffer_next(now_showing); next != now_showing; next = buffer_next(next)) {
-        if (((drawing_mask | ready_mask) & (1 << next)) == 0)  {
-            retval = &surfaces[next];
-            drawing_mask |= 1 << next;
-            break;
-        }
+    next = buffer_find_first(~(drawing_mask | ready_mask | (1 << now_showing)));
+    if (next >= 0) {
+        retval = &surfaces[next];
+        drawing_mask |= 1 << next;
+        lock_seq[next] = next_seq++;
     }
 
     enable_interrupts();
@@ -400,6 +518,32 @@ surface_t* display_lock(void)
     return retval;
 }
 
+surface_t* display_lock_wait(void)
+{
+    surface_t* retval;
+    uint32_t t0 = TICKS_READ();
+
+    while (!(retval = display_lock()))
+    {
+        /* With interrupts disabled (eg: from an exception handler) we cannot
+           block, so keep polling like display_lock callers always did */
+        if (!kthread_can_switch())
+            continue;
+
+        /* Buffers are only released by the VI interrupt, so there is no
+           point in trying again (and disabling interrupts each time) until
+           the next one has been serviced. Other threads can run meanwhile. */
+        kevent_wait(&vi_event);
+    }
+
+    /* The statistics are also updated by the VI interrupt */
+    disable_interrupts();
+    stats.wait_ticks += TICKS_READ() - t0;
+    enable_interrupts();
+
+    return retval;
+}
+
 void display_show( surface_t* surf )
 {
     /* They tried drawing on a bad context */
@@ -420,7 +564,19 @@ void display_show( surface_t* surf )
     assertf(drawing_mask & (1 << i), "display_show called on non-locked display %d (mask: %lx)", i, drawing_mask);
 
     drawing_mask &= ~(1 << i);
-    ready_mask |= 1 << i;
+
+    /* In mailbox mode, a frame older than the one on screen (because it was
+       locked before it) can never be shown: recycle it right away. */
+    if (present_mode == DISPLAY_PRESENT_MAILBOX &&
+        (int32_t)(lock_seq[i] - lock_seq[now_showing]) < 0)
+    {
+        stats.frames_skipped++;
+    }
+    else
+    {
+        ready_mask |= 1 << i;
+        ready_tick[i] = TICKS_READ();
+    }
 
     enable_interrupts();
 }
@@ -442,7 +598,7 @@ void display_show_force( display_context_t disp )
     /* Can't have the video interrupt screwing this up */
     disable_interrupts();
     display_show(disp);
-    __display_callback();
+    __display_refresh(true);
     enable_interrupts();
 }
 
@@ -465,3 +621,42 @@ uint32_t display_get_num_buffers()
 {
     return __buffers;
 }
+
+void display_set_present_mode(display_present_mode_t mode)
+{
+    /* Pending frames are kept in ready_mask in both modes, so switching
+       mode does not require any other change */
+    disable_interrupts();
+    present_mode = mode;
+    enable_interrupts();
+}
+
+display_present_mode_t display_get_present_mode(void)
+{
+    return present_mode;
+}
+
+void display_set_refresh_divisor(uint32_t divisor)
+{
+    assertf(divisor >= 1, "invalid refresh divisor: %lu", divisor);
+    refresh_divisor = divisor;
+}
+
+uint32_t display_get_refresh_divisor(void)
+{
+    return refresh_divisor;
+}
+
+void display_get_stats(display_stats_t *out)
+{
+    disable_interrupts();
+    *out = stats;
+    enable_interrupts();
+}
+
+void display_reset_stats(void)
+{
+    disable_interrupts();
+    memset(&stats, 0, sizeof(stats));
+    enable_interrupts();
+}
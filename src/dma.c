@@ -24,6 +24,14 @@
  * manipulating registers on a cartridge such as a gameshark.  Code should never
  * make raw 32-bit reads or writes in the cartridge domain as it could collide with
  * an in-progress DMA transfer or run into caching issues.
+ *
+ * Buffers that are repeatedly transferred by the RCP (via either PI or SP DMA)
+ * can be tracked with a #dma_buffer_t, which remembers whether the CPU cache
+ * might hold dirty data for the buffer, and thus performs only the cache
+ * maintenance that is actually required before each transfer. An audit mode
+ * (#dma_buffer_audit) verifies the coherency of the cache with RDRAM at each
+ * transition, to find bugs like missing #dma_buffer_cpu_write calls or accesses
+ * to a buffer while the RCP is writing it.
  * @{
  */
 
@@ -471,4 +479,143 @@ void io_write(uint32_t pi_address, uint32_t data)
     enable_interrupts();
 }
 
+/** @brief True if the coherency of DMA buffers must be audited */
+static bool dma_buffer_audit_enabled = false;
+
+/**
+ * @brief Check that the cached view of a DMA buffer matches RDRAM (audit mode)
+ *
+ * @param[in] buf
+ *            DMA buffer to check
+ * @param[in] msg
+ *            Description of the problem, in case of mismatch
+ */
+static void dma_buffer_check(dma_buffer_t *buf, const char *msg)
+{
+    if (!dma_buffer_audit_enabled)
+        return;
+
+    uint8_t *cached = buf->addr;
+    uint8_t *uncached = UncachedAddr(buf->addr);
+    for (uint32_t i = 0; i < buf->len; i++) {
+        assertf(cached[i] == uncached[i], "DMA buffer %p (%lu bytes): %s\n"
+            "offset %lu: cache=%02x RDRAM=%02x", buf->addr, buf->len, msg,
+            i, cached[i], uncached[i]);
+    }
+}
+
+/**
+ * @brief Initialize a DMA buffer
+ *
+ * A DMA buffer tracks the cache state of a memory area that is transferred by
+ * the RCP, so that only the required cache maintenance is performed:
+ *
+ *  * Call #dma_buffer_cpu_write after the CPU writes to the buffer.
+ *  * Call #dma_buffer_rcp_read before a DMA transfer that reads the buffer
+ *    (eg: RDRAM to DMEM, or RDRAM to cartridge). The dirty cachelines are
+ *    written back only if the CPU wrote the buffer since the last transfer.
+ *  * Call #dma_buffer_rcp_write before a DMA transfer that writes the buffer
+ *    (eg: cartridge to RDRAM). The cachelines are invalidated without being
+ *    written back (except the partial ones at the ends of the buffer).
+ *  * Call #dma_buffer_release after the transfer is finished, to give the
+ *    buffer back to the CPU.
+ *
+ * The buffer starts in the #DMA_BUFFER_DIRTY state.
+ *
+ * @param[out] buf
+ *             DMA buffer to initialize
+ * @param[in]  addr
+ *             Start of the memory area
+ * @param[in]  len
+ *             Length of the memory area in bytes
+ */
+void dma_buffer_init(dma_buffer_t *buf, void *addr, uint32_t len)
+{
+    buf->addr = CachedAddr(addr);
+    buf->len = len;
+    buf->state = DMA_BUFFER_DIRTY;
+}
+
+/**
+ * @brief Notify that the CPU wrote to a DMA buffer
+ *
+ * @param[in] buf
+ *            DMA buffer
+ */
+void dma_buffer_cpu_write(dma_buffer_t *buf)
+{
+    assertf(buf->state != DMA_BUFFER_RCP_WRITING && buf->state != DMA_BUFFER_RCP_READING,
+        "DMA buffer %p written by the CPU while in use by the RCP", buf->addr);
+    buf->state = DMA_BUFFER_DIRTY;
+}
+
+/**
+ * @brief Prepare a DMA buffer to be read by the RCP
+ *
+ * @param[in] buf
+ *            DMA buffer
+ */
+void dma_buffer_rcp_read(dma_buffer_t *buf)
+{
+    assertf(buf->state != DMA_BUFFER_RCP_WRITING,
+        "DMA buffer %p read by the RCP while it is being written", buf->addr);
+
+    if (buf->state == DMA_BUFFER_DIRTY)
+        data_cache_dma_out(buf->addr, buf->len);
+    else
+        dma_buffer_check(buf, "written by the CPU without calling dma_buffer_cpu_write");
+    buf->state = DMA_BUFFER_RCP_READING;
+}
+
+/**
+ * @brief Prepare a DMA buffer to be written by the RCP
+ *
+ * After this call, the CPU must not access the buffer until #dma_buffer_release.
+ *
+ * @param[in] buf
+ *            DMA buffer
+ */
+void dma_buffer_rcp_write(dma_buffer_t *buf)
+{
+    assertf(buf->state != DMA_BUFFER_RCP_WRITING && buf->state != DMA_BUFFER_RCP_READING,
+        "DMA buffer %p already in use by the RCP", buf->addr);
+
+    data_cache_dma_in(buf->addr, buf->len);
+    buf->state = DMA_BUFFER_RCP_WRITING;
+}
+
+/**
+ * @brief Give a DMA buffer back to the CPU, after the RCP transfer is finished
+ *
+ * In audit mode, this checks that the CPU did not access the buffer (or the
+ * cachelines it shares with other data) while the RCP was writing it.
+ *
+ * @param[in] buf
+ *            DMA buffer
+ */
+void dma_buffer_release(dma_buffer_t *buf)
+{
+    if (buf->state == DMA_BUFFER_RCP_WRITING)
+        dma_buffer_check(buf, "stale cache after RCP write (was the buffer accessed during the transfer?)");
+    else
+        assertf(buf->state == DMA_BUFFER_RCP_READING, "DMA buffer %p is not in use by the RCP", buf->addr);
+    buf->state = DMA_BUFFER_CLEAN;
+}
+
+/**
+ * @brief Enable or disable the audit of DMA buffers
+ *
+ * In audit mode, every transition of a #dma_buffer_t in which the cache is
+ * expected to be coherent with RDRAM is verified, by comparing the contents
+ * of the buffer through cached and uncached memory. This is slow, so it is
+ * meant to be enabled only while debugging.
+ *
+ * @param[in] enable
+ *            True to enable the audit, false to disable it
+ */
+void dma_buffer_audit(bool enable)
+{
+    dma_buffer_audit_enabled = enable;
+}
+
 /** @} */ /* dma */
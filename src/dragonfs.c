@@ -91,10 +91,14 @@ static directory_entry_t *next_entry = 0;
  */
 static inline void grab_sector(void *cart_loc, void *ram_loc)
 {
+    dma_buffer_t dbuf;
+    dma_buffer_init(&dbuf, ram_loc, SECTOR_SIZE);
+
     /* Make sure we have fresh cache */
-    data_cache_hit_writeback_invalidate(ram_loc, SECTOR_SIZE);
+    dma_buffer_rcp_write(&dbuf);
 
     dma_read((void *)(((uint32_t)ram_loc) & 0x1FFFFFFF), (uint32_t)cart_loc, SECTOR_SIZE);
+    dma_buffer_release(&dbuf);
 }
 
 /**
@@ -972,16 +976,16 @@ int dfs_read(void * const buf, int size, int count, uint32_t handle)
     bool len_aligned = (to_read < 0x7F) || ((to_read & 1) == 0);
     if (rom_aligned && ram_aligned && len_aligned)
     {
-        /* 16-byte alignment: we can simply invalidate the buffer.
-         * 8-byte alignment: we need to also writeback in case the partial
-         *  cachelines have hot data to write back. */
-        if ((((uint32_t)buf | to_read) & 15) == 0)
-            data_cache_hit_invalidate(buf, to_read);
-        else
-            data_cache_hit_writeback_invalidate(buf, to_read);
+        /* Invalidate the buffer. Only the partial cachelines at the ends
+         * (if any) need a writeback, as they might have hot data of other
+         * variables. */
+        dma_buffer_t dbuf;
+        dma_buffer_init(&dbuf, buf, to_read);
+        dma_buffer_rcp_write(&dbuf);
 
         dma_read((void *)(((uint32_t)buf) & 0x1FFFFFFF),
             file->cart_start_loc + file->loc, to_read);
+        dma_buffer_release(&dbuf);
 
         file->loc += to_read;
         return to_read;
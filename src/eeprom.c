@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include "eeprom.h"
 #include "joybus.h"
+#include "joybusinternal.h"
 
 /**
  * @brief Read the status of the EEPROM.
@@ -108,19 +109,18 @@ void eeprom_read( uint8_t block, uint8_t * dest )
 }
 
 /**
- * @brief Write a block to EEPROM.
- *
- * @param[in] block
- *            Block to write data to. Joybus accesses EEPROM in 8-byte blocks.
+ * @brief Compose the joybus message to write a block to EEPROM.
  *
- * @param[in] src
- *            Source buffer for the eight bytes of data to write to EEPROM.
- *
- * @return the EEPROM status byte
+ * @param[out] input
+ *             Joybus message block
+ * @param[in]  block
+ *             Block to write data to
+ * @param[in]  src
+ *             Source buffer for the eight bytes of data to write to EEPROM
  */
-uint8_t eeprom_write( uint8_t block, const uint8_t * src )
+static void eeprom_write_block( uint64_t * input, uint8_t block, const uint8_t * src )
 {
-    uint64_t input[JOYBUS_BLOCK_DWORDS] =
+    const uint64_t message[JOYBUS_BLOCK_DWORDS] =
     {
         0x000000000a010500 | block,
         0x0000000000000000,
@@ -131,15 +131,62 @@ uint8_t eeprom_write( uint8_t block, const uint8_t * src )
         0,
         1
     };
-    uint64_t output[JOYBUS_BLOCK_DWORDS];
 
+    memcpy( input, message, JOYBUS_BLOCK_SIZE );
     memcpy( &input[1], src, EEPROM_BLOCK_SIZE );
+}
+
+/**
+ * @brief Write a block to EEPROM.
+ *
+ * @param[in] block
+ *            Block to write data to. Joybus accesses EEPROM in 8-byte blocks.
+ *
+ * @param[in] src
+ *            Source buffer for the eight bytes of data to write to EEPROM.
+ *
+ * @return the EEPROM status byte
+ */
+uint8_t eeprom_write( uint8_t block, const uint8_t * src )
+{
+    uint64_t input[JOYBUS_BLOCK_DWORDS];
+    uint64_t output[JOYBUS_BLOCK_DWORDS];
+
+    eeprom_write_block( input, block, src );
 
     joybus_exec( input, output );
 
     return output[2] >> 56;
 }
 
+/**
+ * @brief Write a block to EEPROM in background.
+ *
+ * The write is queued via #joybus_exec_async_priority with background
+ * priority, so it never delays controller polling. The source data is copied
+ * immediately, so the buffer can be reused as soon as this function returns.
+ * This function can be called from interrupt handlers (including the
+ * completion callback of a previous write).
+ *
+ * @param[in] block
+ *            Block to write data to. Joybus accesses EEPROM in 8-byte blocks.
+ * @param[in] src
+ *            Source buffer for the eight bytes of data to write to EEPROM.
+ * @param[in] callback
+ *            Function called under interrupt when the write is complete
+ *            (the EEPROM status byte is the first byte of output[2]).
+ * @param[in] ctx
+ *            Opaque pointer passed to the callback.
+ */
+void eeprom_write_async( uint8_t block, const uint8_t * src, void (*callback)(uint64_t *output, void *ctx), void *ctx )
+{
+    uint64_t input[JOYBUS_BLOCK_DWORDS];
+
+    eeprom_write_block( input, block, src );
+
+    joybus_exec_async_priority( input, callback, ctx, JOYBUS_PRIORITY_BACKGROUND );
+}
+
 /**
  * @brief Read a buffer of bytes from EEPROM.
  *
@@ -9,6 +9,7 @@
 #include "libdragon.h"
 #include "system.h"
 #include "utils.h"
+#include "joybusinternal.h"
 
 /**
  * @brief EEPROM Filesystem file descriptor.
@@ -64,6 +65,227 @@ static eepfs_file_t * eepfs_files = NULL;
  */
 static uint16_t eepfs_files_checksum = 0;
 
+/** @brief Maximum number of EEPROM blocks (16k EEPROM) */
+#define EEPFS_MAX_BLOCKS 256
+/** @brief Number of times a failed block write is retried before giving up */
+#define EEPFS_WRITE_RETRIES 3
+
+/**
+ * @brief RAM shadow of the EEPROM contents.
+ * 
+ * Blocks are read from EEPROM the first time they are accessed (see
+ * #eepfs_shadow_load), after which the shadow is authoritative: writes
+ * update it immediately, and the EEPROM is updated in background.
+ * 
+ * Allocated by #eepfs_init and freed by #eepfs_close.
+ */
+static uint8_t * eepfs_shadow = NULL;
+/** @brief Bitmap of the shadow blocks that were read from EEPROM */
+static uint32_t eepfs_loaded[EEPFS_MAX_BLOCKS / 32];
+/** @brief Bitmap of the blocks queued for write-back */
+static uint32_t eepfs_queued[EEPFS_MAX_BLOCKS / 32];
+/** @brief FIFO of the blocks to write back, in order of modification */
+static uint8_t eepfs_queue[EEPFS_MAX_BLOCKS];
+/** @brief Read index of #eepfs_queue */
+static volatile size_t eepfs_queue_head = 0;
+/** @brief Number of blocks in #eepfs_queue */
+static volatile size_t eepfs_queue_count = 0;
+/** @brief True while a block is being written to EEPROM */
+static volatile bool eepfs_writing = false;
+/** @brief Number of failed attempts at writing the current block */
+static int eepfs_write_retries = 0;
+/** @brief Set when a block could not be written to EEPROM (reported by #eepfs_flush) */
+static volatile bool eepfs_write_failed = false;
+/** @brief Set when the write-back queue becomes empty */
+static kevent_t eepfs_idle;
+
+static void eepfs_writeback_done(uint64_t *output, void *ctx);
+
+/**
+ * @brief Queues a block for write-back, at the tail of the FIFO.
+ * 
+ * A block that is already queued is moved to the tail, so that the
+ * EEPROM keeps being updated in the order of the last modifications.
+ * 
+ * @note This function must be called with interrupts disabled.
+ * 
+ * @param[in] block
+ *            EEPROM block to queue
+ */
+static void eepfs_queue_push(uint8_t block)
+{
+    if ( eepfs_queued[block / 32] & (1u << (block % 32)) )
+    {
+        /* Remove the block from its position, compacting the FIFO */
+        size_t i = 0;
+        while ( eepfs_queue[(eepfs_queue_head + i) % EEPFS_MAX_BLOCKS] != block )
+        {
+            ++i;
+        }
+        for ( ; i + 1 < eepfs_queue_count; ++i )
+        {
+            eepfs_queue[(eepfs_queue_head + i) % EEPFS_MAX_BLOCKS] =
+                eepfs_queue[(eepfs_queue_head + i + 1) % EEPFS_MAX_BLOCKS];
+        }
+        eepfs_queue_count--;
+    }
+
+    const size_t tail = (eepfs_queue_head + eepfs_queue_count) % EEPFS_MAX_BLOCKS;
+    eepfs_queue[tail] = block;
+    eepfs_queue_count++;
+    eepfs_queued[block / 32] |= 1u << (block % 32);
+}
+
+/**
+ * @brief Takes the next queued block to write back to EEPROM, if idle.
+ * 
+ * If a block is returned, the write-back is marked as running, and the
+ * caller must start it with #eepfs_writeback_start.
+ * 
+ * @note This function must be called with interrupts disabled.
+ * 
+ * @return The block to write, or -1 if a write is running or the queue is empty
+ */
+static int eepfs_writeback_take(void)
+{
+    if ( eepfs_writing || eepfs_queue_count == 0 )
+    {
+        return -1;
+    }
+
+    const uint8_t block = eepfs_queue[eepfs_queue_head];
+    eepfs_queue_head = (eepfs_queue_head + 1) % EEPFS_MAX_BLOCKS;
+    eepfs_queue_count--;
+    eepfs_queued[block / 32] &= ~(1u << (block % 32));
+    eepfs_writing = true;
+    return block;
+}
+
+/**
+ * @brief Starts writing a block taken by #eepfs_writeback_take to EEPROM.
+ * 
+ * The block data is copied into the joybus message right away,
+ * so the shadow can be modified again while the write is running.
+ * 
+ * @param[in] block
+ *            EEPROM block to write, or -1 to do nothing
+ */
+static void eepfs_writeback_start(int block)
+{
+    if ( block >= 0 )
+    {
+        eeprom_write_async(block, &eepfs_shadow[block * EEPROM_BLOCK_SIZE], eepfs_writeback_done, (void *)block);
+    }
+}
+
+/**
+ * @brief Completion callback of a background EEPROM write (called under interrupt).
+ * 
+ * The joybus slot of the completed write is released before this callback
+ * runs, so queueing the next write from here can always proceed.
+ * 
+ * A failed write puts the block back at the head of the queue, unless it
+ * was modified again in the meantime (so it is already queued with the new
+ * contents). After #EEPFS_WRITE_RETRIES failed retries the block is dropped,
+ * and the error is reported by #eepfs_flush.
+ */
+static void eepfs_writeback_done(uint64_t *output, void *ctx)
+{
+    const uint8_t block_done = (uint32_t)ctx;
+    const uint8_t status = output[2] >> 56;
+
+    eepfs_writing = false;
+
+    if ( status == 0 || (eepfs_queued[block_done / 32] & (1u << (block_done % 32))) )
+    {
+        eepfs_write_retries = 0;
+    }
+    else if ( eepfs_write_retries < EEPFS_WRITE_RETRIES )
+    {
+        eepfs_write_retries++;
+        eepfs_queue_head = (eepfs_queue_head + EEPFS_MAX_BLOCKS - 1) % EEPFS_MAX_BLOCKS;
+        eepfs_queue[eepfs_queue_head] = block_done;
+        eepfs_queue_count++;
+        eepfs_queued[block_done / 32] |= 1u << (block_done % 32);
+    }
+    else
+    {
+        eepfs_write_retries = 0;
+        eepfs_write_failed = true;
+    }
+
+    const int block = eepfs_writeback_take();
+    if ( block < 0 )
+    {
+        kevent_set(&eepfs_idle);
+    }
+    eepfs_writeback_start(block);
+}
+
+/**
+ * @brief Makes sure that a block of the shadow is loaded from EEPROM.
+ *
+ * @param[in] block
+ *            EEPROM block to load
+ */
+static void eepfs_shadow_load(size_t block)
+{
+    if ( !(eepfs_loaded[block / 32] & (1u << (block % 32))) )
+    {
+        eeprom_read(block, &eepfs_shadow[block * EEPROM_BLOCK_SIZE]);
+        eepfs_loaded[block / 32] |= 1u << (block % 32);
+    }
+}
+
+/**
+ * @brief Writes bytes into the shadow, queueing the changed blocks for write-back.
+ * 
+ * Blocks are queued in the order they are modified, so that the EEPROM
+ * is updated in the same order as the writes were issued (a block modified
+ * again is moved to the tail of the queue). Blocks whose contents do not
+ * change are not written at all.
+ *
+ * @param[in] src
+ *            Data to write, or NULL to write zeroes
+ * @param[in] start
+ *            Byte offset in EEPROM to start writing data to
+ * @param[in] len
+ *            Number of bytes to write
+ */
+static void eepfs_shadow_write(const uint8_t * src, size_t start, size_t len)
+{
+    static const uint8_t zeroes[EEPROM_BLOCK_SIZE] = {0};
+
+    while ( len > 0 )
+    {
+        const size_t block = start / EEPROM_BLOCK_SIZE;
+        const size_t chunk = MIN(len, EEPROM_BLOCK_SIZE - start % EEPROM_BLOCK_SIZE);
+        const uint8_t * const data = src ? src : zeroes;
+        uint8_t * const dst = &eepfs_shadow[start];
+
+        eepfs_shadow_load(block);
+        if ( memcmp(dst, data, chunk) != 0 )
+        {
+            disable_interrupts();
+            memcpy(dst, data, chunk);
+            eepfs_queue_push(block);
+            const int next = eepfs_writeback_take();
+            enable_interrupts();
+
+            /* Start the write-back outside of the critical section, so that
+               eeprom_write_async can wait if the joybus queue is full */
+            eepfs_writeback_start(next);
+        }
+
+        if ( src != NULL )
+        {
+            src += chunk;
+        }
+        start += chunk;
+        len -= chunk;
+    }
+}
+
 /**
  * @brief Calculates a CRC-16 checksum from an array of bytes.
  * 
@@ -303,6 +525,22 @@ int eepfs_init(const eepfs_entry_t * entries, size_t count)
         return EEPFS_EBADFS;
     }
 
+    /* Allocate the shadow of the whole EEPROM (so that #eepfs_wipe can clear
+       it all); blocks are loaded on demand */
+    eepfs_shadow = (uint8_t *)malloc(eeprom_total_blocks() * EEPROM_BLOCK_SIZE);
+    if ( eepfs_shadow == NULL )
+    {
+        eepfs_close();
+        return EEPFS_ENOMEM;
+    }
+    memset(eepfs_loaded, 0, sizeof(eepfs_loaded));
+    memset(eepfs_queued, 0, sizeof(eepfs_queued));
+    eepfs_queue_head = 0;
+    eepfs_queue_count = 0;
+    eepfs_write_retries = 0;
+    eepfs_write_failed = false;
+    kevent_init(&eepfs_idle);
+
     /* Calculate and store the CRC-16 checksum for the declared entries */
     const size_t entries_size = sizeof(eepfs_entry_t) * count;
     eepfs_files_checksum = calculate_crc16((void *)entries, entries_size);
@@ -313,7 +551,8 @@ int eepfs_init(const eepfs_entry_t * entries, size_t count)
 /**
  * @brief De-initializes the EEPROM filesystem.
  * 
- * This cleans up the file lookup table.
+ * This waits for the pending writes to complete (see #eepfs_flush),
+ * and cleans up the file lookup table.
  * 
  * You probably won't ever need to call this.
  * 
@@ -327,6 +566,14 @@ int eepfs_close(void)
         return EEPFS_EBADFS;
     }
 
+    /* Complete the pending writes and drop the shadow */
+    if ( eepfs_shadow != NULL )
+    {
+        eepfs_flush();
+        free(eepfs_shadow);
+        eepfs_shadow = NULL;
+    }
+
     /* Clear the file descriptor table */
     free(eepfs_files);
     eepfs_files = NULL;
@@ -364,8 +611,14 @@ int eepfs_read(const char * path, void * dest, size_t size)
         return EEPFS_EBADINPUT;
     }
 
+    const size_t num_blocks = DIVIDE_CEIL(file->num_bytes, EEPROM_BLOCK_SIZE);
+    for ( size_t i = 0; i < num_blocks; ++i )
+    {
+        eepfs_shadow_load(file->start_block + i);
+    }
+
     const size_t start_bytes = file->start_block * EEPROM_BLOCK_SIZE;
-    eeprom_read_bytes(dest, start_bytes, file->num_bytes);
+    memcpy(dest, &eepfs_shadow[start_bytes], file->num_bytes);
 
     return EEPFS_ESUCCESS;
 }
@@ -373,8 +626,13 @@ int eepfs_read(const char * path, void * dest, size_t size)
 /**
  * @brief Writes an entire file to the EEPROM filesystem.
  * 
- * Each EEPROM block write takes approximately 15 milliseconds;
- * this operation may block for a while!
+ * Only the blocks whose contents changed are written. The write happens
+ * in background: each EEPROM block write takes approximately 15 milliseconds,
+ * so the EEPROM is updated one block at a time under interrupt, while
+ * #eepfs_read immediately returns the new contents. Blocks are written in
+ * the same order as the calls to this function. Call #eepfs_flush to wait
+ * for the data to be actually stored in EEPROM (eg: before telling the user
+ * that it is safe to turn off the console).
  *
  * @param[in] path
  *            Path of file in EEPROM filesystem to write to
@@ -402,7 +660,7 @@ int eepfs_write(const char * path, const void * src, size_t size)
     }
 
     const size_t start_bytes = file->start_block * EEPROM_BLOCK_SIZE;
-    eeprom_write_bytes(src, start_bytes, file->num_bytes);
+    eepfs_shadow_write(src, start_bytes, file->num_bytes);
 
     return EEPFS_ESUCCESS;
 }
@@ -414,8 +672,7 @@ int eepfs_write(const char * path, const void * src, size_t size)
  * All files in the filesystem must always exist at the size specified
  * during #eepfs_init
  * 
- * Each EEPROM block write takes approximately 15 milliseconds;
- * this operation may block for a while!
+ * Like #eepfs_write, the EEPROM is updated in background.
  * 
  * Be advised: this is a destructive operation that cannot be undone!
  * 
@@ -434,17 +691,9 @@ int eepfs_erase(const char * path)
         return EEPFS_ENOFILE;
     }
 
-    const size_t num_blocks = DIVIDE_CEIL(file->num_bytes, EEPROM_BLOCK_SIZE);
-    size_t current_block = file->start_block;
-
-    /* eeprom_buf is initialized to all zeroes */
-    const uint8_t eeprom_buf[EEPROM_BLOCK_SIZE] = {0};
-
     /* Write the blocks in with zeroes */
-    while ( current_block < file->start_block + num_blocks )
-    {
-        eeprom_write(current_block++, eeprom_buf);
-    }
+    const size_t num_blocks = DIVIDE_CEIL(file->num_bytes, EEPROM_BLOCK_SIZE);
+    eepfs_shadow_write(NULL, file->start_block * EEPROM_BLOCK_SIZE, num_blocks * EEPROM_BLOCK_SIZE);
 
     return EEPFS_ESUCCESS;
 }
@@ -478,12 +727,11 @@ bool eepfs_verify_signature(void)
     const uint64_t signature = eepfs_generate_signature();
 
     /* Read the signature block out of EEPROM */
-    uint8_t eeprom_buf[EEPROM_BLOCK_SIZE];
-    eeprom_read(0, eeprom_buf);
+    eepfs_shadow_load(0);
 
     /* If the signatures don't match, we can be pretty sure
        that the data in EEPROM is not the expected filesystem */
-    return memcmp(eeprom_buf, (uint8_t *)&signature, EEPROM_BLOCK_SIZE) == 0;
+    return memcmp(eepfs_shadow, (uint8_t *)&signature, EEPROM_BLOCK_SIZE) == 0;
 }
 
 /**
@@ -491,13 +739,15 @@ bool eepfs_verify_signature(void)
  * 
  * This is useful when you want to erase all files in the filesystem.
  * 
- * Each EEPROM block write takes approximately 15 milliseconds;
- * this operation may block for a while:
+ * Like #eepfs_write, the EEPROM is updated in background, but each
+ * EEPROM block write takes approximately 15 milliseconds, so wiping an
+ * EEPROM that is not already blank can take a while to complete:
  * 
  * * 4k EEPROM: 64 blocks * 15ms = 960ms!
  * * 16k EEPROM: 256 blocks * 15ms = 3840ms!
  * 
- * You may want to pause audio in advance of calling this.
+ * The signature is written last, so that a wipe interrupted by a power
+ * loss is detected by #eepfs_verify_signature.
  * 
  * Be advised: this is a destructive operation that cannot be undone!
  * 
@@ -505,20 +755,56 @@ bool eepfs_verify_signature(void)
  */
 void eepfs_wipe(void)
 {
+    /* Write the rest of the blocks in with zeroes */
+    const size_t eeprom_capacity = eeprom_total_blocks();
+    eepfs_shadow_write(NULL, EEPROM_BLOCK_SIZE, (eeprom_capacity - 1) * EEPROM_BLOCK_SIZE);
+
     /* Write the filesystem signature into the first block */
     const uint64_t signature = eepfs_generate_signature();
-    eeprom_write(0, (uint8_t *)&signature);
-
-    /* eeprom_buf is initialized to all zeroes */
-    const uint8_t eeprom_buf[EEPROM_BLOCK_SIZE] = {0};
+    eepfs_shadow_write((uint8_t *)&signature, 0, EEPROM_BLOCK_SIZE);
+}
 
-    /* Write the rest of the blocks in with zeroes */
-    const size_t eeprom_capacity = eeprom_total_blocks();
-    size_t current_block = 1;
+/**
+ * @brief Waits until all the pending writes are stored in EEPROM.
+ * 
+ * While waiting, other threads can run (see #kevent_wait).
+ * 
+ * @retval EEPFS_ESUCCESS if all the writes were stored in EEPROM
+ * @retval EEPFS_EIO if some blocks could not be written since the last flush
+ * @retval EEPFS_EBADFS if the filesystem is not initialized
+ */
+int eepfs_flush(void)
+{
+    if ( eepfs_shadow == NULL )
+    {
+        return EEPFS_EBADFS;
+    }
 
-    while ( current_block < eeprom_capacity )
+    while ( eepfs_pending_blocks() > 0 )
     {
-        eeprom_write(current_block++, eeprom_buf);
+        kevent_wait(&eepfs_idle);
     }
+
+    disable_interrupts();
+    const bool failed = eepfs_write_failed;
+    eepfs_write_failed = false;
+    enable_interrupts();
+
+    return failed ? EEPFS_EIO : EEPFS_ESUCCESS;
+}
+
+/**
+ * @brief Returns the number of blocks still waiting to be written to EEPROM.
+ * 
+ * This can be used to display a "saving" indicator without blocking.
+ * 
+ * @return Number of pending blocks (0 if all the data is stored in EEPROM)
+ */
+size_t eepfs_pending_blocks(void)
+{
+    disable_interrupts();
+    size_t pending = eepfs_queue_count + (eepfs_writing ? 1 : 0);
+    enable_interrupts();
+    return pending;
 }
 
@@ -10,6 +10,8 @@
 #include "graphics.h"
 #include "font.h"
 #include "surface.h"
+#include "utils.h"
+#include "debug.h"
 
 /**
  * @defgroup graphics 2D Graphics
@@ -1181,6 +1183,35 @@ void graphics_draw_sprite_trans_stride( surface_t* disp, int x, int y, sprite_t
     }
 }
 
+/**
+ * @brief Return the pixel data of a mipmap level of a sprite
+ *
+ * The level is (sprite->width >> lod) by (sprite->height >> lod) pixels, in
+ * the same format of the full size image. Each level starts at an address aligned
+ * to 8 bytes, so that it can be loaded directly by the RDP.
+ *
+ * @param[in] sprite
+ *            Sprite to get the level from
+ * @param[in] lod
+ *            Mipmap level (0 is the full size image)
+ *
+ * @return A pointer to the pixel data of the level
+ */
+void *sprite_get_lod_data( sprite_t *sprite, int lod )
+{
+    uint8_t *data = (uint8_t *)sprite->data;
+
+    assertf( lod >= 0 && lod < sprite_get_lod_count( sprite ), "invalid mipmap level %d", lod );
+
+    for( int i = 0; i < lod; i++ )
+    {
+        data += ROUND_UP( (sprite->width >> i) * (sprite->height >> i) * sprite->bitdepth, 8 );
+    }
+
+    return data;
+}
+
+extern inline int sprite_get_lod_count(const sprite_t *sprite);
 extern inline uint16_t color_to_packed16(color_t c);
 extern inline uint32_t color_to_packed32(color_t c);
 extern inline color_t color_from_packed16(uint16_t c);
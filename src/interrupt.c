@@ -3,7 +3,7 @@
  * @brief Interrupt Controller
  * @ingroup interrupt
  */
-#include <malloc.h>
+#include <string.h>
 #include "libdragon.h"
 #include "regsinternal.h"
 
@@ -37,6 +37,23 @@
  * In this manner, it is safe to nest calls to disable and enable
  * interrupts.
  *
+ * Callbacks are stored in preallocated tables (up to #INTERRUPT_MAX_CALLBACKS
+ * per interrupt source), so registering a callback never allocates memory.
+ * Each callback has a priority: when an interrupt occurs, callbacks are called
+ * in order of decreasing priority, and callbacks with the same priority are
+ * called starting from the most recently registered one. The register functions
+ * without a priority (eg: #register_VI_handler) use #INTERRUPT_PRIORITY_DEFAULT.
+ *
+ * To measure the interrupt latency, install a hook with
+ * #set_interrupt_latency_hook: it will be called just before each callback,
+ * with the number of ticks elapsed since the interrupt handler was entered.
+ *
+ * To find out what is keeping interrupts disabled for too long (eg: causing
+ * audio underruns), enable the interrupt statistics with #interrupt_stats_enable.
+ * They record the longest critical sections together with the code that started
+ * them, and the time spent handling each interrupt source. Use
+ * #interrupt_stats_report to print them.
+ *
  * @{
  */
 
@@ -120,16 +137,36 @@ static int __interrupt_sr = 0;
 /** @brief tick at which interrupts were disabled. */
 uint32_t interrupt_disabled_tick = 0;
 
+/** @brief True if the interrupt statistics are being collected */
+static bool stats_enabled = false;
+/** @brief Return address of the call that started the current critical section */
+static void *stats_section_caller = 0;
+/** @brief Interrupt statistics collected so far */
+static interrupt_stats_t stats;
+
 /**
- * @brief Structure of an interrupt callback
+ * @brief An interrupt callback with its priority
  */
-typedef struct callback_link
+typedef struct
 {
     /** @brief Callback function */
     void (*callback)();
-    /** @brief Pointer to next callback */
-    struct callback_link * next;
-} _callback_link;
+    /** @brief Priority of the callback (higher is called first) */
+    int priority;
+} callback_entry_t;
+
+/**
+ * @brief Table of the callbacks registered for an interrupt source
+ *
+ * Entries are kept sorted by decreasing priority.
+ */
+typedef struct
+{
+    /** @brief Registered callbacks */
+    callback_entry_t entries[INTERRUPT_MAX_CALLBACKS];
+    /** @brief Number of registered callbacks */
+    int count;
+} callback_table_t;
 
 /** @brief Static structure to address AI registers */
 static volatile struct AI_regs_s * const AI_regs = (struct AI_regs_s *)0xa4500000;
@@ -144,114 +181,194 @@ static volatile struct SI_regs_s * const SI_regs = (struct SI_regs_s *)0xa480000
 /** @brief Static structure to address SP registers */
 static volatile struct SP_regs_s * const SP_regs = (struct SP_regs_s *)0xa4040000;
 
-/** @brief Linked list of AI callbacks */
-struct callback_link * AI_callback = 0;
-/** @brief Linked list of VI callbacks */
-struct callback_link * VI_callback = 0;
-/** @brief Linked list of PI callbacks */
-struct callback_link * PI_callback = 0;
-/** @brief Linked list of DP callbacks */
-struct callback_link * DP_callback = 0;
-/** @brief Linked list of SI callbacks */
-struct callback_link * SI_callback = 0;
-/** @brief Linked list of SP callbacks */
-struct callback_link * SP_callback = 0;
-/** @brief Linked list of TI callbacks */
-struct callback_link * TI_callback = 0;
-/** @brief Linked list of CART callbacks */
-struct callback_link * CART_callback = 0;
+/** @brief Table of AI callbacks */
+static callback_table_t AI_callback;
+/** @brief Table of VI callbacks */
+static callback_table_t VI_callback;
+/** @brief Table of PI callbacks */
+static callback_table_t PI_callback;
+/** @brief Table of DP callbacks */
+static callback_table_t DP_callback;
+/** @brief Table of SI callbacks */
+static callback_table_t SI_callback;
+/** @brief Table of SP callbacks */
+static callback_table_t SP_callback;
+/** @brief Table of TI callbacks */
+static callback_table_t TI_callback;
+/** @brief Table of CART callbacks */
+static callback_table_t CART_callback;
+
+/** @brief Hook called before each callback to measure the interrupt latency */
+static interrupt_latency_hook_t latency_hook = 0;
 
 static int last_cart_interrupt_count = 0;
 
 /** 
- * @brief Call each callback in a linked list of callbacks
+ * @brief Call each callback in a table of callbacks
  *
- * @param[in] head
- *            Pointer to the head of a callback linke list
+ * @param[in] table
+ *            Table of callbacks to call, in order
+ * @param[in] source
+ *            Interrupt source (reported to the latency hook)
+ * @param[in] entry_tick
+ *            Value of the tick counter when the interrupt handler was entered
  */
-static void __call_callback( struct callback_link * head )
+static void __call_callback( callback_table_t * table, interrupt_source_t source, uint32_t entry_tick )
 {
-    /* Call each registered callback */
-    while( head )
+    uint32_t start_tick = stats_enabled ? TICKS_READ() : 0;
+
+    /* Take a snapshot of the registered callbacks before calling them. A
+       callback might unregister itself (or another callback), which compacts
+       the table: iterating on the table itself would then skip the callback
+       moved into the current slot. */
+    void (*callbacks[INTERRUPT_MAX_CALLBACKS])();
+    int count = table->count;
+
+    for( int i = 0; i < count; i++ )
+    {
+        callbacks[i] = table->entries[i].callback;
+    }
+
+    for( int i = 0; i < count; i++ )
     {
-        if( head->callback )
+        void (*callback)() = callbacks[i];
+
+        if( latency_hook )
         {
-        	head->callback();
+            latency_hook( source, callback, TICKS_READ() - entry_tick );
         }
 
-        /* Go to next */
-	    head=head->next;
+        callback();
+    }
+
+    if( stats_enabled )
+    {
+        uint32_t ticks = TICKS_READ() - start_tick;
+
+        stats.handler_count[source]++;
+        stats.handler_ticks[source] += ticks;
+        if( ticks > stats.handler_max_ticks[source] )
+        {
+            stats.handler_max_ticks[source] = ticks;
+        }
     }
 }
 
 /**
- * @brief Add a callback to a linked list of callbacks
+ * @brief Record a critical section in the interrupt statistics
  *
- * @param[in,out] head
- *                Pointer to the head of a linked list to add to
- * @param[in]     callback
- *                Function to call when executing callbacks in this linked list
+ * @param[in] ticks
+ *            Duration of the critical section
+ * @param[in] caller
+ *            Return address of the call to #disable_interrupts
  */
-static void __register_callback( struct callback_link ** head, void (*callback)() )
+static void __stats_record_section( uint32_t ticks, void *caller )
 {
-    if( head )
+    stats.num_sections++;
+    stats.disabled_ticks += ticks;
+
+    /* Keep the longest sections sorted, with a single entry per caller, so that
+       a hot path does not fill the whole table with the same offender. */
+    int idx = 0;
+    while( idx < INTERRUPT_STATS_MAX_SECTIONS && stats.longest[idx].caller != caller &&
+           stats.longest[idx].ticks >= ticks )
     {
-        /* Add to beginning of linked list */
-        struct callback_link *next = *head;
-        (*head) = malloc(sizeof(struct callback_link));
-
-        if( *head )
+        idx++;
+    }
+    if( idx == INTERRUPT_STATS_MAX_SECTIONS )
+    {
+        /* Shorter than all the recorded sections */
+        return;
+    }
+    if( stats.longest[idx].caller == caller )
+    {
+        /* This caller is already recorded: all the entries before are longer,
+           so it can be updated in place. */
+        if( ticks > stats.longest[idx].ticks )
         {
-            (*head)->next=next;
-            (*head)->callback=callback;
+            stats.longest[idx].ticks = ticks;
         }
+        return;
+    }
+
+    /* Find the entry to drop: the old entry of this caller if any, or the last one */
+    int last = idx;
+    while( last < INTERRUPT_STATS_MAX_SECTIONS - 1 && stats.longest[last].caller != caller )
+    {
+        last++;
+    }
+    for( int i = last; i > idx; i-- )
+    {
+        stats.longest[i] = stats.longest[i-1];
     }
+    stats.longest[idx].ticks = ticks;
+    stats.longest[idx].caller = caller;
 }
 
 /**
- * @brief Remove a callback from a linked list of callbacks
+ * @brief Add a callback to a table of callbacks
  *
- * @param[in,out] head
- *                Pointer to the head of a linked list to remove from
+ * @param[in,out] table
+ *                Table of callbacks to add to
  * @param[in]     callback
- *                Function to search for and remove from callback list
+ *                Function to call when executing callbacks in this table
+ * @param[in]     priority
+ *                Priority of the callback (higher is called first)
  */
-static void __unregister_callback( struct callback_link ** head, void (*callback)() )
+static void __register_callback( callback_table_t * table, void (*callback)(), int priority )
 {
-    if( head )
+    disable_interrupts();
+
+    assertf( table->count < INTERRUPT_MAX_CALLBACKS,
+        "too many callbacks registered for the same interrupt (max: %d)", INTERRUPT_MAX_CALLBACKS );
+
+    /* Insert before the first callback with the same or lower priority, so
+       that among equal priorities the most recent callback is called first */
+    int idx = 0;
+    while( idx < table->count && table->entries[idx].priority > priority )
+    {
+        idx++;
+    }
+
+    for( int i = table->count; i > idx; i-- )
     {
-        /* Try to find callback this matches */
-        struct callback_link *last = 0;
-        struct callback_link *cur  = *head;
+        table->entries[i] = table->entries[i-1];
+    }
+
+    table->entries[idx].callback = callback;
+    table->entries[idx].priority = priority;
+    table->count++;
+
+    enable_interrupts();
+}
+
+/**
+ * @brief Remove a callback from a table of callbacks
+ *
+ * @param[in,out] table
+ *                Table of callbacks to remove from
+ * @param[in]     callback
+ *                Function to search for and remove from the table
+ */
+static void __unregister_callback( callback_table_t * table, void (*callback)() )
+{
+    disable_interrupts();
 
-        while( cur )
+    for( int idx = 0; idx < table->count; idx++ )
+    {
+        if( table->entries[idx].callback == callback )
         {
-            if( cur->callback == callback )
+            /* We found it! Compact the rest of the table */
+            table->count--;
+            for( int i = idx; i < table->count; i++ )
             {
-                /* We found it!  Try to remove it from the list */
-                if( last )
-                {
-                    /* This is somewhere in the linked list */
-                    last->next = cur->next;
-                }
-                else
-                {
-                    /* This is the first node */
-                    *head = cur->next;
-                }
-
-                /* Free memory */
-                free( cur );
-
-                /* Exit early */
-                break;
+                table->entries[i] = table->entries[i+1];
             }
-
-            /* Go to next entry */
-            last = cur;
-            cur = cur->next;
+            break;
         }
     }
+
+    enable_interrupts();
 }
 
 /**
@@ -262,30 +379,33 @@ static void __unregister_callback( struct callback_link ** head, void (*callback
  */
 void __MI_handler(void)
 {
+    uint32_t entry_tick = TICKS_READ();
     unsigned long status = MI_regs->intr & MI_regs->mask;
 
-    if( status & MI_INTR_SP )
+    /* Service AI first: if the audio buffers are not refilled in time,
+       there will be an audible glitch. */
+    if( status & MI_INTR_AI )
     {
         /* Clear interrupt */
-        SP_regs->status=SP_CLEAR_INTERRUPT;
+    	AI_regs->status=AI_CLEAR_INTERRUPT;
 
-        __call_callback(SP_callback);
+	    __call_callback(&AI_callback, INTERRUPT_AI, entry_tick);
     }
 
-    if( status & MI_INTR_SI )
+    if( status & MI_INTR_SP )
     {
         /* Clear interrupt */
-        SI_regs->status=SI_CLEAR_INTERRUPT;
+        SP_regs->status=SP_CLEAR_INTERRUPT;
 
-        __call_callback(SI_callback);
+        __call_callback(&SP_callback, INTERRUPT_SP, entry_tick);
     }
 
-    if( status & MI_INTR_AI )
+    if( status & MI_INTR_SI )
     {
         /* Clear interrupt */
-    	AI_regs->status=AI_CLEAR_INTERRUPT;
+        SI_regs->status=SI_CLEAR_INTERRUPT;
 
-	    __call_callback(AI_callback);
+        __call_callback(&SI_callback, INTERRUPT_SI, entry_tick);
     }
 
     if( status & MI_INTR_VI )
@@ -293,7 +413,7 @@ void __MI_handler(void)
         /* Clear interrupt */
     	VI_regs->cur_line=VI_regs->cur_line;
 
-    	__call_callback(VI_callback);
+    	__call_callback(&VI_callback, INTERRUPT_VI, entry_tick);
     }
 
     if( status & MI_INTR_PI )
@@ -301,7 +421,7 @@ void __MI_handler(void)
         /* Clear interrupt */
         PI_regs->status=PI_CLEAR_INTERRUPT;
 
-        __call_callback(PI_callback);
+        __call_callback(&PI_callback, INTERRUPT_PI, entry_tick);
     }
 
     if( status & MI_INTR_DP )
@@ -309,7 +429,7 @@ void __MI_handler(void)
         /* Clear interrupt */
         MI_regs->mode=DP_CLEAR_INTERRUPT;
 
-        __call_callback(DP_callback);
+        __call_callback(&DP_callback, INTERRUPT_DP, entry_tick);
     }
 }
 
@@ -318,8 +438,10 @@ void __MI_handler(void)
  */
 void __TI_handler(void)
 {
+    uint32_t entry_tick = TICKS_READ();
+
 	/* NOTE: the timer interrupt is already acknowledged in inthandler.S */
-    __call_callback(TI_callback);
+    __call_callback(&TI_callback, INTERRUPT_TI, entry_tick);
 }
 
 /**
@@ -327,8 +449,10 @@ void __TI_handler(void)
  */
 void __CART_handler(void)
 {
+    uint32_t entry_tick = TICKS_READ();
+
     /* Call the registered callbacks */
-    __call_callback(CART_callback);
+    __call_callback(&CART_callback, INTERRUPT_CART, entry_tick);
 
     #ifndef NDEBUG
      /* CART interrupts must be acknowledged by handlers. If the handler fails
@@ -351,7 +475,7 @@ void __CART_handler(void)
  */
 void register_AI_handler( void (*callback)() )
 {
-    __register_callback(&AI_callback,callback);
+    __register_callback(&AI_callback,callback,INTERRUPT_PRIORITY_DEFAULT);
 }
 
 /**
@@ -373,7 +497,7 @@ void unregister_AI_handler( void (*callback)() )
  */
 void register_VI_handler( void (*callback)() )
 {
-    __register_callback(&VI_callback,callback);
+    __register_callback(&VI_callback,callback,INTERRUPT_PRIORITY_DEFAULT);
 }
 
 /**
@@ -395,7 +519,7 @@ void unregister_VI_handler( void (*callback)() )
  */
 void register_PI_handler( void (*callback)() )
 {
-    __register_callback(&PI_callback,callback);
+    __register_callback(&PI_callback,callback,INTERRUPT_PRIORITY_DEFAULT);
 }
 
 /**
@@ -417,7 +541,7 @@ void unregister_PI_handler( void (*callback)() )
  */
 void register_DP_handler( void (*callback)() )
 {
-    __register_callback(&DP_callback,callback);
+    __register_callback(&DP_callback,callback,INTERRUPT_PRIORITY_DEFAULT);
 }
 
 /**
@@ -439,7 +563,7 @@ void unregister_DP_handler( void (*callback)() )
  */
 void register_SI_handler( void (*callback)() )
 {
-    __register_callback(&SI_callback,callback);
+    __register_callback(&SI_callback,callback,INTERRUPT_PRIORITY_DEFAULT);
 }
 
 /**
@@ -461,7 +585,7 @@ void unregister_SI_handler( void (*callback)() )
  */
 void register_SP_handler( void (*callback)() )
 {
-    __register_callback(&SP_callback,callback);
+    __register_callback(&SP_callback,callback,INTERRUPT_PRIORITY_DEFAULT);
 }
 
 /**
@@ -496,7 +620,7 @@ void unregister_SP_handler( void (*callback)() )
  */
 void register_TI_handler( void (*callback)() )
 {
-    __register_callback(&TI_callback,callback);
+    __register_callback(&TI_callback,callback,INTERRUPT_PRIORITY_DEFAULT);
 }
 
 /**
@@ -533,7 +657,7 @@ void unregister_TI_handler( void (*callback)() )
  */
 void register_CART_handler( void (*callback)() )
 {
-    __register_callback(&CART_callback,callback);
+    __register_callback(&CART_callback,callback,INTERRUPT_PRIORITY_DEFAULT);
 }
 
 /**
@@ -547,6 +671,56 @@ void unregister_CART_handler( void (*callback)() )
     __unregister_callback(&CART_callback,callback);
 }
 
+/**
+ * @brief Register a callback for an interrupt source, with a priority
+ *
+ * Callbacks with a higher priority are called first when the interrupt
+ * occurs. This can be used to make sure that latency-sensitive callbacks
+ * (eg: refilling the audio buffers) run before less critical work.
+ * The callback can be unregistered with the unregister function of the
+ * specific interrupt source (eg: #unregister_AI_handler).
+ *
+ * @param[in] source
+ *            Interrupt source
+ * @param[in] callback
+ *            Function to call when the interrupt occurs
+ * @param[in] priority
+ *            Priority of the callback (see #INTERRUPT_PRIORITY_DEFAULT)
+ */
+void register_interrupt_handler( interrupt_source_t source, void (*callback)(), int priority )
+{
+    static callback_table_t * const tables[] = {
+        [INTERRUPT_SP] = &SP_callback,
+        [INTERRUPT_SI] = &SI_callback,
+        [INTERRUPT_AI] = &AI_callback,
+        [INTERRUPT_VI] = &VI_callback,
+        [INTERRUPT_PI] = &PI_callback,
+        [INTERRUPT_DP] = &DP_callback,
+        [INTERRUPT_TI] = &TI_callback,
+        [INTERRUPT_CART] = &CART_callback,
+    };
+
+    assertf( source >= 0 && source < sizeof(tables)/sizeof(tables[0]), "invalid interrupt source: %d", source );
+    __register_callback(tables[source],callback,priority);
+}
+
+/**
+ * @brief Install a hook to measure the interrupt latency
+ *
+ * The hook is called from the interrupt handler just before each callback,
+ * with the number of ticks elapsed since the handler was entered. Since
+ * callbacks are called in sequence, this includes the time spent in the
+ * callbacks called before for the same interrupt. The hook runs in interrupt
+ * context, so it must be fast: typically, it just accumulates statistics.
+ *
+ * @param[in] hook
+ *            Function to call before each callback, or NULL to remove it
+ */
+void set_interrupt_latency_hook( interrupt_latency_hook_t hook )
+{
+    latency_hook = hook;
+}
+
 
 /**
  * @brief Enable or disable the AI interrupt
@@ -753,6 +927,7 @@ void disable_interrupts()
         __interrupt_sr = sr;
 
         interrupt_disabled_tick = TICKS_READ();
+        stats_section_caller = __builtin_return_address(0);
     }
 
     /* Ensure that we remember nesting levels */
@@ -779,6 +954,11 @@ void enable_interrupts()
 
     if( __interrupt_depth == 0 )
     {
+        if( stats_enabled )
+        {
+            __stats_record_section(TICKS_READ() - interrupt_disabled_tick, stats_section_caller);
+        }
+
         /* Restore the interrupt state that was active when interrupts got
            disabled. This is important because, within an interrupt handler,
            we don't want here to force-enable interrupts, or we would allow
@@ -810,4 +990,80 @@ interrupt_state_t get_interrupts_state()
     }
 }
 
+/**
+ * @brief Enable or disable the collection of interrupt statistics
+ *
+ * When enabled, every critical section (from the outermost #disable_interrupts
+ * to the matching #enable_interrupts) is measured, together with the time
+ * spent in the callbacks of each interrupt source. The overhead is a few
+ * counter reads per critical section and per interrupt, so it is disabled
+ * by default.
+ *
+ * Statistics are preserved when disabling the collection, so that they can
+ * be examined later with #interrupt_stats_get or #interrupt_stats_report.
+ *
+ * @param[in] enable
+ *            True to start collecting statistics, false to stop
+ */
+void interrupt_stats_enable( bool enable )
+{
+    stats_enabled = enable;
+}
+
+/**
+ * @brief Clear the interrupt statistics collected so far
+ */
+void interrupt_stats_reset( void )
+{
+    disable_interrupts();
+    memset(&stats, 0, sizeof(stats));
+    enable_interrupts();
+}
+
+/**
+ * @brief Get a copy of the interrupt statistics collected so far
+ *
+ * @param[out] stats_out
+ *             Structure to fill with the statistics
+ */
+void interrupt_stats_get( interrupt_stats_t *stats_out )
+{
+    disable_interrupts();
+    *stats_out = stats;
+    enable_interrupts();
+}
+
+/**
+ * @brief Print the interrupt statistics via #debugf
+ *
+ * The report lists the longest critical sections, with the address of the
+ * code that started them (it can be resolved to a source line with
+ * `mips64-elf-addr2line -e app.elf <address>`), and the time spent handling
+ * each interrupt source.
+ */
+void interrupt_stats_report( void )
+{
+    static const char *source_names[INTERRUPT_NUM_SOURCES] = {
+        "SP", "SI", "AI", "VI", "PI", "DP", "TI", "CART"
+    };
+    interrupt_stats_t s;
+    interrupt_stats_get(&s);
+
+    debugf("Interrupt statistics:\n");
+    debugf("  Critical sections: %lu, total %lld us\n", s.num_sections,
+        TIMER_MICROS_LL(s.disabled_ticks));
+    for( int i = 0; i < INTERRUPT_STATS_MAX_SECTIONS && s.longest[i].ticks; i++ )
+    {
+        debugf("    %8lu us  caller %p\n", (uint32_t)TIMER_MICROS(s.longest[i].ticks), s.longest[i].caller);
+    }
+    debugf("  Interrupt handlers:\n");
+    for( int i = 0; i < INTERRUPT_NUM_SOURCES; i++ )
+    {
+        if( !s.handler_count[i] ) continue;
+        debugf("    %-4s  count %8lu  total %10lld us  max %8lu us\n", source_names[i],
+            s.handler_count[i], TIMER_MICROS_LL(s.handler_ticks[i]),
+            (uint32_t)TIMER_MICROS(s.handler_max_ticks[i]));
+    }
+}
+
 /** @} */
@@ -7,6 +7,7 @@
 #include <string.h>
 #include "libdragon.h"
 #include "regsinternal.h"
+#include "joybusinternal.h"
 
 /**
  * @defgroup joybus Joybus Subsystem
@@ -33,18 +34,23 @@
  * Internally, the JoyBus subsystem communicates with the PIF controller via
  * the SI DMA, via the JoyBus protocol which is a standard master/slave
  * binary protocol. Each message of the protocol is a block of 64 bytes, and
- * can contain multiple commands. Currently, there are no macros or functions
- * to help composing a JoyBus message, so higher-level libraries currently
- * hard code the binary messages. 
+ * can contain multiple commands, one per channel (port). Higher-level
+ * libraries can compose a message with #joybus_block_init and
+ * #joybus_block_add, which pack as many commands as fit into a single block.
  * 
  * All communications is made asynchronously because SI DMA is quite slow:
  * its completion is bound to the PIF actually processing the data, rather than
- * just being the memory transfer. A queue of pending JoyBus messages is kept
- * in a ring buffer, and is then executed under interrupt when the previous SI DMA
- * completes. The internal entry point is #joybus_exec_async, that schedules
- * a message to be sent to PIF, and calls a callback with the reply whenever
- * it is available. A blocking API (#joybus_exec) is made available for
- * simpler usage.
+ * just being the memory transfer. Pending JoyBus messages are kept in a queue
+ * per priority (input polling first, background transfers last), and are then
+ * executed under interrupt when the previous SI DMA completes. Messages that
+ * use different channels are merged into a single block when they fit, so
+ * that they share the PIF round-trip (see #joybus_exec_async_priority).
+ * Queue depth and wait times are tracked by #joybus_get_stats.
+ *
+ * The internal entry point is #joybus_exec_async, that schedules a message
+ * to be sent to PIF, and calls a callback with the reply whenever it is
+ * available. A blocking API (#joybus_exec) is made available for simpler
+ * usage.
  *
  * @{
  */
@@ -70,30 +76,62 @@ static volatile struct SI_regs_s * const SI_regs = (struct SI_regs_s *)0xa480000
  */
 static void * const PIF_RAM = (void *)0x1fc007c0;
 
+/** @brief Number of joybus channels (4 controller ports plus the cartridge) */
+#define JOYBUS_CHANNELS            5
+
 /**
- * @brief A message to be sent to JoyBus, with its completion callback. 
+ * @brief A command within a joybus message block (see #joybus_msg_parse)
  */
 typedef struct {
+    uint8_t channel;            ///< Channel the command is directed to
+    uint8_t offset;             ///< Offset of the command frame in the block
+    uint8_t len;                ///< Length of the command frame (header, command and reply)
+    uint8_t merged_offset;      ///< Offset of the command frame in the block actually sent
+} joybus_frame_t;
+
+/**
+ * @brief A message to be sent to JoyBus, with its completion callback. 
+ */
+typedef struct joybus_msg_s {
     uint64_t input[JOYBUS_BLOCK_DWORDS] __attribute__((aligned(16)));  ///< input message
     void (*callback)(uint64_t *output, void *ctx);                     ///< callback for completion
     void *context;                                                     ///< callback context
+    int priority;                                                      ///< priority (JOYBUS_PRIORITY_*)
+    uint32_t enqueue_ticks;                                            ///< time at which the message was queued
+    uint8_t channels;                                                  ///< bitmask of used channels (0: cannot be merged)
+    uint8_t num_frames;                                                ///< number of commands in the message
+    joybus_frame_t frames[JOYBUS_CHANNELS];                            ///< commands in the message
+    struct joybus_msg_s *next;                                         ///< next message in the queue
 } joybus_msg_t;
 
-#define MAX_JOYBUS_MSGS            8    ///< Maximum number of pending joybus messages
 #define JOYBUS_STATE_IDLE          0    ///< Joybus state: idle (no pending messages)
 #define JOYBUS_STATE_SENDING       1    ///< JoyBus state: sending a message to PIF
 #define JOYBUS_STATE_RECEIVING     2    ///< JoyBus state: receiving a reply from PIF
 
 /** @brief Joybus temporary output buffer */
 static uint64_t joybus_outbuf[JOYBUS_BLOCK_DWORDS] __attribute__((aligned(16)));
+/** @brief Joybus input buffer, used when multiple messages are merged */
+static uint64_t joybus_inbuf[JOYBUS_BLOCK_DWORDS] __attribute__((aligned(16)));
 /** @brief Joybus current state (either #JOYBUS_STATE_IDLE, #JOYBUS_STATE_SENDING or #JOYBUS_STATE_RECEIVING) */
 static volatile int joybus_state;
-/** @brief Joybus pending messages (ring buffer) */
+/** @brief Joybus messages storage */
 static joybus_msg_t joybus_msgs[MAX_JOYBUS_MSGS];
-/** @brief Pending messages write index */
-static volatile int msgs_widx;
-/** @brief Pending messages read index */
-static volatile int msgs_ridx;
+/** @brief List of free messages */
+static joybus_msg_t *msgs_free;
+/** @brief Pending messages, one FIFO per priority (head) */
+static joybus_msg_t *msgs_head[JOYBUS_NUM_PRIORITIES];
+/** @brief Pending messages, one FIFO per priority (tail) */
+static joybus_msg_t *msgs_tail[JOYBUS_NUM_PRIORITIES];
+/** @brief Number of pending messages (including the ones being exchanged) */
+static volatile int msgs_count;
+/** @brief Messages being exchanged with the PIF */
+static joybus_msg_t *msgs_current[JOYBUS_CHANNELS];
+/** @brief Number of messages in #msgs_current */
+static int msgs_current_count;
+/** @brief Set whenever a message slot becomes free */
+static kevent_t msgs_freed;
+/** @brief Joybus statistics (see #joybus_get_stats) */
+static joybus_stats_t joybus_stats;
 
 static void si_interrupt(void);
 
@@ -111,9 +149,17 @@ void __joybus_init(void)
     extern void __init_interrupts(void);
     __init_interrupts();
 
-    // Initialize the message ring buffer
-    msgs_widx = 0;
-    msgs_ridx = 0;
+    // Initialize the message queues
+    msgs_free = NULL;
+    for (int i = MAX_JOYBUS_MSGS-1; i >= 0; i--) {
+        joybus_msgs[i].next = msgs_free;
+        msgs_free = &joybus_msgs[i];
+    }
+    for (int i = 0; i < JOYBUS_NUM_PRIORITIES; i++)
+        msgs_head[i] = msgs_tail[i] = NULL;
+    msgs_count = 0;
+    msgs_current_count = 0;
+    kevent_init(&msgs_freed);
     joybus_state = JOYBUS_STATE_IDLE;
 
     // Acknowledge any pending SI interrupt
@@ -124,19 +170,154 @@ void __joybus_init(void)
     set_SI_interrupt(1);
 }
 
+/**
+ * @brief Parse the commands of a message, to check whether it can be merged with others
+ *
+ * A message can be merged if it is a standard command block (control byte
+ * set to 1), made only of commands, padding bytes and skipped channels.
+ * If the message cannot be merged, its channel mask is set to 0.
+ *
+ * @param      msg    Message to parse
+ */
+static void joybus_msg_parse(joybus_msg_t *msg) {
+    const uint8_t *data = (const uint8_t*)msg->input;
+    int channel = 0;
+    int pos = 0;
+
+    msg->channels = 0;
+    msg->num_frames = 0;
+    if (data[JOYBUS_BLOCK_SIZE-1] != 0x01)
+        return;
+
+    while (pos < JOYBUS_BLOCK_SIZE-1 && data[pos] != 0xFE) {
+        uint8_t b = data[pos];
+        if (b == 0xFF) {             // Padding
+            pos++;
+            continue;
+        }
+        if (b == 0x00) {             // Skip channel
+            channel++;
+            pos++;
+            continue;
+        }
+        if (b == 0xFD || channel >= JOYBUS_CHANNELS || pos+1 >= JOYBUS_BLOCK_SIZE-1) {
+            // Channel reset, or malformed message: send it as-is
+            msg->channels = 0;
+            return;
+        }
+        int len = 2 + (b & 0x3F) + (data[pos+1] & 0x3F);
+        if (pos + len > JOYBUS_BLOCK_SIZE-1) {
+            msg->channels = 0;
+            return;
+        }
+
+        joybus_frame_t *frame = &msg->frames[msg->num_frames++];
+        frame->channel = channel;
+        frame->offset = pos;
+        frame->len = len;
+        msg->channels |= 1 << channel;
+        channel++;
+        pos += len;
+    }
+}
+
+/**
+ * @brief Check whether a message can be added to the block being composed
+ *
+ * @param[in]  msg        Message to add
+ * @param[in]  channels   Channels already used by the block
+ *
+ * @return True if the message can be added to the block
+ */
+static bool joybus_msg_fits(joybus_msg_t *msg, uint8_t channels) {
+    if (!msg->channels || (msg->channels & channels))
+        return false;
+
+    // Each frame costs its length; channels before the last one used that
+    // have no command cost a skip byte.
+    uint8_t all = channels | msg->channels;
+    int last = 31 - __builtin_clz(all);
+    int frames = __builtin_popcount(all);
+    int total = (last + 1 - frames);
+    for (int i = 0; i < msgs_current_count; i++)
+        for (int j = 0; j < msgs_current[i]->num_frames; j++)
+            total += msgs_current[i]->frames[j].len;
+    for (int j = 0; j < msg->num_frames; j++)
+        total += msg->frames[j].len;
+
+    return total < JOYBUS_BLOCK_SIZE-1;
+}
+
+/**
+ * @brief Unlink a message from its priority queue
+ *
+ * @param      msg    Message to unlink
+ * @param      prev   Message preceding it in the queue (or NULL if it is the head)
+ */
+static void joybus_msg_unlink(joybus_msg_t *msg, joybus_msg_t *prev) {
+    if (prev)
+        prev->next = msg->next;
+    else
+        msgs_head[msg->priority] = msg->next;
+    if (msgs_tail[msg->priority] == msg)
+        msgs_tail[msg->priority] = prev;
+    msg->next = NULL;
+}
+
+/**
+ * @brief Compose the merged block of the messages in #msgs_current
+ *
+ * The commands of all the messages are sorted by channel and written in
+ * #joybus_inbuf. The offset of each command in the merged block is recorded
+ * so that the reply can be split again (see #joybus_msg_complete).
+ */
+static void joybus_msg_merge(void) {
+    joybus_frame_t *frames[JOYBUS_CHANNELS] = {0};
+    uint8_t *data = (uint8_t*)joybus_inbuf;
+    int pos = 0;
+
+    joybus_msg_t *owners[JOYBUS_CHANNELS] = {0};
+    int last = 0;
+
+    for (int i = 0; i < msgs_current_count; i++) {
+        for (int j = 0; j < msgs_current[i]->num_frames; j++) {
+            joybus_frame_t *frame = &msgs_current[i]->frames[j];
+            frames[frame->channel] = frame;
+            owners[frame->channel] = msgs_current[i];
+            if (frame->channel > last)
+                last = frame->channel;
+        }
+    }
+
+    for (int ch = 0; ch <= last; ch++) {
+        joybus_frame_t *frame = frames[ch];
+        if (!frame) {
+            data[pos++] = 0x00;
+            continue;
+        }
+        memcpy(data + pos, (uint8_t*)owners[ch]->input + frame->offset, frame->len);
+        frame->merged_offset = pos;
+        pos += frame->len;
+    }
+
+    // Terminate the block
+    memset(data + pos, 0, JOYBUS_BLOCK_SIZE - pos);
+    data[pos] = 0xFE;
+    data[JOYBUS_BLOCK_SIZE-1] = 0x01;
+}
 
 /**
  * @brief Send a joybus messages to the PIF
  * 
  * @note This function must be called with interrupts disabled and SI must be idle
  *
- * @param      msg    Message to send
+ * @param      input    Message block to send
  */
-static void joybus_msg_send(joybus_msg_t *msg) {
+static void joybus_msg_send(uint64_t *input) {
     assert((SI_regs->status & (SI_STATUS_DMA_BUSY | SI_STATUS_IO_BUSY)) == 0);
 
-    data_cache_hit_writeback(msg->input, JOYBUS_BLOCK_SIZE);
-    SI_regs->DRAM_addr = msg->input;
+    data_cache_hit_writeback(input, JOYBUS_BLOCK_SIZE);
+    SI_regs->DRAM_addr = input;
     MEMORY_BARRIER();
     SI_regs->PIF_addr_write = PIF_RAM;
     MEMORY_BARRIER();
@@ -147,10 +328,8 @@ static void joybus_msg_send(joybus_msg_t *msg) {
  * @brief Receive a joybus reply from the PIF
  * 
  * @note This function must be called with interrupts disabled and SI must be idle
- *
- * @param      msg    Message for which a reply is pending
  */
-static void joybus_msg_recv(joybus_msg_t *msg) {
+static void joybus_msg_recv(void) {
     assert((SI_regs->status & (SI_STATUS_DMA_BUSY | SI_STATUS_IO_BUSY)) == 0);
 
     // Start a DMA transfer into the global temporary buffer. We just need
@@ -167,41 +346,144 @@ static void joybus_msg_recv(joybus_msg_t *msg) {
 /**
  * @brief Check where there are new messages to send
  * 
+ * The first message of the highest priority queue is sent. The pending
+ * messages that use other channels are merged into the same block, as long
+ * as they fit. A message is never merged ahead of a message queued before
+ * it that uses one of its channels, so the order of the commands on each
+ * channel is preserved within the same priority.
+ * 
  * @note This function must be called with interrupts disabled.
  */
 static void joybus_poll(void) {
-    // If the ring buffer is not empty, fetch the first message and send it
-    if (msgs_ridx != msgs_widx) {
-        joybus_msg_t *msg = &joybus_msgs[msgs_ridx];
-        joybus_msg_send(msg);
-        return;
+    joybus_msg_t *first = NULL;
+    int prio;
+
+    for (prio = 0; prio < JOYBUS_NUM_PRIORITIES; prio++) {
+        if (msgs_head[prio]) {
+            first = msgs_head[prio];
+            break;
+        }
     }
 
     // Queue is empty, switch to idle state
-    joybus_state = JOYBUS_STATE_IDLE;
+    if (!first) {
+        joybus_state = JOYBUS_STATE_IDLE;
+        return;
+    }
+
+    joybus_msg_unlink(first, NULL);
+    msgs_current[0] = first;
+    msgs_current_count = 1;
+
+    uint32_t now = TICKS_READ();
+    joybus_stats.transactions++;
+
+    // Try to merge other messages into the same block
+    uint8_t channels = first->channels;
+    uint8_t blocked = 0;
+    if (channels && msgs_count > 1) {
+        for (; prio < JOYBUS_NUM_PRIORITIES; prio++) {
+            // Background transfers might be slow (eg: EEPROM writes), so they
+            // never share a block with input polling.
+            if (first->priority == JOYBUS_PRIORITY_INPUT && prio == JOYBUS_PRIORITY_BACKGROUND)
+                break;
+
+            joybus_msg_t *prev = NULL, *msg = msgs_head[prio];
+            while (msg) {
+                joybus_msg_t *next = msg->next;
+                if (!(msg->channels & blocked) && joybus_msg_fits(msg, channels)) {
+                    joybus_msg_unlink(msg, prev);
+                    msgs_current[msgs_current_count++] = msg;
+                    channels |= msg->channels;
+                } else {
+                    // Later messages on the same channels must wait for this one
+                    blocked |= msg->channels ? msg->channels : 0xFF;
+                    prev = msg;
+                }
+                msg = next;
+            }
+        }
+    }
+
+    for (int i = 0; i < msgs_current_count; i++) {
+        joybus_msg_t *msg = msgs_current[i];
+        uint32_t wait = now - msg->enqueue_ticks;
+        joybus_stats.wait_total[msg->priority] += wait;
+        if (wait > joybus_stats.wait_max[msg->priority])
+            joybus_stats.wait_max[msg->priority] = wait;
+    }
+
+    if (msgs_current_count == 1) {
+        joybus_msg_send(first->input);
+    } else {
+        joybus_stats.merged += msgs_current_count;
+        joybus_msg_merge();
+        joybus_msg_send(joybus_inbuf);
+    }
+}
+
+/**
+ * @brief Call the completion callbacks of the messages just exchanged
+ *
+ * If multiple messages were merged, the reply of each command is copied back
+ * at the position it had in the original message, so that each callback
+ * sees the same layout it would have had if the message was sent alone.
+ *
+ * Each slot is returned to the free list before its callback is called, so
+ * that callbacks can queue a follow-up message (eg: a retry) even if all the
+ * other slots are in use.
+ * 
+ * @note This function must be called with interrupts disabled.
+ */
+static void joybus_msg_complete(void) {
+    uint64_t output[JOYBUS_BLOCK_DWORDS] __attribute__((aligned(8)));
+
+    for (int i = 0; i < msgs_current_count; i++) {
+        joybus_msg_t *msg = msgs_current[i];
+        uint64_t *out = joybus_outbuf;
+
+        if (msgs_current_count > 1) {
+            memcpy(output, msg->input, JOYBUS_BLOCK_SIZE);
+            for (int j = 0; j < msg->num_frames; j++) {
+                joybus_frame_t *frame = &msg->frames[j];
+                memcpy((uint8_t*)output + frame->offset,
+                       (uint8_t*)joybus_outbuf + frame->merged_offset, frame->len);
+            }
+            out = output;
+        }
+
+        // Release the slot first. The reply is either in joybus_outbuf
+        // (which is not touched until the next message is sent, after all
+        // the callbacks) or in the local buffer, so the slot can be reused
+        // by the callback itself.
+        void (*callback)(uint64_t *, void *) = msg->callback;
+        void *context = msg->context;
+        joybus_stats.messages[msg->priority]++;
+        msg->next = msgs_free;
+        msgs_free = msg;
+        msgs_count--;
+
+        if (callback)
+            callback(out, context);
+    }
+
+    msgs_current_count = 0;
+    kevent_set(&msgs_freed);
 }
 
 /**
  * @brief SI interrupt handler
  */
 static void si_interrupt(void) {
-    joybus_msg_t *msg;
-
     switch (joybus_state) {
     case JOYBUS_STATE_SENDING:
         // Message sending complete. Start receiving the reply
-        msg = &joybus_msgs[msgs_ridx];
-        joybus_msg_recv(msg);
+        joybus_msg_recv();
         return;
 
     case JOYBUS_STATE_RECEIVING:
-        // Reply received. Call the callback
-        msg = &joybus_msgs[msgs_ridx];
-        if (msg->callback)
-            msg->callback(joybus_outbuf, msg->context);
-
-        // Increment read pointer and poll for new messages
-        msgs_ridx = (msgs_ridx + 1) % MAX_JOYBUS_MSGS;
+        // Reply received. Call the callbacks and poll for new messages
+        joybus_msg_complete();
         joybus_poll();
         return;
 
@@ -214,6 +496,72 @@ static void si_interrupt(void) {
     }
 }
 
+/**
+ * @brief Execute an asynchronous joybus message with a priority.
+ * 
+ * Pending messages are sent in priority order (#JOYBUS_PRIORITY_INPUT first,
+ * #JOYBUS_PRIORITY_BACKGROUND last), and in FIFO order within the same
+ * priority. Messages that use different channels (eg: a controller read and
+ * an EEPROM write) are merged in the same PIF block when they fit, so that
+ * they are exchanged with a single round-trip.
+ * 
+ * If the queue is full, this function waits for a slot to become free,
+ * unless it is called with interrupts disabled (eg: from an interrupt
+ * handler), in which case it asserts.
+ * 
+ * @note The callback function will be called under interrupt. 
+ * 
+ * @param[in]   input       The input block (must be of JOYBUS_BLOCK_SIZE bytes).
+ *                          No specific alignment is required for this data block.
+ * @param[in]   callback    A callback completion function that will be called
+ *                          when the joybus command is finished. Can be NULL.
+ * @param[in]   ctx         Context opaque pointer to pass to the callback.
+ * @param[in]   priority    Priority of the message (JOYBUS_PRIORITY_*)
+ */
+void joybus_exec_async_priority(const void * input, void (*callback)(uint64_t *output, void *ctx), void *ctx, int priority)
+{
+    assertf(priority >= 0 && priority < JOYBUS_NUM_PRIORITIES, "invalid joybus priority: %d", priority);
+
+    while (1) {
+        bool can_wait = get_interrupts_state() == INTERRUPTS_ENABLED;
+        disable_interrupts();
+        if (msgs_free)
+            break;
+        // The task queue is full. If interrupts are disabled, waiting would
+        // deadlock, so just assert.
+        assertf(can_wait, "joybus task queue is full");
+        enable_interrupts();
+        kevent_wait(&msgs_freed);
+    }
+
+    // Write the new task into a free slot, and append it to its queue
+    joybus_msg_t *msg = msgs_free;
+    msgs_free = msg->next;
+    memcpy(msg->input, input, JOYBUS_BLOCK_SIZE);
+    msg->callback = callback;
+    msg->context = ctx;
+    msg->priority = priority;
+    msg->enqueue_ticks = TICKS_READ();
+    msg->next = NULL;
+    joybus_msg_parse(msg);
+
+    if (msgs_tail[priority])
+        msgs_tail[priority]->next = msg;
+    else
+        msgs_head[priority] = msg;
+    msgs_tail[priority] = msg;
+
+    msgs_count++;
+    if (msgs_count > joybus_stats.max_depth)
+        joybus_stats.max_depth = msgs_count;
+
+    // If the joybus subsystem is idle, poll immediately so that we can
+    // begin sending the message.
+    if (joybus_state == JOYBUS_STATE_IDLE)
+        joybus_poll();
+
+    enable_interrupts();
+}
 
 /**
  * @brief Execute an asynchronous joybus message.
@@ -226,6 +574,8 @@ static void si_interrupt(void) {
  * It is possible to schedule multiple joybus messages by calling this
  * function multiple times. They will be automatically executed in order.
  * The maximum number of pending messages at any given time is #MAX_JOYBUS_MSGS.
+ * The message is queued with #JOYBUS_PRIORITY_DEFAULT: see
+ * #joybus_exec_async_priority for details.
  * 
  * @note The callback function will be called under interrupt. 
  * 
@@ -246,27 +596,29 @@ static void si_interrupt(void) {
  */
 void joybus_exec_async(const void * input, void (*callback)(uint64_t *output, void *ctx), void *ctx)
 {
-    // Make sure that the task queue is not full. If it is, just assert for now.
-    // It is not easy to understand what we should do when the queue is full;
-    // blocking would be an option, but if we are under interrupt, we would be
-    // deadlocking. So punt for now: we can revisit this later.
-    assertf((msgs_widx + 1) % MAX_JOYBUS_MSGS != msgs_ridx,
-        "joybus task queue is full");
+    joybus_exec_async_priority(input, callback, ctx, JOYBUS_PRIORITY_DEFAULT);
+}
 
+/**
+ * @brief Get the statistics of the joybus scheduler
+ *
+ * @param[out] stats    Structure to fill with the statistics
+ */
+void joybus_get_stats(joybus_stats_t *stats)
+{
     disable_interrupts();
+    *stats = joybus_stats;
+    stats->queue_depth = msgs_count;
+    enable_interrupts();
+}
 
-    // Write the new task into the ring buffer.
-    joybus_msg_t *msg = &joybus_msgs[msgs_widx];
-    memcpy(msg->input, input, JOYBUS_BLOCK_SIZE);
-    msg->callback = callback;
-    msg->context = ctx;
-
-    // Increment the write index. If the joybus subsystem is idle, poll immediately
-    // so that we can begin sending the message.
-    msgs_widx = (msgs_widx + 1) % MAX_JOYBUS_MSGS;
-    if (joybus_state == JOYBUS_STATE_IDLE)
-        joybus_poll();
-
+/**
+ * @brief Reset the statistics of the joybus scheduler
+ */
+void joybus_reset_stats(void)
+{
+    disable_interrupts();
+    memset(&joybus_stats, 0, sizeof(joybus_stats));
     enable_interrupts();
 }
 
@@ -288,14 +640,93 @@ void joybus_exec_async(const void * input, void (*callback)(uint64_t *output, vo
 void joybus_exec( const void * input, void * output )
 {
     volatile bool done = false;
+    kevent_t done_event;
+    kevent_init(&done_event);
 
     void callback(uint64_t *out, void *ctx) {
         memcpy(output, out, JOYBUS_BLOCK_SIZE);
         done = true;
+        kevent_set(&done_event);
     }
 
     joybus_exec_async(input, callback, NULL);
-    while (!done) {}
+
+    // Block if possible, otherwise (eg: from an exception handler) spin
+    if (kthread_can_switch())
+        kevent_wait(&done_event);
+    else
+        while (!done) {}
+}
+
+/**
+ * @brief Initialize an empty joybus message block
+ *
+ * After initialization, commands can be appended with #joybus_block_add.
+ * The block is always kept well-formed, so it can be sent via
+ * #joybus_exec_async at any time.
+ *
+ * @param[out] blk      Block to initialize
+ */
+void joybus_block_init(joybus_block_t *blk)
+{
+    memset(blk->data, 0, JOYBUS_BLOCK_SIZE);
+    blk->data[0] = 0xFE;
+    blk->data[JOYBUS_BLOCK_SIZE-1] = 0x01;
+    blk->pos = 0;
+    blk->channel = 0;
+}
+
+/**
+ * @brief Append a command to a joybus message block
+ *
+ * The PIF assigns each command in a block to the next channel, so commands
+ * must be appended in increasing channel order: channels that are skipped
+ * are filled with an empty (0x00) marker. Up to one command per channel can
+ * be packed in a single block, as long as the commands and their replies fit
+ * within it.
+ *
+ * The bytes reserved for the reply are filled with 0xFF, as expected by the
+ * PIF. After #joybus_exec_async, the reply will be found in the output block
+ * at the offset returned by this function.
+ *
+ * @param      blk       Block to append the command to
+ * @param[in]  channel   Channel (0-4 for the controller ports and the
+ *                       cartridge) the command is directed to
+ * @param[in]  send      Command bytes to send
+ * @param[in]  send_len  Number of bytes to send
+ * @param[in]  recv_len  Number of bytes of the reply
+ *
+ * @return Offset of the reply within the block, or -1 if the command does not
+ *         fit in the block (in which case the block is not modified)
+ */
+int joybus_block_add(joybus_block_t *blk, int channel, const void *send, int send_len, int recv_len)
+{
+    assertf(send_len > 0 && send_len < JOYBUS_BLOCK_SIZE && recv_len >= 0 && recv_len < JOYBUS_BLOCK_SIZE,
+        "invalid joybus command size: %d/%d", send_len, recv_len);
+
+    // Commands can only go to the channels after the last one used
+    if (channel < blk->channel)
+        return -1;
+
+    // Check that the command fits, leaving room for the end marker (the
+    // last byte of the block is reserved for the PIF control byte)
+    int pos = blk->pos + (channel - blk->channel);
+    int end = pos + 2 + send_len + recv_len;
+    if (end >= JOYBUS_BLOCK_SIZE-1)
+        return -1;
+
+    // Skip the channels in between, then write the command frame
+    memset(blk->data + blk->pos, 0x00, channel - blk->channel);
+    blk->data[pos++] = send_len;
+    blk->data[pos++] = recv_len;
+    memcpy(blk->data + pos, send, send_len);
+    pos += send_len;
+    memset(blk->data + pos, 0xFF, recv_len);
+
+    blk->data[end] = 0xFE;
+    blk->pos = end;
+    blk->channel = channel + 1;
+    return pos;
 }
 
 /** @} */ /* joybus */
@@ -1,6 +1,80 @@
 #ifndef __LIBDRAGON_JOYBUSINTERNAL_H
 #define __LIBDRAGON_JOYBUSINTERNAL_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include "joybus.h"
+#include "kernel.h"
+
+/** @brief Maximum number of pending joybus messages */
+#define MAX_JOYBUS_MSGS            16
+
+/** @brief Joybus priority: input polling, which must never wait for other traffic */
+#define JOYBUS_PRIORITY_INPUT          0
+/** @brief Joybus priority: default */
+#define JOYBUS_PRIORITY_DEFAULT        1
+/** @brief Joybus priority: bulk transfers and saves, that can run in background */
+#define JOYBUS_PRIORITY_BACKGROUND     2
+
+/** @brief A joybus message block being composed (see #joybus_block_add) */
+typedef struct {
+    uint8_t data[JOYBUS_BLOCK_SIZE];    ///< Block contents
+    int pos;                            ///< Offset of the end marker (where the next command goes)
+    int channel;                        ///< Next channel that can receive a command
+} joybus_block_t;
+
 void joybus_exec_async(const void * input, void (*callback)(uint64_t *output, void *ctx), void *ctx);
+void joybus_exec_async_priority(const void * input, void (*callback)(uint64_t *output, void *ctx), void *ctx, int priority);
+
+void joybus_block_init(joybus_block_t *blk);
+int joybus_block_add(joybus_block_t *blk, int channel, const void *send, int send_len, int recv_len);
+
+int accessory_block_add(joybus_block_t *blk, int controller, uint16_t address, const uint8_t *data, bool write);
+int accessory_block_reply(uint64_t *output, int reply, bool write, uint8_t **payload);
+
+/** @brief Maximum number of commands in flight for an accessory pipeline */
+#define ACCESSORY_PIPE_INFLIGHT    4
+
+typedef struct accessory_pipe_s accessory_pipe_t;
+
+/** @brief A 32-byte command of an accessory pipeline (see #accessory_pipe_start) */
+typedef struct {
+    accessory_pipe_t *pipe;     ///< Pipeline this command belongs to
+    uint32_t offset;            ///< Position of the data within the transfer
+    uint16_t address;           ///< 32-byte aligned accessory address
+    bool write;                 ///< True if this is a write command
+    bool done;                  ///< True once the command has completed
+    bool failed;                ///< True if the command failed
+    int retries;                ///< Number of times the command was resent
+    int reply;                  ///< Offset of the reply within the output block
+    uint8_t data[32];           ///< Data to write, or data read
+} accessory_pipe_cmd_t;
+
+/** @brief An accessory transfer with pipelined 32-byte commands (see #accessory_pipe_start) */
+struct accessory_pipe_s {
+    int controller;             ///< Controller (0-3) with the accessory
+    int max_retries;            ///< Number of times a command is resent on a data CRC mismatch
+    /** Prepare the next command, or return false if it cannot be issued yet */
+    bool (*next)(accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd);
+    /** Consume a successful command, in issue order (can be NULL) */
+    void (*retire)(accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd);
+    void *ctx;                  ///< Context of the callbacks
+    accessory_pipe_cmd_t cmds[ACCESSORY_PIPE_INFLIGHT]; ///< Commands in flight (ring, in issue order)
+    int head;                   ///< Oldest command in flight
+    volatile int count;         ///< Number of commands in flight
+    volatile int error;         ///< First error reported by the accessory (0 if none)
+    bool failed;                ///< A command failed: nothing more is issued or retired
+    bool stopping;              ///< Stop issuing commands (see #accessory_pipe_stop)
+    kevent_t event;             ///< Set whenever a command completes
+};
+
+void accessory_pipe_start(accessory_pipe_t *pipe, int controller, int max_retries,
+    bool (*next)(accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd),
+    void (*retire)(accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd), void *ctx);
+void accessory_pipe_pump(accessory_pipe_t *pipe);
+void accessory_pipe_stop(accessory_pipe_t *pipe);
+int accessory_pipe_wait(accessory_pipe_t *pipe);
+
+void eeprom_write_async(uint8_t block, const uint8_t *src, void (*callback)(uint64_t *output, void *ctx), void *ctx);
 
 #endif
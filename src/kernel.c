@@ -0,0 +1,561 @@
+/**
+ * @file kernel.c
+ * @brief Cooperative multithreading kernel
+ * @ingroup kernel
+ */
+#include <malloc.h>
+#include <string.h>
+#include "kernel.h"
+#include "interrupt.h"
+#include "n64sys.h"
+#include "cop0.h"
+#include "debug.h"
+
+/** @brief Value written at the bottom of each thread stack to detect overflows */
+#define KTHREAD_STACK_CANARY    0xDEADBEEF
+
+/** @brief Number of registers saved by a context switch (see kernel_switch.S) */
+#define KTHREAD_CTX_REGS        24
+/** @brief Index of the GP register in the saved context */
+#define KTHREAD_CTX_GP          8
+/** @brief Index of the SP register in the saved context */
+#define KTHREAD_CTX_SP          9
+/** @brief Index of the RA register in the saved context */
+#define KTHREAD_CTX_RA          11
+
+/** @brief Thread states */
+enum {
+    KTHREAD_READY,          ///< Running or ready to run
+    KTHREAD_WAITING,        ///< Waiting on a synchronization primitive
+    KTHREAD_SLEEPING,       ///< Sleeping until a deadline
+    KTHREAD_DEAD,           ///< Exited, waiting to be joined
+};
+
+/** @brief A thread */
+struct kthread_s {
+    /** @brief Callee-saved registers, saved by #__kthread_switch */
+    uint64_t ctx[KTHREAD_CTX_REGS];
+    /** @brief Name of the thread (for debugging) */
+    const char *name;
+    /** @brief Priority (higher runs first) */
+    int8_t pri;
+    /** @brief Current state */
+    uint8_t state;
+    /** @brief Stack memory (NULL for the main thread) */
+    uint8_t *stack;
+    /** @brief Entry point */
+    int (*user_entry)(void*);
+    /** @brief Argument of the entry point */
+    void *user_data;
+    /** @brief Exit code */
+    int result;
+    /** @brief Tick at which a sleeping thread must be woken up */
+    uint32_t wake_tick;
+    /** @brief Next thread in the list of all threads */
+    kthread_t *next;
+    /** @brief Next thread in the wait queue this thread is blocked on */
+    kthread_t *next_wait;
+    /** @brief Threads waiting for this thread to exit */
+    kthread_t *joiners;
+};
+
+/** @brief Save the current context in @p from and restore @p to (kernel_switch.S) */
+void __kthread_switch(uint64_t *from, uint64_t *to);
+
+/** @brief The main thread, running on the boot stack */
+static kthread_t th_main;
+/** @brief Currently running thread (NULL if the kernel is not initialized) */
+static kthread_t *th_cur;
+/** @brief List of all threads */
+static kthread_t *th_list;
+
+/**
+ * @brief Return true if the current context can switch to another thread
+ *
+ * Threads cannot be switched within interrupt handlers (including exception
+ * handlers) or with interrupts disabled. In these contexts, code that waits
+ * for an interrupt must busy-wait instead of calling the blocking functions,
+ * which would assert.
+ */
+bool kthread_can_switch(void)
+{
+    // Within interrupt handlers or with interrupts disabled, IE is off.
+    return (C0_STATUS() & C0_STATUS_IE) != 0;
+}
+
+/** @brief Sign-extend a 32-bit address, as it must be in a 64-bit register */
+static uint64_t kthread_reg(void *addr)
+{
+    return (uint64_t)(int64_t)(int32_t)(uint32_t)addr;
+}
+
+/**
+ * @brief Choose the next thread to run
+ *
+ * Picks the ready thread with highest priority, going round-robin among
+ * threads with the same priority. If @p yield is true, the current thread
+ * is picked only if no other thread is ready.
+ */
+static kthread_t *kthread_pick(bool yield)
+{
+    uint32_t now = TICKS_READ();
+    kthread_t *best = NULL;
+    kthread_t *th = th_cur;
+
+    do {
+        th = th->next ? th->next : th_list;
+        if (th->state == KTHREAD_SLEEPING && (int32_t)(now - th->wake_tick) >= 0)
+            th->state = KTHREAD_READY;
+        if (yield && th == th_cur)
+            continue;
+        if (th->state == KTHREAD_READY && (!best || th->pri > best->pri))
+            best = th;
+    } while (th != th_cur);
+
+    if (!best && th_cur->state == KTHREAD_READY)
+        best = th_cur;
+    return best;
+}
+
+/**
+ * @brief Switch to the next thread to run
+ *
+ * Must be called with interrupts disabled (exactly once). If no thread
+ * is ready, interrupts are serviced until one is woken up.
+ */
+static void kthread_schedule(bool yield)
+{
+    kthread_t *prev = th_cur, *next;
+
+    while (!(next = kthread_pick(yield))) {
+        // Every thread is blocked: let interrupts run, as they might
+        // wake up some thread.
+        enable_interrupts();
+        disable_interrupts();
+    }
+
+    if (next != prev) {
+        assertf(!prev->stack || *(uint32_t*)prev->stack == KTHREAD_STACK_CANARY,
+            "stack overflow in thread %s", prev->name);
+        th_cur = next;
+        __kthread_switch(prev->ctx, next->ctx);
+    }
+}
+
+/** @brief Block the current thread on a wait queue. Must be called with interrupts disabled. */
+static void kthread_block(kthread_t **queue)
+{
+    kthread_t **tail = queue;
+    while (*tail) tail = &(*tail)->next_wait;
+    *tail = th_cur;
+    th_cur->next_wait = NULL;
+    th_cur->state = KTHREAD_WAITING;
+    kthread_schedule(false);
+}
+
+/** @brief Wake up the first thread of a wait queue. Must be called with interrupts disabled. */
+static void kthread_wake_one(kthread_t **queue)
+{
+    kthread_t *th = *queue;
+    if (th) {
+        *queue = th->next_wait;
+        th->state = KTHREAD_READY;
+    }
+}
+
+/** @brief Wake up all the threads of a wait queue. Must be called with interrupts disabled. */
+static void kthread_wake_all(kthread_t **queue)
+{
+    while (*queue)
+        kthread_wake_one(queue);
+}
+
+/** @brief First function run by a new thread */
+static void kthread_entry(void)
+{
+    // The scheduler switched to this thread with interrupts disabled.
+    enable_interrupts();
+    kthread_exit(th_cur->user_entry(th_cur->user_data));
+}
+
+/**
+ * @brief Initialize the kernel
+ *
+ * The caller becomes the main thread, with priority 0. From now on, other
+ * threads can be created with #kthread_new.
+ */
+void kernel_init(void)
+{
+    assertf(!th_cur, "kernel already initialized");
+
+    memset(&th_main, 0, sizeof(th_main));
+    th_main.name = "main";
+    th_main.state = KTHREAD_READY;
+
+    disable_interrupts();
+    th_list = th_cur = &th_main;
+    enable_interrupts();
+}
+
+/**
+ * @brief Close the kernel
+ *
+ * All the threads created with #kthread_new must have been joined.
+ */
+void kernel_close(void)
+{
+    assertf(th_cur == &th_main, "kernel_close must be called by the main thread");
+    assertf(!th_main.next, "kernel_close called while other threads exist");
+
+    disable_interrupts();
+    th_list = th_cur = NULL;
+    enable_interrupts();
+}
+
+/**
+ * @brief Create a new thread
+ *
+ * The thread is ready to run, but being the kernel cooperative, it will
+ * only run once the current thread blocks or yields.
+ *
+ * @param[in] name          Name of the thread (for debugging)
+ * @param[in] stack_size    Size of the stack in bytes
+ * @param[in] pri           Priority. When more threads are ready to run,
+ *                          the one with highest priority runs first.
+ * @param[in] user_entry    Entry point of the thread. Returning from it is
+ *                          equivalent to calling #kthread_exit.
+ * @param[in] user_data     Argument passed to the entry point
+ *
+ * @return The new thread. It must be released with #kthread_join.
+ */
+kthread_t* kthread_new(const char *name, int stack_size, int8_t pri, int (*user_entry)(void*), void *user_data)
+{
+    assertf(th_cur, "kernel not initialized");
+    assertf(stack_size >= 1024, "stack too small: %d", stack_size);
+    stack_size = (stack_size + 15) & ~15;
+
+    kthread_t *th = malloc(sizeof(kthread_t));
+    assertf(th, "not enough memory for thread %s", name);
+    memset(th, 0, sizeof(kthread_t));
+    th->stack = memalign(16, stack_size);
+    assertf(th->stack, "not enough memory for the stack of thread %s (%d bytes)", name, stack_size);
+    *(uint32_t*)th->stack = KTHREAD_STACK_CANARY;
+
+    th->name = name;
+    th->pri = pri;
+    th->user_entry = user_entry;
+    th->user_data = user_data;
+    th->state = KTHREAD_READY;
+
+    // Prepare the context so that the first switch "returns" into kthread_entry,
+    // leaving space on the stack for the argument slots required by the ABI.
+    void *gp;
+    asm ("move %0, $gp" : "=r"(gp));
+    th->ctx[KTHREAD_CTX_GP] = kthread_reg(gp);
+    th->ctx[KTHREAD_CTX_SP] = kthread_reg(th->stack + stack_size - 64);
+    th->ctx[KTHREAD_CTX_RA] = kthread_reg(kthread_entry);
+
+    disable_interrupts();
+    kthread_t **tail = &th_list;
+    while (*tail) tail = &(*tail)->next;
+    *tail = th;
+    enable_interrupts();
+
+    return th;
+}
+
+/**
+ * @brief Wait for a thread to exit, and release it
+ *
+ * @param[in] th    Thread to wait for
+ * @return The exit code of the thread
+ */
+int kthread_join(kthread_t *th)
+{
+    assertf(th != th_cur, "a thread cannot join itself");
+    assertf(th != &th_main, "the main thread cannot be joined");
+    assertf(kthread_can_switch(), "kthread_join called with interrupts disabled");
+
+    disable_interrupts();
+    while (th->state != KTHREAD_DEAD)
+        kthread_block(&th->joiners);
+
+    kthread_t **prev = &th_list;
+    while (*prev != th) prev = &(*prev)->next;
+    *prev = th->next;
+    enable_interrupts();
+
+    int result = th->result;
+    free(th->stack);
+    free(th);
+    return result;
+}
+
+/**
+ * @brief Exit the current thread
+ *
+ * The thread resources are released by #kthread_join.
+ *
+ * @param[in] result    Exit code, returned by #kthread_join
+ */
+void kthread_exit(int result)
+{
+    assertf(th_cur && th_cur != &th_main, "the main thread cannot exit");
+
+    disable_interrupts();
+    th_cur->result = result;
+    th_cur->state = KTHREAD_DEAD;
+    kthread_wake_all(&th_cur->joiners);
+    kthread_schedule(false);
+    __builtin_unreachable();
+}
+
+/**
+ * @brief Give the CPU to other threads that are ready to run
+ *
+ * Other ready threads run even if they have lower priority than the
+ * current one: this allows to use this function in busy-wait loops.
+ * If no other thread is ready, this function returns immediately.
+ *
+ * This function does nothing if the kernel is not initialized, or if called
+ * with interrupts disabled (including from an interrupt handler).
+ */
+void kthread_yield(void)
+{
+    if (!th_cur || !kthread_can_switch())
+        return;
+
+    disable_interrupts();
+    kthread_schedule(true);
+    enable_interrupts();
+}
+
+/**
+ * @brief Suspend the current thread for the specified time
+ *
+ * If the kernel is not initialized, this busy-waits.
+ *
+ * @param[in] ticks     Time to sleep, in CPU ticks (see #TICKS_FROM_MS)
+ */
+void kthread_sleep(uint32_t ticks)
+{
+    if (!th_cur) {
+        wait_ticks(ticks);
+        return;
+    }
+    assertf(kthread_can_switch(), "kthread_sleep called with interrupts disabled");
+
+    disable_interrupts();
+    th_cur->wake_tick = TICKS_READ() + ticks;
+    th_cur->state = KTHREAD_SLEEPING;
+    kthread_schedule(false);
+    enable_interrupts();
+}
+
+/**
+ * @brief Return the current thread
+ *
+ * @return The current thread, or NULL if the kernel is not initialized
+ */
+kthread_t* kthread_current(void)
+{
+    return th_cur;
+}
+
+/**
+ * @brief Return the name of a thread
+ *
+ * @param[in] th    Thread
+ * @return The name passed to #kthread_new
+ */
+const char* kthread_name(kthread_t *th)
+{
+    return th->name;
+}
+
+/**
+ * @brief Initialize a mutex
+ *
+ * A zero-initialized mutex is also valid.
+ *
+ * @param[out] mutex    Mutex to initialize
+ */
+void kmutex_init(kmutex_t *mutex)
+{
+    memset(mutex, 0, sizeof(kmutex_t));
+}
+
+/**
+ * @brief Lock a mutex, waiting until it is available
+ *
+ * Mutexes are not recursive: locking a mutex already owned by the current
+ * thread is an error.
+ *
+ * @param[in] mutex     Mutex to lock
+ */
+void kmutex_lock(kmutex_t *mutex)
+{
+    kthread_t *self = th_cur ? th_cur : &th_main;
+    assertf(kthread_can_switch(), "kmutex_lock called with interrupts disabled");
+
+    disable_interrupts();
+    while (mutex->owner) {
+        assertf(mutex->owner != self, "recursive lock of mutex %p", mutex);
+        assertf(th_cur, "deadlock: mutex %p is locked and there are no threads", mutex);
+        kthread_block(&mutex->waiters);
+    }
+    mutex->owner = self;
+    enable_interrupts();
+}
+
+/**
+ * @brief Try to lock a mutex, without waiting
+ *
+ * @param[in] mutex     Mutex to lock
+ * @return True if the mutex was locked, false if it is owned by another thread
+ */
+bool kmutex_try_lock(kmutex_t *mutex)
+{
+    bool locked = false;
+
+    disable_interrupts();
+    if (!mutex->owner) {
+        mutex->owner = th_cur ? th_cur : &th_main;
+        locked = true;
+    }
+    enable_interrupts();
+    return locked;
+}
+
+/**
+ * @brief Unlock a mutex
+ *
+ * @param[in] mutex     Mutex to unlock. It must be owned by the current thread.
+ */
+void kmutex_unlock(kmutex_t *mutex)
+{
+    disable_interrupts();
+    assertf(mutex->owner == (th_cur ? th_cur : &th_main), "mutex %p not owned by the current thread", mutex);
+    mutex->owner = NULL;
+    kthread_wake_one(&mutex->waiters);
+    enable_interrupts();
+}
+
+/**
+ * @brief Initialize a condition variable
+ *
+ * A zero-initialized condition variable is also valid.
+ *
+ * @param[out] cond     Condition variable to initialize
+ */
+void kcond_init(kcond_t *cond)
+{
+    memset(cond, 0, sizeof(kcond_t));
+}
+
+/**
+ * @brief Wait on a condition variable
+ *
+ * The mutex is atomically released while waiting, and locked again before
+ * returning. As usual with condition variables, the condition must be
+ * checked again after returning, in a loop.
+ *
+ * @param[in] cond      Condition variable to wait on
+ * @param[in] mutex     Mutex protecting the condition, owned by the current thread
+ */
+void kcond_wait(kcond_t *cond, kmutex_t *mutex)
+{
+    assertf(th_cur, "kcond_wait requires the kernel to be initialized");
+    assertf(kthread_can_switch(), "kcond_wait called with interrupts disabled");
+
+    disable_interrupts();
+    assertf(mutex->owner == th_cur, "mutex %p not owned by the current thread", mutex);
+    mutex->owner = NULL;
+    kthread_wake_one(&mutex->waiters);
+    kthread_block(&cond->waiters);
+    enable_interrupts();
+
+    kmutex_lock(mutex);
+}
+
+/**
+ * @brief Wake up one thread waiting on a condition variable
+ *
+ * This function can be called from interrupt handlers.
+ *
+ * @param[in] cond      Condition variable
+ */
+void kcond_signal(kcond_t *cond)
+{
+    disable_interrupts();
+    kthread_wake_one(&cond->waiters);
+    enable_interrupts();
+}
+
+/**
+ * @brief Wake up all the threads waiting on a condition variable
+ *
+ * This function can be called from interrupt handlers.
+ *
+ * @param[in] cond      Condition variable
+ */
+void kcond_broadcast(kcond_t *cond)
+{
+    disable_interrupts();
+    kthread_wake_all(&cond->waiters);
+    enable_interrupts();
+}
+
+/**
+ * @brief Initialize an event (not set)
+ *
+ * A zero-initialized event is also valid.
+ *
+ * @param[out] event    Event to initialize
+ */
+void kevent_init(kevent_t *event)
+{
+    memset(event, 0, sizeof(kevent_t));
+}
+
+/**
+ * @brief Set an event, waking up the threads waiting for it
+ *
+ * This function can be called from interrupt handlers. If multiple threads
+ * are waiting, only the first one that runs will see the event set, and
+ * the others will go back waiting.
+ *
+ * @param[in] event     Event to set
+ */
+void kevent_set(kevent_t *event)
+{
+    disable_interrupts();
+    event->signaled = true;
+    kthread_wake_all(&event->waiters);
+    enable_interrupts();
+}
+
+/**
+ * @brief Wait for an event to be set, and reset it
+ *
+ * If the event is already set, this function returns immediately.
+ *
+ * @param[in] event     Event to wait for
+ */
+void kevent_wait(kevent_t *event)
+{
+    assertf(kthread_can_switch(), "kevent_wait called with interrupts disabled");
+
+    disable_interrupts();
+    while (!event->signaled) {
+        if (th_cur) {
+            kthread_block(&event->waiters);
+        } else {
+            // No other threads: just let the interrupts run
+            enable_interrupts();
+            disable_interrupts();
+        }
+    }
+    event->signaled = false;
+    enable_interrupts();
+}
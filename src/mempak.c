@@ -4,8 +4,10 @@
  * @ingroup mempak
  */
 #include <string.h>
+#include <malloc.h>
 #include "libdragon.h"
 #include "regsinternal.h"
+#include "joybusinternal.h"
 
 /**
  * @defgroup mempak Mempak Filesystem Routines
@@ -27,6 +29,19 @@
  * first using #delete_mempak_entry.  Code should be careful to check how many blocks
  * are free before writing using #get_mempak_free_space.
  *
+ * Each of these functions reads and validates the filesystem structures (header,
+ * TOC and note table) before operating, and writes back the ones it changed, so
+ * that the mempak can be swapped at any time between calls. When performing
+ * several operations in a row (eg: a save menu listing and writing notes), wrap
+ * them between #mempak_batch_begin and #mempak_batch_end: the filesystem
+ * structures are then read once at the beginning and cached, and the changed
+ * sectors are written back once at the end. Raw sector accesses
+ * (#read_mempak_sector, #write_mempak_sector) bypass the cache.
+ *
+ * To back up or restore a whole mempak, use #mempak_backup_begin and
+ * #mempak_restore_begin. The transfer runs in background, and its progress
+ * can be queried with #mempak_image_progress while doing other work.
+ *
  * @{
  */
 
@@ -45,6 +60,24 @@
 #define BLOCK_VALID_LAST    0x7F
 /** @} */
 
+/** @brief Number of times an image transfer command is retried on a data CRC mismatch */
+#define MEMPAK_IMAGE_RETRIES    3
+
+/** @brief State of a whole mempak image transfer (see #mempak_backup_begin) */
+struct mempak_image_s
+{
+    /** @brief Image buffer (#MEMPAK_IMAGE_SIZE bytes) */
+    uint8_t *data;
+    /** @brief True for a restore, false for a backup */
+    bool write;
+    /** @brief Number of bytes requested so far */
+    uint32_t issued;
+    /** @brief Number of bytes transferred so far */
+    volatile uint32_t done;
+    /** @brief Accessory pipeline running the commands */
+    accessory_pipe_t pipe;
+};
+
 /**
  * @brief Read a sector from a mempak
  *
@@ -68,13 +101,10 @@ int read_mempak_sector( int controller, int sector, uint8_t *sector_data )
     if( sector_data == 0 ) { return -1; }
 
     /* Sectors are 256 bytes, a mempak reads 32 bytes at a time */
-    for( int i = 0; i < 8; i++ )
+    if( read_mempak_bulk( controller, sector * MEMPAK_BLOCK_SIZE, sector_data, MEMPAK_BLOCK_SIZE ) )
     {
-        if( read_mempak_address( controller, (sector * MEMPAK_BLOCK_SIZE) + (i * 32), sector_data + (i * 32) ) )
-        {
-            /* Failed to read a block */
-            return -2;
-        }
+        /* Failed to read a block */
+        return -2;
     }
 
     return 0;
@@ -103,13 +133,10 @@ int write_mempak_sector( int controller, int sector, uint8_t *sector_data )
     if( sector_data == 0 ) { return -1; }
 
     /* Sectors are 256 bytes, a mempak writes 32 bytes at a time */
-    for( int i = 0; i < 8; i++ )
+    if( write_mempak_bulk( controller, sector * MEMPAK_BLOCK_SIZE, sector_data, MEMPAK_BLOCK_SIZE ) )
     {
-        if( write_mempak_address( controller, (sector * MEMPAK_BLOCK_SIZE) + (i * 32), sector_data + (i * 32) ) )
-        {
-            /* Failed to read a block */
-            return -2;
-        }
+        /* Failed to write a block */
+        return -2;
     }
 
     return 0;
@@ -642,9 +669,27 @@ static int __get_note_block( uint8_t *sector, int inode, int block )
     return -3;
 }
 
+/** @brief Cached filesystem structures of a mempak */
+typedef struct {
+    int toc;                                ///< Valid TOC sector (1 or 2), or 0 if the cache is not loaded
+    bool batch;                             ///< True if a batch is open (see #mempak_batch_begin)
+    bool toc_dirty;                         ///< True if the TOC must be written back
+    uint16_t notes_dirty;                   ///< Bitmask of note entries that must be written back
+    uint16_t notes_deleted;                 ///< Bitmask of dirty note entries that were deleted
+    uint8_t toc_data[MEMPAK_BLOCK_SIZE];    ///< Contents of the valid TOC
+    uint8_t notes[2 * MEMPAK_BLOCK_SIZE];   ///< Note table (sectors 3 and 4)
+} mempak_cache_t;
+
+/** @brief Filesystem cache for each controller */
+static mempak_cache_t mempak_cache[4];
+
 /**
  * @brief Retrieve the sector number of the first valid TOC found
  *
+ * This also loads the TOC and the note table into the cache of the controller.
+ * Outside of a batch, the filesystem structures are always read again from
+ * the mempak, as it might have been swapped since the last call.
+ *
  * @param[in] controller
  *            The controller (0-3) to inspect for a valid TOC
  *
@@ -655,11 +700,18 @@ static int __get_note_block( uint8_t *sector, int inode, int block )
  */
 static int __get_valid_toc( int controller )
 {
-    /* We will need only one sector at a time */
-    uint8_t data[MEMPAK_BLOCK_SIZE];
+    /* We will need the header and a TOC */
+    uint8_t data[2 * MEMPAK_BLOCK_SIZE];
+    int toc = 1;
+
+    if( controller < 0 || controller > 3 ) { return -2; }
 
-    /* First check to see that the header block is valid */
-    if( read_mempak_sector( controller, 0, data ) )
+    mempak_cache_t *cache = &mempak_cache[controller];
+    if( cache->toc && cache->batch ) { return cache->toc; }
+    cache->toc = 0;
+
+    /* Read the header block and the first TOC at once */
+    if( read_mempak_bulk( controller, 0, data, 2 * MEMPAK_BLOCK_SIZE ) )
     {
         /* Couldn't read header */
         return -2;
@@ -671,38 +723,195 @@ static int __get_valid_toc( int controller )
         return -3;
     }
 
-    /* Try to read the first TOC */
-    if( read_mempak_sector( controller, 1, data ) )
-    {
-        /* Couldn't read header */
-        return -2;
-    }
-
-    if( __validate_toc( data ) )
+    if( __validate_toc( &data[MEMPAK_BLOCK_SIZE] ) )
     {
         /* First TOC is bad.  Maybe the second works? */
-        if( read_mempak_sector( controller, 2, data ) )
+        if( read_mempak_sector( controller, 2, &data[MEMPAK_BLOCK_SIZE] ) )
         {
             /* Couldn't read header */
             return -2;
         }
 
-        if( __validate_toc( data ) )
+        if( __validate_toc( &data[MEMPAK_BLOCK_SIZE] ) )
         {
             /* Second TOC is bad, nothing good on this memcard */
             return -3;
         }
-        else
+
+        toc = 2;
+    }
+
+    /* Grab the whole note table */
+    if( read_mempak_bulk( controller, 3 * MEMPAK_BLOCK_SIZE, cache->notes, 2 * MEMPAK_BLOCK_SIZE ) )
+    {
+        /* Couldn't read note database */
+        return -2;
+    }
+
+    memcpy( cache->toc_data, &data[MEMPAK_BLOCK_SIZE], MEMPAK_BLOCK_SIZE );
+    cache->toc_dirty = false;
+    cache->notes_dirty = 0;
+    cache->notes_deleted = 0;
+    cache->toc = toc;
+
+    /* Found a good TOC! */
+    return toc;
+}
+
+/**
+ * @brief Write back the dirty note entries of a mempak
+ *
+ * @param[in] controller
+ *            The controller (0-3) to write the note entries to
+ * @param[in] deleted
+ *            True to write back only deleted entries, false for all the others
+ *
+ * @retval 0 if the entries were written successfully
+ * @retval -2 if the mempak was not present or couldn't be written
+ */
+static int __flush_notes( int controller, bool deleted )
+{
+    mempak_cache_t *cache = &mempak_cache[controller];
+
+    for( int i = 0; i < 16; i++ )
+    {
+        uint16_t bit = 1 << i;
+        if( !(cache->notes_dirty & bit) ) { continue; }
+        if( ((cache->notes_deleted & bit) != 0) != deleted ) { continue; }
+
+        if( write_mempak_address( controller, (3 * MEMPAK_BLOCK_SIZE) + (i * 32), &cache->notes[i * 32] ) )
         {
-            /* Found a good TOC! */
-            return 2;
+            /* Couldn't update note database */
+            return -2;
         }
+
+        cache->notes_dirty &= ~bit;
     }
-    else
+
+    return 0;
+}
+
+/**
+ * @brief Write back the cached filesystem structures of a mempak
+ *
+ * Only the changed note entries and TOC are written. Deleted notes are written
+ * before the TOC and new notes after it, so that a note never points to free
+ * blocks if the mempak is removed halfway.
+ *
+ * @param[in] controller
+ *            The controller (0-3) to write back
+ *
+ * @retval 0 if the mempak was updated successfully
+ * @retval -2 if the mempak was not present or couldn't be written
+ */
+static int __flush_cache( int controller )
+{
+    mempak_cache_t *cache = &mempak_cache[controller];
+
+    if( __flush_notes( controller, true ) ) { goto error; }
+
+    if( cache->toc_dirty )
+    {
+        /* Write back to alternate TOC first before erasing the known valid one */
+        if( write_mempak_sector( controller, ( cache->toc == 1 ) ? 2 : 1, cache->toc_data ) ||
+            write_mempak_sector( controller, cache->toc, cache->toc_data ) )
+        {
+            /* Failed to write TOC */
+            goto error;
+        }
+
+        cache->toc_dirty = false;
+    }
+
+    if( __flush_notes( controller, false ) ) { goto error; }
+
+    return 0;
+
+error:
+    /* The contents of the mempak are now unknown */
+    cache->toc = 0;
+    cache->toc_dirty = false;
+    cache->notes_dirty = 0;
+    return -2;
+}
+
+/**
+ * @brief Complete an operation that changed the cached filesystem structures
+ *
+ * Outside of a batch, the changes are written back immediately.
+ *
+ * @param[in] controller
+ *            The controller (0-3) that was changed
+ *
+ * @retval 0 if the changes were written successfully (or deferred)
+ * @retval -2 if the mempak was not present or couldn't be written
+ */
+static int __commit_cache( int controller )
+{
+    if( mempak_cache[controller].batch ) { return 0; }
+
+    return __flush_cache( controller );
+}
+
+/**
+ * @brief Begin a batch of mempak operations
+ *
+ * Until #mempak_batch_end is called, the filesystem structures of the mempak
+ * are read only once and kept in memory, and the changes to them are written
+ * back only by #mempak_batch_end. This makes a sequence of operations (eg:
+ * listing all the entries and writing a couple of new ones) much faster.
+ *
+ * The mempak must not be removed until the batch is ended.
+ *
+ * @param[in] controller
+ *            The controller (0-3) to begin the batch on
+ *
+ * @retval 0 if the mempak is valid and the batch was started
+ * @retval -2 if the mempak is not present or couldn't be read
+ * @retval -3 if the mempak is bad or unformatted
+ */
+int mempak_batch_begin( int controller )
+{
+    if( controller < 0 || controller > 3 ) { return -2; }
+
+    mempak_cache_t *cache = &mempak_cache[controller];
+    assertf( !cache->batch, "mempak batch already open on controller %d", controller );
+
+    cache->toc = 0;
+    cache->batch = true;
+
+    int toc = __get_valid_toc( controller );
+    if( toc < 0 )
     {
-        /* Found a good TOC! */
-        return 1;
+        cache->batch = false;
+        return toc;
     }
+
+    return 0;
+}
+
+/**
+ * @brief End a batch of mempak operations
+ *
+ * Writes back all the filesystem structures changed since #mempak_batch_begin.
+ *
+ * @param[in] controller
+ *            The controller (0-3) to end the batch on
+ *
+ * @retval 0 if the changes were written successfully
+ * @retval -2 if the mempak was not present or couldn't be written
+ */
+int mempak_batch_end( int controller )
+{
+    if( controller < 0 || controller > 3 ) { return -2; }
+
+    mempak_cache_t *cache = &mempak_cache[controller];
+    assertf( cache->batch, "mempak batch not open on controller %d", controller );
+
+    int ret = cache->toc ? __flush_cache( controller ) : 0;
+    cache->batch = false;
+    cache->toc = 0;
+    return ret;
 }
 
 /**
@@ -753,7 +962,6 @@ int validate_mempak( int controller )
  */
 int get_mempak_entry( int controller, int entry, entry_structure_t *entry_data )
 {
-    uint8_t data[MEMPAK_BLOCK_SIZE];
     int toc;
 
     if( entry < 0 || entry > 15 ) { return -1; }
@@ -766,29 +974,15 @@ int get_mempak_entry( int controller, int entry, entry_structure_t *entry_data )
         return -2;
     }
 
-    /* Entries are spread across two sectors, but we can luckly grab just one
-       with a single mempak read */
-    if( read_mempak_address( controller, (3 * MEMPAK_BLOCK_SIZE) + (entry * 32), data ) )
-    {
-        /* Couldn't read note database */
-        return -2;
-    }
-
-    if( __read_note( data, entry_data ) )
+    /* Entries are in the cached note table */
+    if( __read_note( &mempak_cache[controller].notes[entry * 32], entry_data ) )
     {
         /* Note is most likely empty, don't bother getting length */
         return 0;
     }
 
-    /* Grab the TOC sector */
-    if( read_mempak_sector( controller, toc, data ) )
-    {
-        /* Couldn't read TOC */
-        return -2;
-    }
-
     /* Get the length of the entry */
-    int blocks = __get_num_pages( data, entry_data->inode );
+    int blocks = __get_num_pages( mempak_cache[controller].toc_data, entry_data->inode );
 
     if( blocks > 0 )
     {
@@ -818,24 +1012,14 @@ int get_mempak_entry( int controller, int entry, entry_structure_t *entry_data )
  */
 int get_mempak_free_space( int controller )
 {
-    uint8_t data[MEMPAK_BLOCK_SIZE];
-    int toc;
-
     /* Make sure mempak is valid */
-    if( (toc = __get_valid_toc( controller )) <= 0 )
+    if( __get_valid_toc( controller ) <= 0 )
     {
         /* Bad mempak or was removed, return */
         return -2;
     }
 
-    /* Grab the valid TOC to get free space */
-    if( read_mempak_sector( controller, toc, data ) )
-    {
-        /* Couldn't read TOC */
-        return -2;
-    }
-
-    return __get_free_space( data );
+    return __get_free_space( mempak_cache[controller].toc_data );
 }
 
 /**
@@ -889,6 +1073,11 @@ int format_mempak( int controller )
                             0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
                             0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00 };
 
+    if( controller < 0 || controller > 3 ) { return -2; }
+
+    /* Drop the cached filesystem (including pending changes of a batch) */
+    mempak_cache[controller].toc = 0;
+
     if( write_mempak_sector( controller, 0, sector ) )
     {
         /* Couldn't write initial sector */
@@ -948,8 +1137,6 @@ int format_mempak( int controller )
  */
 int read_mempak_entry_data( int controller, entry_structure_t *entry, uint8_t *data )
 {
-    int toc;
-    uint8_t tocdata[MEMPAK_BLOCK_SIZE];
 
     /* Some serious sanity checking */
     if( entry == 0 || data == 0 ) { return -1; }
@@ -958,18 +1145,13 @@ int read_mempak_entry_data( int controller, entry_structure_t *entry, uint8_t *d
     if( entry->inode < BLOCK_VALID_FIRST || entry->inode > BLOCK_VALID_LAST ) { return -1; }
 
     /* Grab the TOC sector so we can get to the individual blocks the data comprises of */
-    if( (toc = __get_valid_toc( controller )) <= 0 )
+    if( __get_valid_toc( controller ) <= 0 )
     {
         /* Bad mempak or was removed, return */
         return -2;
     }
 
-    /* Grab the valid TOC to get free space */
-    if( read_mempak_sector( controller, toc, tocdata ) )
-    {
-        /* Couldn't read TOC */
-        return -2;
-    }
+    uint8_t *tocdata = mempak_cache[controller].toc_data;
 
     /* Now loop through blocks and grab each one */
     for( int i = 0; i < entry->blocks; i++ )
@@ -1012,8 +1194,6 @@ int read_mempak_entry_data( int controller, entry_structure_t *entry, uint8_t *d
 int write_mempak_entry_data( int controller, entry_structure_t *entry, uint8_t *data )
 {
     uint8_t sector[MEMPAK_BLOCK_SIZE];
-    uint8_t tmp_data[32];
-    int toc;
 
     /* Sanity checking on input data */
     if( !entry || !data ) { return -1; }
@@ -1022,18 +1202,15 @@ int write_mempak_entry_data( int controller, entry_structure_t *entry, uint8_t *
     if( strlen( entry->name ) == 0 ) { return -1; }
 
     /* Grab valid TOC */
-    if( (toc = __get_valid_toc( controller )) <= 0 )
+    if( __get_valid_toc( controller ) <= 0 )
     {
         /* Bad mempak or was removed, return */
         return -2;
     }
 
-    /* Grab the valid TOC to get free space */
-    if( read_mempak_sector( controller, toc, sector ) )
-    {
-        /* Couldn't read TOC */
-        return -2;
-    }
+    /* Work on a copy of the TOC, so that the cache is unaffected on failure */
+    mempak_cache_t *cache = &mempak_cache[controller];
+    memcpy( sector, cache->toc_data, MEMPAK_BLOCK_SIZE );
 
     /* Verify that we have enough free space */
     if( __get_free_space( sector ) < entry->blocks )
@@ -1097,14 +1274,8 @@ int write_mempak_entry_data( int controller, entry_structure_t *entry, uint8_t *
     {
         entry_structure_t tmp_entry;
 
-        if( read_mempak_address( controller, (3 * MEMPAK_BLOCK_SIZE) + (i * 32), tmp_data ) )
-        {
-            /* Couldn't read note database */
-            return -2;
-        }
-
         /* See if we can write to this note */
-        __read_note( tmp_data, &tmp_entry );
+        __read_note( &cache->notes[i * 32], &tmp_entry );
         if( tmp_entry.valid == 0 )
         {
             entry->entry_id = i;
@@ -1121,32 +1292,16 @@ int write_mempak_entry_data( int controller, entry_structure_t *entry, uint8_t *
 
     /* Update CRC on newly updated TOC */
     sector[1] = __get_toc_checksum( sector );
+    memcpy( cache->toc_data, sector, MEMPAK_BLOCK_SIZE );
+    cache->toc_dirty = true;
 
-    /* Write back to alternate TOC first before erasing the known valid one */
-    if( write_mempak_sector( controller, ( toc == 1 ) ? 2 : 1, sector ) )
-    {
-        /* Failed to write alternate TOC */
-        return -2;
-    }
-
-    /* Write back to good TOC now that alternate is updated */
-    if( write_mempak_sector( controller, toc, sector ) )
-    {
-        /* Failed to write alternate TOC */
-        return -2;
-    }
-
-    /* Convert entry structure to proper entry data */
-    __write_note( entry, tmp_data );
-
-    /* Store entry to empty slot on mempak */
-    if( write_mempak_address( controller, (3 * MEMPAK_BLOCK_SIZE) + (entry->entry_id * 32), tmp_data ) )
-    {
-        /* Couldn't update note database */
-        return -2;
-    }
+    /* Convert entry structure to proper entry data, in the empty slot */
+    __write_note( entry, &cache->notes[entry->entry_id * 32] );
+    cache->notes_dirty |= 1 << entry->entry_id;
+    cache->notes_deleted &= ~(1 << entry->entry_id);
 
-    return 0;
+    /* Write back the TOC and the entry */
+    return __commit_cache( controller );
 }
 
 /**
@@ -1168,7 +1323,6 @@ int delete_mempak_entry( int controller, entry_structure_t *entry )
 {
     entry_structure_t tmp_entry;
     uint8_t data[MEMPAK_BLOCK_SIZE];
-    int toc;
 
     /* Some serious sanity checking */
     if( entry == 0 ) { return -1; }
@@ -1176,14 +1330,17 @@ int delete_mempak_entry( int controller, entry_structure_t *entry )
     if( entry->entry_id > 15 ) { return -1; }
     if( entry->inode < BLOCK_VALID_FIRST || entry->inode > BLOCK_VALID_LAST ) { return -1; }
 
-    /* Ensure that the entry passed in matches what's on the mempak */
-    if( read_mempak_address( controller, (3 * MEMPAK_BLOCK_SIZE) + (entry->entry_id * 32), data ) )
+    /* Grab the first valid TOC entry */
+    if( __get_valid_toc( controller ) <= 0 )
     {
-        /* Couldn't read note database */
+        /* Bad mempak or was removed, return */
         return -2;
     }
 
-    if( __read_note( data, &tmp_entry ) )
+    mempak_cache_t *cache = &mempak_cache[controller];
+
+    /* Ensure that the entry passed in matches what's on the mempak */
+    if( __read_note( &cache->notes[entry->entry_id * 32], &tmp_entry ) )
     {
         /* Couldn't parse entry, can't be valid */
         return -2;
@@ -1195,27 +1352,8 @@ int delete_mempak_entry( int controller, entry_structure_t *entry )
         return -2;
     }
 
-    /* The entry matches, so blank it */
-    memset( data, 0, 32 );
-    if( write_mempak_address( controller, (3 * MEMPAK_BLOCK_SIZE) + (entry->entry_id * 32), data ) )
-    {
-        /* Couldn't update note database */
-        return -2;
-    }
-
-    /* Grab the first valid TOC entry */
-    if( (toc = __get_valid_toc( controller )) <= 0 )
-    {
-        /* Bad mempak or was removed, return */
-        return -2;
-    }
-
-    /* Grab the valid TOC to erase sectors */
-    if( read_mempak_sector( controller, toc, data ) )
-    {
-        /* Couldn't read TOC */
-        return -2;
-    }
+    /* Work on a copy of the TOC, so that the cache is unaffected on failure */
+    memcpy( data, cache->toc_data, MEMPAK_BLOCK_SIZE );
 
     /* Erase all blocks out of the TOC */
     int tally = 0;
@@ -1253,22 +1391,194 @@ int delete_mempak_entry( int controller, entry_structure_t *entry )
 
     /* Update CRC on newly updated TOC */
     data[1] = __get_toc_checksum( data );
+    memcpy( cache->toc_data, data, MEMPAK_BLOCK_SIZE );
+    cache->toc_dirty = true;
 
-    /* Write back to alternate TOC first before erasing the known valid one */
-    if( write_mempak_sector( controller, ( toc == 1 ) ? 2 : 1, data ) )
-    {
-        /* Failed to write alternate TOC */
-        return -2;
-    }
+    /* The entry matches, so blank it */
+    memset( &cache->notes[entry->entry_id * 32], 0, 32 );
+    cache->notes_dirty |= 1 << entry->entry_id;
+    cache->notes_deleted |= 1 << entry->entry_id;
 
-    /* Write back to good TOC now that alternate is updated */
-    if( write_mempak_sector( controller, toc, data ) )
-    {
-        /* Failed to write alternate TOC */
-        return -2;
-    }
+    /* Write back the entry and the TOC */
+    return __commit_cache( controller );
+}
 
+/**
+ * @brief Check that a mempak image contains a valid filesystem
+ *
+ * @param[in] data
+ *            Image of the whole mempak
+ *
+ * @retval 0 if the header and at least one TOC are valid
+ * @retval -3 if the image is bad or unformatted
+ */
+static int __validate_image( uint8_t *data )
+{
+    if( __validate_header( data ) ) { return -3; }
+    if( __validate_toc( &data[1 * MEMPAK_BLOCK_SIZE] ) &&
+        __validate_toc( &data[2 * MEMPAK_BLOCK_SIZE] ) ) { return -3; }
     return 0;
 }
 
+/**
+ * @brief Prepare the next command of a mempak image transfer
+ */
+static bool __image_next( accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd )
+{
+    mempak_image_t *image = pipe->ctx;
+    if( image->issued >= MEMPAK_IMAGE_SIZE ) { return false; }
+
+    cmd->offset = image->issued;
+    cmd->address = image->issued;
+    cmd->write = image->write;
+    if( image->write ) { memcpy( cmd->data, image->data + image->issued, 32 ); }
+    image->issued += 32;
+    return true;
+}
+
+/**
+ * @brief Consume a completed command of a mempak image transfer (called under interrupt)
+ */
+static void __image_retire( accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd )
+{
+    mempak_image_t *image = pipe->ctx;
+    if( !image->write ) { memcpy( image->data + cmd->offset, cmd->data, 32 ); }
+    image->done += 32;
+}
+
+/**
+ * @brief Start a mempak image transfer
+ *
+ * @return The new transfer, or NULL if there was not enough memory
+ */
+static mempak_image_t *__image_begin( int controller, uint8_t *data, bool write )
+{
+    mempak_image_t *image = malloc( sizeof(mempak_image_t) );
+    if( !image ) { return NULL; }
+
+    image->data = data;
+    image->write = write;
+    image->issued = 0;
+    image->done = 0;
+    accessory_pipe_start( &image->pipe, controller, MEMPAK_IMAGE_RETRIES, __image_next, __image_retire, image );
+    return image;
+}
+
+/**
+ * @brief Start a backup of a whole mempak
+ *
+ * The mempak is read in background into the image buffer, with the joybus
+ * commands pipelined back to back at background priority, so that they never
+ * delay controller polling. Each 32-byte block is verified with its data CRC
+ * as it arrives, and read again up to #MEMPAK_IMAGE_RETRIES times in case of
+ * mismatch.
+ *
+ * Use #mempak_image_progress to follow the transfer, and call #mempak_image_end
+ * to wait for its completion and check the result. The image buffer must stay
+ * valid until then.
+ *
+ * @param[out] image
+ *             Set to the new transfer, if started
+ * @param[in]  controller
+ *             The controller (0-3) with the mempak to back up
+ * @param[out] data
+ *             Buffer of #MEMPAK_IMAGE_SIZE bytes where the image is read
+ *
+ * @retval 0 if the backup was started
+ * @retval -1 if the controller is out of range, or image or data is null
+ * @retval -4 if there was not enough memory to start the transfer
+ */
+int mempak_backup_begin( mempak_image_t **image, int controller, uint8_t *data )
+{
+    if( image == 0 || data == 0 ) { return -1; }
+    if( controller < 0 || controller > 3 ) { return -1; }
+
+    *image = __image_begin( controller, data, false );
+    return *image ? 0 : -4;
+}
+
+/**
+ * @brief Start a restore of a whole mempak
+ *
+ * The image is checked to contain a valid filesystem (header and TOC
+ * checksums) before anything is written. It is then written in background,
+ * with the joybus commands pipelined back to back at background priority.
+ * The mempak acknowledges each 32-byte block with its data CRC, and blocks
+ * with a mismatching CRC are written again.
+ *
+ * Use #mempak_image_progress to follow the transfer, and call #mempak_image_end
+ * to wait for its completion and check the result. The image buffer must stay
+ * valid until then. No batch (see #mempak_batch_begin) can be open on the
+ * controller.
+ *
+ * @param[out] image
+ *             Set to the new transfer, if started
+ * @param[in]  controller
+ *             The controller (0-3) with the mempak to restore
+ * @param[in]  data
+ *             Buffer of #MEMPAK_IMAGE_SIZE bytes with the image to write
+ *
+ * @retval 0 if the restore was started
+ * @retval -1 if the controller is out of range, or image or data is null
+ * @retval -3 if the image is bad or unformatted
+ * @retval -4 if there was not enough memory to start the transfer
+ */
+int mempak_restore_begin( mempak_image_t **image, int controller, const uint8_t *data )
+{
+    if( image == 0 || data == 0 ) { return -1; }
+    if( controller < 0 || controller > 3 ) { return -1; }
+    if( __validate_image( (uint8_t *)data ) ) { return -3; }
+
+    mempak_cache_t *cache = &mempak_cache[controller];
+    assertf( !cache->batch, "mempak batch open on controller %d", controller );
+    cache->toc = 0;
+
+    *image = __image_begin( controller, (uint8_t *)data, true );
+    return *image ? 0 : -4;
+}
+
+/**
+ * @brief Return the progress of a mempak image transfer
+ *
+ * This function does not block.
+ *
+ * @param[in] image
+ *            Transfer started by #mempak_backup_begin or #mempak_restore_begin
+ *
+ * @return The number of bytes transferred so far (#MEMPAK_IMAGE_SIZE when
+ *         the transfer is complete), or -2 if the transfer failed because the
+ *         mempak was not present or couldn't be accessed
+ */
+int mempak_image_progress( mempak_image_t *image )
+{
+    /* Both a missing and a misbehaving mempak are reported as not present */
+    if( image->pipe.error ) { return -2; }
+    return image->done;
+}
+
+/**
+ * @brief Wait for a mempak image transfer to complete
+ *
+ * For a backup, the image read is also checked to contain a valid filesystem.
+ * If it does not, the image is still complete, but #mempak_restore_begin
+ * will refuse it: use #write_mempak_bulk to write it back as raw data.
+ *
+ * The transfer is freed, and cannot be used anymore.
+ *
+ * @param[in] image
+ *            Transfer started by #mempak_backup_begin or #mempak_restore_begin
+ *
+ * @retval 0 if the transfer completed successfully
+ * @retval -2 if the mempak was not present or couldn't be accessed
+ * @retval -3 if the backed up image is bad or unformatted
+ */
+int mempak_image_end( mempak_image_t *image )
+{
+    int ret = accessory_pipe_wait( &image->pipe ) ? -2 : 0;
+    if( !ret && !image->write ) { ret = __validate_image( image->data ); }
+
+    free( image );
+    return ret;
+}
+
 /** @} */ /* controller */
@@ -8,6 +8,8 @@
 #include <assert.h>
 #include <malloc.h>
 #include "n64sys.h"
+#include "interrupt.h"
+#include "system.h"
 #include "utils.h"
 
 /**
@@ -122,6 +124,63 @@ void data_cache_hit_writeback_invalidate(volatile void * addr, unsigned long len
     cache_op(0x15, 16);
 }
 
+/**
+ * @brief Prepare a memory region to be written by a DMA transfer (eg: PI or SP DMA to RDRAM)
+ *
+ * This performs the minimal cache maintenance required before the RCP writes
+ * to RDRAM: the cachelines fully contained in the region are just invalidated,
+ * as their contents are going to be overwritten anyway. Only the partial
+ * cachelines at the two ends of the region (if any) are written back before
+ * being invalidated, because they might contain data of other variables.
+ *
+ * Compared to calling #data_cache_hit_writeback_invalidate on the whole region,
+ * this avoids writing back dirty cachelines that are going to be overwritten.
+ *
+ * @note The CPU must not access the region (or write to the partial cachelines
+ *       at its ends) until the DMA transfer is finished.
+ *
+ * @param[in] addr
+ *            Pointer to memory in question
+ * @param[in] length
+ *            Length in bytes of the data pointed at by addr
+ */
+void data_cache_dma_in(volatile void * addr, unsigned long length)
+{
+    unsigned long start = (unsigned long)addr;
+    unsigned long end = start + length;
+
+    if (!length)
+        return;
+
+    if (start & 15) {
+        data_cache_hit_writeback_invalidate((void*)(start & ~15), 16);
+        start = (start & ~15) + 16;
+    }
+    if ((end & 15) && (end & ~15) >= start) {
+        data_cache_hit_writeback_invalidate((void*)(end & ~15), 16);
+        end &= ~15;
+    }
+    if (end > start)
+        __data_cache_hit_invalidate((void*)start, end - start);
+}
+
+/**
+ * @brief Prepare a memory region to be read by a DMA transfer (eg: PI or SP DMA from RDRAM)
+ *
+ * This writes back the dirty cachelines of the region, so that the RCP reads
+ * the data written by the CPU. The cachelines are not invalidated, as they
+ * are still valid after the transfer.
+ *
+ * @param[in] addr
+ *            Pointer to memory in question
+ * @param[in] length
+ *            Length in bytes of the data pointed at by addr
+ */
+void data_cache_dma_out(volatile const void * addr, unsigned long length)
+{
+    data_cache_hit_writeback(addr, length);
+}
+
 /**
  * @brief Force a data cache index writeback invalidate over a memory region
  *
@@ -202,6 +261,176 @@ void inst_cache_invalidate_all(void)
     inst_cache_hit_invalidate(KSEG0_START_ADDR, get_memory_size());
 }
 
+/**
+ * @name Uncached memory pool
+ *
+ * Small uncached buffers are served by a slab allocator, made of a list of slabs
+ * for each power-of-two size class. The size classes include the rspq block
+ * sizes (#RSPQ_BLOCK_MIN_SIZE words, doubling at each step), which are
+ * allocated and freed very often.
+ *
+ * Each slab is obtained from the heap (aligned to its size) and split into
+ * objects of a single size class, so objects are always cacheline-exclusive
+ * and aligned to their size. Slabs are kept small, to limit the memory pinned
+ * by each class: a slab is #UNCACHED_SLAB_GRANULE bytes, or two objects for the
+ * classes larger than half of it. Objects are carved from a new slab only when
+ * they are first needed, and each object is invalidated from the data cache
+ * when it is handed out. A slab is returned to the heap as soon as all its
+ * objects have been freed.
+ *
+ * @{
+ */
+/** @brief Size of the smallest slab (also the granularity of the slab tables) */
+#define UNCACHED_SLAB_GRANULE   (4*1024)
+/** @brief Size of the smallest size class (also the unit of slab offsets) */
+#define UNCACHED_POOL_MIN_SIZE  64
+/** @brief Number of size classes (from 64 bytes to 4 KiB) */
+#define UNCACHED_POOL_CLASSES   7
+/** @brief Maximum number of slab granules (enough to cover 8 MiB of RDRAM) */
+#define UNCACHED_SLAB_MAX       (0x800000 / UNCACHED_SLAB_GRANULE)
+/** @brief Marker for the end of a slab list */
+#define UNCACHED_NONE           0xFFFF
+/** @brief Marker for the end of the free list of a slab */
+#define UNCACHED_FREE_NONE      0xFF
+
+/** @brief State of a slab of the uncached pool (offsets are in units of #UNCACHED_POOL_MIN_SIZE) */
+typedef struct {
+    uint16_t next;      ///< Next slab of the same class with available objects
+    uint8_t used;       ///< Number of objects handed out
+    uint8_t bump;       ///< Offset of the first object never handed out
+    uint8_t free;       ///< Offset of the first freed object (linked through their first byte)
+} uncached_slab_t;
+
+/** @brief First slab with available objects, for each size class */
+static uint16_t uncached_avail[UNCACHED_POOL_CLASSES] = {
+    [0 ... UNCACHED_POOL_CLASSES-1] = UNCACHED_NONE
+};
+/** @brief State of each slab, indexed by the physical address of its first granule */
+static uncached_slab_t uncached_slabs[UNCACHED_SLAB_MAX];
+/** @brief Size class (plus one) of the slab covering each granule; 0 if not a slab */
+static uint8_t uncached_slab_class[UNCACHED_SLAB_MAX];
+/** @} */
+
+/** @brief Return the pool size class that can hold the specified size, or -1 if too large */
+static int uncached_pool_class(size_t size)
+{
+    if (size <= UNCACHED_POOL_MIN_SIZE)
+        return 0;
+    int cls = 32 - __builtin_clz(size - 1) - __builtin_ctz(UNCACHED_POOL_MIN_SIZE);
+    return cls < UNCACHED_POOL_CLASSES ? cls : -1;
+}
+
+/** @brief Return the size of the slabs of a class, in bytes */
+static inline int uncached_slab_size(int cls)
+{
+    return MAX(UNCACHED_SLAB_GRANULE, 2 * (UNCACHED_POOL_MIN_SIZE << cls));
+}
+
+/** @brief Return the uncached address of a slab given its index */
+static inline uint8_t *uncached_slab_addr(uint32_t idx)
+{
+    return (uint8_t*)(0xA0000000 | (idx * UNCACHED_SLAB_GRANULE));
+}
+
+/** @brief Take an object from the first available slab of a class (interrupts must be disabled) */
+static void *uncached_slab_take(int cls)
+{
+    uint32_t idx = uncached_avail[cls];
+    if (idx == UNCACHED_NONE)
+        return NULL;
+
+    uncached_slab_t *slab = &uncached_slabs[idx];
+    uint8_t *base = uncached_slab_addr(idx);
+    void *obj;
+    if (slab->free != UNCACHED_FREE_NONE) {
+        obj = base + slab->free * UNCACHED_POOL_MIN_SIZE;
+        slab->free = *(uint8_t*)obj;
+    } else {
+        obj = base + slab->bump * UNCACHED_POOL_MIN_SIZE;
+        slab->bump += 1 << cls;
+    }
+    slab->used++;
+
+    // Remove the slab from the available list once it is full
+    if (slab->free == UNCACHED_FREE_NONE && slab->bump * UNCACHED_POOL_MIN_SIZE == uncached_slab_size(cls))
+        uncached_avail[cls] = slab->next;
+    return obj;
+}
+
+/** @brief Allocate an object from the uncached pool, growing it by one slab if required */
+static void *uncached_pool_alloc(int cls)
+{
+    int size = UNCACHED_POOL_MIN_SIZE << cls;
+    int slab_size = uncached_slab_size(cls);
+
+    disable_interrupts();
+    void *obj = uncached_slab_take(cls);
+    enable_interrupts();
+
+    if (!obj) {
+        uint8_t *mem = memalign(slab_size, slab_size);
+        if (!mem) return NULL;
+        uint32_t idx = PhysicalAddr(mem) / UNCACHED_SLAB_GRANULE;
+        int granules = slab_size / UNCACHED_SLAB_GRANULE;
+        if (idx + granules > UNCACHED_SLAB_MAX) {
+            free(mem);
+            return NULL;
+        }
+        sys_memory_tag_update("uncached pool", slab_size);
+
+        disable_interrupts();
+        memset(&uncached_slab_class[idx], cls + 1, granules);
+        uncached_slabs[idx] = (uncached_slab_t){
+            .used = 0, .bump = 0, .free = UNCACHED_FREE_NONE, .next = uncached_avail[cls],
+        };
+        uncached_avail[cls] = idx;
+        obj = uncached_slab_take(cls);
+        enable_interrupts();
+    }
+
+    // The object might be in the data cache, if its memory was used as
+    // a normal heap buffer before the slab was allocated. Invalidate it
+    // so that we don't risk a writeback in the short future.
+    data_cache_hit_invalidate(CachedAddr(obj), size);
+    return obj;
+}
+
+/** @brief Return an object to its slab, releasing the slab when it becomes empty */
+static void uncached_pool_free(void *buf, int cls)
+{
+    int slab_size = uncached_slab_size(cls);
+    uint32_t idx = (PhysicalAddr(buf) & ~(slab_size - 1)) / UNCACHED_SLAB_GRANULE;
+    uncached_slab_t *slab = &uncached_slabs[idx];
+    uint8_t *base = uncached_slab_addr(idx);
+    bool release = false;
+
+    disable_interrupts();
+    bool was_full = slab->free == UNCACHED_FREE_NONE && slab->bump * UNCACHED_POOL_MIN_SIZE == slab_size;
+    *(uint8_t*)UncachedAddr(buf) = slab->free;
+    slab->free = ((uint8_t*)UncachedAddr(buf) - base) / UNCACHED_POOL_MIN_SIZE;
+    slab->used--;
+
+    if (slab->used == 0) {
+        // Unlink the empty slab from the available list. It cannot have been
+        // full, as a slab always holds more than one object.
+        uint16_t *link = &uncached_avail[cls];
+        while (*link != idx)
+            link = &uncached_slabs[*link].next;
+        *link = slab->next;
+        memset(&uncached_slab_class[idx], 0, slab_size / UNCACHED_SLAB_GRANULE);
+        release = true;
+    } else if (was_full) {
+        slab->next = uncached_avail[cls];
+        uncached_avail[cls] = idx;
+    }
+    enable_interrupts();
+
+    if (release) {
+        free(CachedAddr(base));
+        sys_memory_tag_update("uncached pool", -slab_size);
+    }
+}
+
 /**
  * @brief Allocate a buffer that will be accessed as uncached memory.
  * 
@@ -210,6 +439,10 @@ void inst_cache_invalidate_all(void)
  * does not share any cacheline with other buffers in the heap, and returns
  * a pointer in the uncached segment (0xA0000000).
  * 
+ * Buffers up to 4 KiB are served by a pool of uncached slabs, so that
+ * allocating and freeing them is fast and does not fragment the heap.
+ * Larger buffers are allocated from the heap.
+ * 
  * The buffer contents are uninitialized.
  * 
  * To free the buffer, use #free_uncached.
@@ -248,6 +481,15 @@ void *malloc_uncached_aligned(int align, size_t size)
     if (align < 16)
         align = 16;
     size = ROUND_UP(size, 16);
+
+    // Pool objects are aligned to their size, so pick a class large enough
+    // for the alignment too.
+    int cls = uncached_pool_class(MAX(size, (size_t)align));
+    if (cls >= 0) {
+        void *mem = uncached_pool_alloc(cls);
+        if (mem) return mem;
+    }
+
     void *mem = memalign(align, size);
     if (!mem) return NULL;
 
@@ -272,6 +514,16 @@ void *malloc_uncached_aligned(int align, size_t size)
  */
 void free_uncached(void *buf)
 {
+    if (!buf) return;
+
+    // Check whether the buffer belongs to a slab of the pool
+    uint32_t idx = PhysicalAddr(buf) / UNCACHED_SLAB_GRANULE;
+    int cls = idx < UNCACHED_SLAB_MAX ? uncached_slab_class[idx] - 1 : -1;
+    if (cls >= 0) {
+        uncached_pool_free(buf, cls);
+        return;
+    }
+
     free(CachedAddr(buf));
 }
 
@@ -0,0 +1,155 @@
+/**
+ * @file profile.c
+ * @brief Statistical CPU profiler
+ * @ingroup profile
+ */
+#include <malloc.h>
+#include <string.h>
+#include "profile.h"
+#include "timer.h"
+#include "exception.h"
+#include "interrupt.h"
+#include "n64sys.h"
+#include "debug.h"
+
+/** @brief Version of the dump format parsed by n64prof */
+#define PROFILE_DUMP_VERSION   1
+
+/** @brief Start of the text segment (defined by the linker script) */
+extern char __text_start[];
+/** @brief End of the text segment (defined by the linker script) */
+extern char __text_end[];
+/**
+ * @brief Stack pointer of the current interrupt frame (see inthandler.S)
+ *
+ * Interrupts are not reentrant, so while a timer callback is running this
+ * points to the frame of the code that was interrupted.
+ */
+extern uint8_t *interrupt_exception_frame;
+
+/** @brief Timer used to take samples */
+static timer_link_t *profile_timer;
+/** @brief Histogram of the samples, one bucket per granule of text segment */
+static uint32_t *profile_buckets;
+/** @brief Number of buckets in the histogram */
+static uint32_t profile_num_buckets;
+/** @brief Log2 of the number of bytes of text covered by each bucket */
+static int profile_shift;
+/** @brief Sampling frequency in Hz */
+static int profile_frequency;
+/** @brief Number of samples taken */
+static uint32_t profile_samples;
+/** @brief Number of samples whose PC was outside the text segment */
+static uint32_t profile_outside;
+
+/** @brief Timer callback: record the PC of the interrupted code */
+static void profile_sample(int ovfl)
+{
+    volatile reg_block_t *regs = (volatile reg_block_t*)(interrupt_exception_frame + 32);
+    uint32_t offset = regs->epc - (uint32_t)__text_start;
+    uint32_t idx = offset >> profile_shift;
+
+    profile_samples++;
+    if (idx < profile_num_buckets)
+        profile_buckets[idx]++;
+    else
+        profile_outside++;
+}
+
+/**
+ * @brief Start the profiler
+ *
+ * The profiler allocates a histogram with one 32-bit counter for each
+ * @p granularity bytes of the text segment, so a finer granularity gives
+ * more precise results at the cost of more memory. A granularity of
+ * 16 or 32 bytes is usually a good compromise, as the report is anyway
+ * aggregated per function.
+ *
+ * @param[in] frequency
+ *            Number of samples per second. Each sample costs an interrupt,
+ *            so very high frequencies will slow down the application.
+ * @param[in] granularity
+ *            Number of bytes of code covered by each entry of the histogram
+ *            (must be a power of two, at least 4).
+ */
+void profile_start(int frequency, int granularity)
+{
+    assertf(!profile_timer, "profiler already started");
+    assertf(frequency > 0 && frequency <= 100000, "invalid sampling frequency: %d", frequency);
+    assertf(granularity >= 4 && (granularity & (granularity - 1)) == 0,
+        "granularity must be a power of two, at least 4: %d", granularity);
+
+    int shift = __builtin_ctz(granularity);
+    uint32_t num_buckets = ((__text_end - __text_start) + granularity - 1) >> shift;
+
+    // Keep the histogram if it is compatible, so that profile_start/profile_stop
+    // can be used to profile only some parts of the application.
+    if (!profile_buckets || shift != profile_shift || frequency != profile_frequency) {
+        free(profile_buckets);
+        profile_buckets = malloc(num_buckets * sizeof(uint32_t));
+        assertf(profile_buckets, "not enough memory for the profile histogram (%lu bytes)",
+            (uint32_t)(num_buckets * sizeof(uint32_t)));
+        profile_num_buckets = num_buckets;
+        profile_shift = shift;
+        profile_frequency = frequency;
+        profile_reset();
+    }
+
+    profile_timer = new_timer(TICKS_PER_SECOND / frequency, TF_CONTINUOUS, profile_sample);
+}
+
+/**
+ * @brief Stop the profiler
+ *
+ * The histogram is preserved, so that it can be dumped with #profile_dump,
+ * or further samples can be added by calling #profile_start again with the
+ * same parameters.
+ */
+void profile_stop(void)
+{
+    if (profile_timer) {
+        delete_timer(profile_timer);
+        profile_timer = NULL;
+    }
+}
+
+/**
+ * @brief Clear all the samples collected so far
+ */
+void profile_reset(void)
+{
+    disable_interrupts();
+    if (profile_buckets)
+        memset(profile_buckets, 0, profile_num_buckets * sizeof(uint32_t));
+    profile_samples = 0;
+    profile_outside = 0;
+    enable_interrupts();
+}
+
+/**
+ * @brief Dump the collected samples via #debugf
+ *
+ * The dump is a text block that can be parsed by the n64prof tool. Only the
+ * histogram entries with at least one sample are dumped. The dump can be
+ * mixed with any other debugging output: n64prof will just skip it.
+ */
+void profile_dump(void)
+{
+    if (!profile_buckets)
+        return;
+
+    // Take a snapshot of the totals: the histogram itself can keep changing
+    // while dumping, which is fine for a statistical profile.
+    disable_interrupts();
+    uint32_t samples = profile_samples;
+    uint32_t outside = profile_outside;
+    enable_interrupts();
+
+    debugf("PROFILE %d %08lx %d %d %lu %lu\n", PROFILE_DUMP_VERSION,
+        (uint32_t)__text_start, 1 << profile_shift, profile_frequency, samples, outside);
+    for (uint32_t i = 0; i < profile_num_buckets; i++) {
+        if (profile_buckets[i])
+            debugf("%08lx %lu\n", (uint32_t)__text_start + (i << profile_shift), profile_buckets[i]);
+    }
+    debugf("PROFILE END\n");
+}
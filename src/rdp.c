@@ -7,6 +7,7 @@
 #include <malloc.h>
 #include <string.h>
 #include "libdragon.h"
+#include "utils.h"
 
 /**
  * @defgroup rdp Hardware Display Interface
@@ -64,6 +65,30 @@
  */
 #define RINGBUFFER_SLACK 1024
 
+/** @brief Maximum size in bytes of a triangle command (edge, shade, texture and Z coefficients) */
+#define TRIANGLE_MAX_SIZE  (32 + 64 + 64 + 16)
+
+/**
+ * @brief Edge data computed during triangle setup, shared by all the attributes
+ */
+typedef struct
+{
+    /** @brief X delta between the first and third vertex (1/4 pixels) */
+    int32_t hx;
+    /** @brief Y delta between the first and third vertex (1/4 pixels) */
+    int32_t hy;
+    /** @brief X delta between the first and second vertex (1/4 pixels) */
+    int32_t mx;
+    /** @brief Y delta between the first and second vertex (1/4 pixels) */
+    int32_t my;
+    /** @brief Twice the signed area of the triangle (1/16 square pixels) */
+    int64_t nz;
+    /** @brief Inverse slope of the major edge (s15.16) */
+    int32_t ish;
+    /** @brief Distance from the first vertex to the scanline above it (1/4 pixels, <= 0) */
+    int32_t fy;
+} tri_edge_t;
+
 /**
  * @brief Cached sprite structure
  * */
@@ -81,6 +106,8 @@ typedef struct
     uint16_t real_width;
     /** @brief Height of the texture rounded up to next power of 2 */
     uint16_t real_height;
+    /** @brief Mipmap level of the sprite that was loaded (0 = full size) */
+    uint8_t lod;
 } sprite_cache;
 
 /** @brief Ringbuffer where partially assembled commands will be placed before sending to the RDP */
@@ -444,6 +471,8 @@ void rdp_enable_texture_copy( void )
  *            Whether to mirror this texture when displaying
  * @param[in] sprite
  *            Pointer to the sprite structure to load the texture out of
+ * @param[in] lod
+ *            Mipmap level of the sprite to load the texture from
  * @param[in] sl
  *            The pixel offset S of the top left of the texture relative to sprite space
  * @param[in] tl
@@ -453,19 +482,25 @@ void rdp_enable_texture_copy( void )
  * @param[in] th
  *            The pixel offset T of the bottom right of the texture relative to sprite space
  *
+ * @note Texture coordinates are relative to the mipmap level being loaded.
+ *
  * @return The amount of texture memory in bytes that was consumed by this texture.
  */
-static uint32_t __rdp_load_texture( uint32_t texslot, uint32_t texloc, mirror_t mirror_enabled, sprite_t *sprite, int sl, int tl, int sh, int th )
+static uint32_t __rdp_load_texture( uint32_t texslot, uint32_t texloc, mirror_t mirror_enabled, sprite_t *sprite, int lod, int sl, int tl, int sh, int th )
 {
+    void *data = sprite_get_lod_data( sprite, lod );
+    int lwidth = sprite->width >> lod;
+    int lheight = sprite->height >> lod;
+
     /* Invalidate data associated with sprite in cache */
     if( flush_strategy == FLUSH_STRATEGY_AUTOMATIC )
     {
-        data_cache_hit_writeback_invalidate( sprite->data, sprite->width * sprite->height * sprite->bitdepth );
+        data_cache_hit_writeback_invalidate( data, lwidth * lheight * sprite->bitdepth );
     }
 
     /* Point the RDP at the actual sprite data */
-    __rdp_ringbuffer_queue( 0xFD000000 | ((sprite->bitdepth == 2) ? 0x00100000 : 0x00180000) | (sprite->width - 1) );
-    __rdp_ringbuffer_queue( (uint32_t)sprite->data );
+    __rdp_ringbuffer_queue( 0xFD000000 | ((sprite->bitdepth == 2) ? 0x00100000 : 0x00180000) | (lwidth - 1) );
+    __rdp_ringbuffer_queue( (uint32_t)data );
     __rdp_ringbuffer_send();
 
     /* Figure out the s,t coordinates of the sprite we are copying out of */
@@ -499,11 +534,74 @@ static uint32_t __rdp_load_texture( uint32_t texslot, uint32_t texloc, mirror_t
     cache[texslot & 0x7].t = tl;
     cache[texslot & 0x7].real_width = real_width;
     cache[texslot & 0x7].real_height = real_height;
+    cache[texslot & 0x7].lod = lod;
     
     /* Return the amount of texture memory consumed by this texture */
     return ((real_width / 8) + round_amount) * 8 * real_height * sprite->bitdepth;
 }
 
+/**
+ * @brief Select the mipmap level of a sprite to use for a scaled draw
+ *
+ * The smallest level that is still at least as large as the drawn sprite is selected,
+ * so that it is never magnified. The larger of the two scales is used, so that
+ * the less minified axis does not lose detail.
+ *
+ * @param[in] sprite
+ *            Sprite that will be drawn
+ * @param[in] x_scale
+ *            Horizontal scaling factor relative to the full size sprite
+ * @param[in] y_scale
+ *            Vertical scaling factor relative to the full size sprite
+ *
+ * @return The mipmap level to load
+ */
+static int __rdp_select_lod( sprite_t *sprite, double x_scale, double y_scale )
+{
+    double scale = MAX( x_scale, y_scale );
+    int count = sprite_get_lod_count( sprite );
+    int lod = 0;
+
+    while( lod + 1 < count && scale * (2 << lod) <= 1.0 )
+    {
+        lod++;
+    }
+
+    return lod;
+}
+
+/**
+ * @brief Load a slice of a mipmap level of a sprite into RDP TMEM
+ *
+ * @param[in] texslot
+ *            The RDP texture slot to load this sprite into (0-7)
+ * @param[in] texloc
+ *            The RDP TMEM offset to place the texture at
+ * @param[in] mirror
+ *            Whether the sprite should be mirrored when displaying past boundaries
+ * @param[in] sprite
+ *            Pointer to sprite structure to load the texture from
+ * @param[in] lod
+ *            Mipmap level to load the slice from
+ * @param[in] offset
+ *            Offset of the particular slice to load into RDP TMEM.
+ *
+ * @return The number of bytes consumed in RDP TMEM by loading this sprite
+ */
+static uint32_t __rdp_load_texture_slice( uint32_t texslot, uint32_t texloc, mirror_t mirror, sprite_t *sprite, int lod, int offset )
+{
+    /* Figure out the s,t coordinates of the sprite we are copying out of */
+    int twidth = (sprite->width >> lod) / sprite->hslices;
+    int theight = (sprite->height >> lod) / sprite->vslices;
+
+    int sl = (offset % sprite->hslices) * twidth;
+    int tl = (offset / sprite->hslices) * theight;
+    int sh = sl + twidth - 1;
+    int th = tl + theight - 1;
+
+    return __rdp_load_texture( texslot, texloc, mirror, sprite, lod, sl, tl, sh, th );
+}
+
 /**
  * @brief Load a sprite into RDP TMEM
  *
@@ -522,7 +620,7 @@ uint32_t rdp_load_texture( uint32_t texslot, uint32_t texloc, mirror_t mirror, s
 {
     if( !sprite ) { return 0; }
 
-    return __rdp_load_texture( texslot, texloc, mirror, sprite, 0, 0, sprite->width - 1, sprite->height - 1 );
+    return __rdp_load_texture( texslot, texloc, mirror, sprite, 0, 0, 0, sprite->width - 1, sprite->height - 1 );
 }
 
 /**
@@ -558,16 +656,72 @@ uint32_t rdp_load_texture_stride( uint32_t texslot, uint32_t texloc, mirror_t mi
 {
     if( !sprite ) { return 0; }
 
-    /* Figure out the s,t coordinates of the sprite we are copying out of */
-    int twidth = sprite->width / sprite->hslices;
-    int theight = sprite->height / sprite->vslices;
+    return __rdp_load_texture_slice( texslot, texloc, mirror, sprite, 0, offset );
+}
 
-    int sl = (offset % sprite->hslices) * twidth;
-    int tl = (offset / sprite->hslices) * theight;
-    int sh = sl + twidth - 1;
-    int th = tl + theight - 1;
+/**
+ * @brief Load a sprite into RDP TMEM, selecting the mipmap level for the draw scale
+ *
+ * If the sprite contains mipmap levels (see the --mipmap option of mksprite), the
+ * smallest level that is still at least as large as the scaled sprite is loaded.
+ * This loads less data into TMEM and avoids aliasing on minified sprites. Sprites
+ * without mipmap levels are always loaded at full size.
+ *
+ * #rdp_draw_sprite_scaled takes the loaded level into account, so it must be called
+ * with the same scale passed here, relative to the full size sprite.
+ *
+ * @param[in] texslot
+ *            The RDP texture slot to load this sprite into (0-7)
+ * @param[in] texloc
+ *            The RDP TMEM offset to place the texture at
+ * @param[in] mirror
+ *            Whether the sprite should be mirrored when displaying past boundaries
+ * @param[in] sprite
+ *            Pointer to sprite structure to load the texture from
+ * @param[in] x_scale
+ *            Horizontal scaling factor the sprite will be drawn at
+ * @param[in] y_scale
+ *            Vertical scaling factor the sprite will be drawn at
+ *
+ * @return The number of bytes consumed in RDP TMEM by loading this sprite
+ */
+uint32_t rdp_load_texture_scaled( uint32_t texslot, uint32_t texloc, mirror_t mirror, sprite_t *sprite, double x_scale, double y_scale )
+{
+    if( !sprite ) { return 0; }
+
+    int lod = __rdp_select_lod( sprite, x_scale, y_scale );
+
+    return __rdp_load_texture( texslot, texloc, mirror, sprite, lod, 0, 0, (sprite->width >> lod) - 1, (sprite->height >> lod) - 1 );
+}
+
+/**
+ * @brief Load part of a sprite into RDP TMEM, selecting the mipmap level for the draw scale
+ *
+ * This is the equivalent of #rdp_load_texture_stride for scaled draws. See
+ * #rdp_load_texture_scaled for how the mipmap level is selected.
+ *
+ * @param[in] texslot
+ *            The RDP texture slot to load this sprite into (0-7)
+ * @param[in] texloc
+ *            The RDP TMEM offset to place the texture at
+ * @param[in] mirror
+ *            Whether the sprite should be mirrored when displaying past boundaries
+ * @param[in] sprite
+ *            Pointer to sprite structure to load the texture from
+ * @param[in] offset
+ *            Offset of the particular slice to load into RDP TMEM.
+ * @param[in] x_scale
+ *            Horizontal scaling factor the sprite will be drawn at
+ * @param[in] y_scale
+ *            Vertical scaling factor the sprite will be drawn at
+ *
+ * @return The number of bytes consumed in RDP TMEM by loading this sprite
+ */
+uint32_t rdp_load_texture_stride_scaled( uint32_t texslot, uint32_t texloc, mirror_t mirror, sprite_t *sprite, int offset, double x_scale, double y_scale )
+{
+    if( !sprite ) { return 0; }
 
-    return __rdp_load_texture( texslot, texloc, mirror, sprite, sl, tl, sh, th );
+    return __rdp_load_texture_slice( texslot, texloc, mirror, sprite, __rdp_select_lod( sprite, x_scale, y_scale ), offset );
 }
 
 /**
@@ -695,13 +849,15 @@ void rdp_draw_textured_rectangle( uint32_t texslot, int tx, int ty, int bx, int
 void rdp_draw_sprite( uint32_t texslot, int x, int y, mirror_t mirror )
 {
     /* Just draw a rectangle the size of the sprite */
-    rdp_draw_textured_rectangle_scaled( texslot, x, y, x + cache[texslot & 0x7].width, y + cache[texslot & 0x7].height, 1.0, 1.0, mirror );
+    rdp_draw_sprite_scaled( texslot, x, y, 1.0, 1.0, mirror );
 }
 
 /**
  * @brief Draw a texture to the screen as a scaled sprite
  *
  * Given an already loaded texture, this function will draw a rectangle textured with the loaded texture.
+ * The scale is relative to the full size sprite, even if a smaller mipmap level was loaded
+ * with #rdp_load_texture_scaled or #rdp_load_texture_stride_scaled.
  *
  * Before using this command to draw a textured rectangle, use #rdp_enable_texture_copy to set the RDP
  * up in texture mode.
@@ -721,10 +877,23 @@ void rdp_draw_sprite( uint32_t texslot, int x, int y, mirror_t mirror )
  */
 void rdp_draw_sprite_scaled( uint32_t texslot, int x, int y, double x_scale, double y_scale, mirror_t mirror )
 {
+    /* A mipmap level is smaller than the sprite: compute the size of the full
+       sprite (scaling the size in texels, not the last texel index) */
+    int lod = cache[texslot & 0x7].lod;
+    int width = ((cache[texslot & 0x7].width + 1) << lod) - 1;
+    int height = ((cache[texslot & 0x7].height + 1) << lod) - 1;
+
     /* Since we want to still view the whole sprite, we must resize the rectangle area too */
-    int new_width = (int)(((double)cache[texslot & 0x7].width * x_scale) + 0.5);
-    int new_height = (int)(((double)cache[texslot & 0x7].height * y_scale) + 0.5);
-    
+    int new_width = (int)(((double)width * x_scale) + 0.5);
+    int new_height = (int)(((double)height * y_scale) + 0.5);
+
+    /* Scale the mipmap level back up to the requested size */
+    if( lod )
+    {
+        x_scale *= 1 << lod;
+        y_scale *= 1 << lod;
+    }
+
     /* Draw a rectangle the size of the new sprite */
     rdp_draw_textured_rectangle_scaled( texslot, x, y, x + new_width, y + new_height, x_scale, y_scale, mirror );
 }
@@ -857,6 +1026,286 @@ void rdp_draw_filled_triangle( float x1, float y1, float x2, float y2, float x3,
     __rdp_ringbuffer_send();
 }
 
+/**
+ * @brief Enable drawing of triangles with #rdp_draw_triangle
+ *
+ * Configure the color combiner and the rendering mode so that triangles drawn
+ * with the same flags are rasterized in 1-cycle mode. The output color is the
+ * shade color (#RDP_TRI_SHADE), the texel color (#RDP_TRI_TEX), or their product
+ * if both are requested. If none of them is requested, the primitive color
+ * (see #rdp_set_primitive_color) is used.
+ *
+ * If #RDP_TRI_ZBUF is specified, depth compare and update are enabled, so a
+ * Z-buffer must be configured with #rdp_attach_zbuffer.
+ *
+ * @param[in] flags
+ *            Combination of #RDP_TRI_SHADE, #RDP_TRI_TEX and #RDP_TRI_ZBUF
+ */
+void rdp_enable_triangle_mode( uint32_t flags )
+{
+    /* Combiner: (A-B)*C+D, the same formula is used for both cycles */
+    uint32_t a = 15, b = 15, c = 31, d;
+    if( (flags & RDP_TRI_SHADE) && (flags & RDP_TRI_TEX) )
+    {
+        /* TEX0 * SHADE */
+        a = 1; c = 4; d = 7;
+    }
+    else if( flags & RDP_TRI_SHADE ) { d = 4; }
+    else if( flags & RDP_TRI_TEX )   { d = 1; }
+    else                             { d = 3; }
+
+    __rdp_ringbuffer_queue( 0xFC000000 | (a << 20) | (c << 15) | (7 << 12) | (7 << 9) | (a << 5) | c );
+    __rdp_ringbuffer_queue( (b << 28) | (b << 24) | (7 << 21) | (7 << 18) | (d << 15) | (7 << 12) | (d << 9) | (d << 6) | (7 << 3) | d );
+    __rdp_ringbuffer_send();
+
+    /* 1-cycle mode, no dithering, RGB texture filters; the blender passes
+       the combiner output through (IN * 0 + IN * 1) */
+    __rdp_ringbuffer_queue( 0xEF000CFF );
+    __rdp_ringbuffer_queue( 0x0F0A4000 | ((flags & RDP_TRI_ZBUF) ? 0x30 : 0) );
+    __rdp_ringbuffer_send();
+}
+
+/**
+ * @brief Configure the Z-buffer used by triangles drawn with #RDP_TRI_ZBUF
+ *
+ * The Z-buffer must be a 16-bit surface with the same width as the surface
+ * the RDP is attached to. It must be cleared before drawing a new frame,
+ * for instance by filling it with 0xFF bytes (farthest depth).
+ *
+ * @param[in] zbuf
+ *            A 16-bit surface to use as Z-buffer
+ */
+void rdp_attach_zbuffer( surface_t *zbuf )
+{
+    if( zbuf == 0 ) { return; }
+
+    assertf(TEX_FORMAT_BITDEPTH(surface_get_format(zbuf)) == 16, "Z-buffer must be a 16-bit surface");
+
+    __rdp_ringbuffer_queue( 0xFE000000 );
+    __rdp_ringbuffer_queue( PhysicalAddr(zbuf->buffer) );
+    __rdp_ringbuffer_send();
+}
+
+/**
+ * @brief Compute the coefficients of an attribute interpolated over a triangle
+ *
+ * All values are in s15.16 fixed point. The derivatives of the attribute are
+ * obtained from the plane equation passing through the three vertices.
+ *
+ * @param[in]  e     Edge data of the triangle
+ * @param[in]  a1    Attribute value at the first (top) vertex
+ * @param[in]  a2    Attribute value at the second (middle) vertex
+ * @param[in]  a3    Attribute value at the third (bottom) vertex
+ * @param[out] out   Attribute value at the top of the major edge, DaDx, DaDe, DaDy
+ */
+static inline void __rdp_triangle_attr( const tri_edge_t *e, int32_t a1, int32_t a2, int32_t a3, int32_t out[4] )
+{
+    int64_t ma = (int64_t)a2 - a1;
+    int64_t ha = (int64_t)a3 - a1;
+    int32_t dadx = 0, dady = 0;
+
+    if( e->nz )
+    {
+        /* Deltas are in 1/4 pixels and nz in 1/16 square pixels, hence
+           the factor 4 to obtain per-pixel derivatives. */
+        dadx = -((e->hy * ma - e->my * ha) * 4) / e->nz;
+        dady = -((e->mx * ha - e->hx * ma) * 4) / e->nz;
+    }
+
+    int32_t dade = dady + (int32_t)(((int64_t)dadx * e->ish) >> 16);
+
+    out[0] = a1 + (int32_t)(((int64_t)e->fy * dade) >> 2);
+    out[1] = dadx;
+    out[2] = dade;
+    out[3] = dady;
+}
+
+/**
+ * @brief Queue a block of coefficients for up to four attributes
+ *
+ * This is the layout used by the RDP for both shade (R, G, B, A) and texture
+ * (S, T, W) coefficients: integer and fractional parts are split in separate
+ * words, two attributes per word.
+ *
+ * @param[in] c
+ *            Coefficients of each attribute, as computed by #__rdp_triangle_attr
+ */
+static void __rdp_triangle_queue_coeffs( int32_t c[4][4] )
+{
+    /* Value, DaDx, DaDe, DaDy: integer parts of the first two, then their
+       fractional parts, and the same for the last two */
+    static const int order[2][2] = { { 0, 1 }, { 2, 3 } };
+
+    for( int i = 0; i < 2; i++ )
+    {
+        for( int j = 0; j < 2; j++ )
+        {
+            int k = order[i][j];
+            __rdp_ringbuffer_queue( (c[0][k] & 0xFFFF0000) | ((uint32_t)c[1][k] >> 16) );
+            __rdp_ringbuffer_queue( (c[2][k] & 0xFFFF0000) | ((uint32_t)c[3][k] >> 16) );
+        }
+        for( int j = 0; j < 2; j++ )
+        {
+            int k = order[i][j];
+            __rdp_ringbuffer_queue( (c[0][k] << 16) | (c[1][k] & 0xFFFF) );
+            __rdp_ringbuffer_queue( (c[2][k] << 16) | (c[3][k] & 0xFFFF) );
+        }
+    }
+}
+
+/**
+ * @brief Queue a triangle command in the ring buffer, without sending it
+ *
+ * @param[in] flags
+ *            Combination of #RDP_TRI_SHADE, #RDP_TRI_TEX and #RDP_TRI_ZBUF
+ * @param[in] texslot
+ *            Texture slot used for texturing
+ * @param[in] v1
+ *            First vertex
+ * @param[in] v2
+ *            Second vertex
+ * @param[in] v3
+ *            Third vertex
+ */
+static void __rdp_triangle( uint32_t flags, uint32_t texslot, const rdp_vertex_t *v1, const rdp_vertex_t *v2, const rdp_vertex_t *v3 )
+{
+    /* Sort vertices by Y ascending to find the major, mid and low edges */
+    if( v1->y > v2->y ) { SWAP(v1, v2); }
+    if( v2->y > v3->y ) { SWAP(v2, v3); }
+    if( v1->y > v2->y ) { SWAP(v1, v2); }
+
+    tri_edge_t e;
+    e.hx = v3->x - v1->x;
+    e.hy = v3->y - v1->y;
+    e.mx = v2->x - v1->x;
+    e.my = v2->y - v1->y;
+    int32_t lx = v3->x - v2->x;
+    int32_t ly = v3->y - v2->y;
+    e.nz = (int64_t)e.hx * e.my - (int64_t)e.hy * e.mx;
+
+    /* Inverse slopes in s15.16 (deltas are in the same unit, so they cancel out) */
+    e.ish = e.hy ? ((int64_t)e.hx << 16) / e.hy : 0;
+    int32_t ism = e.my ? ((int64_t)e.mx << 16) / e.my : 0;
+    int32_t isl = ly ? ((int64_t)lx << 16) / ly : 0;
+
+    /* The RDP starts walking the edges from the scanline containing the
+       top vertex, so move X back to that scanline. */
+    e.fy = -(v1->y & 3);
+    int32_t xh = (v1->x << 14) + (int32_t)(((int64_t)e.fy * e.ish) >> 2);
+    int32_t xm = (v1->x << 14) + (int32_t)(((int64_t)e.fy * ism) >> 2);
+    int32_t xl = v2->x << 14;
+
+    uint32_t lft = e.nz < 0;
+
+    __rdp_ringbuffer_queue( 0xC8000000 | ((flags & 0x7) << 24) | (lft << 23) | ((texslot & 0x7) << 16) | (v3->y & 0x3FFF) );
+    __rdp_ringbuffer_queue( ((v2->y & 0x3FFF) << 16) | (v1->y & 0x3FFF) );
+    __rdp_ringbuffer_queue( xl );
+    __rdp_ringbuffer_queue( isl );
+    __rdp_ringbuffer_queue( xh );
+    __rdp_ringbuffer_queue( e.ish );
+    __rdp_ringbuffer_queue( xm );
+    __rdp_ringbuffer_queue( ism );
+
+    if( flags & RDP_TRI_SHADE )
+    {
+        int32_t c[4][4];
+        __rdp_triangle_attr( &e, v1->r << 16, v2->r << 16, v3->r << 16, c[0] );
+        __rdp_triangle_attr( &e, v1->g << 16, v2->g << 16, v3->g << 16, c[1] );
+        __rdp_triangle_attr( &e, v1->b << 16, v2->b << 16, v3->b << 16, c[2] );
+        __rdp_triangle_attr( &e, v1->a << 16, v2->a << 16, v3->a << 16, c[3] );
+        __rdp_triangle_queue_coeffs( c );
+    }
+
+    if( flags & RDP_TRI_TEX )
+    {
+        /* Perspective correction is not supported, so W is left to zero */
+        int32_t c[4][4] = {{ 0 }};
+        __rdp_triangle_attr( &e, v1->s << 16, v2->s << 16, v3->s << 16, c[0] );
+        __rdp_triangle_attr( &e, v1->t << 16, v2->t << 16, v3->t << 16, c[1] );
+        __rdp_triangle_queue_coeffs( c );
+    }
+
+    if( flags & RDP_TRI_ZBUF )
+    {
+        int32_t z[4];
+        __rdp_triangle_attr( &e, v1->z << 16, v2->z << 16, v3->z << 16, z );
+        __rdp_ringbuffer_queue( z[0] );
+        __rdp_ringbuffer_queue( z[1] );
+        __rdp_ringbuffer_queue( z[2] );
+        __rdp_ringbuffer_queue( z[3] );
+    }
+}
+
+/**
+ * @brief Draw a triangle with optional shading, texturing and depth
+ *
+ * The triangle setup (edge slopes and attribute gradients) is calculated on
+ * the CPU using fixed point math only. Vertex order is not important.
+ *
+ * Before calling this function, configure the RDP with #rdp_enable_triangle_mode
+ * using the same flags. When texturing, the texture must have been loaded into
+ * @p texslot with #rdp_load_texture or #rdp_load_texture_stride, and texture
+ * coordinates are relative to the loaded texture.
+ *
+ * @param[in] flags
+ *            Combination of #RDP_TRI_SHADE, #RDP_TRI_TEX and #RDP_TRI_ZBUF
+ * @param[in] texslot
+ *            The texture slot that the texture was previously loaded into (0-7).
+ *            Ignored if #RDP_TRI_TEX is not specified.
+ * @param[in] v1
+ *            First vertex
+ * @param[in] v2
+ *            Second vertex
+ * @param[in] v3
+ *            Third vertex
+ */
+void rdp_draw_triangle( uint32_t flags, uint32_t texslot, const rdp_vertex_t *v1, const rdp_vertex_t *v2, const rdp_vertex_t *v3 )
+{
+    __rdp_triangle( flags, texslot, v1, v2, v3 );
+    __rdp_ringbuffer_send();
+}
+
+/**
+ * @brief Draw a batch of indexed triangles
+ *
+ * This is equivalent to calling #rdp_draw_triangle once per triangle, but
+ * multiple triangles are sent to the RDP with a single transfer, which is
+ * much faster for large meshes.
+ *
+ * @param[in] flags
+ *            Combination of #RDP_TRI_SHADE, #RDP_TRI_TEX and #RDP_TRI_ZBUF
+ * @param[in] texslot
+ *            The texture slot that the texture was previously loaded into (0-7).
+ *            Ignored if #RDP_TRI_TEX is not specified.
+ * @param[in] vertices
+ *            Array of vertices
+ * @param[in] indices
+ *            Array of vertex indices, three per triangle
+ * @param[in] num_triangles
+ *            Number of triangles to draw
+ */
+void rdp_draw_triangles( uint32_t flags, uint32_t texslot, const rdp_vertex_t *vertices, const uint16_t *indices, int num_triangles )
+{
+    for( int i = 0; i < num_triangles; i++ )
+    {
+        /* Send what we have so far once the batch reaches the slack area, so
+           that #__rdp_ringbuffer_send wraps the ring buffer around exactly as
+           it does for single commands. Batches are also kept within the size
+           of the slack, like any other command, so that the RDP is done
+           fetching them before the ring buffer wraps over them. */
+        if( rdp_end > (RINGBUFFER_SIZE - RINGBUFFER_SLACK) ||
+            __rdp_ringbuffer_size() + TRIANGLE_MAX_SIZE > RINGBUFFER_SLACK )
+        {
+            __rdp_ringbuffer_send();
+        }
+
+        __rdp_triangle( flags, texslot, &vertices[indices[0]], &vertices[indices[1]], &vertices[indices[2]] );
+        indices += 3;
+    }
+
+    __rdp_ringbuffer_send();
+}
+
 /**
  * @brief Set the flush strategy for texture loads
  *
@@ -16,6 +16,7 @@
 #include "console.h"
 #include "regsinternal.h"
 #include "n64sys.h"
+#include "dma.h"
 #include "interrupt.h"
 
 /**
@@ -105,7 +106,9 @@ void rsp_read_code(void* start, unsigned long size, unsigned int imem_offset)
 {
     assert(((uint32_t)start % 8) == 0);
     assert((imem_offset % 8) == 0);
-    data_cache_hit_writeback_invalidate(start, size);
+    dma_buffer_t dbuf;
+    dma_buffer_init(&dbuf, start, size);
+    dma_buffer_rcp_write(&dbuf);
 
     disable_interrupts();
     __SP_DMA_wait();
@@ -119,6 +122,7 @@ void rsp_read_code(void* start, unsigned long size, unsigned int imem_offset)
     __SP_DMA_wait();
 
     enable_interrupts();
+    dma_buffer_release(&dbuf);
 }
 
 
@@ -126,7 +130,9 @@ void rsp_read_data(void* start, unsigned long size, unsigned int dmem_offset)
 {
     assert(((uint32_t)start % 8) == 0);
     assert((dmem_offset % 8) == 0);
-    data_cache_hit_writeback_invalidate(start, size);
+    dma_buffer_t dbuf;
+    dma_buffer_init(&dbuf, start, size);
+    dma_buffer_rcp_write(&dbuf);
 
     disable_interrupts();
     __SP_DMA_wait();
@@ -140,6 +146,7 @@ void rsp_read_data(void* start, unsigned long size, unsigned int dmem_offset)
     __SP_DMA_wait();
 
     enable_interrupts();
+    dma_buffer_release(&dbuf);
 }
 
 /** @brief Internal implementation of #rsp_run_async */
@@ -8,6 +8,7 @@
 #include <time.h>
 #include "libdragon.h"
 #include "system.h"
+#include "joybusinternal.h"
 
 /**
  * @defgroup rtc Real-Time Clock Subsystem
@@ -154,17 +155,51 @@
 #define JOYBUS_RTC_CONTROL_MODE_RUN 0x0300
 
 /**
- * @brief Invalidate the most-recent RTC time cache after 1 second.
+ * @brief Resynchronize the extrapolated clock with the RTC every 10 seconds.
  */
-#define RTC_GET_CACHE_INVALIDATE_TICKS (TICKS_PER_SECOND)
+#define RTC_CLOCK_RESYNC_TICKS (10LL * TICKS_PER_SECOND)
 
 /**
- * @brief Tick counter state when #rtc_get cache was last updated.
+ * @brief Software clock extrapolated from the RTC.
  *
- * Set to 0 to manually invalidate the #rtc_get cache.
- * Cache will invalidate every #RTC_GET_CACHE_INVALIDATE_TICKS.
+ * The RTC is read once, and the current time is then extrapolated from
+ * #timer_ticks, so that reading the time does not require a PIF round-trip.
+ * Every #RTC_CLOCK_RESYNC_TICKS, a new RTC read is scheduled in background
+ * and its result is applied on the next access to the clock.
+ *
+ * The RTC only has a resolution of one second, so the sub-second phase of
+ * the clock is estimated: each resync moves the clock forward to the start
+ * of the second reported by the RTC if the clock was behind it, or back to
+ * its end if the clock was ahead. Over a few resyncs, the clock converges
+ * towards the actual second boundary.
+ *
+ * Moving the clock back never makes the returned time go backwards: the
+ * clock holds at the last returned time until it catches up with it.
  */
-static int64_t rtc_get_cache_ticks = 0;
+static struct {
+    /** @brief Incremented when the clock is invalidated, to discard stale reads */
+    uint32_t generation;
+    /** @brief Whether #base_sec and #base_ticks are valid */
+    bool valid;
+    /** @brief Time (in seconds since the epoch) at #base_ticks */
+    time_t base_sec;
+    /** @brief Timer ticks at the start of the second #base_sec */
+    int64_t base_ticks;
+    /** @brief Timer ticks of the last RTC read (or background read request) */
+    int64_t sync_ticks;
+    /** @brief Latest time returned by the clock, in ticks since the epoch */
+    int64_t last_time;
+    /** @brief A background RTC read is in flight */
+    bool resync_pending;
+    /** @brief Clock generation at the time of the background RTC read */
+    uint32_t resync_generation;
+    /** @brief A background RTC read has completed and must be applied */
+    bool resync_ready;
+    /** @brief Time returned by the completed background RTC read */
+    rtc_time_t resync_time;
+    /** @brief Timer ticks at which the background RTC read completed */
+    int64_t resync_ticks;
+} rtc_clock;
 
 /**
  * @brief Real-time clock detection values.
@@ -260,24 +295,19 @@ static uint32_t joybus_rtc_status( void )
 }
 
 /**
- * @brief Read a block of data from the Joybus real-time clock.
- *
- * This is a low-level utility function that is used by
- * #joybus_rtc_read_control and #rtc_get.
+ * @brief Prepare the Joybus command block to read an RTC block.
  *
  * @param[in]   block
- *              Which RTC block to read from (0-2)
+ *              Which RTC block to read (0-2)
  *
- * @param[out]  data
- *              Destination pointer for the RTC block data
- *
- * @return the status byte from the Joybus real-time clock
+ * @param[out]  input
+ *              Destination for the Joybus command block
  */
-static uint8_t joybus_rtc_read( uint8_t block, uint64_t * data )
+static void joybus_rtc_read_input( uint8_t block, uint64_t * input )
 {
     assert(block <= 2);
 
-    uint64_t input[JOYBUS_BLOCK_DWORDS] =
+    const uint64_t cmd[JOYBUS_BLOCK_DWORDS] =
     {
         0x0000000002090700 | block,
         0xffffffffffffffff,
@@ -288,7 +318,28 @@ static uint8_t joybus_rtc_read( uint8_t block, uint64_t * data )
         0,
         1
     };
+    memcpy( input, cmd, sizeof(cmd) );
+}
+
+/**
+ * @brief Read a block of data from the Joybus real-time clock.
+ *
+ * This is a low-level utility function that is used by
+ * #joybus_rtc_read_control and #rtc_get.
+ *
+ * @param[in]   block
+ *              Which RTC block to read from (0-2)
+ *
+ * @param[out]  data
+ *              Destination pointer for the RTC block data
+ *
+ * @return the status byte from the Joybus real-time clock
+ */
+static uint8_t joybus_rtc_read( uint8_t block, uint64_t * data )
+{
+    uint64_t input[JOYBUS_BLOCK_DWORDS];
     uint64_t output[JOYBUS_BLOCK_DWORDS];
+    joybus_rtc_read_input( block, input );
 
     joybus_exec( input, output );
 
@@ -379,20 +430,16 @@ static void joybus_rtc_read_control( uint16_t * control, uint32_t * calibration
 }
 
 /**
- * @brief Read the current date/time from the Joybus real-time clock.
+ * @brief Decode the time block of the Joybus real-time clock.
  *
- * The result of calling this function when the Joybus RTC is not
- * present is undefined and may not be safe. #rtc_get will not
- * call this function if the Joybus RTC was not detected.
+ * @param[in]   data
+ *              The RTC block 2 data
  *
  * @param[out]  rtc_time
  *              Destination pointer for the RTC time data structure
  */
-static void joybus_rtc_read_time( rtc_time_t * rtc_time )
+static void joybus_rtc_decode_time( uint64_t data, rtc_time_t * rtc_time )
 {
-    uint64_t data;
-    joybus_rtc_read( 2, &data );
-
     uint8_t * bytes = (uint8_t *)&data;
 
     rtc_time->sec = bcd_to_byte(bytes[0]);
@@ -406,6 +453,23 @@ static void joybus_rtc_read_time( rtc_time_t * rtc_time )
     rtc_time->year += 1900;
 }
 
+/**
+ * @brief Read the current date/time from the Joybus real-time clock.
+ *
+ * The result of calling this function when the Joybus RTC is not
+ * present is undefined and may not be safe. #rtc_get will not
+ * call this function if the Joybus RTC was not detected.
+ *
+ * @param[out]  rtc_time
+ *              Destination pointer for the RTC time data structure
+ */
+static void joybus_rtc_read_time( rtc_time_t * rtc_time )
+{
+    uint64_t data;
+    joybus_rtc_read( 2, &data );
+    joybus_rtc_decode_time( data, rtc_time );
+}
+
 /**
  * @brief Write the control block to the Joybus real-time clock.
  *
@@ -522,25 +586,157 @@ static rtc_type_t rtc_present( void )
 }
 
 /**
- * @brief Hook function for newlib gettimeofday to get the current date/time.
+ * @brief Invalidate the extrapolated clock.
  *
- * @return the current timestamp in seconds or -1 if RTC is unavailable.
+ * The next access to the clock will read the RTC synchronously, and may
+ * return an earlier time than before. Background reads that are still in
+ * flight will be discarded.
  */
-static time_t newlib_time_hook( void )
+static void rtc_clock_invalidate( void )
 {
-    static rtc_time_t rtc_time;
-    if( !rtc_get( &rtc_time ) ) return -1;
+    disable_interrupts();
+    rtc_clock.generation++;
+    rtc_clock.valid = false;
+    rtc_clock.last_time = 0;
+    rtc_clock.resync_ready = false;
+    enable_interrupts();
+}
 
+/**
+ * @brief Synchronize the extrapolated clock with a time read from the RTC.
+ *
+ * @param[in]   rtc_time
+ *              The time read from the RTC
+ *
+ * @param[in]   ticks
+ *              Timer ticks at which the time was read
+ */
+static void rtc_clock_apply( const rtc_time_t * rtc_time, int64_t ticks )
+{
     struct tm time;
-    time.tm_sec = rtc_time.sec;
-    time.tm_min = rtc_time.min;
-    time.tm_hour = rtc_time.hour;
-    time.tm_mday = rtc_time.day;
-    time.tm_mon = rtc_time.month;
-    time.tm_year = rtc_time.year - 1900;
+    time.tm_sec = rtc_time->sec;
+    time.tm_min = rtc_time->min;
+    time.tm_hour = rtc_time->hour;
+    time.tm_mday = rtc_time->day;
+    time.tm_mon = rtc_time->month;
+    time.tm_year = rtc_time->year - 1900;
     time.tm_isdst = -1; /* Auto-detect Daylight Saving Time */
+    time_t sec = mktime( &time );
+
+    /* Ticks elapsed within the second reported by the RTC, according to
+       the extrapolated clock. Clamp it within the second, so that the
+       clock never drifts more than one second away from the RTC. */
+    int64_t phase = 0;
+    if( rtc_clock.valid )
+    {
+        phase = (int64_t)(rtc_clock.base_sec - sec) * TICKS_PER_SECOND +
+                (ticks - rtc_clock.base_ticks);
+        if( phase < 0 ) phase = 0;
+        if( phase >= TICKS_PER_SECOND ) phase = TICKS_PER_SECOND - 1;
+    }
+
+    rtc_clock.base_sec = sec;
+    rtc_clock.base_ticks = ticks - phase;
+    rtc_clock.valid = true;
+}
+
+/**
+ * @brief Completion callback of the background RTC read.
+ *
+ * Called under interrupt: just record the result, which will be applied
+ * by the next access to the clock.
+ *
+ * @param[in]   output
+ *              The Joybus reply block
+ *
+ * @param[in]   ctx
+ *              Unused
+ */
+static void rtc_clock_resync_done( uint64_t * output, void * ctx )
+{
+    rtc_clock.resync_pending = false;
+    if( rtc_clock.resync_generation != rtc_clock.generation ) return;
+
+    joybus_rtc_decode_time( output[1], &rtc_clock.resync_time );
+    rtc_clock.resync_ticks = timer_ticks();
+    rtc_clock.resync_ready = true;
+}
+
+/**
+ * @brief Read the extrapolated clock.
+ *
+ * The RTC is read synchronously only the first time (or after the clock
+ * was invalidated). Afterwards, the time is extrapolated from #timer_ticks,
+ * and the RTC is read again in background every #RTC_CLOCK_RESYNC_TICKS.
+ *
+ * @param[out]  tv
+ *              Destination for the current time
+ *
+ * @return whether the time was available
+ */
+static bool rtc_clock_get( struct timeval * tv )
+{
+    /* libdragon currently only supports getting the time for Joybus RTC! */
+    if( rtc_present() != RTC_JOYBUS ) return false;
 
-    return mktime( &time );
+    /* Fetch the result of the background read, if any */
+    rtc_time_t resync_time;
+    int64_t resync_ticks = 0;
+    bool resync_ready;
+    disable_interrupts();
+    resync_ready = rtc_clock.resync_ready;
+    if( resync_ready )
+    {
+        resync_time = rtc_clock.resync_time;
+        resync_ticks = rtc_clock.resync_ticks;
+        rtc_clock.resync_ready = false;
+    }
+    enable_interrupts();
+
+    if( resync_ready ) rtc_clock_apply( &resync_time, resync_ticks );
+
+    int64_t now = timer_ticks();
+    if( !rtc_clock.valid )
+    {
+        joybus_rtc_read_time( &resync_time );
+        now = timer_ticks();
+        rtc_clock_apply( &resync_time, now );
+        rtc_clock.sync_ticks = now;
+    }
+    else if( !rtc_clock.resync_pending &&
+             now - rtc_clock.sync_ticks > RTC_CLOCK_RESYNC_TICKS )
+    {
+        uint64_t input[JOYBUS_BLOCK_DWORDS];
+        joybus_rtc_read_input( 2, input );
+        rtc_clock.sync_ticks = now;
+        rtc_clock.resync_pending = true;
+        rtc_clock.resync_generation = rtc_clock.generation;
+        joybus_exec_async_priority( input, rtc_clock_resync_done,
+            NULL, JOYBUS_PRIORITY_BACKGROUND );
+    }
+
+    /* Never go back in time, even if the last resync moved the clock back */
+    int64_t time = (int64_t)rtc_clock.base_sec * TICKS_PER_SECOND +
+                   (now - rtc_clock.base_ticks);
+    if( time < rtc_clock.last_time ) time = rtc_clock.last_time;
+    rtc_clock.last_time = time;
+
+    tv->tv_sec = time / TICKS_PER_SECOND;
+    tv->tv_usec = (time % TICKS_PER_SECOND) * 1000000 / TICKS_PER_SECOND;
+    return true;
+}
+
+/**
+ * @brief Hook function for newlib gettimeofday to get the current date/time.
+ *
+ * @param[out]  tv
+ *              Destination for the current time
+ *
+ * @return 0 on success, or -1 if RTC is unavailable.
+ */
+static int newlib_timeofday_hook( struct timeval * tv )
+{
+    return rtc_clock_get( tv ) ? 0 : -1;
 }
 
 /**
@@ -567,8 +763,8 @@ bool rtc_init( void )
     /* libdragon currently only supports Joybus RTC! */
     if( rtc_present() != RTC_JOYBUS ) return false;
 
-    /* Invalidate the #rtc_get cache */
-    rtc_get_cache_ticks = 0;
+    /* Invalidate the extrapolated clock */
+    rtc_clock_invalidate();
 
     /* Read the calibration data from the control block */
     uint32_t calibration;
@@ -579,7 +775,7 @@ bool rtc_init( void )
     wait_ms( JOYBUS_RTC_WRITE_BLOCK_DELAY );
 
     /* Enable newlib `gettimeofday` integration */
-    hook_time_call( &newlib_time_hook );
+    hook_timeofday_call( &newlib_timeofday_hook );
 
     return true;
 }
@@ -599,9 +795,9 @@ bool rtc_init( void )
 void rtc_close( void )
 {
     /* Disable newlib `gettimeofday` integration */
-    unhook_time_call( &newlib_time_hook );
-    /* Invalidate the #rtc_get cache */
-    rtc_get_cache_ticks = 0;
+    unhook_timeofday_call( &newlib_timeofday_hook );
+    /* Invalidate the extrapolated clock */
+    rtc_clock_invalidate();
 }
 
 /**
@@ -671,18 +867,16 @@ void rtc_normalize_time( rtc_time_t * rtc_time )
  * If the RTC is not detected or supported, this function will
  * not modify the destination rtc_time parameter.
  *
- * Your code should call this once per frame to update the #rtc_time_t
- * data structure. The RTC Subsystem maintains a cache of the
- * most-recent RTC time that was read and will only perform an
- * actual RTC read command if the cache is invalidated. The
- * destination rtc_time parameter will be updated regardless of
- * the cache validity.
- *
- * Cache will invalidate every #RTC_GET_CACHE_INVALIDATE_TICKS.
- * Calling #rtc_set will also invalidate the cache.
+ * Your code can call this as often as needed (for instance, once per
+ * frame) to update the #rtc_time_t data structure. The RTC Subsystem
+ * reads the RTC once and then extrapolates the current time from the
+ * timer ticks, resynchronizing with the RTC in background every
+ * #RTC_CLOCK_RESYNC_TICKS. The ISO C time functions use the same clock,
+ * with sub-second resolution.
  *
- * If an actual RTC read command is needed, this function can take
- * a few milliseconds to complete.
+ * Calling #rtc_set will invalidate the clock: the first call after it
+ * performs an actual RTC read command, that can take a few milliseconds
+ * to complete.
  *
  * @param[out]  rtc_time
  *              Destination pointer for the RTC time data structure
@@ -691,25 +885,20 @@ void rtc_normalize_time( rtc_time_t * rtc_time )
  */
 bool rtc_get( rtc_time_t * rtc_time )
 {
-    /* libdragon currently only supports getting the time for Joybus RTC! */
-    if( rtc_present() != RTC_JOYBUS ) return false;
+    struct timeval tv;
+    if( !rtc_clock_get( &tv ) ) return false;
 
-    /* This should be overwritten the first time this function is called */
-    static rtc_time_t cache_time = { 2000, 0, 1, 0, 0, 0, 6 };
-
-    /* Check if the cached time is still valid */
-    int64_t now = timer_ticks();
-    if(
-        rtc_get_cache_ticks == 0 || /* cache manually invalidated */
-        (now - rtc_get_cache_ticks) > RTC_GET_CACHE_INVALIDATE_TICKS
-    )
-    {
-        /* Update the cache */
-        joybus_rtc_read_time( &cache_time );
-        rtc_get_cache_ticks = now;
-    }
+    struct tm time;
+    time_t sec = tv.tv_sec;
+    localtime_r( &sec, &time );
 
-    memcpy( rtc_time, &cache_time, sizeof(rtc_time_t) );
+    rtc_time->year = time.tm_year + 1900;
+    rtc_time->month = time.tm_mon;
+    rtc_time->day = time.tm_mday;
+    rtc_time->hour = time.tm_hour;
+    rtc_time->min = time.tm_min;
+    rtc_time->sec = time.tm_sec;
+    rtc_time->week_day = time.tm_wday;
 
     return true;
 }
@@ -754,8 +943,8 @@ bool rtc_set( rtc_time_t * write_time )
     /* Wait for the RTC to start running */
     while( joybus_rtc_is_stopped() ) { /* Spinloop */ }
     wait_ms( JOYBUS_RTC_WRITE_FINISHED_DELAY );
-    /* Invalidate the #rtc_get cache */
-    rtc_get_cache_ticks = 0;
+    /* Invalidate the extrapolated clock */
+    rtc_clock_invalidate();
     return true;
 }
 
@@ -6,6 +6,8 @@
 
 #include "surface.h"
 #include "n64sys.h"
+#include "rsp.h"
+#include "rspq.h"
 #include "debug.h"
 #include <assert.h>
 #include <string.h>
@@ -72,6 +74,121 @@ surface_t surface_make_sub(surface_t *parent, uint32_t x0, uint32_t y0, uint32_t
     return sub;
 }
 
+DEFINE_RSP_UCODE(rsp_surface);
+
+/** @brief Overlay ID of the surface ucode (0 if not registered yet) */
+static uint32_t surface_ovl_id = 0;
+
+/** @brief Commands of the surface overlay (see rsp_surface.S) */
+enum {
+    SURFACE_CMD_FILL    = 0x0,
+    SURFACE_CMD_COPY    = 0x1,
+    SURFACE_CMD_CONVERT = 0x2,
+};
+
+void surface_rsp_init(void)
+{
+    if (!surface_ovl_id) {
+        rspq_init();
+        surface_ovl_id = rspq_overlay_register(&rsp_surface);
+    }
+}
+
+void surface_rsp_close(void)
+{
+    if (surface_ovl_id) {
+        rspq_overlay_unregister(surface_ovl_id);
+        surface_ovl_id = 0;
+    }
+}
+
+/** @brief Register the surface overlay on first use and return its ID */
+static uint32_t surface_overlay_id(void)
+{
+    surface_rsp_init();
+    return surface_ovl_id;
+}
+
+/** @brief Check that a surface can be accessed by the RSP DMA engine */
+static void surface_check_dma(const surface_t *surface, uint32_t row_bytes)
+{
+    assertf(((uint32_t)surface->buffer & 7) == 0 && (surface->stride & 7) == 0 && (row_bytes & 7) == 0,
+        "surface not suitable for RSP operations: buffer, stride and row length must be 8-byte aligned (%p, %u, %lu)",
+        surface->buffer, surface->stride, row_bytes);
+}
+
+void surface_fill_async(surface_t *surface, uint32_t color)
+{
+    tex_format_t fmt = surface_get_format(surface);
+    uint32_t row_bytes = TEX_FORMAT_PIX2BYTES(fmt, surface->width);
+    surface_check_dma(surface, row_bytes);
+    if (!surface->width || !surface->height)
+        return;
+
+    // The ucode always fills with 32-bit words, so replicate smaller colors
+    switch (TEX_FORMAT_BITDEPTH(fmt)) {
+    case 4:  color &= 0xF; color |= color << 4; // fallthrough
+    case 8:  color &= 0xFF; color |= color << 8; // fallthrough
+    case 16: color &= 0xFFFF; color |= color << 16; break;
+    }
+
+    rspq_write(surface_overlay_id(), SURFACE_CMD_FILL,
+        row_bytes,
+        PhysicalAddr(surface->buffer),
+        (surface->height << 16) | surface->stride,
+        color);
+}
+
+void surface_copy_async(surface_t *dst, const surface_t *src)
+{
+    tex_format_t fmt = surface_get_format(dst);
+    assertf(fmt == surface_get_format(src),
+        "surface_copy_async: format mismatch (%s vs %s)", tex_format_name(fmt), tex_format_name(surface_get_format(src)));
+    assertf(dst->width == src->width && dst->height == src->height,
+        "surface_copy_async: size mismatch (%dx%d vs %dx%d)", dst->width, dst->height, src->width, src->height);
+
+    uint32_t row_bytes = TEX_FORMAT_PIX2BYTES(fmt, dst->width);
+    surface_check_dma(dst, row_bytes);
+    surface_check_dma(src, row_bytes);
+    if (!dst->width || !dst->height)
+        return;
+
+    rspq_write(surface_overlay_id(), SURFACE_CMD_COPY,
+        row_bytes,
+        PhysicalAddr(src->buffer),
+        PhysicalAddr(dst->buffer),
+        (src->stride << 16) | dst->stride,
+        dst->height);
+}
+
+void surface_convert_async(surface_t *dst, const surface_t *src)
+{
+    tex_format_t dst_fmt = surface_get_format(dst);
+    tex_format_t src_fmt = surface_get_format(src);
+    if (dst_fmt == src_fmt) {
+        surface_copy_async(dst, src);
+        return;
+    }
+
+    assertf((src_fmt == FMT_RGBA16 && dst_fmt == FMT_RGBA32) || (src_fmt == FMT_RGBA32 && dst_fmt == FMT_RGBA16),
+        "surface_convert_async: unsupported conversion from %s to %s", tex_format_name(src_fmt), tex_format_name(dst_fmt));
+    assertf(dst->width == src->width && dst->height == src->height,
+        "surface_convert_async: size mismatch (%dx%d vs %dx%d)", dst->width, dst->height, src->width, src->height);
+    assertf((dst->width & 3) == 0, "surface_convert_async: width must be a multiple of 4 (%d)", dst->width);
+
+    surface_check_dma(dst, TEX_FORMAT_PIX2BYTES(dst_fmt, dst->width));
+    surface_check_dma(src, TEX_FORMAT_PIX2BYTES(src_fmt, src->width));
+    if (!dst->width || !dst->height)
+        return;
+
+    rspq_write(surface_overlay_id(), SURFACE_CMD_CONVERT,
+        ((src_fmt == FMT_RGBA32) << 16) | dst->width,
+        PhysicalAddr(src->buffer),
+        PhysicalAddr(dst->buffer),
+        (src->stride << 16) | dst->stride,
+        dst->height);
+}
+
 extern inline surface_t surface_make(void *buffer, tex_format_t format, uint32_t width, uint32_t height, uint32_t stride);
 extern inline tex_format_t surface_get_format(const surface_t *surface);
 extern inline surface_t surface_make_linear(void *buffer, tex_format_t format, uint32_t width, uint32_t height);
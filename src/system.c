@@ -51,6 +51,12 @@
  * filesystem will be passed the file "/directory/file.txt".  The file handle returned
  * will be passed into all subsequent calls to your filesystem until the file is
  * closed.
+ *
+ * Reads can be accelerated with a per-file read-ahead buffer, enabled with
+ * #sys_set_readahead: small reads are then served from memory, and the
+ * filesystem is only called to refill the buffer. This works with any
+ * filesystem (eg: both "rom:/" and "sd:/"). Positional reads that do not
+ * move the file offset are available via pread().
  * @{
  */
 
@@ -122,6 +128,8 @@ typedef struct
      * (eg. 'rom:/' or 'cf:/') 
      */
     char *prefix;
+    /** @brief Length of the prefix (cached to speed up lookups) */
+    int prefix_len;
     /** @brief Filesystem callback pointers */
     filesystem_t *fs;
 } fs_mapping_t;
@@ -130,7 +138,9 @@ typedef struct
  * @brief Filesystem open handle structure
  *
  * This is used to look up the correct filesystem function to call
- * when working with an open file handle
+ * when working with an open file handle. The file handle returned to
+ * newlib is the index of this structure in the `handles` array, plus
+ * #FIRST_FILENO, so that lookups are O(1).
  */
 typedef struct
 {
@@ -138,22 +148,36 @@ typedef struct
     int fs_mapping;
     /** @brief The handle assigned to this open file as returned by the 
      *         filesystem code called to handle the open operation.  Will
-     *         be passed to all subsequent file operations on the file. */
+     *         be passed to all subsequent file operations on the file.
+     *         NULL if this entry is free. */
     void *handle;
-    /** @brief The handle assigned by the filesystem code that will be returned
-     *         to newlib.  All subsequent newlib calls will use this handle which
-     *         will be used to look up the internal reference. */
-    int fileno;
+    /** @brief Read-ahead buffer (NULL if read-ahead is disabled) */
+    uint8_t *ra_buf;
+    /** @brief Size of the read-ahead buffer */
+    int ra_size;
+    /** @brief Number of valid bytes in the read-ahead buffer */
+    int ra_len;
+    /** @brief Position of the next byte to return from the read-ahead buffer */
+    int ra_pos;
+    /** @brief File offset of the first byte of the read-ahead buffer (-1 if unknown) */
+    int ra_offset;
 } fs_handle_t;
 
+/** @brief First file handle returned by open (after STDIN, STDOUT, STDERR) */
+#define FIRST_FILENO    3
+
 /** @brief Array of filesystems registered */
 static fs_mapping_t filesystems[MAX_FILESYSTEMS] = { { 0 } };
+/** @brief Filesystem matched by the last lookup by name */
+static int last_fs_link = 0;
 /** @brief Array of open handles tracked */
 static fs_handle_t handles[MAX_OPEN_HANDLES] = { { 0 } };
 /** @brief Current stdio hook structure */
 static stdio_t stdio_hooks = { 0 };
 /** @brief Function to provide the current time */
 time_t (*time_hook)( void ) = NULL;
+/** @brief Function to provide the current time with sub-second resolution */
+int (*timeofday_hook)( struct timeval *ptimeval ) = NULL;
 
 /* Forward definitions */
 int close( int fildes );
@@ -272,27 +296,6 @@ static int __strcmp( const char * const a, const char * const b )
     return __strncmp( a, b, -1 );
 }
 
-/**
- * @brief Return a unique filesystem handle
- *
- * @return A unique 32-bit value usable as a filesystem handle
- */
-static int __get_new_handle()
-{
-    /* Start past STDIN, STDOUT, STDERR file handles */
-    static int handle = 3;
-    int newhandle;
-
-    disable_interrupts();
-
-    /* Always give out a nonzero handle unique to the system */
-    newhandle = handle++;
-
-    enable_interrupts();
-
-    return newhandle;
-}
-
 /**
  * @brief Register a filesystem with newlib
  *
@@ -370,6 +373,7 @@ int attach_filesystem( const char * const prefix, filesystem_t *filesystem )
 
     /* Attach the prefix */
     filesystems[handle].prefix = __strdup( prefix );
+    filesystems[handle].prefix_len = len;
 
     /* Attach the inputted filesystem */
     filesystems[handle].fs = filesystem;
@@ -409,15 +413,16 @@ int detach_filesystem( const char * const prefix )
                 /* We found the filesystem, now go through and close every open file handle */
                 for( int j = 0; j < MAX_OPEN_HANDLES; j++ )
                 {
-                    if( handles[j].fileno > 0 && handles[j].fs_mapping == i )
+                    if( handles[j].handle && handles[j].fs_mapping == i )
                     {
-                        close( handles[j].fileno );
+                        close( j + FIRST_FILENO );
                     }
                 }
 
                 /* Now free the memory associated with the prefix and zero out the filesystem */
                 free( filesystems[i].prefix );
                 filesystems[i].prefix = 0;
+                filesystems[i].prefix_len = 0;
                 filesystems[i].fs = 0;
 
                 /* All went well */
@@ -431,6 +436,26 @@ int detach_filesystem( const char * const prefix )
     return -2;
 }
 
+/**
+ * @brief Get the open handle structure of a file handle
+ *
+ * @param[in] fileno
+ *            File handle
+ *
+ * @return Pointer to the open handle structure or null if the file is not open.
+ */
+static fs_handle_t *__get_handle( int fileno )
+{
+    /* Invalid */
+    if( fileno < FIRST_FILENO || fileno >= FIRST_FILENO + MAX_OPEN_HANDLES )
+    {
+        return 0;
+    }
+
+    fs_handle_t *h = &handles[fileno - FIRST_FILENO];
+    return h->handle ? h : 0;
+}
+
 /**
  * @brief Get a filesystem pointer by handle
  *
@@ -443,23 +468,9 @@ int detach_filesystem( const char * const prefix )
  */
 static filesystem_t *__get_fs_pointer_by_handle( int fileno )
 {
-    /* Invalid */
-    if( fileno <= 0 )
-    {
-        return 0;
-    }
-
-    for( int i = 0; i < MAX_OPEN_HANDLES; i++ )
-    {
-        if( handles[i].fileno == fileno )
-        {
-            /* Found it */
-            return filesystems[handles[i].fs_mapping].fs;
-        }
-    }
+    fs_handle_t *h = __get_handle( fileno );
 
-    /* Couldn't find it */
-    return 0;
+    return h ? filesystems[h->fs_mapping].fs : 0;
 }
 
 /**
@@ -478,13 +489,23 @@ static int __get_fs_link_by_name( const char * const name )
         return -1;
     }
 
+    /* Most accesses go to the same filesystem, so try the last one first */
+    fs_mapping_t *last = &filesystems[last_fs_link];
+    if( last->prefix && __strncmp( last->prefix, name, last->prefix_len ) == 0 )
+    {
+        return last_fs_link;
+    }
+
     for( int i = 0; i < MAX_FILESYSTEMS; i++ )
     {
-        if( filesystems[i].prefix )
+        /* Compare the first character before the whole prefix, as it
+           is enough to discard most filesystems */
+        if( filesystems[i].prefix && filesystems[i].prefix[0] == name[0] )
         {
-            if( __strncmp( filesystems[i].prefix, name, __strlen( filesystems[i].prefix ) ) == 0 )
+            if( __strncmp( filesystems[i].prefix, name, filesystems[i].prefix_len ) == 0 )
             {
                 /* Found it */
+                last_fs_link = i;
                 return i;
             }
         }
@@ -527,22 +548,45 @@ static filesystem_t *__get_fs_pointer_by_name( const char * const name )
  */
 static void *__get_fs_handle( int fileno )
 {
-    /* Invalid */
-    if( fileno <= 0 )
-    {
-        return 0;
-    }
+    fs_handle_t *h = __get_handle( fileno );
 
-    for( int i = 0; i < MAX_OPEN_HANDLES; i++ )
+    return h ? h->handle : 0;
+}
+
+/**
+ * @brief Discard the contents of the read-ahead buffer of a file
+ *
+ * The filesystem is seeked back to the current logical position of the
+ * file, that is the position of the first byte not yet returned by read.
+ *
+ * @param[in] fs
+ *            Filesystem of the file
+ * @param[in] h
+ *            Open handle structure of the file
+ *
+ * @return 0 on success or a negative value on error.
+ */
+static int __readahead_drop( filesystem_t *fs, fs_handle_t *h )
+{
+    int unread = h->ra_len - h->ra_pos;
+
+    h->ra_len = 0;
+    h->ra_pos = 0;
+    h->ra_offset = -1;
+
+    if( unread > 0 )
     {
-        if( handles[i].fileno == fileno )
+        if( fs->lseek == 0 )
+        {
+            errno = ENOSYS;
+            return -1;
+        }
+        if( fs->lseek( h->handle, -unread, SEEK_CUR ) < 0 )
         {
-            /* Found it */
-            return handles[i].handle;
+            return -1;
         }
     }
 
-    /* Couldn't find it */
     return 0;
 }
 
@@ -587,15 +631,9 @@ int close( int fildes )
     }
 
     /* Free the open file handle */
-    for( int i = 0; i < MAX_OPEN_HANDLES; i++)
-    {
-        if( handles[i].fileno == fildes )
-        {
-            handles[i].fs_mapping = 0;
-            handles[i].handle = NULL;
-            handles[i].fileno = 0;
-        }
-    }
+    fs_handle_t *h = __get_handle( fildes );
+    free( h->ra_buf );
+    *h = (fs_handle_t){ 0 };
 
     if( fs->close == 0 )
     {
@@ -727,6 +765,14 @@ int getpid( void )
  */
 int gettimeofday( struct timeval *ptimeval, void *ptimezone )
 {
+    if( timeofday_hook != NULL )
+    {
+        if( timeofday_hook( ptimeval ) == 0 )
+        {
+            return 0;
+        }
+    }
+
     if( time_hook != NULL )
     {
         time_t time = time_hook();
@@ -822,7 +868,7 @@ int link( char *existing, char *new )
 int lseek( int file, int ptr, int dir )
 {
     filesystem_t *fs = __get_fs_pointer_by_handle( file );
-    void *handle = __get_fs_handle( file );
+    fs_handle_t *h = __get_handle( file );
 
     if( fs == 0 )
     {
@@ -837,7 +883,28 @@ int lseek( int file, int ptr, int dir )
         return -1;
     }
 
-    return fs->lseek( handle, ptr, dir );
+    if( h->ra_len > 0 )
+    {
+        /* If the destination is within the read-ahead buffer, just move
+           within it, without calling the filesystem */
+        if( h->ra_offset >= 0 && (dir == SEEK_SET || dir == SEEK_CUR) )
+        {
+            int pos = (dir == SEEK_SET) ? ptr : h->ra_offset + h->ra_pos + ptr;
+
+            if( pos >= h->ra_offset && pos <= h->ra_offset + h->ra_len )
+            {
+                h->ra_pos = pos - h->ra_offset;
+                return pos;
+            }
+        }
+
+        if( __readahead_drop( fs, h ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return fs->lseek( h->handle, ptr, dir );
 }
 
 /**
@@ -872,7 +939,7 @@ int open( char *file, int flags, int mode )
     /* Do we have room for a new file? */
     for( int i = 0; i < MAX_OPEN_HANDLES; i++ )
     {
-        if( handles[i].fileno == 0 )
+        if( handles[i].handle == 0 )
         {
             /* Yes, we have room, try the open */
             int mapping = __get_fs_link_by_name( file );
@@ -883,17 +950,17 @@ int open( char *file, int flags, int mode )
                 return -1;
             }
  
-            void *ptr = fs->open( file + __strlen( filesystems[mapping].prefix ), flags );
+            void *ptr = fs->open( file + filesystems[mapping].prefix_len, flags );
 
             if( ptr )
             {
                 /* Create new internal handle */
-                handles[i].fileno = __get_new_handle();
                 handles[i].handle = ptr;
                 handles[i].fs_mapping = mapping;
+                handles[i].ra_offset = -1;
 
                 /* Return our own handle */
-                return handles[i].fileno;
+                return i + FIRST_FILENO;
             }
             else
             {
@@ -947,7 +1014,7 @@ int read( int file, char *ptr, int len )
     {
         /* Read from file */
         filesystem_t *fs = __get_fs_pointer_by_handle( file );
-        void *handle = __get_fs_handle( file );
+        fs_handle_t *h = __get_handle( file );
 
         if( fs == 0 )
         {
@@ -962,8 +1029,174 @@ int read( int file, char *ptr, int len )
             return -1;
         }
 
-        return fs->read( handle, (uint8_t *)ptr, len );
+        if( !h->ra_buf )
+        {
+            return fs->read( h->handle, (uint8_t *)ptr, len );
+        }
+
+        /* Serve as much as possible from the read-ahead buffer */
+        int done = h->ra_len - h->ra_pos;
+        if( done > len ) { done = len; }
+        __memcpy( ptr, (char *)h->ra_buf + h->ra_pos, done );
+        h->ra_pos += done;
+
+        if( done < len )
+        {
+            int ret;
+
+            if( len - done >= h->ra_size )
+            {
+                /* Large read: go straight to the filesystem, as buffering
+                   would only add a copy. The buffer has been consumed, so
+                   just forget about it. */
+                h->ra_len = 0;
+                h->ra_pos = 0;
+                h->ra_offset = -1;
+                ret = fs->read( h->handle, (uint8_t *)ptr + done, len - done );
+            }
+            else
+            {
+                /* Refill the buffer, remembering where it starts in the file
+                   so that short seeks and positional reads can use it */
+                h->ra_offset = fs->lseek ? fs->lseek( h->handle, 0, SEEK_CUR ) : -1;
+                ret = fs->read( h->handle, h->ra_buf, h->ra_size );
+                h->ra_len = ret > 0 ? ret : 0;
+                h->ra_pos = 0;
+
+                if( ret > 0 )
+                {
+                    ret = (len - done < h->ra_len) ? len - done : h->ra_len;
+                    __memcpy( ptr + done, (char *)h->ra_buf, ret );
+                    h->ra_pos = ret;
+                }
+            }
+
+            if( ret < 0 )
+            {
+                /* Report the error only if nothing was read */
+                return done ? done : ret;
+            }
+            done += ret;
+        }
+
+        return done;
+    }
+}
+
+/**
+ * @brief Read data from a file at a given offset
+ *
+ * Contrary to #read, this function does not change the current offset
+ * of the file. If the requested data is in the read-ahead buffer, it is
+ * returned without calling the filesystem.
+ *
+ * @param[in]  file
+ *             File handle
+ * @param[out] ptr
+ *             Data pointer to read data to
+ * @param[in]  len
+ *             Length in bytes of data to read
+ * @param[in]  offset
+ *             Offset in bytes within the file
+ *
+ * @return Actual number of bytes read or a negative value on error.
+ */
+ssize_t pread( int file, void *ptr, size_t len, off_t offset )
+{
+    filesystem_t *fs = __get_fs_pointer_by_handle( file );
+    fs_handle_t *h = __get_handle( file );
+
+    if( fs == 0 || offset < 0 || offset > INT_MAX || len > INT_MAX )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if( fs->read == 0 || fs->lseek == 0 )
+    {
+        /* Filesystem doesn't support random access */
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if( h->ra_len > 0 && h->ra_offset >= 0 &&
+        offset >= h->ra_offset && offset <= h->ra_offset + h->ra_len &&
+        len <= (size_t)(h->ra_offset + h->ra_len - offset) )
+    {
+        __memcpy( ptr, (char *)h->ra_buf + (offset - h->ra_offset), len );
+        return len;
+    }
+
+    /* Save the current position of the filesystem handle (which is ahead
+       of the logical position if there is buffered data, but that is fine
+       as we are going to restore it) */
+    int cur = fs->lseek( h->handle, 0, SEEK_CUR );
+    if( cur < 0 || fs->lseek( h->handle, offset, SEEK_SET ) < 0 )
+    {
+        return -1;
+    }
+
+    int ret = fs->read( h->handle, (uint8_t *)ptr, len );
+
+    if( fs->lseek( h->handle, cur, SEEK_SET ) < 0 )
+    {
+        return -1;
+    }
+
+    return ret;
+}
+
+/**
+ * @brief Configure the read-ahead buffer of a file
+ *
+ * With a read-ahead buffer, reads smaller than the buffer are served from
+ * memory, and the filesystem is called only to refill it with @p size bytes
+ * at a time. This speeds up code that performs many small reads (eg: parsers
+ * using fread on a file opened with fopen), as each filesystem call might have
+ * a large fixed cost (eg: a PI DMA or a SD card access). Reads larger than the
+ * buffer bypass it.
+ *
+ * For a file opened with fopen, use fileno() to get the file handle.
+ *
+ * @param[in] file
+ *            File handle
+ * @param[in] size
+ *            Size of the read-ahead buffer in bytes, or 0 to disable it
+ *
+ * @return 0 on success or a negative value on error.
+ */
+int sys_set_readahead( int file, int size )
+{
+    filesystem_t *fs = __get_fs_pointer_by_handle( file );
+    fs_handle_t *h = __get_handle( file );
+
+    if( fs == 0 || size < 0 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if( __readahead_drop( fs, h ) < 0 )
+    {
+        return -1;
     }
+
+    free( h->ra_buf );
+    h->ra_buf = 0;
+    h->ra_size = 0;
+
+    if( size > 0 )
+    {
+        h->ra_buf = malloc( size );
+        if( !h->ra_buf )
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        h->ra_size = size;
+    }
+
+    return 0;
 }
 
 /**
@@ -987,6 +1220,16 @@ int readlink( const char *path, char *buf, size_t bufsize )
     return -1;
 }
 
+/** @brief Current end of the heap */
+static char *heap_end = 0;
+/** @brief Highest end of the heap ever reached */
+static char *heap_peak = 0;
+/** @brief Maximum end of the heap */
+static char *heap_top = 0;
+
+/** @brief Memory tags accounted via #sys_memory_tag_update */
+static memory_tag_t memory_tags[MAX_MEMORY_TAGS];
+
 /**
  * @brief Return a new chunk of memory to be used as heap
  *
@@ -997,8 +1240,6 @@ int readlink( const char *path, char *buf, size_t bufsize )
  */
 void *sbrk( int incr )
 {
-    static char * heap_end = 0;
-    static char * heap_top = 0;
     char *        prev_heap_end;
 
     disable_interrupts();
@@ -1006,6 +1247,7 @@ void *sbrk( int incr )
     if( heap_end == 0 )
     {
         heap_end = (char*)HEAP_START_ADDR;
+        heap_peak = heap_end;
         heap_top = (char*)KSEG0_START_ADDR + get_memory_size() - STACK_SIZE;
     }
 
@@ -1020,11 +1262,111 @@ void *sbrk( int incr )
         errno = ENOMEM;
     }
 
+    if (heap_end > heap_peak)
+    {
+        heap_peak = heap_end;
+    }
+
     enable_interrupts();
 
     return (void *)prev_heap_end;
 }
 
+/**
+ * @brief Get statistics about the heap usage
+ *
+ * The statistics combine the heap boundaries managed by sbrk with
+ * the allocation statistics of malloc. The free bytes not at the top of
+ * the heap are holes between allocations, and measure fragmentation.
+ *
+ * @param[out] stats
+ *             Structure that will be filled with the statistics
+ */
+void sys_get_heap_stats( heap_stats_t *stats )
+{
+    struct mallinfo mi = mallinfo();
+
+    disable_interrupts();
+    stats->heap_start = (uint32_t)HEAP_START_ADDR;
+    stats->heap_end = heap_end ? (uint32_t)heap_end : stats->heap_start;
+    stats->heap_peak = heap_peak ? (uint32_t)heap_peak : stats->heap_start;
+    stats->heap_limit = (uint32_t)KSEG0_START_ADDR + get_memory_size() - STACK_SIZE;
+    enable_interrupts();
+
+    stats->live_bytes = mi.uordblks;
+    stats->free_bytes = mi.fordblks;
+    stats->free_chunks = mi.ordblks;
+    stats->top_free_bytes = mi.keepcost;
+}
+
+/**
+ * @brief Account memory to a memory tag
+ *
+ * Memory tags allow to keep track of which subsystem is using memory. Each tag
+ * is identified by its name, and keeps the number of live bytes accounted
+ * to it, and their high-water mark. Libdragon accounts the memory of its own
+ * large buffers (eg: the uncached memory pool and arenas); applications
+ * can use their own tags too. Use #debug_memory_report to display them.
+ *
+ * At most #MAX_MEMORY_TAGS tags can be tracked; further tags are ignored.
+ *
+ * @param[in] name
+ *            Name of the tag
+ * @param[in] delta
+ *            Number of bytes allocated (positive) or freed (negative)
+ */
+void sys_memory_tag_update( const char *name, int32_t delta )
+{
+    disable_interrupts();
+
+    for( int i = 0; i < MAX_MEMORY_TAGS; i++ )
+    {
+        memory_tag_t *tag = &memory_tags[i];
+
+        if( !tag->name )
+        {
+            tag->name = name;
+        }
+        else if( tag->name != name && __strcmp( tag->name, name ) != 0 )
+        {
+            continue;
+        }
+
+        tag->live_bytes += delta;
+        if( tag->live_bytes > tag->peak_bytes )
+        {
+            tag->peak_bytes = tag->live_bytes;
+        }
+        break;
+    }
+
+    enable_interrupts();
+}
+
+/**
+ * @brief Get the memory tags
+ *
+ * @param[out] tags
+ *             Array that will be filled with the tags
+ * @param[in]  max
+ *             Maximum number of tags to return
+ *
+ * @return The number of tags written into the array
+ */
+int sys_get_memory_tags( memory_tag_t *tags, int max )
+{
+    int n = 0;
+
+    disable_interrupts();
+    for( ; n < max && n < MAX_MEMORY_TAGS && memory_tags[n].name; n++ )
+    {
+        tags[n] = memory_tags[n];
+    }
+    enable_interrupts();
+
+    return n;
+}
+
 /**
  * @brief Return file stats based on a file name
  *
@@ -1116,7 +1458,7 @@ int unlink( char *name )
     }
 
     /* Must offset past the prefix */
-    return fs->unlink( name + __strlen( filesystems[mapping].prefix ) );
+    return fs->unlink( name + filesystems[mapping].prefix_len );
 }
 
 /**
@@ -1184,7 +1526,7 @@ int write( int file, char *ptr, int len )
     {
         /* Filesystem write */
         filesystem_t *fs = __get_fs_pointer_by_handle( file );
-        void *handle = __get_fs_handle( file );
+        fs_handle_t *h = __get_handle( file );
 
         if( fs == 0 )
         {
@@ -1199,7 +1541,14 @@ int write( int file, char *ptr, int len )
             return -1;
         }
 
-        return fs->write( handle, (uint8_t *)ptr, len );
+        /* Write at the logical position, and make sure that the read-ahead
+           buffer does not return stale data afterwards */
+        if( h->ra_len > 0 && __readahead_drop( fs, h ) < 0 )
+        {
+            return -1;
+        }
+
+        return fs->write( h->handle, (uint8_t *)ptr, len );
     }
 }
 
@@ -1234,7 +1583,7 @@ int dir_findfirst( const char * const path, dir_t *dir )
         return -1;
     }
 
-    return fs->findfirst( (char *)path + + __strlen( filesystems[mapping].prefix ), dir );
+    return fs->findfirst( (char *)path + filesystems[mapping].prefix_len, dir );
 }
 
 /**
@@ -1359,6 +1708,49 @@ int unhook_time_call( time_t (*time_fn)( void ) )
     return 0;
 }
 
+/**
+ * @brief Hook into gettimeofday with a sub-second resolution time callback.
+ *
+ * The callback has precedence over the one registered with #hook_time_call.
+ * It must fill the timeval structure and return 0, or return a negative
+ * value if the time is not available, in which case gettimeofday falls
+ * back to the #hook_time_call callback (if any).
+ *
+ * @param[in] timeofday_fn
+ *            Pointer to callback for the current time function
+ *
+ * @return 0 if successful or a negative value on failure.
+ */
+int hook_timeofday_call( int (*timeofday_fn)( struct timeval *ptimeval ) )
+{
+    if( timeofday_fn == NULL )
+    {
+        return -1;
+    }
+
+    timeofday_hook = timeofday_fn;
+
+    return 0;
+}
+
+/**
+ * @brief Unhook from gettimeofday sub-second resolution time callback.
+ *
+ * @param[in] timeofday_fn
+ *            Pointer to callback for the current time function
+ *
+ * @return 0 if successful or a negative value on failure.
+ */
+int unhook_timeofday_call( int (*timeofday_fn)( struct timeval *ptimeval ) )
+{
+    if( timeofday_hook == timeofday_fn )
+    {
+        timeofday_hook = NULL;
+    }
+
+    return 0;
+}
+
 /**
  * @brief Implement _flush_cache as required by GCC for nested functions.
  *
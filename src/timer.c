@@ -4,6 +4,7 @@
  * @ingroup timer
  */
 #include <malloc.h>
+#include <string.h>
 #include "libdragon.h"
 #include "regsinternal.h"
 
@@ -36,8 +37,40 @@
  * @{
  */
 
-/** @brief Internal linked list of timers */
-static timer_link_t *TI_timers = 0;
+/** @brief Entry of the timer queue */
+typedef struct
+{
+	/** @brief Copy of the timer deadline, to avoid dereferencing timers while sorting */
+	uint32_t left;
+	/** @brief The timer */
+	timer_link_t *timer;
+} timer_entry_t;
+
+/** @brief Initial number of entries allocated for the timer queue */
+#define TIMER_QUEUE_INITIAL_SIZE   16
+
+/** @brief Minimum distance in the future at which the compare register is programmed */
+#define TIMER_MIN_DELAY            TIMER_TICKS(2)
+
+/**
+ * @brief Timer queue: a binary min-heap of the active timers, sorted by deadline
+ *
+ * Deadlines are 32-bit tick values that wrap around, so they are compared
+ * by their distance from #TI_base. All the timers in the queue expire after
+ * #TI_base, which is moved forward whenever no timer is expired: after
+ * processing the expired timers, and when a timer is added.
+ */
+static timer_entry_t *TI_queue = NULL;
+/** @brief Number of timers in the queue */
+static int TI_count = 0;
+/** @brief Number of entries allocated in the queue */
+static int TI_size = 0;
+/** @brief Number of timers allocated by the timer module (see #timer_queue_reserve) */
+static int TI_timers = 0;
+/** @brief Reference time for comparing deadlines */
+static uint32_t TI_base = 0;
+/** @brief Timer whose callback is currently running (NULL if stopped during the callback) */
+static timer_link_t *TI_running = NULL;
 
 /** @brief Higher-part of 64-bit tick counter */
 volatile uint32_t ticks64_high;
@@ -51,137 +84,226 @@ extern volatile uint32_t interrupt_disabled_tick;
 /** @brief Timer is the special overflow timer. */
 #define TF_OVERFLOW    0x40
 
-/** @brief Timer has been called once in this interrupt. */
-#define TF_CALLED      0x80
+/** @brief Return true if deadline @p a comes before deadline @p b */
+static inline bool timer_before(uint32_t a, uint32_t b)
+{
+	return a - TI_base < b - TI_base;
+}
 
-/** @brief Update the compare register to match the first expiring timer. */
-static void timer_update_compare(timer_link_t *head) {
-	uint32_t now = TICKS_READ();
-	uint32_t smallest = 0xFFFFFFFF;
+/** @brief Store an entry in the queue, keeping track of its position in the timer */
+static inline void timer_queue_set(int idx, timer_entry_t e)
+{
+	TI_queue[idx] = e;
+	e.timer->queue_idx = idx;
+}
+
+/** @brief Move an entry of the queue up, until its parent expires before it */
+static void timer_queue_sift_up(int idx)
+{
+	timer_entry_t e = TI_queue[idx];
+	while (idx > 0)
+	{
+		int parent = (idx - 1) / 2;
+		if (!timer_before(e.left, TI_queue[parent].left))
+			break;
+		timer_queue_set(idx, TI_queue[parent]);
+		idx = parent;
+	}
+	timer_queue_set(idx, e);
+}
 
-	while (head)
+/** @brief Move an entry of the queue down, until its children expire after it */
+static void timer_queue_sift_down(int idx)
+{
+	timer_entry_t e = TI_queue[idx];
+	while (1)
 	{
-		/* See how much time is left before the timer expires. Notice that
-		   the subtraction is also safe with overflows. */
-		uint32_t left = head->left - now;
-		if (left < smallest)
-			smallest = left;
-
-		/* Go to next */
-		head = head->next;
+		int child = idx * 2 + 1;
+		if (child >= TI_count)
+			break;
+		if (child + 1 < TI_count && timer_before(TI_queue[child+1].left, TI_queue[child].left))
+			child++;
+		if (!timer_before(TI_queue[child].left, e.left))
+			break;
+		timer_queue_set(idx, TI_queue[child]);
+		idx = child;
 	}
+	timer_queue_set(idx, e);
+}
 
-	/* set compare to shortest time left */
-	C0_WRITE_COMPARE(now + smallest);
+/** @brief Check whether a timer is in the queue */
+static bool timer_queue_contains(timer_link_t *timer)
+{
+	/* The index might be garbage for timers allocated by the caller and
+	   never started, so check it before trusting it. */
+	int idx = timer->queue_idx;
+	return idx >= 0 && idx < TI_count && TI_queue[idx].timer == timer;
 }
 
 /**
- * @brief Process linked list of timers
+ * @brief Make room in the queue for the given number of timers.
  *
- * Walk the linked list of timers and call the callbacks of any that
- * have expired.
- *
- * @note This function will remove one-shot timers from the list after
- *       they have fired.
- *
- * @param[in] head
- *            Head of the linked list of timers
- *
- * @retval 1 The list needs reprocessing
- * @retval 0 All timer operations were handled successfully
+ * This allocates memory, so it must not be called from interrupt handlers
+ * or with interrupts disabled. The queue is grown when timers are created
+ * (and when caller-owned timers are started outside of interrupts), so that
+ * inserting a timer never needs to allocate, even from a timer callback.
  */
-static int __proc_timers(timer_link_t * thead)
+static void timer_queue_reserve(int count)
 {
-	timer_link_t *head = thead;
-	timer_link_t *last = 0;
-	uint32_t start = C0_COMPARE();
-	uint32_t now = TICKS_READ();
+	if (count <= TI_size)
+		return;
 
-	while (head)
-	{
-		/* Consider a timer as expired if its deadline is at the
-		 * COMPARE value (time at which the interrupt triggered) or up to 5
-		 * microseconds after. This 5 microseconds window is useful to cluster
-		 * timers that expire close to each other; eg: if the client creates
-		 * many timers with the same period, they will be created in a fast
-		 * sequence and have a little delay between each other. */
-		if (!(head->flags & TF_CALLED) && 
-			!(head->flags & TF_DISABLED) &&
-			TICKS_DISTANCE(start, head->left) >= 0 && 
-			TICKS_DISTANCE(head->left, now+TIMER_TICKS(5)) >= 0)
-		{
-			/* yes - timed out, do callback */
-			head->ovfl = TICKS_DISTANCE(head->left, now);
-
-			/* invoke the appropriate callback function */
-			if (head->flags & TF_CONTEXT && head->callback_with_context)
-				head->callback_with_context(head->ovfl, head->ctx);
-			else if (head->callback)
-				head->callback(head->ovfl);
-
-			/* reset ticks if continuous */
-			if (head->flags & TF_CONTINUOUS)
-			{
-				head->left += head->set;
-				last = head;
-
-				/* Special case: the internal overflow timer has a period
-				 * of 2**32, so next occurrence will look exactly like the
-				 * current one. Since we're going to reprocess the list, we
-				 * would keep executing it many times until we eventually
-				 * exit the 5 microseconds window.
-				 * So we mark this timer as already called (TF_CALLED) and
-				 * avoid calling it again. 
-				 *
-				 * Notice that we do this only for overflow because other timers
-				 * with a short period might actually be called multiple times
-				 * under interrupt. For instance, if a continuous timer with
-				 * a short period is followed by a very slow one-shot timer,
-				 * when the latter is finished the former might need to fire again.
-				 */
-				if (head->flags & TF_OVERFLOW)
-					head->flags |= TF_CALLED;
-			}
-			else
-			{
-				/* one-shot, remove from list */
-				if (last)
-					last->next = head->next;
-				else
-					TI_timers = head->next;
-			}
-
-			/* Go through timer list again. If the callback was slow, maybe
-			   other timers have expired. */
-			return 1;
-		}
+	int size = TI_size;
+	while (size < count)
+		size *= 2;
+	timer_entry_t *queue = malloc(size * sizeof(timer_entry_t));
+	assertf(queue, "not enough memory for the timer queue");
 
-		/* Go to next */
-		last = head;
-		head = head->next;
-	}
+	/* The timer interrupt might be using the queue: switch atomically */
+	disable_interrupts();
+	timer_entry_t *old = TI_queue;
+	memcpy(queue, old, TI_count * sizeof(timer_entry_t));
+	TI_queue = queue;
+	TI_size = size;
+	enable_interrupts();
+	free(old);
+}
 
-	/* Clear the TF_CALLED flag from the overflow timer (if any) */
-	while (thead) {
-		thead->flags &= ~TF_CALLED;
-		thead = thead->next;
+/** @brief Add a timer to the queue. Must be called with interrupts disabled. */
+static void timer_queue_insert(timer_link_t *timer)
+{
+	assertf(TI_count < TI_size, "timer queue full: start caller-owned timers outside of interrupts first");
+	TI_queue[TI_count] = (timer_entry_t){ timer->left, timer };
+	timer_queue_sift_up(TI_count++);
+}
+
+/** @brief Remove a timer from the queue. Must be called with interrupts disabled. */
+static void timer_queue_remove(timer_link_t *timer)
+{
+	int idx = timer->queue_idx;
+	if (idx != --TI_count)
+	{
+		/* Fill the hole with the last entry, which can then move either
+		   up or down to restore the heap order. */
+		timer_queue_set(idx, TI_queue[TI_count]);
+		if (idx > 0 && timer_before(TI_queue[idx].left, TI_queue[(idx - 1) / 2].left))
+			timer_queue_sift_up(idx);
+		else
+			timer_queue_sift_down(idx);
 	}
-	return 0;							// exit timer callback
+	timer->queue_idx = -1;
+}
+
+/** @brief Update the compare register to match the first expiring timer. */
+static void timer_update_compare(void)
+{
+	if (TI_count == 0)
+		return;
+
+	uint32_t now = TICKS_READ();
+	uint32_t left = TI_queue[0].left - TI_base;
+	uint32_t cur = now - TI_base;
+
+	if (left <= cur || left - cur <= TIMER_MIN_DELAY)
+		/* Already expired (or about to): trigger the interrupt as soon
+		   as possible, so that it is processed. */
+		C0_WRITE_COMPARE(now + TIMER_MIN_DELAY);
+	else
+		C0_WRITE_COMPARE(TI_queue[0].left);
+}
+
+/** @brief Insert or move a timer in the queue, and reprogram the compare register */
+static void timer_schedule(timer_link_t *timer)
+{
+	disable_interrupts();
+
+	if (timer_queue_contains(timer))
+		timer_queue_remove(timer);
+
+	/* Move the base forward if no timer is expired, so that the new
+	   deadline is compared correctly even if it is far in the future. */
+	uint32_t now = TICKS_READ();
+	if (TI_count == 0 || TI_queue[0].left - TI_base > now - TI_base)
+		TI_base = now;
+
+	timer_queue_insert(timer);
+	timer_update_compare();
+
+	enable_interrupts();
 }
 
 /**
  * @brief Timer interrupt callback function
  *
  * This function is called by the interrupt controller whenever 
- * compare == count.
+ * compare == count. It runs the callbacks of all the expired timers,
+ * in order of deadline, and then programs the compare register for the
+ * next one.
  */
 static void timer_interrupt_callback(void)
 {
-	while (__proc_timers(TI_timers))
-		{}
+	timer_link_t *overflow = NULL;
+	uint32_t now;
+
+	while (1)
+	{
+		now = TICKS_READ();
+		if (TI_count == 0)
+			break;
+
+		/* Consider a timer as expired if its deadline is up to 5 microseconds
+		 * in the future. This 5 microseconds window is useful to cluster
+		 * timers that expire close to each other; eg: if the client creates
+		 * many timers with the same period, they will be created in a fast
+		 * sequence and have a little delay between each other.
+		 * The overflow timer must instead run exactly after the counter wraps. */
+		timer_link_t *head = TI_queue[0].timer;
+		uint32_t window = (head->flags & TF_OVERFLOW) ? 0 : TIMER_TICKS(5);
+		if (head->left - TI_base > now + window - TI_base)
+			break;
+
+		timer_queue_remove(head);
+		head->ovfl = TICKS_DISTANCE(head->left, now);
+
+		/* invoke the appropriate callback function */
+		TI_running = head;
+		if (head->flags & TF_CONTEXT && head->callback_with_context)
+			head->callback_with_context(head->ovfl, head->ctx);
+		else if (head->callback)
+			head->callback(head->ovfl);
+
+		/* Reschedule if continuous, unless the callback stopped or restarted
+		   the timer itself. Other timers (including this one) are checked
+		   again: if the callback was slow, maybe they have expired too. */
+		if (TI_running == head && (head->flags & TF_CONTINUOUS) && !timer_queue_contains(head))
+		{
+			head->left += head->set;
+
+			/* Special case: the internal overflow timer has a period of 2**32,
+			   so its next deadline is the same as the current one. Queue it only
+			   after moving the base forward, or it would look expired again. */
+			if (head->flags & TF_OVERFLOW)
+				overflow = head;
+			else
+				timer_queue_insert(head);
+		}
+		TI_running = NULL;
+	}
+
+	/* All the timers still in the queue expire after now, so it can become
+	   the new base. If the overflow timer fired, the base must be strictly
+	   after its deadline, otherwise it would look expired again. */
+	if (overflow)
+	{
+		while (TICKS_READ() == overflow->left) {}
+		now = TICKS_READ();
+	}
+	TI_base = now;
+	if (overflow)
+		timer_queue_insert(overflow);
 
 	// Update counter for next interrupt.
-	timer_update_compare(TI_timers);
+	timer_update_compare();
 }
 
 /**
@@ -208,10 +330,25 @@ static void timer_overflow_callback(int ovfl)
  */
 void timer_init(void)
 {
-	assertf(!TI_timers, "timer module already initialized");
+	assertf(!TI_queue, "timer module already initialized");
+	TI_size = TIMER_QUEUE_INITIAL_SIZE;
+	TI_queue = malloc(TI_size * sizeof(timer_entry_t));
+	assertf(TI_queue, "not enough memory for the timer queue");
+	TI_count = 0;
+
 	/* Create first timer for overflows: expires when counter is 0 and
 	 * has a period of 2**32. */
 	timer_link_t *timer = malloc(sizeof(timer_link_t));
+	TI_timers = 1;
+
+	/* Reset the count and compare registers. Avoid to accidentally trigger
+	   an interrupt by setting count to 1 and compare to 0. Also enable
+	   timer interrupts in COP0. */
+	disable_interrupts();
+	ticks64_high = 0;
+	C0_WRITE_COUNT(1);
+	C0_WRITE_COMPARE(0);
+	TI_base = 1;
 	if (timer)
 	{
 		timer->left = 0;
@@ -219,18 +356,10 @@ void timer_init(void)
 		timer->flags = TF_CONTINUOUS | TF_OVERFLOW;
 		timer->callback = timer_overflow_callback;
 		timer->ctx = NULL;
-		timer->next = NULL;
+		timer->queue_idx = -1;
 
-		TI_timers = timer;
+		timer_queue_insert(timer);
 	}
-
-	/* Reset the count and compare registers. Avoid to accidentally trigger
-	   an interrupt by setting count to 1 and compare to 0. Also enable
-	   timer interrupts in COP0. */
-	disable_interrupts();
-	ticks64_high = 0;
-	C0_WRITE_COUNT(1);
-	C0_WRITE_COMPARE(0);
 	set_TI_interrupt(1);
 	register_TI_handler(timer_interrupt_callback);
 	enable_interrupts();
@@ -253,26 +382,22 @@ void timer_init(void)
  */
 timer_link_t *new_timer(int ticks, int flags, timer_callback1_t callback)
 {
-	assertf(TI_timers, "timer module not initialized");
+	assertf(TI_queue, "timer module not initialized");
 	timer_link_t *timer = malloc(sizeof(timer_link_t));
 	if (timer)
 	{
+		timer_queue_reserve(++TI_timers);
 		timer->left = TICKS_READ() + (int32_t)ticks;
 		timer->set = ticks;
 		timer->flags = flags;
 		timer->callback = callback;
 		timer->ctx = NULL;
+		timer->queue_idx = -1;
 
 		if (flags & TF_DISABLED)
 			return timer;
 
-		disable_interrupts();
-
-		timer->next = TI_timers;
-		TI_timers = timer;
-		timer_update_compare(TI_timers);
-
-		enable_interrupts();
+		timer_schedule(timer);
 	}
 	return timer;
 }
@@ -295,26 +420,22 @@ timer_link_t *new_timer(int ticks, int flags, timer_callback1_t callback)
  */
 timer_link_t *new_timer_context(int ticks, int flags, timer_callback2_t callback, void *ctx)
 {
-	assertf(TI_timers, "timer module not initialized");
+	assertf(TI_queue, "timer module not initialized");
 	timer_link_t *timer = malloc(sizeof(timer_link_t));
 	if (timer)
 	{
+		timer_queue_reserve(++TI_timers);
 		timer->left = TICKS_READ() + (int32_t)ticks;
 		timer->set = ticks;
 		timer->flags = flags | TF_CONTEXT;
 		timer->callback_with_context = callback;
 		timer->ctx = ctx;
+		timer->queue_idx = -1;
 
 		if (flags & TF_DISABLED)
 			return timer;
 
-		disable_interrupts();
-
-		timer->next = TI_timers;
-		TI_timers = timer;
-		timer_update_compare(TI_timers);
-
-		enable_interrupts();
+		timer_schedule(timer);
 	}
 	return timer;
 }
@@ -336,7 +457,7 @@ timer_link_t *new_timer_context(int ticks, int flags, timer_callback2_t callback
  */
 void start_timer(timer_link_t *timer, int ticks, int flags, timer_callback1_t callback)
 {
-	assertf(TI_timers, "timer module not initialized");
+	assertf(TI_queue, "timer module not initialized");
 	if (timer)
 	{
 		timer->left = TICKS_READ() + (int32_t)ticks;
@@ -346,15 +467,16 @@ void start_timer(timer_link_t *timer, int ticks, int flags, timer_callback1_t ca
 		timer->ctx = NULL;
 
 		if (flags & TF_DISABLED)
+		{
+			stop_timer(timer);
 			return;
+		}
 
-		disable_interrupts();
-
-		timer->next = TI_timers;
-		TI_timers = timer;
-		timer_update_compare(TI_timers);
+		/* Caller-owned timers are not counted: make room now, if allocating is safe */
+		if (C0_STATUS() & C0_STATUS_IE)
+			timer_queue_reserve(TI_count + 1);
 
-		enable_interrupts();
+		timer_schedule(timer);
 	}
 }
 
@@ -376,7 +498,7 @@ void start_timer(timer_link_t *timer, int ticks, int flags, timer_callback1_t ca
  */
 void start_timer_context(timer_link_t *timer, int ticks, int flags, timer_callback2_t callback, void *ctx)
 {
-	assertf(TI_timers, "timer module not initialized");
+	assertf(TI_queue, "timer module not initialized");
 	if (timer)
 	{
 		timer->left = TICKS_READ() + (int32_t)ticks;
@@ -386,15 +508,16 @@ void start_timer_context(timer_link_t *timer, int ticks, int flags, timer_callba
 		timer->ctx = ctx;
 
 		if (flags & TF_DISABLED)
+		{
+			stop_timer(timer);
 			return;
+		}
 
-		disable_interrupts();
-
-		timer->next = TI_timers;
-		TI_timers = timer;
-		timer_update_compare(TI_timers);
+		/* Caller-owned timers are not counted: make room now, if allocating is safe */
+		if (C0_STATUS() & C0_STATUS_IE)
+			timer_queue_reserve(TI_count + 1);
 
-		enable_interrupts();
+		timer_schedule(timer);
 	}
 }
 
@@ -411,18 +534,12 @@ void restart_timer(timer_link_t *timer)
 		timer->left = TICKS_READ() + (int32_t)timer->set;
 		timer->flags &= ~TF_DISABLED;
 
-		disable_interrupts();
-
-		timer->next = TI_timers;
-		TI_timers = timer;
-		timer_update_compare(TI_timers);
-
-		enable_interrupts();
+		timer_schedule(timer);
 	}
 }
 
 /**
- * @brief Stop a timer and remove it from the list
+ * @brief Stop a timer and remove it from the queue
  *
  * @note This function does not free a timer structure, use #delete_timer
  *       to do this.
@@ -432,31 +549,19 @@ void restart_timer(timer_link_t *timer)
  */
 void stop_timer(timer_link_t *timer)
 {
-	timer_link_t *head;
-	timer_link_t *last = 0;
-
-	assertf(TI_timers, "timer module not initialized");
+	assertf(TI_queue, "timer module not initialized");
 	if (timer)
 	{
 		disable_interrupts();
-		head = TI_timers;
-		while (head)
+		if (timer_queue_contains(timer))
 		{
-			if (head == timer)
-			{
-				/* remove from list */
-				if (last)
-					last->next = head->next;
-				else
-					TI_timers = head->next;
-
-				break;
-			}
-
-			last = head;
-			head = head->next;
+			timer_queue_remove(timer);
+			timer_update_compare();
 		}
-		timer_update_compare(TI_timers);
+
+		/* If the timer is stopped by its own callback, do not reschedule it */
+		if (timer == TI_running)
+			TI_running = NULL;
 		enable_interrupts();
 	}
 }
@@ -469,11 +574,12 @@ void stop_timer(timer_link_t *timer)
  */
 void delete_timer(timer_link_t *timer)
 {
-	assertf(TI_timers, "timer module not initialized");
+	assertf(TI_queue, "timer module not initialized");
 	if (timer)
 	{
 		stop_timer(timer);
 		free(timer);
+		TI_timers--;
 	}
 }
 
@@ -486,18 +592,17 @@ void delete_timer(timer_link_t *timer)
  */
 void timer_close(void)
 {
-	assertf(TI_timers, "timer module not initialized");
+	assertf(TI_queue, "timer module not initialized");
 	disable_interrupts();
 	
 	/* Disable generation of timer interrupt. */
 	set_TI_interrupt(0);
 	unregister_TI_handler(timer_interrupt_callback);
 
-	timer_link_t *head = TI_timers;
-	while (head)
+	for (int i = 0; i < TI_count; i++)
 	{
-		timer_link_t *last = head;
-		head = head->next;
+		timer_link_t *last = TI_queue[i].timer;
+		last->queue_idx = -1;
 
 		if (last->flags & TF_CONTINUOUS)
 		{
@@ -511,7 +616,9 @@ void timer_close(void)
 			free(last);
 		}
 	}
-	TI_timers = 0;
+	free(TI_queue);
+	TI_queue = NULL;
+	TI_count = TI_size = TI_timers = 0;
 	enable_interrupts();
 }
 
@@ -524,7 +631,7 @@ void timer_close(void)
 long long timer_ticks(void)
 {
 	uint32_t low, high;
-	assertf(TI_timers, "timer module not initialized");
+	assertf(TI_queue, "timer module not initialized");
 
 	/* Check whether interrupts are enabled or not. We need a different strategy
 	 * to account for race conditions. */
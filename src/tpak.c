@@ -6,7 +6,11 @@
 
 #include "tpak.h"
 #include "controller.h"
+#include "interrupt.h"
+#include "joybusinternal.h"
 #include <string.h>
+#include <malloc.h>
+#include <assert.h>
 
 /**
  * @defgroup transferpak Transfer Pak interface
@@ -34,6 +38,13 @@
  * Note that these functions do not account for cartridge bank switching.
  * For more information about Game Boy cartridge bank switching, refer to the
  * GBDev Pan Docs at https://gbdev.io/pandocs/
+ *
+ * To dump a whole ROM or Save RAM, use #tpak_stream_begin instead. The stream
+ * takes care of the cartridge bank switching, and reads the data in background
+ * into a ring buffer supplied by the caller, so that the transfer overlaps
+ * with CPU work. The data is fetched with #tpak_stream_read as it arrives,
+ * and #tpak_stream_end reports any error, including a mismatch of the ROM
+ * global checksum.
  */
 
 /**
@@ -69,6 +80,80 @@
 /** @brief Transfer Pak cartridge bank size (16 KiB) */
 #define TPAK_BANK_SIZE   0x4000
 
+/** @brief Game Boy cartridge ROM bank size (16 KiB) */
+#define GB_ROM_BANK_SIZE    0x4000
+/** @brief Game Boy cartridge RAM bank size (8 KiB) */
+#define GB_RAM_BANK_SIZE    0x2000
+
+/** @brief Number of times a stream command is retried on a data CRC mismatch */
+#define TPAK_STREAM_RETRIES 3
+
+/**
+ * @name Memory bank controllers supported by the Transfer Pak stream
+ * @{
+ */
+#define TPAK_MBC_NONE   0   ///< No memory bank controller
+#define TPAK_MBC1       1   ///< MBC1
+#define TPAK_MBC2       2   ///< MBC2
+#define TPAK_MBC3       3   ///< MBC3
+#define TPAK_MBC5       5   ///< MBC5
+/** @} */
+
+/** @brief Maximum number of cartridge register writes needed to map a bank */
+#define TPAK_STREAM_MAX_SETUP   6
+
+_Static_assert(TPAK_STREAM_INFLIGHT == ACCESSORY_PIPE_INFLIGHT, "stream commands are run by the accessory pipeline");
+
+/** @brief State of a Game Boy cartridge stream (see #tpak_stream_begin) */
+struct tpak_stream_s
+{
+    /** @brief Controller (0-3) with the Transfer Pak. */
+    int controller;
+    /** @brief Cartridge memory being streamed. */
+    tpak_stream_source_t source;
+    /** @brief Memory bank controller of the cartridge. */
+    int mbc;
+    /** @brief Ring buffer supplied by the caller. */
+    uint8_t *ring;
+    /** @brief Size of the ring buffer in bytes. */
+    uint32_t ring_size;
+    /** @brief Total number of bytes in the stream. */
+    uint32_t size;
+    /** @brief Number of bytes read by the caller so far. */
+    uint32_t consumed;
+    /** @brief Number of bytes available in the ring buffer so far. */
+    volatile uint32_t produced;
+    /** @brief Number of bytes requested to the Transfer Pak so far. */
+    uint32_t issued;
+    /** @brief Stream offset of the currently mapped bank. */
+    uint32_t bank_start;
+    /** @brief Stream offset of the end of the currently mapped bank. */
+    uint32_t bank_end;
+    /** @brief Transfer Pak address of the currently mapped bank. */
+    uint16_t bank_address;
+    /** @brief Register writes needed to map the next bank. */
+    struct {
+        /** @brief Transfer Pak address to write to. */
+        uint16_t address;
+        /** @brief Value to write. */
+        uint8_t value;
+    } setup[TPAK_STREAM_MAX_SETUP];
+    /** @brief Number of register writes in #setup. */
+    int setup_count;
+    /** @brief Next register write of #setup to issue. */
+    int setup_pos;
+    /** @brief Transfer Pak bank selected by the last write of #setup. */
+    int setup_bank;
+    /** @brief Number of write commands in flight. */
+    int writes_inflight;
+    /** @brief Running cartridge checksum of the received data. */
+    uint16_t checksum;
+    /** @brief Cartridge checksum from the ROM header. */
+    uint16_t expected_checksum;
+    /** @brief Accessory pipeline running the commands. */
+    accessory_pipe_t pipe;
+};
+
 /**
  * @brief Set Transfer Pak or Game Boy cartridge status/control value.
  *
@@ -245,10 +330,15 @@ int tpak_write(int controller, uint16_t address, uint8_t* data, uint16_t size)
             adjusted_address = TPAK_ADDRESS_DATA;
         }
 
-        write_mempak_address(controller, adjusted_address, cursor);
-        address += TPAK_BLOCK_SIZE;
-        cursor += TPAK_BLOCK_SIZE;
-        adjusted_address += TPAK_BLOCK_SIZE;
+        // Transfer up to the end of the current bank in one go
+        int chunk = TPAK_BANK_SIZE - (address % TPAK_BANK_SIZE);
+        if (chunk > end_address - address)
+            chunk = end_address - address;
+
+        write_mempak_bulk(controller, adjusted_address, cursor, chunk);
+        address += chunk;
+        cursor += chunk;
+        adjusted_address += chunk;
     }
 
     return 0;
@@ -295,10 +385,15 @@ int tpak_read(int controller, uint16_t address, uint8_t* buffer, uint16_t size)
             adjusted_address = TPAK_ADDRESS_DATA;
         }
 
-        read_mempak_address(controller, adjusted_address, cursor);
-        address += TPAK_BLOCK_SIZE;
-        cursor += TPAK_BLOCK_SIZE;
-        adjusted_address += TPAK_BLOCK_SIZE;
+        // Transfer up to the end of the current bank in one go
+        int chunk = TPAK_BANK_SIZE - (address % TPAK_BANK_SIZE);
+        if (chunk > end_address - address)
+            chunk = end_address - address;
+
+        read_mempak_bulk(controller, adjusted_address, cursor, chunk);
+        address += chunk;
+        cursor += chunk;
+        adjusted_address += chunk;
     }
 
     return 0;
@@ -325,3 +420,464 @@ bool tpak_check_header(struct gameboy_cartridge_header* header)
 
     return sum == header->header_checksum;
 }
+
+/**
+ * @brief Queue a Transfer Pak bank switch to map the next bank of a stream.
+ *
+ * Nothing is queued if the bank is already selected by the previous
+ * queued write.
+ *
+ * @param[in,out] stream    The stream
+ * @param[in]     tpak_bank Transfer Pak bank (0-3) to select
+ */
+static void tpak_stream_setup_bank(tpak_stream_t *stream, int tpak_bank)
+{
+    if (stream->setup_count && stream->setup_bank == tpak_bank) return;
+    assert(stream->setup_count < TPAK_STREAM_MAX_SETUP);
+    stream->setup[stream->setup_count].address = TPAK_ADDRESS_BANK;
+    stream->setup[stream->setup_count].value = tpak_bank;
+    stream->setup_count++;
+    stream->setup_bank = tpak_bank;
+}
+
+/**
+ * @brief Queue a cartridge register write to map the next bank of a stream.
+ *
+ * @param[in,out] stream     The stream
+ * @param[in]     gb_address Game Boy address of the register
+ * @param[in]     value      Value to write
+ */
+static void tpak_stream_setup_write(tpak_stream_t *stream, uint16_t gb_address, uint8_t value)
+{
+    tpak_stream_setup_bank(stream, gb_address / TPAK_BANK_SIZE);
+    assert(stream->setup_count < TPAK_STREAM_MAX_SETUP);
+    stream->setup[stream->setup_count].address = TPAK_ADDRESS_DATA + (gb_address % TPAK_BANK_SIZE);
+    stream->setup[stream->setup_count].value = value;
+    stream->setup_count++;
+}
+
+/**
+ * @brief Prepare the register writes that map the bank containing the next stream offset.
+ *
+ * Consecutive writes to the same Transfer Pak bank select it only once.
+ *
+ * @param[in,out] stream The stream
+ */
+static void tpak_stream_map_bank(tpak_stream_t *stream)
+{
+    int mbc = stream->mbc;
+    stream->setup_count = stream->setup_pos = 0;
+
+    if (stream->source == TPAK_STREAM_ROM)
+    {
+        int bank = stream->issued / GB_ROM_BANK_SIZE;
+        stream->bank_start = bank * GB_ROM_BANK_SIZE;
+        stream->bank_end = stream->bank_start + GB_ROM_BANK_SIZE;
+
+        // Bank 0 is always at 0x0000, other banks are mapped at 0x4000
+        uint16_t gb_address = bank ? 0x4000 : 0x0000;
+
+        if (mbc == TPAK_MBC1)
+        {
+            if (bank && (bank & 0x1F) == 0)
+            {
+                // Banks 0x20, 0x40 and 0x60 can only be mapped at 0x0000, in mode 1
+                tpak_stream_setup_write(stream, 0x4000, bank >> 5);
+                tpak_stream_setup_write(stream, 0x6000, 1);
+                gb_address = 0x0000;
+            }
+            else
+            {
+                tpak_stream_setup_write(stream, 0x2000, bank & 0x1F);
+                tpak_stream_setup_write(stream, 0x4000, bank >> 5);
+                tpak_stream_setup_write(stream, 0x6000, 0);
+            }
+        }
+        else if (bank && mbc == TPAK_MBC2)
+            tpak_stream_setup_write(stream, 0x2100, bank & 0x0F);
+        else if (bank && mbc == TPAK_MBC3)
+            tpak_stream_setup_write(stream, 0x2000, bank & 0x7F);
+        else if (bank && mbc == TPAK_MBC5)
+        {
+            tpak_stream_setup_write(stream, 0x2000, bank & 0xFF);
+            tpak_stream_setup_write(stream, 0x3000, (bank >> 8) & 1);
+        }
+
+        tpak_stream_setup_bank(stream, gb_address / TPAK_BANK_SIZE);
+        stream->bank_address = TPAK_ADDRESS_DATA + (gb_address % TPAK_BANK_SIZE);
+    }
+    else
+    {
+        int bank = stream->issued / GB_RAM_BANK_SIZE;
+        stream->bank_start = bank * GB_RAM_BANK_SIZE;
+        stream->bank_end = stream->bank_start + GB_RAM_BANK_SIZE;
+        if (stream->bank_end > stream->size)
+            stream->bank_end = stream->size;
+
+        // Enable the RAM before the first bank
+        if (bank == 0)
+            tpak_stream_setup_write(stream, 0x0000, 0x0A);
+
+        if (mbc == TPAK_MBC1 || mbc == TPAK_MBC3 || mbc == TPAK_MBC5)
+        {
+            tpak_stream_setup_write(stream, 0x4000, bank);
+            // MBC1 only switches RAM banks in mode 1
+            if (mbc == TPAK_MBC1 && bank == 0)
+                tpak_stream_setup_write(stream, 0x6000, 1);
+        }
+
+        // Save RAM is at 0xA000
+        tpak_stream_setup_bank(stream, 0xA000 / TPAK_BANK_SIZE);
+        stream->bank_address = TPAK_ADDRESS_DATA + (0xA000 % TPAK_BANK_SIZE);
+    }
+}
+
+/**
+ * @brief Prepare the next command of a stream.
+ *
+ * Register writes are serialized: they are sent only when no other command
+ * is in flight, and reads are sent only after all of them have completed,
+ * so that a retried command never executes with the wrong bank mapped.
+ * Reads are pipelined up to #TPAK_STREAM_INFLIGHT, as long as there is
+ * room for their data in the ring buffer.
+ *
+ * Called by the accessory pipeline, with interrupts disabled.
+ *
+ * @param[in]  pipe The accessory pipeline of the stream
+ * @param[out] cmd  The command to prepare
+ * @return Whether a command was prepared.
+ */
+static bool tpak_stream_next(accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd)
+{
+    tpak_stream_t *stream = pipe->ctx;
+
+    for (;;)
+    {
+        if (stream->setup_pos < stream->setup_count)
+        {
+            if (pipe->count) return false;
+            cmd->write = true;
+            cmd->address = stream->setup[stream->setup_pos].address;
+            memset(cmd->data, stream->setup[stream->setup_pos].value, TPAK_BLOCK_SIZE);
+            stream->setup_pos++;
+            stream->writes_inflight++;
+            return true;
+        }
+
+        if (stream->issued < stream->bank_end)
+        {
+            if (stream->writes_inflight) return false;
+            if (stream->issued + TPAK_BLOCK_SIZE - stream->consumed > stream->ring_size) return false;
+            cmd->write = false;
+            cmd->offset = stream->issued;
+            cmd->address = stream->bank_address + (stream->issued - stream->bank_start);
+            stream->issued += TPAK_BLOCK_SIZE;
+            return true;
+        }
+
+        // Wait for the reads of the current bank before switching
+        if (stream->issued >= stream->size || pipe->count) return false;
+        tpak_stream_map_bank(stream);
+    }
+}
+
+/**
+ * @brief Consume a completed stream command (called under interrupt).
+ *
+ * Commands are retired in issue order: read data is stored in the ring
+ * buffer, where it becomes visible to #tpak_stream_read, and added to the
+ * running checksum.
+ *
+ * @param[in] pipe The accessory pipeline of the stream
+ * @param[in] cmd  The completed command
+ */
+static void tpak_stream_retire(accessory_pipe_t *pipe, accessory_pipe_cmd_t *cmd)
+{
+    tpak_stream_t *stream = pipe->ctx;
+
+    if (cmd->write)
+    {
+        stream->writes_inflight--;
+        return;
+    }
+
+    memcpy(stream->ring + cmd->offset % stream->ring_size, cmd->data, TPAK_BLOCK_SIZE);
+    if (stream->source == TPAK_STREAM_ROM)
+    {
+        for (int i = 0; i < TPAK_BLOCK_SIZE; i++)
+        {
+            // The global checksum does not include itself (0x014E-0x014F)
+            uint32_t offset = cmd->offset + i;
+            if (offset != 0x014E && offset != 0x014F)
+                stream->checksum += cmd->data[i];
+        }
+    }
+    stream->produced += TPAK_BLOCK_SIZE;
+}
+
+/**
+ * @brief Convert an error of the accessory pipeline of a stream.
+ *
+ * @param[in] err Error returned by the accessory pipeline
+ * @return 0 or @ref TPAK_ERROR.
+ */
+static int tpak_stream_error(int err)
+{
+    if (!err) return 0;
+    return (err == -2) ? TPAK_ERROR_NO_TPAK : TPAK_ERROR_TRANSFER;
+}
+
+/**
+ * @brief Return the memory bank controller of a cartridge, if supported by the stream.
+ *
+ * @param[in] header The cartridge header
+ * @return One of the TPAK_MBC values, or -1 if not supported.
+ */
+static int tpak_stream_mbc(struct gameboy_cartridge_header* header)
+{
+    switch (header->cartridge_type)
+    {
+    case GB_ROM_ONLY: case GB_ROM_RAM: case GB_ROM_RAM_BATTERY:
+        return TPAK_MBC_NONE;
+    case GB_MBC1: case GB_MBC1_RAM: case GB_MBC1_RAM_BATTERY:
+        return TPAK_MBC1;
+    case GB_MBC2: case GB_MBC2_BATTERY:
+        return TPAK_MBC2;
+    case GB_MBC3: case GB_MBC3_RAM: case GB_MBC3_RAM_BATTERY:
+    case GB_MBC3_TIMER_BATTERY: case GB_MBC3_TIMER_RAM_BATTERY:
+        return TPAK_MBC3;
+    case GB_MBC5: case GB_MBC5_RAM: case GB_MBC5_RAM_BATTERY:
+    case GB_MBC5_RUMBLE: case GB_MBC5_RUMBLE_RAM: case GB_MBC5_RUMBLE_RAM_BATTERY:
+        return TPAK_MBC5;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief Get the size of a Game Boy cartridge ROM or Save RAM.
+ *
+ * This is the number of bytes that a stream (see #tpak_stream_begin) of the
+ * cartridge will return.
+ *
+ * @param[in] header
+ *            The cartridge header (see #tpak_get_cartridge_header).
+ * @param[in] source
+ *            The cartridge memory (ROM or Save RAM).
+ * @return The size in bytes, or @ref TPAK_ERROR if the memory bank controller
+ *         or the memory size is not supported by the stream, or the
+ *         cartridge has no Save RAM.
+ */
+int tpak_get_cartridge_size(struct gameboy_cartridge_header* header, tpak_stream_source_t source)
+{
+    int mbc = tpak_stream_mbc(header);
+    if (mbc < 0) return TPAK_ERROR_UNSUPPORTED_CART;
+
+    if (source == TPAK_STREAM_ROM)
+    {
+        switch (header->rom_size_code)
+        {
+        case GB_ROM_1152KB: return 72 * GB_ROM_BANK_SIZE;
+        case GB_ROM_1280KB: return 80 * GB_ROM_BANK_SIZE;
+        case GB_ROM_1536KB: return 96 * GB_ROM_BANK_SIZE;
+        default:
+            if (header->rom_size_code > GB_ROM_8MB) return TPAK_ERROR_UNSUPPORTED_CART;
+            return (2 * GB_ROM_BANK_SIZE) << header->rom_size_code;
+        }
+    }
+    else if (source == TPAK_STREAM_SRAM)
+    {
+        // MBC2 has 512x4 bits of built-in RAM
+        if (mbc == TPAK_MBC2) return 512;
+
+        switch (header->ram_size_code)
+        {
+        case GB_RAM_2KB:   return 2 * 1024;
+        case GB_RAM_8KB:   return 8 * 1024;
+        case GB_RAM_32KB:  return 32 * 1024;
+        case GB_RAM_64KB:  return 64 * 1024;
+        case GB_RAM_128KB: return 128 * 1024;
+        default:           return TPAK_ERROR_UNSUPPORTED_CART;
+        }
+    }
+
+    return TPAK_ERROR_INVALID_ARGUMENT;
+}
+
+/**
+ * @brief Start streaming a Game Boy cartridge ROM or Save RAM via Transfer Pak.
+ *
+ * The cartridge header is read to find out the memory bank controller and
+ * the size of the memory, then the whole memory is read in background, bank
+ * by bank, into the ring buffer. The read commands are pipelined with
+ * background joybus priority, so they never delay controller polling, and
+ * the CPU is free to process the data fetched with #tpak_stream_read while
+ * the next blocks are being transferred. Each 32-byte block is verified
+ * with its data CRC as it arrives, and resent up to #TPAK_STREAM_RETRIES
+ * times in case of mismatch.
+ *
+ * ROM only, MBC1, MBC2, MBC3 and MBC5 cartridges are supported.
+ *
+ * The Transfer Pak must have been initialized with #tpak_init. Call
+ * #tpak_stream_end when done, even if the stream was not read completely.
+ *
+ * @code{.c}
+ *     tpak_stream_t *stream;
+ *     static uint8_t ring[4096];
+ *     int ret = tpak_stream_begin(&stream, 0, TPAK_STREAM_ROM, ring, sizeof(ring));
+ *     if (ret == 0) {
+ *         uint32_t size = tpak_stream_size(stream);
+ *         while (ret >= 0 && tpak_stream_tell(stream) < size) {
+ *             uint32_t pos = tpak_stream_tell(stream);
+ *             ret = tpak_stream_read(stream, rom + pos, size - pos);
+ *         }
+ *         ret = tpak_stream_end(stream);
+ *     }
+ * @endcode
+ *
+ * @param[out] stream
+ *             Set to the new stream, if successful.
+ * @param[in]  controller
+ *             The controller (0-3) with Transfer Pak connected.
+ * @param[in]  source
+ *             The cartridge memory to read (ROM or Save RAM).
+ * @param[in]  ring
+ *             Ring buffer where the data is received. It must stay valid
+ *             until #tpak_stream_end.
+ * @param[in]  ring_size
+ *             Size of the ring buffer. Must be a multiple of 32 bytes; at
+ *             least 32 * #TPAK_STREAM_INFLIGHT bytes are needed to fully
+ *             pipeline the transfer.
+ * @return 0 if successful or @ref TPAK_ERROR otherwise.
+ */
+int tpak_stream_begin(tpak_stream_t **stream, int controller, tpak_stream_source_t source, uint8_t *ring, uint32_t ring_size)
+{
+    struct gameboy_cartridge_header header;
+
+    if (!stream || controller < 0 || controller > 3 ||
+        (source != TPAK_STREAM_ROM && source != TPAK_STREAM_SRAM) ||
+        !ring || ring_size < TPAK_BLOCK_SIZE || ring_size % TPAK_BLOCK_SIZE)
+    {
+        return TPAK_ERROR_INVALID_ARGUMENT;
+    }
+
+    int result = tpak_get_cartridge_header(controller, &header);
+    if (result) return result;
+    if (!tpak_check_header(&header)) return TPAK_ERROR_CHECKSUM;
+
+    int size = tpak_get_cartridge_size(&header, source);
+    if (size < 0) return size;
+
+    tpak_stream_t *s = malloc(sizeof(tpak_stream_t));
+    if (!s) return TPAK_ERROR_NO_MEMORY;
+    memset(s, 0, sizeof(*s));
+    s->controller = controller;
+    s->source = source;
+    s->mbc = tpak_stream_mbc(&header);
+    s->ring = ring;
+    s->ring_size = ring_size;
+    s->size = size;
+    s->expected_checksum = header.global_checksum;
+    accessory_pipe_start(&s->pipe, controller, TPAK_STREAM_RETRIES, tpak_stream_next, tpak_stream_retire, s);
+
+    *stream = s;
+    return 0;
+}
+
+/**
+ * @brief Fetch the data received so far by a Transfer Pak stream.
+ *
+ * This function does not block: it copies up to size bytes among those
+ * already received, and frees their space in the ring buffer so that the
+ * stream can proceed. The position in the stream is returned by
+ * #tpak_stream_tell, and the total size by #tpak_stream_size.
+ *
+ * @param[in,out] stream
+ *                The stream started with #tpak_stream_begin.
+ * @param[out]    buffer
+ *                Destination buffer.
+ * @param[in]     size
+ *                Maximum number of bytes to copy.
+ * @return Number of bytes copied (possibly 0), or @ref TPAK_ERROR if
+ *         the transfer failed.
+ */
+int tpak_stream_read(tpak_stream_t *stream, uint8_t *buffer, uint32_t size)
+{
+    disable_interrupts();
+    int err = tpak_stream_error(stream->pipe.error);
+    uint32_t avail = stream->produced - stream->consumed;
+    enable_interrupts();
+
+    if (err) return err;
+    if (size > avail) size = avail;
+
+    uint32_t pos = stream->consumed % stream->ring_size;
+    uint32_t first = stream->ring_size - pos;
+    if (first > size) first = size;
+    memcpy(buffer, stream->ring + pos, first);
+    memcpy(buffer + first, stream->ring, size - first);
+
+    disable_interrupts();
+    stream->consumed += size;
+    accessory_pipe_pump(&stream->pipe);
+    enable_interrupts();
+
+    return size;
+}
+
+/**
+ * @brief Get the total size of a Transfer Pak stream.
+ *
+ * @param[in] stream
+ *            The stream started with #tpak_stream_begin.
+ * @return The size in bytes of the cartridge memory being streamed.
+ */
+uint32_t tpak_stream_size(tpak_stream_t *stream)
+{
+    return stream->size;
+}
+
+/**
+ * @brief Get the position in a Transfer Pak stream.
+ *
+ * @param[in] stream
+ *            The stream started with #tpak_stream_begin.
+ * @return The number of bytes read with #tpak_stream_read so far.
+ */
+uint32_t tpak_stream_tell(tpak_stream_t *stream)
+{
+    return stream->consumed;
+}
+
+/**
+ * @brief Terminate a Transfer Pak stream.
+ *
+ * Waits for the commands in flight, and disables the cartridge Save RAM
+ * if it was being streamed. If the whole ROM was streamed, its global
+ * checksum is verified against the cartridge header. Errors of the commands
+ * that were still in flight are not reported, as their data is discarded.
+ *
+ * The stream is freed, and cannot be used anymore.
+ *
+ * @param[in] stream
+ *            The stream started with #tpak_stream_begin.
+ * @return 0 if successful or @ref TPAK_ERROR otherwise.
+ */
+int tpak_stream_end(tpak_stream_t *stream)
+{
+    accessory_pipe_stop(&stream->pipe);
+    int result = tpak_stream_error(accessory_pipe_wait(&stream->pipe));
+
+    if (stream->source == TPAK_STREAM_SRAM)
+    {
+        tpak_set_bank(stream->controller, 0);
+        tpak_set_value(stream->controller, TPAK_ADDRESS_DATA, 0x00);
+    }
+
+    if (!result && stream->source == TPAK_STREAM_ROM && stream->produced == stream->size &&
+        stream->checksum != stream->expected_checksum)
+        result = TPAK_ERROR_CHECKSUM;
+
+    free(stream);
+    return result;
+}
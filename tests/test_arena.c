@@ -0,0 +1,33 @@
+
+void test_arena(TestContext *ctx)
+{
+    arena_t arena;
+    arena_init(&arena, "test arena", 256);
+    DEFER(arena_close(&arena));
+
+    uint8_t *a = arena_alloc(&arena, 3);
+    uint8_t *b = arena_alloc(&arena, 5);
+    ASSERT(a && b, "allocation failed");
+    ASSERT_EQUAL_HEX((uint32_t)a & 7, 0, "allocation not aligned");
+    ASSERT_EQUAL_HEX((uint32_t)b & 7, 0, "allocation not aligned");
+    ASSERT_EQUAL_SIGNED(b - a, 8, "allocations are not contiguous");
+
+    uint8_t *c = arena_alloc_aligned(&arena, 64, 16);
+    ASSERT_EQUAL_HEX((uint32_t)c & 63, 0, "aligned allocation not aligned");
+
+    // Rewinding releases everything allocated after the mark
+    uint32_t mark = arena_mark(&arena);
+    uint8_t *d = arena_alloc(&arena, 32);
+    arena_rewind(&arena, mark);
+    ASSERT(arena_alloc(&arena, 32) == d, "rewind did not release memory");
+    arena_rewind(&arena, mark);
+
+    // Allocations that do not fit fail without changing the arena
+    ASSERT(arena_alloc(&arena, 256) == NULL, "allocation should not fit");
+    ASSERT_EQUAL_UNSIGNED(arena_mark(&arena), mark, "failed allocation changed the arena");
+
+    arena_reset(&arena);
+    ASSERT(arena_alloc(&arena, 256) == a, "reset did not release memory");
+    ASSERT(arena_alloc(&arena, 1) == NULL, "arena should be full");
+    ASSERT_EQUAL_UNSIGNED(arena.peak, 256, "wrong peak usage");
+}
@@ -1,3 +1,4 @@
+#include <system.h>
 
 void test_cache_invalidate(TestContext *ctx) {
 	// Interrupts causing other code to run can easily invalidate cache and make
@@ -56,3 +57,61 @@ void test_cache_invalidate(TestContext *ctx) {
 		}
 	}
 }
+
+static int32_t uncached_pool_bytes(void) {
+	memory_tag_t tags[MAX_MEMORY_TAGS];
+	int n = sys_get_memory_tags(tags, MAX_MEMORY_TAGS);
+	for (int i=0;i<n;i++)
+		if (strcmp(tags[i].name, "uncached pool") == 0)
+			return tags[i].live_bytes;
+	return 0;
+}
+
+void test_malloc_uncached_pool(TestContext *ctx) {
+	int32_t pool_bytes = uncached_pool_bytes();
+
+	// Small buffers come from the pool: they must be uncached, aligned to
+	// their size class, and not overlap each other.
+	void *bufs[64];
+	for (int i=0;i<64;i++) {
+		int size = 16 << (i % 8);
+		bufs[i] = malloc_uncached(size);
+		ASSERT(bufs[i] != NULL, "allocation %d failed", i);
+		ASSERT(((uint32_t)bufs[i] & 0xF0000000) == 0xA0000000, "buffer %d not uncached: %p", i, bufs[i]);
+		ASSERT(((uint32_t)bufs[i] & 15) == 0, "buffer %d not cacheline aligned: %p", i, bufs[i]);
+		memset(bufs[i], i, size);
+	}
+	for (int i=0;i<64;i++) {
+		uint8_t *p = bufs[i];
+		for (int j=0;j<(16 << (i % 8));j++)
+			ASSERT_EQUAL_HEX(p[j], i, "buffer %d overwritten at %d", i, j);
+	}
+
+	// Freed buffers are reused
+	void *last = bufs[63];
+	free_uncached(last);
+	bufs[63] = malloc_uncached(16 << (63 % 8));
+	ASSERT(bufs[63] == last, "freed buffer not reused (%p != %p)", bufs[63], last);
+
+	// Empty slabs are returned to the heap
+	for (int i=0;i<64;i++)
+		free_uncached(bufs[i]);
+	ASSERT_EQUAL_SIGNED(uncached_pool_bytes(), pool_bytes, "empty slabs not released");
+
+	// A single small buffer only pins a small slab
+	void *small = malloc_uncached(16);
+	ASSERT(uncached_pool_bytes() - pool_bytes <= 4096, "slab too large: %d bytes", (int)(uncached_pool_bytes() - pool_bytes));
+	free_uncached(small);
+	ASSERT_EQUAL_SIGNED(uncached_pool_bytes(), pool_bytes, "empty slab not released");
+
+	// Alignment larger than the size selects a larger class
+	void *aligned = malloc_uncached_aligned(256, 32);
+	ASSERT(((uint32_t)aligned & 255) == 0, "buffer not aligned: %p", aligned);
+	free_uncached(aligned);
+
+	// Large buffers still come from the heap
+	void *big = malloc_uncached(64*1024);
+	ASSERT(big != NULL, "large allocation failed");
+	memset(big, 0xAA, 64*1024);
+	free_uncached(big);
+}
@@ -0,0 +1,69 @@
+static void test_controller_init_once(void) {
+	static bool inited = false;
+	if (!inited) {
+		controller_init();
+		inited = true;
+	}
+}
+
+void test_controller_schedule(TestContext *ctx) {
+	// Timestamps of the last vertical interrupts
+	static volatile uint32_t vi_ticks[16];
+	static volatile int vi_idx;
+	void vi_handler(void) { vi_ticks[vi_idx++ % 16] = TICKS_READ(); }
+
+	timer_init();
+	DEFER(timer_close());
+	test_controller_init_once();
+	DEFER(controller_set_scan_schedule(1, 0));
+
+	bool pal = get_tv_type() == TV_PAL;
+	uint32_t frame = TICKS_PER_SECOND / (pal ? 50 : 60);
+
+	// Count the scans in 200 ms, with the default schedule and with 4
+	// scans per frame. Samples that are never fetched count as dropped.
+	int count_scans(void) {
+		wait_ms(50);
+		controller_scan();
+		controller_reset_latency_stats();
+		wait_ms(200);
+		controller_scan();
+		controller_latency_stats_t stats;
+		controller_get_latency_stats(&stats);
+		return stats.samples + stats.dropped;
+	}
+
+	int frames = pal ? 10 : 12;
+	int scans = count_scans();
+	ASSERT(scans >= frames - 2 && scans <= frames + 2, "wrong number of scans with default schedule: %d", scans);
+
+	controller_set_scan_schedule(4, 0);
+	scans = count_scans();
+	ASSERT(scans >= frames*4 - 4 && scans <= frames*4 + 4, "wrong number of scans with 4 scans per frame: %d", scans);
+
+	// Scan once per frame, in the middle of the frame. The timer is phased
+	// on the vertical interrupt, so the sample must be read about half
+	// a frame after it.
+	register_VI_handler(vi_handler);
+	DEFER(unregister_VI_handler(vi_handler));
+	controller_set_scan_schedule(1, pal ? 312 : 262);
+	wait_ms(100);
+
+	for (int i = 0; i < 4; i++) {
+		wait_ms(20);
+		disable_interrupts();
+		controller_scan();
+		uint32_t sample = controller_get_sample_ticks();
+		int32_t phase = -1;
+		for (int j = 0; j < 16; j++) {
+			int32_t d = TICKS_DISTANCE(vi_ticks[j], sample);
+			if (d >= 0 && (phase < 0 || d < phase))
+				phase = d;
+		}
+		enable_interrupts();
+
+		ASSERT(phase >= 0, "no vertical interrupt before sample");
+		ASSERT(phase >= frame * 4 / 10 && phase <= frame * 7 / 10,
+			"sample not taken in the middle of the frame (phase: %ld ticks, frame: %lu ticks)", phase, frame);
+	}
+}
@@ -97,3 +97,27 @@ void test_debug_sdfs(TestContext *ctx) {
 
 #undef ROM_FILE
 #undef SD_FILE
+
+void test_debug_async(TestContext *ctx) {
+	ASSERT(debug_init_async(256), "cannot activate asynchronous logging");
+	DEFER(debug_close_async());
+
+	// Each line is 20 bytes: fill more than the ring buffer can hold
+	for (int i=0; i<32; i++)
+		fprintf(stderr, "async log line #%02d\n", i);
+
+	uint32_t dropped, dropped_bytes;
+	debug_get_async_stats(&dropped, &dropped_bytes);
+	if (dropped == 0) {
+		SKIP("no debugging channel active");
+		return;
+	}
+	ASSERT(dropped_bytes >= 32*20 - 256, "too few bytes dropped: %lu", dropped_bytes);
+
+	// After a flush, there is room again
+	debug_flush();
+	fprintf(stderr, "async log line #%02d\n", 32);
+	uint32_t dropped2;
+	debug_get_async_stats(&dropped2, NULL);
+	ASSERT_EQUAL_UNSIGNED(dropped2, dropped, "write dropped after flush");
+}
@@ -1,3 +1,6 @@
+#include <unistd.h>
+#include <fcntl.h>
+
 
 void test_dfs_read(TestContext *ctx) {
 	int fh = dfs_open("counter.dat");
@@ -88,3 +91,46 @@ void test_dfs_rom_addr(TestContext *ctx) {
 
 	ASSERT_EQUAL_MEM(buf1, buf2, 128, "DMA ROM access is different");
 }
+
+void test_dfs_readahead(TestContext *ctx) {
+	int fd = open("rom:/counter.dat", O_RDONLY);
+	ASSERT(fd >= 0, "counter.dat not found");
+	DEFER(close(fd));
+	ASSERT_EQUAL_SIGNED(sys_set_readahead(fd, 256), 0, "cannot set read-ahead");
+
+	uint8_t buf[512];
+
+	// Small sequential reads, crossing the read-ahead buffer boundary
+	int pos = 0;
+	for (int i=0; i<64; i++) {
+		int n = 1 + RANDN(15);
+		ASSERT_EQUAL_SIGNED(read(fd, buf, n), n, "short read");
+		for (int j=0; j<n; j++)
+			ASSERT_EQUAL_HEX(buf[j], (pos+j) & 0xFF, "invalid data at %d", pos+j);
+		pos += n;
+	}
+
+	// Seeks, both within and outside the buffer
+	for (int i=0; i<64; i++) {
+		int off = RANDN(1024);
+		ASSERT_EQUAL_SIGNED(lseek(fd, off, SEEK_SET), off, "invalid seek");
+		ASSERT_EQUAL_SIGNED(read(fd, buf, 4), 4, "short read");
+		ASSERT_EQUAL_HEX(buf[0], off & 0xFF, "invalid data after seek to %d", off);
+		ASSERT_EQUAL_HEX(buf[3], (off+3) & 0xFF, "invalid data after seek to %d", off);
+		ASSERT_EQUAL_SIGNED(lseek(fd, 0, SEEK_CUR), off+4, "invalid position");
+	}
+
+	// Large reads bypass the buffer
+	lseek(fd, 3, SEEK_SET);
+	ASSERT_EQUAL_SIGNED(read(fd, buf, sizeof(buf)), sizeof(buf), "short read");
+	ASSERT_EQUAL_HEX(buf[sizeof(buf)-1], (3+sizeof(buf)-1) & 0xFF, "invalid data in large read");
+
+	// Positional reads do not move the file offset
+	lseek(fd, 100, SEEK_SET);
+	read(fd, buf, 1);
+	ASSERT_EQUAL_SIGNED(pread(fd, buf, 8, 700), 8, "short pread");
+	ASSERT_EQUAL_HEX(buf[0], 700 & 0xFF, "invalid data in pread");
+	ASSERT_EQUAL_SIGNED(pread(fd, buf, 8, 110), 8, "short pread");
+	ASSERT_EQUAL_HEX(buf[0], 110 & 0xFF, "invalid data in pread from buffer");
+	ASSERT_EQUAL_SIGNED(lseek(fd, 0, SEEK_CUR), 101, "pread moved the file offset");
+}
@@ -27,3 +27,40 @@ void test_dma_read_misalign(TestContext *ctx) {
 		}
 	}
 }
+
+void test_dma_buffer(TestContext *ctx) {
+	uint32_t rom = dfs_rom_addr("counter.dat");
+	uint8_t ram[128] __attribute__((aligned(16)));
+
+	dma_buffer_audit(true);
+	DEFER(dma_buffer_audit(false));
+
+	// Use a buffer that partially covers the first and last cachelines,
+	// and write the surrounding bytes via the cache: they must survive
+	// the transfer.
+	memset(ram, 0xAA, sizeof(ram));
+	dma_buffer_t buf;
+	dma_buffer_init(&buf, ram+8, 96);
+
+	dma_buffer_rcp_write(&buf);
+	dma_read(ram+8, rom, 96);
+	dma_buffer_release(&buf);
+	ASSERT_EQUAL_SIGNED(buf.state, DMA_BUFFER_CLEAN, "buffer not clean after release");
+
+	for (int i=0; i<8; i++) {
+		ASSERT_EQUAL_HEX(ram[i], 0xAA, "prefix overwritten at %d", i);
+		ASSERT_EQUAL_HEX(ram[104+i], 0xAA, "suffix overwritten at %d", i);
+	}
+	for (int i=0; i<96; i++)
+		ASSERT_EQUAL_HEX(ram[8+i], i, "invalid data at %d", i);
+
+	// Reading a clean buffer requires no writeback; after a CPU write,
+	// the data must reach RDRAM.
+	dma_buffer_rcp_read(&buf);
+	dma_buffer_release(&buf);
+	ram[8] = 0x55;
+	dma_buffer_cpu_write(&buf);
+	dma_buffer_rcp_read(&buf);
+	ASSERT_EQUAL_HEX(((uint8_t*)UncachedAddr(ram))[8], 0x55, "CPU write not written back");
+	dma_buffer_release(&buf);
+}
@@ -76,6 +76,14 @@ void test_eepromfs(TestContext *ctx) {
     result = memcmp(file2_src, file2_dst, sizeof(file2_src));
     ASSERT_EQUAL_SIGNED(result, 0, "eepfs write/read mismatch");
 
+    // Test that the write-back reaches the EEPROM
+    result = eepfs_flush();
+    ASSERT_EQUAL_SIGNED(result, EEPFS_ESUCCESS, "eepfs flush failed");
+    ASSERT_EQUAL_UNSIGNED(eepfs_pending_blocks(), 0, "eepfs blocks still pending after flush");
+    eeprom_read_bytes(file2_dst, (1 + sizeof(file1_src) / EEPROM_BLOCK_SIZE) * EEPROM_BLOCK_SIZE, sizeof(file2_dst));
+    result = memcmp(file2_src, file2_dst, sizeof(file2_src));
+    ASSERT_EQUAL_SIGNED(result, 0, "eepfs write-back mismatch");
+
     // Ensure file1 was not modified
     result = eepfs_read("file1", file1_dst, sizeof(file1_dst));
     ASSERT_EQUAL_SIGNED(result, EEPFS_ESUCCESS, "eepfs read failed");
@@ -96,6 +104,15 @@ void test_eepromfs(TestContext *ctx) {
     ASSERT_EQUAL_SIGNED(result, EEPFS_ESUCCESS, "eepfs close failed");
     result = eepfs_init(eeprom_files2, eeprom_files2_count);
     ASSERT(eepfs_verify_signature() == false, "expected invalid eepfs signature"); 
+
+    // Test that wiping also clears the blocks beyond the filesystem
+    const uint64_t dirty_eeprom_block = 0xFFFFFFFFFFFFFFFFull;
+    uint64_t last_eeprom_block;
+    eeprom_write(eeprom_capacity - 1, (uint8_t *)&dirty_eeprom_block);
     eepfs_wipe();
     ASSERT(eepfs_verify_signature() == true, "expected valid eepfs signature"); 
+    result = eepfs_flush();
+    ASSERT_EQUAL_SIGNED(result, EEPFS_ESUCCESS, "eepfs flush failed");
+    eeprom_read(eeprom_capacity - 1, (uint8_t *)&last_eeprom_block);
+    ASSERT_EQUAL_HEX(last_eeprom_block, 0, "eepfs wipe did not clear the last block");
 }
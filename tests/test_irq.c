@@ -43,3 +43,96 @@ void test_irq_reentrancy(TestContext *ctx) {
 	ASSERT(!fail_order, "invalid order of call of callbacks");
 	ASSERT(!fail_reentrant, "interrupt called while another interrupt was in progress");
 }
+
+void test_irq_priority(TestContext *ctx) {
+	// Check that callbacks are called in order of priority, and that
+	// the latency hook is called before each of them.
+	static int order[4]; static int num_called; static int num_hooks;
+	num_called = 0; num_hooks = 0;
+
+	void cb_low(void) { order[num_called++] = 1; }
+	void cb_default(void) { order[num_called++] = 2; }
+	void cb_high(void) { order[num_called++] = 3; }
+	void hook(interrupt_source_t source, void (*callback)(), uint32_t ticks) {
+		if (source == INTERRUPT_TI) num_hooks++;
+	}
+
+	register_interrupt_handler(INTERRUPT_TI, cb_low, INTERRUPT_PRIORITY_LOW);
+	DEFER(unregister_TI_handler(cb_low));
+	register_TI_handler(cb_default);
+	DEFER(unregister_TI_handler(cb_default));
+	register_interrupt_handler(INTERRUPT_TI, cb_high, INTERRUPT_PRIORITY_HIGH);
+	DEFER(unregister_TI_handler(cb_high));
+	set_interrupt_latency_hook(hook);
+	DEFER(set_interrupt_latency_hook(NULL));
+
+	// Trigger a timer interrupt
+	disable_interrupts();
+	C0_WRITE_COMPARE(TICKS_READ() + TICKS_FROM_MS(1));
+	set_TI_interrupt(1);
+	enable_interrupts();
+	DEFER(set_TI_interrupt(0));
+	wait_ms(2);
+
+	ASSERT_EQUAL_SIGNED(num_called, 3, "wrong number of callbacks called");
+	ASSERT_EQUAL_SIGNED(num_hooks, 3, "wrong number of latency hook calls");
+	ASSERT_EQUAL_SIGNED(order[0], 3, "high priority callback not called first");
+	ASSERT_EQUAL_SIGNED(order[1], 2, "default priority callback not called second");
+	ASSERT_EQUAL_SIGNED(order[2], 1, "low priority callback not called last");
+}
+
+void test_irq_unregister(TestContext *ctx) {
+	// A callback that unregisters itself must not cause the following
+	// callback to be skipped.
+	static int num_first; static int num_second;
+	num_first = 0; num_second = 0;
+
+	void cb_first(void) { num_first++; unregister_TI_handler(cb_first); }
+	void cb_second(void) { num_second++; }
+
+	register_interrupt_handler(INTERRUPT_TI, cb_first, INTERRUPT_PRIORITY_HIGH);
+	register_TI_handler(cb_second);
+	DEFER(unregister_TI_handler(cb_second));
+
+	for (int i=0;i<2;i++) {
+		disable_interrupts();
+		C0_WRITE_COMPARE(TICKS_READ() + TICKS_FROM_MS(1));
+		set_TI_interrupt(1);
+		enable_interrupts();
+		wait_ms(2);
+		set_TI_interrupt(0);
+	}
+
+	ASSERT_EQUAL_SIGNED(num_first, 1, "self-unregistering callback not called once");
+	ASSERT_EQUAL_SIGNED(num_second, 2, "callback after a self-unregistering one skipped");
+}
+
+void test_irq_stats(TestContext *ctx) {
+	interrupt_stats_reset();
+	interrupt_stats_enable(true);
+	DEFER(interrupt_stats_enable(false));
+
+	// A long critical section, and a timer interrupt
+	disable_interrupts();
+	wait_ms(2);
+	enable_interrupts();
+
+	void cb(void) {}
+	register_TI_handler(cb);
+	DEFER(unregister_TI_handler(cb));
+	disable_interrupts();
+	C0_WRITE_COMPARE(TICKS_READ() + TICKS_FROM_MS(1));
+	set_TI_interrupt(1);
+	enable_interrupts();
+	DEFER(set_TI_interrupt(0));
+	wait_ms(2);
+
+	interrupt_stats_t stats;
+	interrupt_stats_get(&stats);
+
+	ASSERT(stats.num_sections >= 2, "critical sections not recorded (%lu)", stats.num_sections);
+	ASSERT(stats.longest[0].ticks >= TICKS_FROM_MS(2), "longest critical section too short (%lu)", stats.longest[0].ticks);
+	ASSERT(stats.longest[0].caller != NULL, "caller of critical section not recorded");
+	ASSERT(stats.longest[1].ticks <= stats.longest[0].ticks, "critical sections not sorted");
+	ASSERT_EQUAL_UNSIGNED(stats.handler_count[INTERRUPT_TI], 1, "timer interrupt not counted");
+}
@@ -0,0 +1,97 @@
+
+#define TEST_KERNEL_PROLOG() \
+	kernel_init(); DEFER(kernel_close());
+
+void test_kernel_basic(TestContext *ctx) {
+	TEST_KERNEL_PROLOG();
+
+	int order[8]; int n = 0;
+
+	int thread(void *arg) {
+		for (int i = 0; i < 3; i++) {
+			order[n++] = (int)arg;
+			kthread_yield();
+		}
+		return (int)arg * 10;
+	}
+
+	kthread_t *t1 = kthread_new("t1", 4096, 0, thread, (void*)1);
+	kthread_t *t2 = kthread_new("t2", 4096, 0, thread, (void*)2);
+
+	// Threads run round-robin only when the main thread yields or blocks
+	ASSERT_EQUAL_SIGNED(n, 0, "threads started before yielding");
+	ASSERT_EQUAL_SIGNED(kthread_join(t1), 10, "wrong exit code");
+	ASSERT_EQUAL_SIGNED(kthread_join(t2), 20, "wrong exit code");
+
+	int expected[6] = { 1, 2, 1, 2, 1, 2 };
+	ASSERT_EQUAL_SIGNED(n, 6, "wrong number of steps");
+	ASSERT_EQUAL_MEM((uint8_t*)order, (uint8_t*)expected, sizeof(expected), "wrong scheduling order");
+}
+
+void test_kernel_mutex_cond(TestContext *ctx) {
+	TEST_KERNEL_PROLOG();
+
+	kmutex_t mutex; kmutex_init(&mutex);
+	kcond_t cond; kcond_init(&cond);
+	int queue = 0, consumed = 0;
+
+	int producer(void *arg) {
+		for (int i = 0; i < 10; i++) {
+			kmutex_lock(&mutex);
+			queue++;
+			kcond_signal(&cond);
+			kmutex_unlock(&mutex);
+			kthread_yield();
+		}
+		return 0;
+	}
+
+	kthread_t *th = kthread_new("producer", 4096, 0, producer, NULL);
+
+	kmutex_lock(&mutex);
+	while (consumed < 10) {
+		while (queue == 0)
+			kcond_wait(&cond, &mutex);
+		queue--;
+		consumed++;
+	}
+	kmutex_unlock(&mutex);
+
+	kthread_join(th);
+	ASSERT_EQUAL_SIGNED(queue, 0, "items left in queue");
+	ASSERT(kmutex_try_lock(&mutex), "mutex still locked");
+	kmutex_unlock(&mutex);
+}
+
+void test_kernel_event_irq(TestContext *ctx) {
+	timer_init();
+	DEFER(timer_close());
+	TEST_KERNEL_PROLOG();
+
+	kevent_t ev; kevent_init(&ev);
+	volatile int steps = 0;
+
+	void cb(int ovfl) {
+		kevent_set(&ev);
+	}
+
+	int sleeper(void *arg) {
+		kthread_sleep(TICKS_FROM_MS(3));
+		steps++;
+		return 0;
+	}
+
+	kthread_t *th = kthread_new("sleeper", 4096, 0, sleeper, NULL);
+	timer_link_t *tt = new_timer(TICKS_FROM_MS(5), TF_ONE_SHOT, cb);
+	DEFER(delete_timer(tt));
+
+	// Block on an event set by the timer interrupt. Meanwhile, the sleeper
+	// thread wakes up and completes.
+	uint32_t t0 = TICKS_READ();
+	kevent_wait(&ev);
+	uint32_t elapsed = TICKS_READ() - t0;
+
+	ASSERT(elapsed >= TICKS_FROM_MS(4), "event wait returned too early (%ld ticks)", elapsed);
+	ASSERT_EQUAL_SIGNED(steps, 1, "sleeper did not run");
+	kthread_join(th);
+}
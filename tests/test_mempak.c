@@ -0,0 +1,51 @@
+#include <malloc.h>
+
+void test_mempak_image_args(TestContext *ctx) {
+	// Arguments and images are validated before talking to the mempak,
+	// so these checks do not need one to be connected.
+	uint8_t *data = malloc(MEMPAK_IMAGE_SIZE);
+	DEFER(free(data));
+	memset(data, 0, MEMPAK_IMAGE_SIZE);
+	mempak_image_t *image = NULL;
+
+	ASSERT_EQUAL_SIGNED(mempak_backup_begin(NULL, 0, data), -1, "null image accepted");
+	ASSERT_EQUAL_SIGNED(mempak_backup_begin(&image, 0, NULL), -1, "null data accepted");
+	ASSERT_EQUAL_SIGNED(mempak_backup_begin(&image, -1, data), -1, "controller -1 accepted");
+	ASSERT_EQUAL_SIGNED(mempak_backup_begin(&image, 4, data), -1, "controller 4 accepted");
+	ASSERT_EQUAL_SIGNED(mempak_restore_begin(NULL, 0, data), -1, "null image accepted");
+	ASSERT_EQUAL_SIGNED(mempak_restore_begin(&image, 0, NULL), -1, "null data accepted");
+	ASSERT_EQUAL_SIGNED(mempak_restore_begin(&image, 4, data), -1, "controller 4 accepted");
+
+	// An image without a valid filesystem is never written
+	ASSERT_EQUAL_SIGNED(mempak_restore_begin(&image, 0, data), -3, "unformatted image accepted");
+	ASSERT(image == NULL, "transfer returned on error");
+}
+
+void test_mempak_image_backup(TestContext *ctx) {
+	test_controller_init_once();
+	if (identify_accessory(0) != ACCESSORY_MEMPAK) {
+		SKIP("mempak not found in controller 1; skipping backup test");
+	}
+
+	uint8_t *data = malloc(MEMPAK_IMAGE_SIZE);
+	DEFER(free(data));
+	uint8_t *expected = malloc(MEMPAK_IMAGE_SIZE);
+	DEFER(free(expected));
+	memset(data, 0xAA, MEMPAK_IMAGE_SIZE);
+
+	mempak_image_t *image;
+	ASSERT_EQUAL_SIGNED(mempak_backup_begin(&image, 0, data), 0, "backup not started");
+
+	// Progress must grow monotonically up to the whole image
+	int last = 0, progress;
+	while ((progress = mempak_image_progress(image)) < MEMPAK_IMAGE_SIZE) {
+		if (progress < 0) break;
+		ASSERT(progress >= last, "progress went backwards: %d -> %d", last, progress);
+		last = progress;
+	}
+	int ret = mempak_image_end(image);
+	ASSERT(ret == 0 || ret == -3, "backup failed: %d", ret);
+
+	ASSERT_EQUAL_SIGNED(read_mempak_bulk(0, 0, expected, MEMPAK_IMAGE_SIZE), 0, "bulk read failed");
+	ASSERT_EQUAL_MEM(data, expected, MEMPAK_IMAGE_SIZE, "backup differs from the mempak contents");
+}
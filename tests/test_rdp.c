@@ -0,0 +1,58 @@
+void test_rdp_triangles_wrap(TestContext *ctx)
+{
+    const int size = 64, cell = 8, cells = size / cell;
+    const int num_tris = cells * cells * 2;
+
+    surface_t fb = surface_alloc(FMT_RGBA16, size, size);
+    DEFER(surface_free(&fb));
+    memset(fb.buffer, 0, fb.height * fb.stride);
+
+    rdp_vertex_t *verts = malloc(num_tris * 3 * sizeof(rdp_vertex_t));
+    DEFER(free(verts));
+    uint16_t *indices = malloc(num_tris * 3 * sizeof(uint16_t));
+    DEFER(free(indices));
+
+    rdp_init();
+    DEFER(rdp_close());
+    rdp_attach(&fb);
+    rdp_sync(SYNC_PIPE);
+    rdp_set_clipping(0, 0, size, size);
+    rdp_enable_triangle_mode(RDP_TRI_SHADE);
+
+    // Each cell is split in two triangles. Shaded triangles are 96 bytes
+    // each, so every pass is longer than the whole ring buffer and the last
+    // pass (whose colors are checked) is drawn after several wrap-arounds.
+    for (int pass = 0; pass < 4; pass++) {
+        for (int i = 0; i < num_tris; i++) {
+            int x = (i / 2) % cells * cell, y = (i / 2) / cells * cell;
+            rdp_vertex_t *v = &verts[i * 3];
+            memset(v, 0, 3 * sizeof(rdp_vertex_t));
+            if (i & 1) {
+                v[0].x = (x + cell) << 2; v[0].y = y << 2;
+                v[1].x = (x + cell) << 2; v[1].y = (y + cell) << 2;
+                v[2].x = x << 2;          v[2].y = (y + cell) << 2;
+            } else {
+                v[0].x = x << 2;          v[0].y = y << 2;
+                v[1].x = (x + cell) << 2; v[1].y = y << 2;
+                v[2].x = x << 2;          v[2].y = (y + cell) << 2;
+            }
+            for (int j = 0; j < 3; j++) {
+                v[j].r = (i + pass) * 8; v[j].g = i; v[j].b = pass * 64; v[j].a = 0xFF;
+                indices[i * 3 + j] = i * 3 + j;
+            }
+        }
+        rdp_draw_triangles(RDP_TRI_SHADE, 0, verts, indices, num_tris);
+    }
+
+    rdp_detach();
+
+    uint16_t *pix = fb.buffer;
+    for (int i = 0; i < num_tris; i++) {
+        int x = (i / 2) % cells * cell, y = (i / 2) / cells * cell;
+        // Sample a pixel well inside each triangle
+        int px = x + ((i & 1) ? cell - 2 : 1), py = y + ((i & 1) ? cell - 2 : 1);
+        uint8_t r = (i + 3) * 8, g = i, b = 3 * 64;
+        uint16_t expected = ((r >> 3) << 11) | ((g >> 3) << 6) | ((b >> 3) << 1) | 1;
+        ASSERT_EQUAL_HEX(pix[py * size + px], expected, "wrong color for triangle %d at (%d,%d)", i, px, py);
+    }
+}
@@ -0,0 +1,48 @@
+#include <time.h>
+
+void test_rtc_clock(TestContext *ctx) {
+	timer_init();
+	DEFER(timer_close());
+
+	if (!rtc_init()) {
+		SKIP("RTC not found; skipping RTC clock tests");
+	}
+	DEFER(rtc_close());
+
+	// The first read goes to the RTC, the following ones are extrapolated
+	// from the timer and must not wait for a Joybus round-trip.
+	struct timeval tv, prev;
+	ASSERT(gettimeofday(&prev, NULL) == 0, "gettimeofday failed");
+
+	uint32_t t0 = TICKS_READ();
+	for (int i = 0; i < 16; i++)
+		gettimeofday(&tv, NULL);
+	uint32_t elapsed = TICKS_DISTANCE(t0, TICKS_READ());
+	ASSERT(elapsed < TICKS_FROM_MS(1), "extrapolated clock too slow (%lu ticks for 16 reads)", elapsed);
+
+	// For 1.5 seconds, the time must never go backwards and must have
+	// sub-second resolution.
+	int usec_changes = 0;
+	t0 = TICKS_READ();
+	while (TICKS_DISTANCE(t0, TICKS_READ()) < TICKS_FROM_MS(1500)) {
+		wait_ms(3);
+		gettimeofday(&tv, NULL);
+		ASSERT(tv.tv_usec >= 0 && tv.tv_usec < 1000000, "invalid microseconds: %ld", (long)tv.tv_usec);
+		ASSERT(tv.tv_sec > prev.tv_sec || (tv.tv_sec == prev.tv_sec && tv.tv_usec >= prev.tv_usec),
+			"time went backwards: %lld.%06ld -> %lld.%06ld",
+			(long long)prev.tv_sec, (long)prev.tv_usec, (long long)tv.tv_sec, (long)tv.tv_usec);
+		if (tv.tv_sec == prev.tv_sec && tv.tv_usec != prev.tv_usec)
+			usec_changes++;
+		prev = tv;
+	}
+	ASSERT(usec_changes > 100, "no sub-second resolution (%d changes)", usec_changes);
+
+	// rtc_get reads the same clock
+	rtc_time_t rtc;
+	ASSERT(rtc_get(&rtc), "rtc_get failed");
+	struct tm tm;
+	time_t sec = prev.tv_sec;
+	localtime_r(&sec, &tm);
+	int diff = (rtc.hour * 3600 + rtc.min * 60 + rtc.sec) - (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec);
+	ASSERT(diff >= 0 && diff <= 1, "rtc_get and gettimeofday disagree (%d seconds)", diff);
+}
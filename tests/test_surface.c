@@ -0,0 +1,97 @@
+#define TEST_SURFACE_PROLOG() \
+    rspq_init(); DEFER(rspq_close()); \
+    surface_rsp_init(); DEFER(surface_rsp_close());
+
+void test_surface_fill(TestContext *ctx)
+{
+    TEST_SURFACE_PROLOG();
+
+    surface_t s16 = surface_alloc(FMT_RGBA16, 320, 16);
+    DEFER(surface_free(&s16));
+    surface_t s32 = surface_alloc(FMT_RGBA32, 1200, 2);
+    DEFER(surface_free(&s32));
+    memset(s16.buffer, 0, s16.height * s16.stride);
+
+    // Fill only a rectangle in the middle, to check that strides are respected
+    surface_t sub = surface_make_sub(&s16, 8, 4, 64, 8);
+    surface_fill_async(&sub, 0x1234);
+    // Rows longer than the DMEM buffer must be split in multiple chunks
+    surface_fill_async(&s32, 0xAABBCCDD);
+    rspq_wait();
+
+    uint16_t *p16 = s16.buffer;
+    for (int y = 0; y < s16.height; y++) {
+        for (int x = 0; x < s16.width; x++) {
+            bool inside = x >= 8 && x < 8+64 && y >= 4 && y < 4+8;
+            ASSERT_EQUAL_HEX(p16[y * s16.width + x], inside ? 0x1234 : 0,
+                "wrong pixel at (%d,%d)", x, y);
+        }
+    }
+
+    uint32_t *p32 = s32.buffer;
+    for (int i = 0; i < s32.width * s32.height; i++)
+        ASSERT_EQUAL_HEX(p32[i], 0xAABBCCDD, "wrong pixel at %d", i);
+}
+
+void test_surface_copy(TestContext *ctx)
+{
+    TEST_SURFACE_PROLOG();
+
+    surface_t src = surface_alloc(FMT_RGBA16, 640, 8);
+    DEFER(surface_free(&src));
+    surface_t dst = surface_alloc(FMT_RGBA16, 640, 8);
+    DEFER(surface_free(&dst));
+
+    uint16_t *ps = src.buffer, *pd = dst.buffer;
+    for (int i = 0; i < src.width * src.height; i++) {
+        ps[i] = i * 7;
+        pd[i] = 0xFFFF;
+    }
+
+    surface_t src_sub = surface_make_sub(&src, 0, 0, 640, 4);
+    surface_t dst_sub = surface_make_sub(&dst, 0, 4, 640, 4);
+    surface_copy_async(&dst_sub, &src_sub);
+    rspq_wait();
+
+    for (int i = 0; i < 640 * 4; i++)
+        ASSERT_EQUAL_HEX(pd[i], 0xFFFF, "destination overwritten at %d", i);
+    ASSERT_EQUAL_MEM((uint8_t*)(pd + 640 * 4), (uint8_t*)ps, 640 * 4 * 2, "copied data does not match");
+}
+
+void test_surface_convert(TestContext *ctx)
+{
+    TEST_SURFACE_PROLOG();
+
+    const int W = 300, H = 3;
+    surface_t s16 = surface_alloc(FMT_RGBA16, W, H);
+    DEFER(surface_free(&s16));
+    surface_t s32 = surface_alloc(FMT_RGBA32, W, H);
+    DEFER(surface_free(&s32));
+    surface_t back = surface_alloc(FMT_RGBA16, W, H);
+    DEFER(surface_free(&back));
+
+    uint16_t *p16 = s16.buffer;
+    for (int i = 0; i < W * H; i++)
+        p16[i] = i * 0x9E37;
+    p16[0] = 0xF800; p16[1] = 0x07C0; p16[2] = 0x003E; p16[3] = 0x0001;
+
+    surface_convert_async(&s32, &s16);
+    surface_convert_async(&back, &s32);
+    rspq_wait();
+
+    uint32_t *p32 = s32.buffer;
+    ASSERT_EQUAL_HEX(p32[0], 0xFF000000, "wrong red expansion");
+    ASSERT_EQUAL_HEX(p32[1], 0x00FF0000, "wrong green expansion");
+    ASSERT_EQUAL_HEX(p32[2], 0x0000FF00, "wrong blue expansion");
+    ASSERT_EQUAL_HEX(p32[3], 0x000000FF, "wrong alpha expansion");
+
+    for (int i = 0; i < W * H; i++) {
+        uint16_t c = p16[i];
+        uint32_t r = (c >> 11) & 0x1F, g = (c >> 6) & 0x1F, b = (c >> 1) & 0x1F;
+        uint32_t exp = ((r << 3 | r >> 2) << 24) | ((g << 3 | g >> 2) << 16) |
+                       ((b << 3 | b >> 2) << 8) | ((c & 1) ? 0xFF : 0);
+        ASSERT_EQUAL_HEX(p32[i], exp, "wrong RGBA32 pixel at %d", i);
+    }
+
+    ASSERT_EQUAL_MEM((uint8_t*)back.buffer, (uint8_t*)s16.buffer, W * H * 2, "round-trip conversion does not match");
+}
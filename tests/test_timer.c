@@ -335,3 +335,34 @@ void test_timer_disabled_start(TestContext *ctx) {
 		2+3+3+2+3+3,
 		"invalid timer_ticks");
 }
+
+void test_timer_many(TestContext *ctx) {
+	timer_init();
+	DEFER(timer_close());
+
+	// Create more timers than the initial size of the timer queue, in
+	// shuffled order, and check that they fire in order of deadline.
+	#define NUM_TIMERS 40
+	volatile int order[NUM_TIMERS];
+	volatile int called = 0;
+	void cb(int ovfl, void *ctx) {
+		order[called++] = (int)ctx;
+	}
+
+	timer_link_t *timers[NUM_TIMERS];
+	for (int i=0; i<NUM_TIMERS; i++) {
+		int n = (i * 17) % NUM_TIMERS;
+		timers[i] = new_timer_context(TIMER_TICKS(100 + n * 50), TF_ONE_SHOT, cb, (void*)n);
+	}
+	DEFER(for (int i=0; i<NUM_TIMERS; i++) delete_timer(timers[i]));
+
+	// Stop a few of them, to exercise removal from the middle of the queue
+	for (int i=0; i<NUM_TIMERS; i+=5)
+		stop_timer(timers[i]);
+
+	wait_ms(4);
+	ASSERT_EQUAL_SIGNED(called, NUM_TIMERS - NUM_TIMERS/5, "wrong number of timers called");
+	for (int i=1; i<called; i++)
+		ASSERT(order[i-1] < order[i], "timers called out of order (%d after %d)", order[i], order[i-1]);
+	#undef NUM_TIMERS
+}
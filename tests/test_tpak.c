@@ -0,0 +1,56 @@
+void test_tpak_stream_args(TestContext *ctx) {
+	// Arguments are validated before talking to the Transfer Pak, so these
+	// checks do not need one to be connected.
+	static uint8_t ring[TPAK_STREAM_INFLIGHT * 32];
+	tpak_stream_t *stream = NULL;
+
+	ASSERT_EQUAL_SIGNED(tpak_stream_begin(NULL, 0, TPAK_STREAM_ROM, ring, sizeof(ring)), TPAK_ERROR_INVALID_ARGUMENT, "null stream accepted");
+	ASSERT_EQUAL_SIGNED(tpak_stream_begin(&stream, -1, TPAK_STREAM_ROM, ring, sizeof(ring)), TPAK_ERROR_INVALID_ARGUMENT, "controller -1 accepted");
+	ASSERT_EQUAL_SIGNED(tpak_stream_begin(&stream, 4, TPAK_STREAM_ROM, ring, sizeof(ring)), TPAK_ERROR_INVALID_ARGUMENT, "controller 4 accepted");
+	ASSERT_EQUAL_SIGNED(tpak_stream_begin(&stream, 0, 2, ring, sizeof(ring)), TPAK_ERROR_INVALID_ARGUMENT, "invalid source accepted");
+	ASSERT_EQUAL_SIGNED(tpak_stream_begin(&stream, 0, TPAK_STREAM_ROM, NULL, sizeof(ring)), TPAK_ERROR_INVALID_ARGUMENT, "null ring accepted");
+	ASSERT_EQUAL_SIGNED(tpak_stream_begin(&stream, 0, TPAK_STREAM_ROM, ring, 0), TPAK_ERROR_INVALID_ARGUMENT, "empty ring accepted");
+	ASSERT_EQUAL_SIGNED(tpak_stream_begin(&stream, 0, TPAK_STREAM_ROM, ring, 48), TPAK_ERROR_INVALID_ARGUMENT, "unaligned ring size accepted");
+	ASSERT(stream == NULL, "stream returned on error");
+}
+
+void test_tpak_cartridge_size(TestContext *ctx) {
+	struct gameboy_cartridge_header header;
+	memset(&header, 0, sizeof(header));
+
+	// ROM sizes
+	header.cartridge_type = GB_MBC5_RAM_BATTERY;
+	header.rom_size_code = GB_ROM_32KB;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_ROM), 32*1024, "wrong size for 32 KiB ROM");
+	header.rom_size_code = GB_ROM_1MB;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_ROM), 1024*1024, "wrong size for 1 MiB ROM");
+	header.rom_size_code = GB_ROM_8MB;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_ROM), 8*1024*1024, "wrong size for 8 MiB ROM");
+	header.rom_size_code = GB_ROM_1152KB;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_ROM), 1152*1024, "wrong size for 1152 KiB ROM");
+	header.rom_size_code = GB_ROM_1536KB;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_ROM), 1536*1024, "wrong size for 1536 KiB ROM");
+	header.rom_size_code = 0x09;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_ROM), TPAK_ERROR_UNSUPPORTED_CART, "unknown ROM size accepted");
+
+	// Save RAM sizes (note that 64 KiB and 128 KiB codes are out of order)
+	header.ram_size_code = GB_RAM_NONE;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_SRAM), TPAK_ERROR_UNSUPPORTED_CART, "cartridge without RAM accepted");
+	header.ram_size_code = GB_RAM_8KB;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_SRAM), 8*1024, "wrong size for 8 KiB RAM");
+	header.ram_size_code = GB_RAM_64KB;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_SRAM), 64*1024, "wrong size for 64 KiB RAM");
+	header.ram_size_code = GB_RAM_128KB;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_SRAM), 128*1024, "wrong size for 128 KiB RAM");
+
+	// MBC2 has built-in RAM, regardless of the RAM size code
+	header.cartridge_type = GB_MBC2_BATTERY;
+	header.ram_size_code = GB_RAM_NONE;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_SRAM), 512, "wrong size for MBC2 RAM");
+
+	// Unsupported memory bank controllers
+	header.cartridge_type = GB_MBC6;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_ROM), TPAK_ERROR_UNSUPPORTED_CART, "MBC6 accepted");
+	header.cartridge_type = GB_MBC7_SENSOR_RUMBLE_RAM_BATTERY;
+	ASSERT_EQUAL_SIGNED(tpak_get_cartridge_size(&header, TPAK_STREAM_SRAM), TPAK_ERROR_UNSUPPORTED_CART, "MBC7 accepted");
+}
@@ -170,15 +170,23 @@ int assert_equal_mem(TestContext *ctx, const char *file, int line, const uint8_t
 #include "test_dfs.c"
 #include "test_eepromfs.c"
 #include "test_cache.c"
+#include "test_arena.c"
 #include "test_ticks.c"
 #include "test_timer.c"
+#include "test_kernel.c"
 #include "test_irq.c"
+#include "test_controller.c"
+#include "test_rtc.c"
+#include "test_tpak.c"
+#include "test_mempak.c"
 #include "test_exception.c"
 #include "test_debug.c"
 #include "test_dma.c"
 #include "test_cop1.c"
 #include "test_constructors.c"
 #include "test_rspq.c"
+#include "test_surface.c"
+#include "test_rdp.c"
 
 /**********************************************************************
  * MAIN
@@ -210,13 +218,31 @@ static const struct Testsuite
 	TEST_FUNC(test_timer_context,            186, TEST_FLAGS_RESET_COUNT),
 	TEST_FUNC(test_timer_disabled_start,     733, TEST_FLAGS_RESET_COUNT),
 	TEST_FUNC(test_timer_disabled_restart,   733, TEST_FLAGS_RESET_COUNT),
+	TEST_FUNC(test_timer_many,                 0, TEST_FLAGS_RESET_COUNT | TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_irq_reentrancy,           230, TEST_FLAGS_RESET_COUNT),
+	TEST_FUNC(test_irq_priority,               0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_irq_unregister,             0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_irq_stats,                  0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_controller_schedule,        0, TEST_FLAGS_RESET_COUNT | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rtc_clock,                  0, TEST_FLAGS_RESET_COUNT | TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_tpak_stream_args,            0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_tpak_cartridge_size,         0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_mempak_image_args,           0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_mempak_image_backup,         0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_kernel_basic,                0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_kernel_mutex_cond,           0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_kernel_event_irq,            0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_dfs_read,                 948, TEST_FLAGS_IO),
 	TEST_FUNC(test_dfs_rom_addr,              25, TEST_FLAGS_IO),
+	TEST_FUNC(test_dfs_readahead,              0, TEST_FLAGS_IO | TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_eepromfs,                   0, TEST_FLAGS_IO),
 	TEST_FUNC(test_cache_invalidate,        1763, TEST_FLAGS_NONE),
+	TEST_FUNC(test_malloc_uncached_pool,       0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_arena,                      0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_debug_sdfs,                 0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_debug_async,                0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_dma_read_misalign,       7003, TEST_FLAGS_NONE),
+	TEST_FUNC(test_dma_buffer,                 0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_cop1_denormalized_float,    0, TEST_FLAGS_NO_EMULATOR),
 	TEST_FUNC(test_rspq_queue_single,          0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_queue_multiple,        0, TEST_FLAGS_NO_BENCHMARK),
@@ -237,6 +263,10 @@ static const struct Testsuite
 	TEST_FUNC(test_rspq_highpri_multiple,      0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_highpri_overlay,       0, TEST_FLAGS_NO_BENCHMARK),
 	TEST_FUNC(test_rspq_big_command,           0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_surface_fill,               0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_surface_copy,               0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_surface_convert,            0, TEST_FLAGS_NO_BENCHMARK),
+	TEST_FUNC(test_rdp_triangles_wrap,         0, TEST_FLAGS_NO_BENCHMARK),
 };
 
 int main() {
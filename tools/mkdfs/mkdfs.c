@@ -1,3 +1,7 @@
+#ifdef __linux__
+/* Needed for copy_file_range */
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
@@ -5,8 +9,11 @@
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "dragonfs.h"
 #include "dfsinternal.h"
 
@@ -16,296 +23,1217 @@
 #define SWAPLONG(i) (((uint32_t)((i) & 0xFF000000) >> 24) | ((uint32_t)((i) & 0x00FF0000) >>  8) | ((uint32_t)((i) & 0x0000FF00) <<  8) | ((uint32_t)((i) & 0x000000FF) << 24))
 #endif
 
-uint8_t *dfs = NULL;
+/* Size of the buffer used to copy file contents into the image (multiple of 16) */
+#define COPY_BUFFER_SIZE    (256 * 1024)
+
+/* Maximum number of hashing threads */
+#define MAX_THREADS         64
+
+/* Identifier and version of the manifest file */
+#define MANIFEST_MAGIC      "mkdfs-manifest"
+#define MANIFEST_VERSION    1
+
+/* A file content stored in the image, shared by all the files with the same contents */
+typedef struct blob
+{
+    /* Content hash (128-bit MurmurHash3) */
+    uint64_t hash[2];
+    /* Size in bytes */
+    uint32_t size;
+    /* Offset within the image */
+    uint32_t offset;
+    /* True if the offset has been assigned */
+    int placed;
+    /* True if the contents are already in the image (incremental mode) */
+    int in_image;
+    /* Number of files with these contents */
+    int refs;
+    /* Path of the first file with these contents, to compare the others with */
+    const char *path;
+    /* File that provides the contents to write */
+    struct node *owner;
+} blob_t;
+
+/* A file or directory to be placed in the filesystem image */
+typedef struct node
+{
+    /* Path on the host filesystem */
+    char *path;
+    /* Name within the filesystem image */
+    char name[MAX_FILENAME_LEN + 1];
+    /* True if this is a directory */
+    int is_dir;
+    /* File size in bytes (files only) */
+    uint32_t size;
+    /* Modification time (files only) */
+    int64_t mtime;
+    /* Content hash (files only) */
+    uint64_t hash[2];
+    /* True if the hash must be computed from the file contents */
+    int need_hash;
+    /* Contents of the file (files only) */
+    blob_t *blob;
+    /* Offset of the directory entry within the image */
+    uint32_t entry;
+    /* Offset of the file contents or of the first child entry */
+    uint32_t file_pointer;
+    /* First child (directories only) and next sibling */
+    struct node *children;
+    struct node *next;
+} node_t;
+
+/* A file recorded in the manifest of a previous build */
+typedef struct
+{
+    char *path;
+    uint32_t size;
+    int64_t mtime;
+    uint64_t hash[2];
+    uint32_t offset;
+    /* File of the tree at the same path, if unchanged since the previous build */
+    struct node *node;
+} manifest_entry_t;
+
+/* A free range of the image (incremental mode) */
+typedef struct
+{
+    uint32_t offset;
+    uint32_t size;
+} extent_t;
+
+/* Size of the image laid out so far */
 uint32_t fs_size = 0;
 
-/* Offset from start of filesystem */
-inline uint32_t sector_offset(void *sector)
+/* Free ranges below fs_size, reused before growing the image */
+extent_t *free_extents = NULL;
+int num_free_extents = 0;
+
+/* All the files of the tree, in image order */
+node_t **files = NULL;
+int num_files = 0;
+
+/* Hash table of the contents, indexed by hash */
+blob_t **blobs = NULL;
+uint32_t blobs_mask = 0;
+
+/* Manifest of the previous build, sorted by path */
+manifest_entry_t *manifest = NULL;
+int manifest_count = 0;
+
+/* Reserve space in the image, return its offset */
+uint32_t dfs_alloc(uint32_t size)
+{
+    uint32_t rsize = (size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    uint32_t offset = fs_size;
+
+    /* First fit within the holes left by a previous build */
+    for(int i = 0; i < num_free_extents; i++)
+    {
+        if(rsize && free_extents[i].size >= rsize)
+        {
+            offset = free_extents[i].offset;
+            free_extents[i].offset += rsize;
+            free_extents[i].size -= rsize;
+            return offset;
+        }
+    }
+
+    fs_size += rsize;
+
+    return offset;
+}
+
+void free_tree(node_t *node)
 {
-    uint32_t x = (uint8_t *)sector - dfs;
+    while(node)
+    {
+        node_t *next = node->next;
+
+        free_tree(node->children);
+        free(node->path);
+        free(node);
 
-    return x;
+        node = next;
+    }
 }
 
-inline void *sector_to_memory(uint32_t offset)
+void print_help(const char * const prog_name)
 {
-    return (void *)(dfs + offset);
+    fprintf(stderr, "Usage: %s [-j <threads>] [-m <manifest> [-i]] <File> <Directory>\n", prog_name);
+    fprintf(stderr, "  where <File> is the resulting filesystem image\n");
+    fprintf(stderr, "  and <Directory> is the directory (including subdirectories) to include\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -j <threads>   Number of threads used to hash files (default: number of CPUs)\n");
+    fprintf(stderr, "  -m <manifest>  Write a manifest of the image, needed by -i\n");
+    fprintf(stderr, "  -i             Incremental build: update the existing image, rewriting only\n");
+    fprintf(stderr, "                 the changed files (requires the manifest of the previous build)\n");
+    fprintf(stderr, "Files with identical contents are stored only once.\n");
 }
 
-uint32_t dfs_alloc(int size)
+/* 128-bit MurmurHash3 (x64 variant), computed incrementally over a file */
+static inline uint64_t rotl64(uint64_t x, int r)
 {
-    void *end;
-    int rsize = (size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    return (x << r) | (x >> (64 - r));
+}
 
-    if(!dfs)
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline uint64_t read_le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+
+    for(int i = 7; i >= 0; i--)
     {
-        dfs = malloc(rsize);
-        fs_size = rsize;
+        v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+#define MURMUR_C1   0x87c37b91114253d5ULL
+#define MURMUR_C2   0x4cf5ad432745937fULL
+
+void hash_blocks(uint64_t h[2], const uint8_t *data, uint32_t len)
+{
+    uint64_t h1 = h[0], h2 = h[1];
+
+    for(uint32_t i = 0; i + 16 <= len; i += 16)
+    {
+        uint64_t k1 = read_le64(data + i);
+        uint64_t k2 = read_le64(data + i + 8);
+
+        k1 *= MURMUR_C1; k1 = rotl64(k1, 31); k1 *= MURMUR_C2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= MURMUR_C2; k2 = rotl64(k2, 33); k2 *= MURMUR_C1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
 
-        end = dfs;
+    h[0] = h1;
+    h[1] = h2;
+}
+
+void hash_final(uint64_t h[2], const uint8_t *tail, uint32_t total_len)
+{
+    uint64_t h1 = h[0], h2 = h[1];
+    uint64_t k1 = 0, k2 = 0;
+
+    switch(total_len & 15)
+    {
+        case 15: k2 ^= (uint64_t)tail[14] << 48; /* fallthrough */
+        case 14: k2 ^= (uint64_t)tail[13] << 40; /* fallthrough */
+        case 13: k2 ^= (uint64_t)tail[12] << 32; /* fallthrough */
+        case 12: k2 ^= (uint64_t)tail[11] << 24; /* fallthrough */
+        case 11: k2 ^= (uint64_t)tail[10] << 16; /* fallthrough */
+        case 10: k2 ^= (uint64_t)tail[9] << 8;   /* fallthrough */
+        case  9: k2 ^= (uint64_t)tail[8];
+                 k2 *= MURMUR_C2; k2 = rotl64(k2, 33); k2 *= MURMUR_C1; h2 ^= k2;
+                 /* fallthrough */
+        case  8: k1 ^= (uint64_t)tail[7] << 56; /* fallthrough */
+        case  7: k1 ^= (uint64_t)tail[6] << 48; /* fallthrough */
+        case  6: k1 ^= (uint64_t)tail[5] << 40; /* fallthrough */
+        case  5: k1 ^= (uint64_t)tail[4] << 32; /* fallthrough */
+        case  4: k1 ^= (uint64_t)tail[3] << 24; /* fallthrough */
+        case  3: k1 ^= (uint64_t)tail[2] << 16; /* fallthrough */
+        case  2: k1 ^= (uint64_t)tail[1] << 8;  /* fallthrough */
+        case  1: k1 ^= (uint64_t)tail[0];
+                 k1 *= MURMUR_C1; k1 = rotl64(k1, 31); k1 *= MURMUR_C2; h1 ^= k1;
+    }
+
+    h1 ^= total_len; h2 ^= total_len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+
+    h[0] = h1;
+    h[1] = h2;
+}
+
+/* Hash the contents of a file */
+int hash_file(node_t *node, uint8_t *buffer)
+{
+    uint32_t done = 0;
+    FILE *fp = fopen(node->path, "rb");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open file '%s' for read!\n", node->path);
+        return -1;
     }
-    else
+
+    node->hash[0] = node->hash[1] = 0;
+
+    while(done < node->size)
     {
-        dfs = realloc(dfs, fs_size + rsize);
+        uint32_t chunk = MIN(node->size - done, COPY_BUFFER_SIZE);
+
+        if(fread(buffer, 1, chunk, fp) != chunk)
+        {
+            break;
+        }
 
-        end = dfs + fs_size;
-        fs_size += rsize;
+        hash_blocks(node->hash, buffer, chunk);
+        done += chunk;
+
+        if(done == node->size)
+        {
+            hash_final(node->hash, buffer + (chunk & ~15), node->size);
+        }
+    }
+
+    fclose(fp);
+
+    if(done != node->size)
+    {
+        fprintf(stderr, "Cannot read all contents of file '%s'!\n", node->path);
+        return -1;
     }
 
-    /* Zero out last bytes */
-    memset(end, 0, rsize);
+    if(node->size == 0)
+    {
+        hash_final(node->hash, NULL, 0);
+    }
 
-    return sector_offset(end);    
+    return 0;
 }
 
-/* Add a new sector to the filesystem, return that sector pointer */
-uint32_t new_sector(void)
+/* Work queue of the hashing threads */
+pthread_mutex_t hash_lock = PTHREAD_MUTEX_INITIALIZER;
+int hash_next = 0;
+int hash_error = 0;
+
+void *hash_worker(void *arg)
 {
-    return dfs_alloc(SECTOR_SIZE);
+    uint8_t *buffer = malloc(COPY_BUFFER_SIZE);
+
+    if(!buffer)
+    {
+        pthread_mutex_lock(&hash_lock);
+        hash_error = 1;
+        pthread_mutex_unlock(&hash_lock);
+        return NULL;
+    }
+
+    while(1)
+    {
+        pthread_mutex_lock(&hash_lock);
+        int i = hash_error ? num_files : hash_next++;
+        pthread_mutex_unlock(&hash_lock);
+
+        if(i >= num_files)
+        {
+            break;
+        }
+
+        if(files[i]->need_hash && hash_file(files[i], buffer))
+        {
+            pthread_mutex_lock(&hash_lock);
+            hash_error = 1;
+            pthread_mutex_unlock(&hash_lock);
+        }
+    }
+
+    free(buffer);
+    return NULL;
 }
 
-uint32_t new_blob(int size)
+/* Hash all the files that need it, with a pool of threads */
+int hash_files(int num_threads)
 {
-    return dfs_alloc(size);    
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+
+    hash_next = 0;
+    hash_error = 0;
+
+    for(int i = 1; i < num_threads; i++)
+    {
+        if(pthread_create(&threads[started], NULL, hash_worker, NULL) == 0)
+        {
+            started++;
+        }
+    }
+
+    /* The main thread works too */
+    hash_worker(NULL);
+
+    for(int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    return hash_error ? -1 : 0;
 }
 
-void kill_fs()
+/* Check that a file has the same contents as the given range of another
+   file. Errors count as a mismatch. */
+int same_contents(const char *path, const char *other, uint32_t offset, uint32_t size)
 {
-    if(dfs)
+    uint8_t *buffer = malloc(2 * COPY_BUFFER_SIZE);
+    FILE *fp = fopen(path, "rb");
+    FILE *fo = fopen(other, "rb");
+    int same = buffer && fp && fo && fseek(fo, offset, SEEK_SET) == 0;
+
+    while(same && size)
     {
-        free(dfs);
+        uint32_t chunk = MIN(size, COPY_BUFFER_SIZE);
+
+        same = fread(buffer, 1, chunk, fp) == chunk &&
+               fread(buffer + COPY_BUFFER_SIZE, 1, chunk, fo) == chunk &&
+               memcmp(buffer, buffer + COPY_BUFFER_SIZE, chunk) == 0;
+        size -= chunk;
     }
+
+    if(fp)
+    {
+        fclose(fp);
+    }
+
+    if(fo)
+    {
+        fclose(fo);
+    }
+
+    free(buffer);
+    return same;
 }
 
-void print_help(const char * const prog_name)
+/* Find the blob with the given contents, optionally creating it. When
+   creating, the hash only selects the candidates: the file at path must
+   also have the same bytes as the blob, otherwise it gets its own blob. */
+blob_t *find_blob(const uint64_t hash[2], uint32_t size, const char *path, int create)
 {
-    fprintf(stderr, "Usage: %s <File> <Directory>\n", prog_name);
-    fprintf(stderr, "  where <File> is the resulting filesystem image\n");
-    fprintf(stderr, "  and <Directory> is the directory (including subdirectories) to include\n");
+    uint32_t i = (uint32_t)hash[0] & blobs_mask;
+
+    while(blobs[i])
+    {
+        if(blobs[i]->hash[0] == hash[0] && blobs[i]->hash[1] == hash[1] && blobs[i]->size == size &&
+           (!create || same_contents(path, blobs[i]->path, 0, size)))
+        {
+            return blobs[i];
+        }
+
+        i = (i + 1) & blobs_mask;
+    }
+
+    if(!create)
+    {
+        return NULL;
+    }
+
+    blobs[i] = calloc(1, sizeof(blob_t));
+
+    if(blobs[i])
+    {
+        blobs[i]->hash[0] = hash[0];
+        blobs[i]->hash[1] = hash[1];
+        blobs[i]->size = size;
+        blobs[i]->path = path;
+    }
+
+    return blobs[i];
 }
 
-uint32_t add_file(const char * const file, uint32_t *size)
+void free_blobs(void)
 {
-    FILE *fp;
+    for(uint32_t i = 0; blobs && i <= blobs_mask; i++)
+    {
+        free(blobs[i]);
+    }
+
+    free(blobs);
+}
+
+int compare_manifest(const void *a, const void *b)
+{
+    return strcmp(((const manifest_entry_t *)a)->path, ((const manifest_entry_t *)b)->path);
+}
 
-    printf("Adding '%s' to filesystem image.\n", file);
+void free_manifest(void)
+{
+    for(int i = 0; i < manifest_count; i++)
+    {
+        free(manifest[i].path);
+    }
 
-    fp = fopen(file, "rb");
+    free(manifest);
+    manifest = NULL;
+    manifest_count = 0;
+}
+
+/* Load the manifest of a previous build. Returns the size of the image it
+   describes, or 0 if it cannot be used */
+uint32_t read_manifest(const char * const path)
+{
+    char line[4096 + 128];
+    uint32_t image_size;
+    int version;
+    FILE *fp = fopen(path, "r");
 
     if(!fp)
     {
-        fprintf(stderr, "Cannot open file '%s' for read!\n", file);
         return 0;
     }
 
-    fseek(fp, 0, SEEK_END);
-    *size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    if (*size > 0x0FFFFFFF)
+    if(!fgets(line, sizeof(line), fp) ||
+       sscanf(line, MANIFEST_MAGIC " %d %" SCNu32, &version, &image_size) != 2 ||
+       version != MANIFEST_VERSION)
     {
-        fprintf(stderr, "File '%s' too big for the filesystem!\n", file);
+        fclose(fp);
         return 0;
     }
 
-    uint32_t blob = new_blob(*size);
-    uint8_t *data = sector_to_memory(blob);
+    while(fgets(line, sizeof(line), fp))
+    {
+        manifest_entry_t entry;
+        int pos;
 
-    int read = fread(data, 1, *size, fp);
-    if (read < 0) {
-        /* Wat? */
-        fprintf(stderr, "Cannot add all contents of file '%s' to filesystem!\n", file);
-        fclose(fp);
-        return 0;    
+        if(sscanf(line, "%016" SCNx64 "%016" SCNx64 " %" SCNu32 " %" SCNu32 " %" SCNd64 " %n",
+                  &entry.hash[0], &entry.hash[1], &entry.size, &entry.offset, &entry.mtime, &pos) != 5)
+        {
+            free_manifest();
+            fclose(fp);
+            return 0;
+        }
+
+        line[strcspn(line, "\r\n")] = 0;
+        entry.path = strdup(line + pos);
+        entry.node = NULL;
+
+        manifest_entry_t *grown = realloc(manifest, (manifest_count + 1) * sizeof(manifest_entry_t));
+
+        if(!entry.path || !grown)
+        {
+            free(entry.path);
+            free_manifest();
+            fclose(fp);
+            return 0;
+        }
+
+        manifest = grown;
+        manifest[manifest_count++] = entry;
     }
 
     fclose(fp);
-    return blob;
+
+    qsort(manifest, manifest_count, sizeof(manifest_entry_t), compare_manifest);
+
+    return image_size;
 }
 
-uint32_t add_directory(const char * const path)
+/* Write the manifest of the image just built */
+int write_manifest(const char * const path)
 {
-    directory_entry_t *tmp_entry;
-    uint32_t first_entry = 0;
-    uint32_t cur_entry = 0;
+    FILE *fp = fopen(path, "w");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Error opening '%s' for writing.\n", path);
+        return -1;
+    }
+
+    fprintf(fp, MANIFEST_MAGIC " %d %" PRIu32 "\n", MANIFEST_VERSION, fs_size);
+
+    for(int i = 0; i < num_files; i++)
+    {
+        node_t *node = files[i];
+
+        fprintf(fp, "%016" PRIx64 "%016" PRIx64 " %" PRIu32 " %" PRIu32 " %" PRId64 " %s\n",
+                node->hash[0], node->hash[1], node->size, node->file_pointer, node->mtime, node->path);
+    }
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* First pass: collect the directory tree, without reading any file contents.
+   Returns 0 on success, and sets *list to the (possibly empty) list of entries */
+int scan_directory(const char * const path, node_t **list)
+{
+    node_t *last = NULL;
     DIR *dirp;
     struct dirent *dp;
 
+    *list = NULL;
+
     if((dirp = opendir(path)) == NULL)
     {
         return 0;
     }
 
-    do {
-        if((dp = readdir(dirp)) != NULL)
+    while((dp = readdir(dirp)) != NULL)
+    {
+        if(strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+        {
+            /* Ignore */
+            continue;
+        }
+
+        node_t *node = calloc(1, sizeof(node_t));
+        char *file = malloc(strlen(path) + strlen(dp->d_name) + 2);
+        struct stat stats;
+
+        if(!node || !file)
         {
-            if(strcmp(dp->d_name, ".") == 0)
+            /* Out of memory */
+            free(node);
+            free(file);
+            closedir(dirp);
+            return -1;
+        }
+
+        strcpy(file, path);
+
+        /* Only add a / if there isn't one */
+        if(path[strlen(path) - 1] != '/')
+        {
+            strcat(file, "/");
+        }
+
+        strcat(file, dp->d_name);
+
+        node->path = file;
+        strncpy(node->name, dp->d_name, MAX_FILENAME_LEN);
+        node->name[MAX_FILENAME_LEN] = 0;
+
+        /* Figure out if it is a directory or regular (windows doesn't include d_type in dirent) */
+        if(stat(file, &stats) != 0)
+        {
+            fprintf(stderr, "Cannot stat '%s': %s\n", file, strerror(errno));
+            free_tree(node);
+            closedir(dirp);
+            return -1;
+        }
+
+        if(S_ISREG(stats.st_mode))
+        {
+            if(stats.st_size > 0x0FFFFFFF)
             {
-                /* Ignore */
+                fprintf(stderr, "File '%s' too big for the filesystem!\n", file);
+                free_tree(node);
+                closedir(dirp);
+                return -1;
             }
-            else if(strcmp(dp->d_name, "..") == 0)
+
+            node->size = stats.st_size;
+            node->mtime = stats.st_mtime;
+        }
+        else if(S_ISDIR(stats.st_mode))
+        {
+            node->is_dir = 1;
+
+            if(scan_directory(file, &node->children))
             {
-                /* Ignore */
+                free_tree(node);
+                closedir(dirp);
+                return -1;
             }
-            else
+
+            if(!node->children)
             {
-                char *file = malloc(strlen(path) + strlen(dp->d_name) + 2);
-                struct stat stats;
-
-                if(!file)
-                {
-                    /* Out of memory */
-                    return 0;
-                }
-
-                strcpy(file, path);
-
-                /* Only add a / if there isn't one */
-                if(path[strlen(path) - 1] != '/')
-                {
-                    strcat(file, "/");
-                }
-
-                strcat(file, dp->d_name);
-
-                /* Figure out if it is a directory or regular (windows doesn't include d_type in dirent) */
-                stat( file, &stats );
-
-                if(S_ISREG(stats.st_mode))
-                {
-                    uint32_t new_entry = new_sector();
-                    uint32_t file_size = 0;
-
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->next_entry = 0;
-
-                    /* Copy over filename */
-                    strncpy(tmp_entry->path, dp->d_name, MAX_FILENAME_LEN);
-                    tmp_entry->path[MAX_FILENAME_LEN] = 0;
-
-                    uint32_t new_file = add_file(file, &file_size);
-
-                    if(!new_file)
-                    {
-                        free(file);
-                        return 0;
-                    }
-
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->file_pointer = SWAPLONG(new_file);
-                    tmp_entry->flags = SWAPLONG((FLAGS_FILE << 28) | (file_size & 0x0FFFFFFF));
-
-                    if(cur_entry)
-                    {
-                        /* Link up! */
-                        tmp_entry = sector_to_memory(cur_entry);
-                        tmp_entry->next_entry = SWAPLONG(new_entry);
-                    }
-
-                    /* This is now the current working entry */
-                    cur_entry = new_entry;
-                }
-                else if(S_ISDIR(stats.st_mode))
-                {
-                    uint32_t new_entry = new_sector();
-
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->flags = SWAPLONG(FLAGS_DIR << 28); /* Size doesn't matter for directories */
-                    tmp_entry->next_entry = 0;
-
-                    /* Copy over filename */
-                    strncpy(tmp_entry->path, dp->d_name, MAX_FILENAME_LEN);
-                    tmp_entry->path[MAX_FILENAME_LEN] = 0;
-
-                    uint32_t new_directory = add_directory(file);
-
-                    if(!new_directory)
-                    {
-                        fprintf(stderr, "Skipping empty directory: %s\n", file);
-                        free(file);
-                        continue;
-                    }
-
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->file_pointer = SWAPLONG(new_directory);
-
-                    if(cur_entry)
-                    {
-                        /* Link up! */
-                        tmp_entry = sector_to_memory(cur_entry);
-                        tmp_entry->next_entry = SWAPLONG(new_entry);
-                    }
-
-                    /* This is now the current working entry */
-                    cur_entry = new_entry;
-                }
-
-                free(file);
-
-                if(!first_entry)
-                {
-                    /* Return pointer to first file on list */
-                    first_entry = cur_entry;
-                }
+                fprintf(stderr, "Skipping empty directory: %s\n", file);
+                free_tree(node);
+                continue;
             }
         }
-    } while (dp != NULL);
+        else
+        {
+            /* Not a file nor a directory */
+            free_tree(node);
+            continue;
+        }
+
+        if(last)
+        {
+            last->next = node;
+        }
+        else
+        {
+            *list = node;
+        }
+
+        last = node;
+    }
 
     closedir(dirp);
 
-    /* Will return 0 if we don't find any entries (don't support directories without files) */
-    return first_entry;
+    return 0;
+}
+
+/* Collect the files of the tree in image order */
+int collect_files(node_t *list)
+{
+    for(node_t *node = list; node; node = node->next)
+    {
+        if(node->is_dir)
+        {
+            if(collect_files(node->children))
+            {
+                return -1;
+            }
+
+            continue;
+        }
+
+        node_t **grown = realloc(files, (num_files + 1) * sizeof(node_t *));
+
+        if(!grown)
+        {
+            return -1;
+        }
+
+        files = grown;
+        files[num_files++] = node;
+    }
+
+    return 0;
+}
+
+int compare_extents(const void *a, const void *b)
+{
+    uint32_t oa = ((const extent_t *)a)->offset;
+    uint32_t ob = ((const extent_t *)b)->offset;
+
+    return (oa > ob) - (oa < ob);
+}
+
+/* Incremental mode: keep the contents of the previous image that are still
+   referenced, and make the rest of it available to dfs_alloc */
+int reuse_image(const char *image_path, uint32_t image_size)
+{
+    extent_t *used = malloc((num_files + 1) * sizeof(extent_t));
+    int num_used = 0;
+
+    if(!used)
+    {
+        return -1;
+    }
+
+    /* The identifier is always in the first sector, and the first entry of
+       the root directory in the second one */
+    used[num_used].offset = 0;
+    used[num_used++].size = 2 * SECTOR_SIZE;
+
+    for(int i = 0; i < manifest_count; i++)
+    {
+        manifest_entry_t *entry = &manifest[i];
+        uint32_t rsize = (entry->size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        blob_t *blob = find_blob(entry->hash, entry->size, NULL, 0);
+
+        if(!blob || blob->placed || entry->offset % SECTOR_SIZE || entry->offset + rsize > image_size ||
+           entry->offset < 2 * SECTOR_SIZE)
+        {
+            /* Not needed anymore, or already found in the image */
+            continue;
+        }
+
+        /* Unless they belong to an unchanged file at the same path, contents
+           that only match by hash must be the same bytes */
+        if(!(entry->node && entry->node->blob == blob) &&
+           !same_contents(blob->path, image_path, entry->offset, entry->size))
+        {
+            continue;
+        }
+
+        blob->offset = entry->offset;
+        blob->placed = 1;
+        blob->in_image = 1;
+
+        used[num_used].offset = entry->offset;
+        used[num_used++].size = rsize;
+    }
+
+    qsort(used, num_used, sizeof(extent_t), compare_extents);
+
+    /* Everything else is free */
+    free_extents = malloc((num_used + 1) * sizeof(extent_t));
+
+    if(!free_extents)
+    {
+        free(used);
+        return -1;
+    }
+
+    uint32_t end = 0;
+
+    for(int i = 0; i <= num_used; i++)
+    {
+        uint32_t start = (i < num_used) ? used[i].offset : image_size;
+
+        if(start > end)
+        {
+            free_extents[num_free_extents].offset = end;
+            free_extents[num_free_extents++].size = start - end;
+        }
+
+        if(i < num_used)
+        {
+            end = MAX(end, used[i].offset + used[i].size);
+        }
+    }
+
+    fs_size = MAX(image_size, 2 * SECTOR_SIZE);
+    free(used);
+
+    return 0;
+}
+
+/* Assign image offsets to a list of entries, in the same order they will be
+   written. The first entry goes at first_entry if not zero. */
+void layout_directory(node_t *list, uint32_t first_entry)
+{
+    for(node_t *node = list; node; node = node->next)
+    {
+        node->entry = (node == list && first_entry) ? first_entry : dfs_alloc(SECTOR_SIZE);
+
+        if(node->is_dir)
+        {
+            layout_directory(node->children, 0);
+            node->file_pointer = node->children->entry;
+        }
+        else
+        {
+            blob_t *blob = node->blob;
+
+            if(!blob->placed)
+            {
+                /* First file with these contents */
+                blob->offset = dfs_alloc(blob->size);
+                blob->placed = 1;
+                blob->owner = node;
+            }
+
+            node->file_pointer = blob->offset;
+        }
+    }
+}
+
+/* Write zeros to pad the image up to the next sector boundary */
+int write_padding(FILE *out, uint32_t size)
+{
+    static const uint8_t zeros[SECTOR_SIZE];
+    uint32_t pad = (SECTOR_SIZE - size % SECTOR_SIZE) % SECTOR_SIZE;
+
+    return fwrite(zeros, 1, pad, out) == pad ? 0 : -1;
+}
+
+/* Stream the contents of a file into the image, with a fixed-size buffer */
+int write_file(FILE *out, node_t *node, uint8_t *buffer)
+{
+    uint32_t copied = 0;
+    FILE *fp;
+
+    printf("Adding '%s' to filesystem image.\n", node->path);
+
+    fp = fopen(node->path, "rb");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open file '%s' for read!\n", node->path);
+        return -1;
+    }
+
+    if(fseek(out, node->file_pointer, SEEK_SET) != 0)
+    {
+        fclose(fp);
+        return -1;
+    }
+
+#ifdef __linux__
+    /* Let the kernel copy the data directly between the files if possible */
+    if(node->size > 0 && fflush(out) == 0)
+    {
+        while(copied < node->size)
+        {
+            ssize_t ret = copy_file_range(fileno(fp), NULL, fileno(out), NULL, node->size - copied, 0);
+
+            if(ret <= 0)
+            {
+                break;
+            }
+
+            copied += ret;
+        }
+
+        /* Resync the stdio streams with the file offsets moved by the kernel */
+        fseek(fp, copied, SEEK_SET);
+        fseek(out, node->file_pointer + copied, SEEK_SET);
+    }
+#endif
+
+    while(copied < node->size)
+    {
+        uint32_t chunk = MIN(node->size - copied, COPY_BUFFER_SIZE);
+
+        if(fread(buffer, 1, chunk, fp) != chunk)
+        {
+            break;
+        }
+
+        if(fwrite(buffer, 1, chunk, out) != chunk)
+        {
+            fclose(fp);
+            return -1;
+        }
+
+        copied += chunk;
+    }
+
+    fclose(fp);
+
+    if(copied != node->size)
+    {
+        fprintf(stderr, "Cannot add all contents of file '%s' to filesystem!\n", node->path);
+        return -1;
+    }
+
+    return write_padding(out, node->size);
+}
+
+/* Second pass: write the entries and the new file contents */
+int write_directory(FILE *out, node_t *list, uint8_t *buffer)
+{
+    for(node_t *node = list; node; node = node->next)
+    {
+        directory_entry_t entry;
+
+        memset(&entry, 0, sizeof(entry));
+        entry.next_entry = SWAPLONG(node->next ? node->next->entry : 0);
+        strcpy(entry.path, node->name);
+        entry.file_pointer = SWAPLONG(node->file_pointer);
+
+        if(node->is_dir)
+        {
+            entry.flags = SWAPLONG(FLAGS_DIR << 28); /* Size doesn't matter for directories */
+        }
+        else
+        {
+            entry.flags = SWAPLONG((FLAGS_FILE << 28) | (node->size & 0x0FFFFFFF));
+        }
+
+        if(fseek(out, node->entry, SEEK_SET) != 0 || fwrite(&entry, 1, sizeof(entry), out) != sizeof(entry))
+        {
+            return -1;
+        }
+
+        if(node->is_dir)
+        {
+            if(write_directory(out, node->children, buffer))
+            {
+                return -1;
+            }
+        }
+        else if(node->blob->owner == node && !node->blob->in_image)
+        {
+            if(write_file(out, node, buffer))
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Drop the free space at the end of the image, so that it shrinks when
+   files are removed (incremental mode) */
+void trim_free_extents(void)
+{
+    /* Free extents are sorted and never adjacent, so only the last
+       non-empty one can reach the end of the image */
+    for(int i = num_free_extents - 1; i >= 0; i--)
+    {
+        if(free_extents[i].size)
+        {
+            if(free_extents[i].offset + free_extents[i].size == fs_size)
+            {
+                fs_size = free_extents[i].offset;
+                free_extents[i].size = 0;
+            }
+
+            break;
+        }
+    }
+}
+
+/* Clear the parts of the image that are not used anymore (incremental mode) */
+int clear_free_extents(FILE *out, uint8_t *buffer)
+{
+    memset(buffer, 0, COPY_BUFFER_SIZE);
+
+    for(int i = 0; i < num_free_extents; i++)
+    {
+        uint32_t left = free_extents[i].size;
+
+        if(fseek(out, free_extents[i].offset, SEEK_SET) != 0)
+        {
+            return -1;
+        }
+
+        while(left)
+        {
+            uint32_t chunk = MIN(left, COPY_BUFFER_SIZE);
+
+            if(fwrite(buffer, 1, chunk, out) != chunk)
+            {
+                return -1;
+            }
+
+            left -= chunk;
+        }
+    }
+
+    return 0;
+}
+
+int default_threads(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(n > 0)
+    {
+        return MIN(n, MAX_THREADS);
+    }
+#endif
+
+    return 4;
 }
 
 int main(int argc, char *argv[])
 {
-    if(argc != 3)
+    node_t *root = NULL;
+    const char *manifest_path = NULL;
+    int incremental = 0;
+    int num_threads = default_threads();
+    int i;
+
+    for(i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            num_threads = atoi(argv[++i]);
+
+            if(num_threads < 1 || num_threads > MAX_THREADS)
+            {
+                fprintf(stderr, "Invalid number of threads: %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            manifest_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "-i") == 0)
+        {
+            incremental = 1;
+        }
+        else
+        {
+            print_help(argv[0]);
+            return -1;
+        }
+    }
+
+    if(argc - i != 2 || (incremental && !manifest_path))
     {
         print_help(argv[0]);
         return -1;
     }
 
-    /* Add in identifier */
-    directory_entry_t *id = sector_to_memory(new_sector());
+    const char *image_path = argv[i];
+    const char *dir_path = argv[i + 1];
+
+    if(scan_directory(dir_path, &root))
+    {
+        fprintf(stderr, "Error creating filesystem: cannot scan directory: %s\n", dir_path);
+        free_tree(root);
+        return -1;
+    }
 
-    if(!id)
+    if(!root)
+    {
+        /* Error adding directory */
+        fprintf(stderr, "Error creating filesystem: directory is empty or does not exist: %s\n", dir_path);
+        return -1;
+    }
+
+    if(collect_files(root))
     {
         fprintf(stderr, "Out of memory!\n");
+        free_tree(root);
+        return -1;
+    }
 
+    /* Check whether the previous image can be updated */
+    uint32_t image_size = 0;
+
+    if(incremental)
+    {
+        struct stat stats;
+
+        image_size = read_manifest(manifest_path);
+
+        if(!image_size || stat(image_path, &stats) != 0 || stats.st_size != image_size)
+        {
+            printf("No valid previous image, building '%s' from scratch.\n", image_path);
+            free_manifest();
+            image_size = 0;
+        }
+    }
+
+    /* Hash the contents of all the files, except the unchanged ones of an incremental build */
+    for(int f = 0; f < num_files; f++)
+    {
+        node_t *node = files[f];
+        manifest_entry_t key = { .path = node->path };
+        manifest_entry_t *prev = manifest_count ?
+            bsearch(&key, manifest, manifest_count, sizeof(manifest_entry_t), compare_manifest) : NULL;
+
+        if(prev && prev->size == node->size && prev->mtime == node->mtime)
+        {
+            node->hash[0] = prev->hash[0];
+            node->hash[1] = prev->hash[1];
+            prev->node = node;
+        }
+        else
+        {
+            node->need_hash = 1;
+        }
+    }
+
+    if(hash_files(num_threads))
+    {
+        fprintf(stderr, "Error creating filesystem: cannot read all files.\n");
+        free_tree(root);
+        free(files);
+        free_manifest();
         return -1;
     }
 
-    id->flags = SWAPLONG(ROOT_FLAGS);
-    id->next_entry = SWAPLONG(ROOT_NEXT_ENTRY);
-    strcpy(id->path, ROOT_PATH);
+    /* Index the contents, so that identical files share them */
+    for(blobs_mask = 1; blobs_mask < 2 * (uint32_t)num_files; blobs_mask <<= 1) {}
+    blobs = calloc(blobs_mask, sizeof(blob_t *));
+    blobs_mask--;
 
-    if(!add_directory(argv[2]))
+    int unique = 0;
+
+    for(int f = 0; blobs && f < num_files; f++)
     {
-        /* Error adding directory */
-        fprintf(stderr, "Error creating filesystem: directory is empty or does not exist: %s\n", argv[2]);
+        blob_t *blob = find_blob(files[f]->hash, files[f]->size, files[f]->path, 1);
 
-        kill_fs();
+        if(!blob)
+        {
+            break;
+        }
 
+        if(blob->refs++ == 0)
+        {
+            unique++;
+        }
+
+        files[f]->blob = blob;
+    }
+
+    if(!blobs || (num_files && !files[num_files - 1]->blob) ||
+       (image_size && reuse_image(image_path, image_size)))
+    {
+        fprintf(stderr, "Out of memory!\n");
+        free_tree(root);
+        free(files);
+        free_blobs();
+        free_manifest();
         return -1;
     }
 
+    /* The identifier comes first, followed by the first entry of the root
+       directory, where the runtime looks for it */
+    if(!image_size)
+    {
+        dfs_alloc(2 * SECTOR_SIZE);
+    }
+
+    layout_directory(root, SECTOR_SIZE);
+    trim_free_extents();
+
+    /* The manifest is stale as soon as the image is modified */
+    if(manifest_path)
+    {
+        remove(manifest_path);
+    }
+
     /* Write out filesystem */
-    FILE *fp = fopen(argv[1], "wb");
+    FILE *fp = fopen(image_path, image_size ? "r+b" : "wb");
+    uint8_t *buffer = malloc(COPY_BUFFER_SIZE);
 
-    if(!fp)
+    if(!fp || !buffer)
     {
         /* Error writing file out */
-        fprintf(stderr, "Error opening '%s' for writing.\n", argv[1]);
+        fprintf(stderr, "Error opening '%s' for writing.\n", image_path);
 
-        kill_fs();
+        if(fp)
+        {
+            fclose(fp);
+        }
+
+        free(buffer);
+        free_tree(root);
+        free(files);
+        free_blobs();
+        free_manifest();
 
         return -1;
     }
 
-    fwrite(dfs, 1, fs_size, fp);
-    fclose(fp);
+    /* Add in identifier */
+    directory_entry_t id;
 
-    kill_fs();
+    memset(&id, 0, sizeof(id));
+    id.flags = SWAPLONG(ROOT_FLAGS);
+    id.next_entry = SWAPLONG(ROOT_NEXT_ENTRY);
+    strcpy(id.path, ROOT_PATH);
 
-    return 0;
+    int ret = 0;
+
+    if(fwrite(&id, 1, sizeof(id), fp) != sizeof(id) || write_directory(fp, root, buffer) ||
+       clear_free_extents(fp, buffer) || fflush(fp) != 0 || ftruncate(fileno(fp), fs_size) != 0)
+    {
+        fprintf(stderr, "Error writing filesystem image '%s'.\n", image_path);
+        ret = -1;
+    }
+
+    if(fclose(fp) != 0)
+    {
+        ret = -1;
+    }
+
+    if(!ret && manifest_path && write_manifest(manifest_path))
+    {
+        fprintf(stderr, "Error writing manifest '%s'.\n", manifest_path);
+        ret = -1;
+    }
+
+    if(!ret)
+    {
+        printf("%d files, %d unique contents, image size %" PRIu32 " bytes.\n", num_files, unique, fs_size);
+    }
+
+    free(buffer);
+    free_tree(root);
+    free(files);
+    free_blobs();
+    free_manifest();
+
+    if(ret)
+    {
+        remove(image_path);
+    }
+
+    return ret;
 }
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <math.h>
 #include <png.h>
 #include <sys/types.h>
 #include <sys/param.h>
@@ -12,6 +13,14 @@
 
 #define FORMAT_UNCOMPRESSED 0
 
+/* The number of additional mipmap levels is stored in the upper nibble of the format byte */
+#define FORMAT_LODS_SHIFT   4
+#define MAX_LODS            8
+
+#define MIPMAP_NONE         0
+#define MIPMAP_BOX          1
+#define MIPMAP_LANCZOS      2
+
 #if BYTE_ORDER == BIG_ENDIAN
 #define SWAP_WORD(x) (x)
 #else
@@ -34,7 +43,154 @@ void write_value( uint8_t *colorbuf, FILE *fp, int bitdepth )
     }
 }
 
-int read_png( char *png_file, char *spr_file, int depth, int hslices, int vslices )
+void write_image( uint8_t *image, int width, int height, FILE *fp, int bitdepth, int pad )
+{
+    int size = width * height * ((bitdepth == BITDEPTH_32BPP) ? 4 : 2);
+    uint8_t zero = 0;
+
+    for( int i = 0; i < width * height; i++ )
+    {
+        write_value( &image[i * 4], fp, bitdepth );
+    }
+
+    /* Pad to 8 bytes when another level follows, as the RDP can only load
+       textures from aligned addresses */
+    for( ; pad && size % 8; size++ )
+    {
+        fwrite( &zero, 1, 1, fp );
+    }
+}
+
+/* Halve an image by averaging each 2x2 block. Colors are weighted by alpha so that
+   transparent pixels do not darken the edges of opaque areas. */
+uint8_t *mipmap_box( uint8_t *src, int width, int height )
+{
+    int dw = width / 2;
+    int dh = height / 2;
+    uint8_t *dst = malloc( dw * dh * 4 );
+
+    for( int y = 0; y < dh; y++ )
+    {
+        for( int x = 0; x < dw; x++ )
+        {
+            int sum[3] = { 0, 0, 0 };
+            int plain[3] = { 0, 0, 0 };
+            int alpha = 0;
+
+            for( int j = 0; j < 4; j++ )
+            {
+                uint8_t *p = &src[(((y * 2) + (j >> 1)) * width + (x * 2) + (j & 1)) * 4];
+
+                for( int c = 0; c < 3; c++ )
+                {
+                    sum[c] += p[c] * p[3];
+                    plain[c] += p[c];
+                }
+                alpha += p[3];
+            }
+
+            uint8_t *out = &dst[(y * dw + x) * 4];
+            for( int c = 0; c < 3; c++ )
+            {
+                out[c] = alpha ? (sum[c] + alpha / 2) / alpha : (plain[c] + 2) / 4;
+            }
+            out[3] = (alpha + 2) / 4;
+        }
+    }
+
+    return dst;
+}
+
+float lanczos2( float x )
+{
+    if( x == 0.0f ) { return 1.0f; }
+    if( x <= -2.0f || x >= 2.0f ) { return 0.0f; }
+
+    float px = M_PI * x;
+    return 2.0f * sinf( px ) * sinf( px / 2.0f ) / (px * px);
+}
+
+/* Halve a single row or column of premultiplied pixels with a Lanczos-2 filter.
+   Taps are clamped to the slice containing each output pixel, so that the
+   images of a spritemap do not bleed into each other. */
+void lanczos_halve( float *src, int sstep, float *dst, int dstep, int len, int slice )
+{
+    for( int i = 0; i < len / 2; i++ )
+    {
+        int first = ((i * 2) / slice) * slice;
+        int last = first + slice - 1;
+        float acc[4] = { 0, 0, 0, 0 };
+        float wsum = 0;
+
+        for( int k = i * 2 - 3; k <= i * 2 + 4; k++ )
+        {
+            float w = lanczos2( ((k + 0.5f) - (i * 2 + 1)) / 2.0f );
+            float *p = &src[MIN( MAX( k, first ), last ) * sstep];
+
+            for( int c = 0; c < 4; c++ )
+            {
+                acc[c] += p[c] * w;
+            }
+            wsum += w;
+        }
+
+        for( int c = 0; c < 4; c++ )
+        {
+            dst[i * dstep + c] = acc[c] / wsum;
+        }
+    }
+}
+
+/* Halve an image with a separable Lanczos-2 filter, working on premultiplied alpha */
+uint8_t *mipmap_lanczos( uint8_t *src, int width, int height, int hslices, int vslices )
+{
+    int dw = width / 2;
+    int dh = height / 2;
+    float *in = malloc( width * height * 4 * sizeof( float ) );
+    float *tmp = malloc( dw * height * 4 * sizeof( float ) );
+    float *out = malloc( dw * dh * 4 * sizeof( float ) );
+    uint8_t *dst = malloc( dw * dh * 4 );
+
+    for( int i = 0; i < width * height; i++ )
+    {
+        float a = src[i * 4 + 3] / 255.0f;
+
+        for( int c = 0; c < 3; c++ )
+        {
+            in[i * 4 + c] = src[i * 4 + c] * a;
+        }
+        in[i * 4 + 3] = src[i * 4 + 3];
+    }
+
+    for( int y = 0; y < height; y++ )
+    {
+        lanczos_halve( &in[y * width * 4], 4, &tmp[y * dw * 4], 4, width, width / hslices );
+    }
+
+    for( int x = 0; x < dw; x++ )
+    {
+        lanczos_halve( &tmp[x * 4], dw * 4, &out[x * 4], dw * 4, height, height / vslices );
+    }
+
+    for( int i = 0; i < dw * dh; i++ )
+    {
+        float a = MIN( MAX( out[i * 4 + 3], 0.0f ), 255.0f );
+
+        for( int c = 0; c < 3; c++ )
+        {
+            float v = (a > 0.0f) ? out[i * 4 + c] * 255.0f / a : 0.0f;
+            dst[i * 4 + c] = (uint8_t)(MIN( MAX( v, 0.0f ), 255.0f ) + 0.5f);
+        }
+        dst[i * 4 + 3] = (uint8_t)(a + 0.5f);
+    }
+
+    free( in );
+    free( tmp );
+    free( out );
+    return dst;
+}
+
+int read_png( char *png_file, char *spr_file, int depth, int hslices, int vslices, int mipmap, int maxlods )
 {
     png_structp png_ptr;
     png_infop info_ptr;
@@ -45,6 +201,7 @@ int read_png( char *png_file, char *spr_file, int depth, int hslices, int vslice
     FILE *fp;
     FILE *op;
     int err = 0;
+    int lods = 1;
 
     /* Open file descriptors for read and write */
     if ((fp = fopen(png_file, "rb")) == NULL)
@@ -104,8 +261,22 @@ int read_png( char *png_file, char *spr_file, int depth, int hslices, int vslice
     wval8 = (depth == BITDEPTH_32BPP) ? 4 : 2;
     fwrite( &wval8, sizeof( wval8 ), 1, op );
 
+    /* Each mipmap level halves the size of every slice, so stop as soon as a slice cannot be halved exactly */
+    if( mipmap != MIPMAP_NONE )
+    {
+        int swidth = width / hslices;
+        int sheight = height / vslices;
+
+        while( lods < maxlods && (swidth % 2) == 0 && (sheight % 2) == 0 )
+        {
+            swidth /= 2;
+            sheight /= 2;
+            lods++;
+        }
+    }
+
     /* Format */
-    wval8 = FORMAT_UNCOMPRESSED;
+    wval8 = FORMAT_UNCOMPRESSED | ((lods - 1) << FORMAT_LODS_SHIFT);
     fwrite( &wval8, sizeof( wval8 ), 1, op );
 
     /* Horizontal and vertical slices */
@@ -163,7 +334,9 @@ int read_png( char *png_file, char *spr_file, int depth, int hslices, int vslice
         /* Now it's time to read the image. */
         png_read_image(png_ptr, row_pointers);
 
-        /* Translate out to sprite format */
+        /* Translate out to 8-bit RGBA */
+        uint8_t *image = malloc( width * height * 4 );
+
         switch( color_type )
         {
             case PNG_COLOR_TYPE_RGB:
@@ -174,31 +347,49 @@ int read_png( char *png_file, char *spr_file, int depth, int hslices, int vslice
                 {
                     for( int i = 0; i < width; i++ )
                     {
-                        uint8_t buf[4];
+                        uint8_t *buf = &image[(j * width + i) * 4];
 
                         buf[0] = row_pointers[j][(i * 3)];
                         buf[1] = row_pointers[j][(i * 3) + 1];
                         buf[2] = row_pointers[j][(i * 3) + 2];
                         buf[3] = 255;
-
-                        write_value( buf, op, depth );
                     }
                 }
 
                 break;
             case PNG_COLOR_TYPE_RGB_ALPHA:
-                /* Easy, just dump rows or convert */
+                /* Easy, just copy rows */
                 for( int row = 0; row < height; row++ )
                 {
-                    for( int col = 0; col < width; col++ )
-                    {
-                        write_value( &row_pointers[row][col * 4], op, depth );
-                    }
+                    memcpy( &image[row * width * 4], row_pointers[row], width * 4 );
                 }
 
                 break;
         }
 
+        /* Write out the full image, followed by each mipmap level */
+        int lwidth = width;
+        int lheight = height;
+
+        for( int lod = 0; lod < lods; lod++ )
+        {
+            if( lod > 0 )
+            {
+                uint8_t *next = (mipmap == MIPMAP_LANCZOS) ?
+                    mipmap_lanczos( image, lwidth, lheight, hslices, vslices ) :
+                    mipmap_box( image, lwidth, lheight );
+
+                free( image );
+                image = next;
+                lwidth /= 2;
+                lheight /= 2;
+            }
+
+            write_image( image, lwidth, lheight, op, depth, lod + 1 < lods );
+        }
+
+        free( image );
+
 exitmem:
         /* Free the row pointers memory */
         for( int row = 0; row < height; row++ )
@@ -225,7 +416,9 @@ exitfiles:
 
 void print_args( char * name )
 {
-    fprintf( stderr, "Usage: %s <bit depth> [<horizontal slices> <vertical slices>] <input png> <output file>\n", name );
+    fprintf( stderr, "Usage: %s [--mipmap <box|lanczos>] [--lods <count>] <bit depth> [<horizontal slices> <vertical slices>] <input png> <output file>\n", name );
+    fprintf( stderr, "\t--mipmap generates a chain of mipmap levels, halving the size each time, with the specified filter.\n" );
+    fprintf( stderr, "\t--lods limits the number of levels (including the full size image) to at most <count> (default: %d).\n", MAX_LODS );
     fprintf( stderr, "\t<bit depth> should be 16 or 32.\n" );
     fprintf( stderr, "\t<horizontal slices> should be a number two or greater signifying how many images are in this spritemap horizontally.\n" );
     fprintf( stderr, "\t<vertical slices> should be a number two or greater signifying how many images are in this spritemap vertically.\n" );
@@ -235,11 +428,53 @@ void print_args( char * name )
 
 int main( int argc, char *argv[] )
 {
+    char *name = argv[0];
     int bitdepth;
+    int mipmap = MIPMAP_NONE;
+    int maxlods = MAX_LODS;
+
+    /* Parse options */
+    while( argc > 1 && strncmp( argv[1], "--", 2 ) == 0 )
+    {
+        if( argc > 2 && !strcmp( argv[1], "--mipmap" ) )
+        {
+            if( !strcmp( argv[2], "box" ) )
+            {
+                mipmap = MIPMAP_BOX;
+            }
+            else if( !strcmp( argv[2], "lanczos" ) )
+            {
+                mipmap = MIPMAP_LANCZOS;
+            }
+            else
+            {
+                print_args( name );
+                return -EINVAL;
+            }
+        }
+        else if( argc > 2 && !strcmp( argv[1], "--lods" ) )
+        {
+            maxlods = atoi( argv[2] );
+
+            if( maxlods < 1 || maxlods > MAX_LODS )
+            {
+                print_args( name );
+                return -EINVAL;
+            }
+        }
+        else
+        {
+            print_args( name );
+            return -EINVAL;
+        }
+
+        argc -= 2;
+        argv += 2;
+    }
 
     if( argc != 4 && argc != 6 )
     {
-        print_args( argv[0] );
+        print_args( name );
         return -EINVAL;
     }
 
@@ -256,14 +491,14 @@ int main( int argc, char *argv[] )
     }
     else
     {
-        print_args( argv[0] );
+        print_args( name );
         return -EINVAL;
     }
 
     if( argc == 4 )
     {
         /* Translate, return result */
-        return read_png( argv[2], argv[3], bitdepth, 1, 1 );
+        return read_png( argv[2], argv[3], bitdepth, 1, 1, mipmap, maxlods );
     }
     else
     {
@@ -271,6 +506,6 @@ int main( int argc, char *argv[] )
         int vslices = atoi( argv[3] );
 
         /* Translate, return result */
-        return read_png( argv[4], argv[5], bitdepth, hslices, vslices );
+        return read_png( argv[4], argv[5], bitdepth, hslices, vslices, mipmap, maxlods );
     }
 }
@@ -0,0 +1,346 @@
+/*
+ * n64prof - Symbolize profiles dumped by profile_dump()
+ *
+ * Reads the debug log of an application that called profile_dump(), matches
+ * the sampled addresses against the function symbols of the ELF file, and
+ * prints a report of the functions where most CPU time is spent.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* Profile dump format version (keep in sync with profile.c) */
+#define PROFILE_DUMP_VERSION 1
+
+#define ELF_ST_TYPE(info)   ((info) & 0xF)
+#define STT_FUNC            2
+#define SHT_SYMTAB          2
+
+typedef struct {
+    uint32_t addr;
+    uint32_t size;
+    const char *name;
+    uint64_t samples;
+} symbol_t;
+
+typedef struct {
+    uint32_t addr;
+    uint32_t samples;
+} bucket_t;
+
+static symbol_t *symbols = NULL;
+static int num_symbols = 0;
+
+static bool flag_verbose = false;
+
+static void print_args(const char *name)
+{
+    fprintf(stderr, "Usage: %s [flags] <app.elf> <log file>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Symbolize a profile dumped with profile_dump(), and print the hottest functions.\n");
+    fprintf(stderr, "The log file can contain any other debugging output: it will be skipped.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Command-line flags:\n");
+    fprintf(stderr, "   -n/--top <N>          Number of functions to show (default: 30, 0 for all)\n");
+    fprintf(stderr, "   -a/--addresses <N>    Also show the N hottest addresses (default: 0)\n");
+    fprintf(stderr, "   -v/--verbose          Verbose output\n");
+    fprintf(stderr, "\n");
+}
+
+static uint16_t rd16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+static uint32_t rd32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+static uint64_t rd64(const uint8_t *p) { return ((uint64_t)rd32(p) << 32) | rd32(p + 4); }
+
+static void *read_file(const char *fn, size_t *size)
+{
+    FILE *f = fopen(fn, "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open file: %s\n", fn);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (fsize < 0) {
+        fprintf(stderr, "error reading file: %s\n", fn);
+        fclose(f);
+        return NULL;
+    }
+    *size = fsize;
+    uint8_t *buf = malloc(*size + 1);
+    if (fread(buf, 1, *size, f) != *size) {
+        fprintf(stderr, "error reading file: %s\n", fn);
+        fclose(f);
+        free(buf);
+        return NULL;
+    }
+    buf[*size] = 0;
+    fclose(f);
+    return buf;
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+    const symbol_t *sa = a, *sb = b;
+    if (sa->addr != sb->addr)
+        return sa->addr < sb->addr ? -1 : 1;
+    // Prefer sized symbols over aliases without size
+    return (sa->size < sb->size) - (sa->size > sb->size);
+}
+
+/* Check that a range of bytes lies within a file of the specified size */
+static bool in_file(uint64_t off, uint64_t len, size_t size)
+{
+    return off <= size && len <= size - off;
+}
+
+/* Load all the function symbols from a big-endian MIPS ELF file (32 or 64 bit) */
+static bool load_symbols(const char *fn)
+{
+    size_t size;
+    uint8_t *elf = read_file(fn, &size);
+    if (!elf)
+        return false;
+
+    if (size < 0x40 || memcmp(elf, "\x7f" "ELF", 4) != 0 || elf[5] != 2) {
+        fprintf(stderr, "%s: not a big-endian ELF file\n", fn);
+        return false;
+    }
+    bool is64 = elf[4] == 2;
+
+    uint64_t shoff = is64 ? rd64(elf + 0x28) : rd32(elf + 0x20);
+    int shentsize = rd16(elf + (is64 ? 0x3A : 0x2E));
+    int shnum = rd16(elf + (is64 ? 0x3C : 0x30));
+
+    if (shentsize < (is64 ? 0x40 : 0x28) || !in_file(shoff, (uint64_t)shnum * shentsize, size)) {
+        fprintf(stderr, "%s: truncated or invalid section headers\n", fn);
+        return false;
+    }
+
+    for (int i = 0; i < shnum; i++) {
+        const uint8_t *sh = elf + shoff + i * shentsize;
+        if (rd32(sh + 4) != SHT_SYMTAB)
+            continue;
+
+        uint64_t symoff = is64 ? rd64(sh + 0x18) : rd32(sh + 0x10);
+        uint64_t symsize = is64 ? rd64(sh + 0x20) : rd32(sh + 0x14);
+        uint32_t link = rd32(sh + (is64 ? 0x28 : 0x18));
+        uint64_t entsize = is64 ? rd64(sh + 0x38) : rd32(sh + 0x24);
+
+        if (entsize < (is64 ? 24 : 16) || !in_file(symoff, symsize, size) || link >= (uint32_t)shnum) {
+            fprintf(stderr, "%s: truncated or invalid symbol table\n", fn);
+            return false;
+        }
+
+        const uint8_t *strsh = elf + shoff + link * shentsize;
+        uint64_t stroff = is64 ? rd64(strsh + 0x18) : rd32(strsh + 0x10);
+        uint64_t strsize = is64 ? rd64(strsh + 0x20) : rd32(strsh + 0x14);
+        if (!in_file(stroff, strsize, size)) {
+            fprintf(stderr, "%s: truncated or invalid string table\n", fn);
+            return false;
+        }
+        const char *strtab = (const char*)elf + stroff;
+
+        // The file buffer is NUL-terminated, so names within the string
+        // table can't run past the end of the file
+        uint64_t n = symsize / entsize;
+        symbols = realloc(symbols, (num_symbols + n) * sizeof(symbol_t));
+        for (uint64_t j = 0; j < n; j++) {
+            const uint8_t *sym = elf + symoff + j * entsize;
+            uint8_t info = sym[is64 ? 4 : 12];
+            if (ELF_ST_TYPE(info) != STT_FUNC || rd32(sym) >= strsize)
+                continue;
+
+            symbol_t *s = &symbols[num_symbols++];
+            s->name = strtab + rd32(sym);
+            // Addresses of 64-bit ELFs are sign-extended KSEG0 addresses
+            s->addr = is64 ? (uint32_t)rd64(sym + 8) : rd32(sym + 4);
+            s->size = is64 ? (uint32_t)rd64(sym + 16) : rd32(sym + 8);
+            s->samples = 0;
+        }
+    }
+
+    if (num_symbols == 0) {
+        fprintf(stderr, "%s: no function symbols found (was the ELF stripped?)\n", fn);
+        return false;
+    }
+
+    qsort(symbols, num_symbols, sizeof(symbol_t), symbol_cmp);
+    if (flag_verbose)
+        fprintf(stderr, "loaded %d function symbols from %s\n", num_symbols, fn);
+    return true;
+}
+
+/* Find the function containing an address (binary search) */
+static symbol_t *find_symbol(uint32_t addr)
+{
+    int lo = 0, hi = num_symbols - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (symbols[mid].addr <= addr) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (found < 0)
+        return NULL;
+
+    // Step back over aliases at the same address to find the sized symbol
+    while (found > 0 && symbols[found-1].addr == symbols[found].addr)
+        found--;
+    symbol_t *s = &symbols[found];
+    if (s->size && addr >= s->addr + s->size)
+        return NULL;
+    return s;
+}
+
+static int bucket_cmp(const void *a, const void *b)
+{
+    const bucket_t *ba = a, *bb = b;
+    return (ba->samples < bb->samples) - (ba->samples > bb->samples);
+}
+
+static int symbol_samples_cmp(const void *a, const void *b)
+{
+    const symbol_t *sa = *(const symbol_t**)a, *sb = *(const symbol_t**)b;
+    return (sa->samples < sb->samples) - (sa->samples > sb->samples);
+}
+
+int main(int argc, char *argv[])
+{
+    int top = 30, top_addresses = 0;
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            print_args(argv[0]);
+            return 0;
+        } else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
+            flag_verbose = true;
+        } else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--top")) {
+            if (++i == argc) {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return 1;
+            }
+            top = atoi(argv[i]);
+        } else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--addresses")) {
+            if (++i == argc) {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return 1;
+            }
+            top_addresses = atoi(argv[i]);
+        } else {
+            fprintf(stderr, "invalid flag: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (argc - i != 2) {
+        print_args(argv[0]);
+        return 1;
+    }
+
+    if (!load_symbols(argv[i]))
+        return 1;
+
+    size_t log_size;
+    char *log = read_file(argv[i+1], &log_size);
+    if (!log)
+        return 1;
+
+    // Find the last profile in the log: if the application dumped the
+    // profile several times, the last one contains all the samples.
+    char *prof = NULL;
+    for (char *p = strstr(log, "PROFILE "); p; p = strstr(p + 1, "PROFILE ")) {
+        if (strncmp(p, "PROFILE END", 11) != 0)
+            prof = p;
+    }
+    if (!prof) {
+        fprintf(stderr, "%s: no profile found\n", argv[i+1]);
+        return 1;
+    }
+
+    int version, granularity, frequency;
+    unsigned int text_start, samples, outside;
+    if (sscanf(prof, "PROFILE %d %x %d %d %u %u", &version, &text_start, &granularity,
+               &frequency, &samples, &outside) != 6) {
+        fprintf(stderr, "%s: invalid profile header\n", argv[i+1]);
+        return 1;
+    }
+    if (version != PROFILE_DUMP_VERSION) {
+        fprintf(stderr, "%s: unsupported profile version %d\n", argv[i+1], version);
+        return 1;
+    }
+
+    bucket_t *buckets = NULL;
+    int num_buckets = 0, cap_buckets = 0;
+    uint64_t unknown = 0;
+    char *line = strchr(prof, '\n');
+    while (line) {
+        line++;
+        if (!strncmp(line, "PROFILE END", 11))
+            break;
+        unsigned int addr, count;
+        if (sscanf(line, "%x %u", &addr, &count) == 2) {
+            if (num_buckets == cap_buckets) {
+                cap_buckets = cap_buckets ? cap_buckets * 2 : 1024;
+                buckets = realloc(buckets, cap_buckets * sizeof(bucket_t));
+            }
+            buckets[num_buckets++] = (bucket_t){ addr, count };
+
+            // A bucket might span two functions: account it to the one
+            // containing its first instruction.
+            symbol_t *s = find_symbol(addr);
+            if (s)
+                s->samples += count;
+            else
+                unknown += count;
+        }
+        line = strchr(line, '\n');
+    }
+
+    printf("Samples: %u (%.2f seconds at %d Hz), granularity: %d bytes\n",
+        samples, (double)samples / frequency, frequency, granularity);
+    if (samples == 0)
+        return 0;
+    if (outside)
+        printf("Samples outside text segment: %u (%.2f%%)\n", outside, outside * 100.0 / samples);
+    if (unknown)
+        printf("Samples without symbol: %llu (%.2f%%)\n", (unsigned long long)unknown, unknown * 100.0 / samples);
+    printf("\n");
+
+    symbol_t **hot = malloc(num_symbols * sizeof(symbol_t*));
+    int num_hot = 0;
+    for (int j = 0; j < num_symbols; j++)
+        if (symbols[j].samples)
+            hot[num_hot++] = &symbols[j];
+    qsort(hot, num_hot, sizeof(symbol_t*), symbol_samples_cmp);
+
+    printf("  %%time  cumul%%    samples  function\n");
+    uint64_t cumul = 0;
+    for (int j = 0; j < num_hot && (top == 0 || j < top); j++) {
+        cumul += hot[j]->samples;
+        printf("%7.2f %7.2f %10llu  %s\n", hot[j]->samples * 100.0 / samples,
+            cumul * 100.0 / samples, (unsigned long long)hot[j]->samples, hot[j]->name);
+    }
+
+    if (top_addresses > 0) {
+        qsort(buckets, num_buckets, sizeof(bucket_t), bucket_cmp);
+        printf("\n  %%time    samples  address   location\n");
+        for (int j = 0; j < num_buckets && j < top_addresses; j++) {
+            symbol_t *s = find_symbol(buckets[j].addr);
+            printf("%7.2f %10u  %08x  ", buckets[j].samples * 100.0 / samples,
+                buckets[j].samples, buckets[j].addr);
+            if (s)
+                printf("%s+0x%x\n", s->name, buckets[j].addr - s->addr);
+            else
+                printf("?\n");
+        }
+    }
+
+    return 0;
+}